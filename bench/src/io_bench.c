@@ -0,0 +1,246 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+
+/**
+ * Storage I/O backend benchmark.
+ * Runs the same datafile-shaped I/O through every backend: random reads of one record (header, key and value
+ * as separate iovecs, like the reader) from a number of threads, the same reads submitted in batches, and
+ * appends of record batches to a registered file, with and without an fdatasync after each (like the writer
+ * in the NONE and BATCH durability modes). Reads mostly hit the page cache, so they show each backend's
+ * per-call overhead rather than the device's.
+ *
+ * Usage: io-bench <dir> [ops per run] [max threads] [value size]
+ */
+
+#define _GNU_SOURCE
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "time.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "pthread.h"
+
+#include "ccask/io.h"
+#include "ccask/status.h"
+
+#define BENCH_KEY_SIZE 24
+#define BENCH_HEADER_SIZE 20
+#define BENCH_FILE_SIZE (64 << 20)
+#define BENCH_READ_BATCH 32
+#define BENCH_APPEND_BATCH 64
+#define BENCH_SYNCED_APPENDS 200    // synced batches per run, they are bound by the device
+
+typedef struct bench_backend {
+    const char *name;
+    ccask_io_backend_e backend;
+    bool sqpoll;
+} bench_backend_t;
+
+static const bench_backend_t backends[] = {
+    { "sync", CCASK_IO_SYNC, false },
+    { "io_uring", CCASK_IO_URING, false },
+    { "io_uring+sqpoll", CCASK_IO_URING, true },
+};
+
+static uint32_t record_size;
+static uint32_t value_size;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+typedef struct reader_job {
+    int fd;
+    size_t ops;
+    size_t batch;
+    uint64_t seed;
+    size_t failed;
+} reader_job_t;
+
+static void* reader_main(void *arg) {
+    reader_job_t *job = arg;
+    size_t num_records = BENCH_FILE_SIZE / record_size;
+
+    uint8_t (*headers)[BENCH_HEADER_SIZE] = malloc(job->batch * BENCH_HEADER_SIZE);
+    uint8_t (*keys)[BENCH_KEY_SIZE] = malloc(job->batch * BENCH_KEY_SIZE);
+    uint8_t *values = malloc(job->batch * value_size);
+    struct iovec (*iov)[3] = malloc(job->batch * sizeof(*iov));
+    ccask_io_read_t *reads = malloc(job->batch * sizeof(ccask_io_read_t));
+
+    for (size_t i = 0; i < job->batch; i++) {
+        iov[i][0] = (struct iovec){ headers[i], BENCH_HEADER_SIZE };
+        iov[i][1] = (struct iovec){ keys[i], BENCH_KEY_SIZE };
+        iov[i][2] = (struct iovec){ values + i * value_size, value_size };
+    }
+
+    for (size_t done = 0; done < job->ops; done += job->batch) {
+        for (size_t i = 0; i < job->batch; i++) {
+            off_t offset = (off_t)(next_random(&job->seed) % num_records) * record_size;
+            reads[i] = (ccask_io_read_t){ .fd = job->fd, .iov = iov[i], .iovcnt = 3, .offset = offset };
+        }
+
+        if (job->batch == 1) {
+            if (ccask_io_preadv(job->fd, iov[0], 3, reads[0].offset) != CCASK_OK) job->failed++;
+        } else {
+            ccask_io_preadv_batch(reads, job->batch);
+            for (size_t i = 0; i < job->batch; i++) {
+                if (reads[i].status != CCASK_OK) job->failed++;
+            }
+        }
+    }
+
+    free(reads);
+    free(iov);
+    free(values);
+    free(keys);
+    free(headers);
+    return NULL;
+}
+
+static void bench_reads(const bench_backend_t *b, int fd, size_t ops, size_t num_threads, size_t batch) {
+    pthread_t threads[num_threads];
+    reader_job_t jobs[num_threads];
+
+    double start = now_seconds();
+    for (size_t t = 0; t < num_threads; t++) {
+        jobs[t] = (reader_job_t){ fd, ops / num_threads, batch, 0x9e3779b97f4a7c15ULL * (t + 1), 0 };
+        pthread_create(&threads[t], NULL, reader_main, &jobs[t]);
+    }
+
+    size_t failed = 0;
+    for (size_t t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+        failed += jobs[t].failed;
+    }
+    double elapsed = now_seconds() - start;
+
+    char workload[32];
+    snprintf(workload, sizeof(workload), batch > 1 ? "read-batch-%zu" : "read", batch);
+    printf("%-16s %-16s %8zu %14.1f", b->name, workload, num_threads, ops / num_threads * num_threads / elapsed / 1e3);
+    if (failed) printf("   (%zu failed)", failed);
+    printf("\n");
+}
+
+static void bench_appends(const bench_backend_t *b, const char *dir, size_t batches, bool sync) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/io-bench-append.data", dir);
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("open");
+        return;
+    }
+    ccask_io_register_file(fd);
+
+    uint8_t *records = malloc((size_t)BENCH_APPEND_BATCH * record_size);
+    memset(records, 'r', (size_t)BENCH_APPEND_BATCH * record_size);
+    struct iovec iov[BENCH_APPEND_BATCH];
+    for (size_t i = 0; i < BENCH_APPEND_BATCH; i++) iov[i] = (struct iovec){ records + i * record_size, record_size };
+
+    size_t failed = 0;
+    off_t offset = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < batches; i++) {
+        bool synced = true;
+        if (ccask_io_pwritev(fd, iov, BENCH_APPEND_BATCH, offset, sync ? &synced : NULL) != CCASK_OK || !synced) failed++;
+        offset += (off_t)BENCH_APPEND_BATCH * record_size;
+    }
+    double elapsed = now_seconds() - start;
+
+    ccask_io_unregister_file(fd);
+    close(fd);
+    unlink(path);
+    free(records);
+
+    printf("%-16s %-16s %8d %14.1f", b->name, sync ? "append+sync" : "append", 1, batches * BENCH_APPEND_BATCH / elapsed / 1e3);
+    if (failed) printf("   (%zu failed)", failed);
+    printf("\n");
+}
+
+static int create_read_file(const char *path) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) return -1;
+
+    uint8_t chunk[1 << 16];
+    memset(chunk, 'd', sizeof(chunk));
+    for (size_t written = 0; written < BENCH_FILE_SIZE; written += sizeof(chunk)) {
+        if (write(fd, chunk, sizeof(chunk)) != (ssize_t)sizeof(chunk)) {
+            close(fd);
+            return -1;
+        }
+    }
+    fsync(fd);
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <dir> [ops per run] [max threads] [value size]\n", argv[0]);
+        return 1;
+    }
+    const char *dir = argv[1];
+    size_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 200000;
+    size_t max_threads = argc > 3 ? strtoull(argv[3], NULL, 10) : 8;
+    value_size = argc > 4 ? (uint32_t)strtoul(argv[4], NULL, 10) : 100;
+    record_size = BENCH_HEADER_SIZE + BENCH_KEY_SIZE + value_size;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/io-bench-read.data", dir);
+    int fd = create_read_file(path);
+    if (fd < 0) {
+        perror("Couldn't create the file to read from");
+        return 1;
+    }
+
+    printf("%-16s %-16s %8s %14s   (%u-byte records, %d MiB file)\n",
+        "backend", "workload", "threads", "K records/s", record_size, BENCH_FILE_SIZE >> 20);
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        const bench_backend_t *b = &backends[i];
+        ccask_io_init(b->backend, b->sqpoll);
+        if (b->backend != CCASK_IO_SYNC && strcmp(ccask_io_backend_name(), "sync") == 0) {
+            printf("%-16s unavailable\n", b->name);
+            continue;
+        }
+
+        for (size_t threads = 1; threads <= max_threads; threads *= 2) bench_reads(b, fd, ops, threads, 1);
+        bench_reads(b, fd, ops, 1, BENCH_READ_BATCH);
+        bench_appends(b, dir, ops / BENCH_APPEND_BATCH, false);
+        bench_appends(b, dir, BENCH_SYNCED_APPENDS, true);
+
+        ccask_io_shutdown();
+    }
+
+    close(fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,228 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+/**
+ * Keydir microbenchmark.
+ * Compares the sharded Swiss-table keydir against the previous uthash keydir (a single table behind a
+ * rwlock, reimplemented here) on inserts, updates, lookup hits and lookup misses.
+ *
+ * Usage: keydir-bench [max keys] [threads]
+ */
+
+#define _GNU_SOURCE
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdbool.h"
+#include "time.h"
+#include "pthread.h"
+#include "uthash.h"
+
+#include "ccask/files.h"
+#include "ccask/keydir.h"
+#include "ccask/status.h"
+
+#define BENCH_KEY_SIZE 24
+
+// the keydir as it was before sharding
+typedef struct uthash_record {
+    void *key;
+    uint32_t key_size;
+    uint64_t file_id;
+    uint64_t record_pos;
+    uint32_t value_size;
+    uint32_t timestamp;
+    UT_hash_handle hh;
+} uthash_record_t;
+
+static uthash_record_t *uthash_table = NULL;
+static pthread_rwlock_t uthash_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static bool uthash_find(void *key, uint32_t key_size, ccask_keydir_record_t *out) {
+    uthash_record_t *entry;
+    pthread_rwlock_rdlock(&uthash_lock);
+    HASH_FIND(hh, uthash_table, key, key_size, entry);
+    if (entry) {
+        out->file_id = entry->file_id;
+        out->record_pos = entry->record_pos;
+        out->value_size = entry->value_size;
+    }
+    pthread_rwlock_unlock(&uthash_lock);
+    return entry != NULL;
+}
+
+static void uthash_upsert(void *key, uint32_t key_size, uint64_t file_id, uint64_t record_pos) {
+    uthash_record_t *entry;
+    pthread_rwlock_wrlock(&uthash_lock);
+    HASH_FIND(hh, uthash_table, key, key_size, entry);
+    if (!entry) {
+        entry = malloc(sizeof(uthash_record_t));
+        entry->key = malloc(key_size);
+        memcpy(entry->key, key, key_size);
+        entry->key_size = key_size;
+        HASH_ADD_KEYPTR(hh, uthash_table, entry->key, key_size, entry);
+    }
+    entry->file_id = file_id;
+    entry->record_pos = record_pos;
+    entry->value_size = 100;
+    entry->timestamp = 0;
+    pthread_rwlock_unlock(&uthash_lock);
+}
+
+static void uthash_clear(void) {
+    uthash_record_t *entry, *tmp;
+    HASH_ITER(hh, uthash_table, entry, tmp) {
+        HASH_DEL(uthash_table, entry);
+        free(entry->key);
+        free(entry);
+    }
+}
+
+typedef struct bench_impl {
+    const char *name;
+    bool (*find)(void *key, uint32_t key_size, ccask_keydir_record_t *out);
+    void (*upsert)(void *key, uint32_t key_size, uint64_t file_id, uint64_t record_pos);
+} bench_impl_t;
+
+static bool swiss_find(void *key, uint32_t key_size, ccask_keydir_record_t *out) {
+    return ccask_keydir_find(key, key_size, out) == CCASK_OK;
+}
+
+static void swiss_upsert(void *key, uint32_t key_size, uint64_t file_id, uint64_t record_pos) {
+    ccask_keydir_upsert(key, key_size, file_id, record_pos, 100, 0);
+}
+
+static const bench_impl_t impls[] = {
+    { "uthash+rwlock", uthash_find, uthash_upsert },
+    { "sharded-swiss", swiss_find, swiss_upsert },
+};
+
+static inline void make_key(char *buf, uint64_t i) {
+    snprintf(buf, BENCH_KEY_SIZE, "user:%016llx", (unsigned long long)(i * UINT64_C(0x9E3779B97F4A7C15)));
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct lookup_job {
+    const bench_impl_t *impl;
+    size_t num_keys;
+    size_t lookups;
+    uint64_t key_offset; // keys past `num_keys` are misses
+    size_t found;
+    unsigned seed;
+} lookup_job_t;
+
+static void* lookup_worker(void *arg) {
+    lookup_job_t *job = arg;
+    char key[BENCH_KEY_SIZE];
+    ccask_keydir_record_t record;
+
+    for (size_t i = 0; i < job->lookups; i++) {
+        make_key(key, job->key_offset + (uint64_t)rand_r(&job->seed) % job->num_keys);
+        if (job->impl->find(key, BENCH_KEY_SIZE, &record)) job->found++;
+    }
+    return NULL;
+}
+
+// returns lookups per second across all threads
+static double run_lookups(const bench_impl_t *impl, size_t num_keys, size_t num_threads, bool hits) {
+    size_t lookups = 2000000 / num_threads;
+    pthread_t threads[num_threads];
+    lookup_job_t jobs[num_threads];
+
+    double start = now_seconds();
+    for (size_t t = 0; t < num_threads; t++) {
+        jobs[t] = (lookup_job_t){ impl, num_keys, lookups, hits ? 0 : num_keys, 0, (unsigned)t + 1 };
+        pthread_create(&threads[t], NULL, lookup_worker, &jobs[t]);
+    }
+
+    size_t found = 0;
+    for (size_t t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+        found += jobs[t].found;
+    }
+    double elapsed = now_seconds() - start;
+
+    if (found != (hits ? lookups * num_threads : 0)) {
+        fprintf(stderr, "%s: unexpected lookup results (%zu found)\n", impl->name, found);
+    }
+    return lookups * num_threads / elapsed;
+}
+
+static void run_benchmark(const bench_impl_t *impl, size_t num_keys, size_t num_threads) {
+    char key[BENCH_KEY_SIZE];
+
+    double start = now_seconds();
+    for (size_t i = 0; i < num_keys; i++) {
+        make_key(key, i);
+        impl->upsert(key, BENCH_KEY_SIZE, 1, i);
+    }
+    double insert = num_keys / (now_seconds() - start);
+
+    start = now_seconds();
+    for (size_t i = 0; i < num_keys; i++) {
+        make_key(key, i);
+        impl->upsert(key, BENCH_KEY_SIZE, 2, i);
+    }
+    double update = num_keys / (now_seconds() - start);
+
+    double hit = run_lookups(impl, num_keys, num_threads, true);
+    double miss = run_lookups(impl, num_keys, num_threads, false);
+
+    printf("%-14s %10zu %12.2f %12.2f %12.2f %12.2f\n",
+        impl->name, num_keys, insert / 1e6, update / 1e6, hit / 1e6, miss / 1e6);
+}
+
+int main(int argc, char **argv) {
+    size_t max_keys = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t num_threads = argc > 2 ? strtoull(argv[2], NULL, 10) : 4;
+    if (num_threads == 0) num_threads = 1;
+
+    // the keydir recovers from the data directory on init, so give it an empty one
+    char data_dir[] = "/tmp/ccask-bench-XXXXXX";
+    if (!mkdtemp(data_dir) || ccask_files_init(data_dir, 1 << 20, 1) != CCASK_OK) {
+        fprintf(stderr, "couldn't set up a data directory\n");
+        return 1;
+    }
+
+    printf("%-14s %10s %12s %12s %12s %12s   (millions of ops/s, %zu lookup threads)\n",
+        "keydir", "keys", "insert", "update", "find-hit", "find-miss", num_threads);
+
+    for (size_t num_keys = 1000; num_keys <= max_keys; num_keys *= 10) {
+        for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+            if (impls[i].upsert == swiss_upsert && ccask_keydir_init(0) != CCASK_OK) {
+                fprintf(stderr, "couldn't initialize the keydir\n");
+                return 1;
+            }
+
+            run_benchmark(&impls[i], num_keys, num_threads);
+
+            if (impls[i].upsert == swiss_upsert) ccask_keydir_shutdown();
+            else uthash_clear();
+        }
+    }
+
+    ccask_files_shutdown();
+    return 0;
+}
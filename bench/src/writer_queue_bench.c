@@ -0,0 +1,263 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+/**
+ * Writer queue contention benchmark.
+ * Producer threads push records as fast as they can while a single consumer pops and frees them, like the
+ * writer thread without the disk I/O. Compares the lock-free MPSC queue against the previous ring buffer
+ * (serialization and a condvar signal under one mutex, reimplemented here) for a range of producer counts.
+ *
+ * Usage: writer-queue-bench [records per run] [max producers] [value size]
+ */
+
+#define _GNU_SOURCE
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdbool.h"
+#include "stdatomic.h"
+#include "time.h"
+#include "sched.h"
+#include "pthread.h"
+
+#include "ccask/records.h"
+#include "ccask/writer_ringbuf.h"
+#include "ccask/pending.h"
+#include "ccask/status.h"
+
+#define BENCH_KEY_SIZE 24
+#define BENCH_QUEUE_CAPACITY 1024
+
+// the writer ring buffer as it was before the MPSC queue
+static struct {
+    ccask_datafile_record_t *buf;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+    bool shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+} mutex_ring;
+
+static ccask_status_e mutex_ring_init(size_t capacity) {
+    mutex_ring.buf = calloc(capacity, sizeof(ccask_datafile_record_t));
+    mutex_ring.capacity = capacity;
+    mutex_ring.head = mutex_ring.tail = 0;
+    mutex_ring.shutdown = false;
+    pthread_mutex_init(&mutex_ring.mutex, NULL);
+    pthread_cond_init(&mutex_ring.not_empty, NULL);
+    return mutex_ring.buf ? CCASK_OK : CCASK_FAIL;
+}
+
+static void mutex_ring_start_shutdown(void) {
+    pthread_mutex_lock(&mutex_ring.mutex);
+    mutex_ring.shutdown = true;
+    pthread_cond_broadcast(&mutex_ring.not_empty);
+    pthread_mutex_unlock(&mutex_ring.mutex);
+}
+
+static void mutex_ring_destroy(void) {
+    pthread_cond_destroy(&mutex_ring.not_empty);
+    pthread_mutex_destroy(&mutex_ring.mutex);
+    free(mutex_ring.buf);
+}
+
+static ccask_status_e mutex_ring_push(uint64_t timestamp, void *key, uint32_t key_size, void *value, uint32_t value_size) {
+    pthread_mutex_lock(&mutex_ring.mutex);
+
+    size_t next = (mutex_ring.head + 1) % mutex_ring.capacity;
+    if (next == mutex_ring.tail) {
+        pthread_mutex_unlock(&mutex_ring.mutex);
+        return CCASK_RETRY;
+    }
+
+    if (ccask_create_datafile_record(mutex_ring.buf[mutex_ring.head], timestamp, key, key_size, value, value_size) != CCASK_OK) {
+        pthread_mutex_unlock(&mutex_ring.mutex);
+        return CCASK_FAIL;
+    }
+    mutex_ring.head = next;
+
+    pthread_cond_signal(&mutex_ring.not_empty);
+    pthread_mutex_unlock(&mutex_ring.mutex);
+    return CCASK_OK;
+}
+
+static ccask_status_e mutex_ring_pop(ccask_datafile_record_t record) {
+    pthread_mutex_lock(&mutex_ring.mutex);
+    while (mutex_ring.tail == mutex_ring.head && !mutex_ring.shutdown) {
+        pthread_cond_wait(&mutex_ring.not_empty, &mutex_ring.mutex);
+    }
+
+    if (mutex_ring.shutdown && mutex_ring.tail == mutex_ring.head) {
+        pthread_mutex_unlock(&mutex_ring.mutex);
+        return CCASK_FAIL;
+    }
+
+    memcpy(record, mutex_ring.buf[mutex_ring.tail], sizeof(ccask_datafile_record_t));
+    mutex_ring.tail = (mutex_ring.tail + 1) % mutex_ring.capacity;
+    pthread_mutex_unlock(&mutex_ring.mutex);
+    return CCASK_OK;
+}
+
+static ccask_writer_ringbuf_t *mpsc_queue;
+
+// bounded by record count only, like the mutex ring
+static ccask_status_e mpsc_queue_init(size_t capacity) {
+    if (ccask_pending_init(capacity) != CCASK_OK) return CCASK_FAIL;
+    mpsc_queue = ccask_writer_ringbuf_create(capacity, SIZE_MAX);
+    return mpsc_queue ? CCASK_OK : CCASK_FAIL;
+}
+
+static void mpsc_queue_start_shutdown(void) {
+    ccask_writer_ringbuf_start_shutdown(mpsc_queue);
+}
+
+static void mpsc_queue_destroy(void) {
+    ccask_writer_ringbuf_destroy(mpsc_queue);
+    ccask_pending_shutdown();
+}
+
+// pushes also index the record for reads, so pops drop it again like the writer does
+static ccask_status_e mpsc_queue_pop(ccask_datafile_record_t record) {
+    if (ccask_writer_ringbuf_pop(mpsc_queue, record) != CCASK_OK) return CCASK_FAIL;
+    ccask_pending_remove_batch((ccask_datafile_record_t*)record, 1);
+    return CCASK_OK;
+}
+
+static ccask_status_e mpsc_queue_push(uint64_t timestamp, void *key, uint32_t key_size, void *value, uint32_t value_size) {
+    return ccask_writer_ringbuf_push(mpsc_queue, timestamp, key, key_size, value, value_size, 0, NULL);
+}
+
+typedef struct bench_impl {
+    const char *name;
+    ccask_status_e (*init)(size_t capacity);
+    void (*start_shutdown)(void);
+    void (*destroy)(void);
+    ccask_status_e (*push)(uint64_t timestamp, void *key, uint32_t key_size, void *value, uint32_t value_size);
+    ccask_status_e (*pop)(ccask_datafile_record_t record);
+} bench_impl_t;
+
+static const bench_impl_t impls[] = {
+    { "mutex-ring", mutex_ring_init, mutex_ring_start_shutdown, mutex_ring_destroy, mutex_ring_push, mutex_ring_pop },
+    { "mpsc-queue", mpsc_queue_init, mpsc_queue_start_shutdown, mpsc_queue_destroy, mpsc_queue_push, mpsc_queue_pop },
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct producer_job {
+    const bench_impl_t *impl;
+    size_t records;
+    size_t id;
+    void *value;
+    uint32_t value_size;
+    size_t full; // pushes rejected because the queue was full
+} producer_job_t;
+
+static void* producer_main(void *arg) {
+    producer_job_t *job = arg;
+    char key[BENCH_KEY_SIZE];
+
+    for (size_t i = 0; i < job->records; i++) {
+        snprintf(key, BENCH_KEY_SIZE, "p%03zu:%016zx", job->id, i);
+        ccask_status_e res;
+        while ((res = job->impl->push(0, key, BENCH_KEY_SIZE, job->value, job->value_size)) == CCASK_RETRY) {
+            job->full++;
+            sched_yield();
+        }
+        if (res != CCASK_OK) {
+            fprintf(stderr, "%s: push failed\n", job->impl->name);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void* consumer_main(void *arg) {
+    const bench_impl_t *impl = arg;
+    ccask_datafile_record_t record;
+    size_t popped = 0;
+
+    while (impl->pop(record) == CCASK_OK) {
+        free_datafile_record(record);
+        popped++;
+    }
+    return (void*)popped;
+}
+
+static void run_benchmark(const bench_impl_t *impl, size_t num_records, size_t num_producers, uint32_t value_size) {
+    if (impl->init(BENCH_QUEUE_CAPACITY) != CCASK_OK) {
+        fprintf(stderr, "%s: couldn't initialize the queue\n", impl->name);
+        return;
+    }
+
+    void *value = malloc(value_size);
+    memset(value, 'v', value_size);
+
+    pthread_t consumer;
+    pthread_t producers[num_producers];
+    producer_job_t jobs[num_producers];
+
+    double start = now_seconds();
+    pthread_create(&consumer, NULL, consumer_main, (void*)impl);
+    for (size_t p = 0; p < num_producers; p++) {
+        jobs[p] = (producer_job_t){ impl, num_records / num_producers, p, value, value_size, 0 };
+        pthread_create(&producers[p], NULL, producer_main, &jobs[p]);
+    }
+
+    size_t full = 0;
+    for (size_t p = 0; p < num_producers; p++) {
+        pthread_join(producers[p], NULL);
+        full += jobs[p].full;
+    }
+    impl->start_shutdown();
+
+    void *popped;
+    pthread_join(consumer, &popped);
+    double elapsed = now_seconds() - start;
+    impl->destroy();
+    free(value);
+
+    size_t pushed = num_records / num_producers * num_producers;
+    if ((size_t)popped != pushed) {
+        fprintf(stderr, "%s: popped %zu of %zu records\n", impl->name, (size_t)popped, pushed);
+    }
+
+    printf("%-12s %10zu %14.2f %14zu\n", impl->name, num_producers, pushed / elapsed / 1e6, full);
+}
+
+int main(int argc, char **argv) {
+    size_t num_records = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+    size_t max_producers = argc > 2 ? strtoull(argv[2], NULL, 10) : 64;
+    uint32_t value_size = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 10) : 100;
+
+    printf("%-12s %10s %14s %14s   (%zu records of %u-byte values, queue of %d)\n",
+        "queue", "producers", "M records/s", "full-retries", num_records, value_size, BENCH_QUEUE_CAPACITY);
+
+    for (size_t num_producers = 1; num_producers <= max_producers; num_producers *= 2) {
+        for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+            run_benchmark(&impls[i], num_records, num_producers, value_size);
+        }
+    }
+    return 0;
+}
@@ -7,7 +7,7 @@
 #include "ccask/compactor.h"
 
 int main() {
-    ccask_options_t opts;
+    ccask_options_t opts = {0};
     opts.data_dir = "../test_data";
     opts.writer_ringbuf_capacity = 10;
     opts.datafile_rotate_threshold = 60;
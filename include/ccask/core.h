@@ -25,21 +25,120 @@ extern "C" {
 
 #include "stddef.h"
 #include "stdint.h"
+#include "stdbool.h"
 
 #include "ccask/status.h"
 
 /**
  * Configuration options that can be passed to `ccask`
  */
+/**
+ * When written records are made durable (synced to the storage device).
+ */
+typedef enum ccask_durability {
+    CCASK_DURABILITY_NONE = 0,  /* Left to the kernel's writeback, `ccask_flush` still syncs on demand */
+    CCASK_DURABILITY_INTERVAL,  /* fdatasync every `sync_interval_ms` if anything was written meanwhile */
+    CCASK_DURABILITY_BATCH,     /* fdatasync after every batch the writer appends (and every blocking put) */
+    CCASK_DURABILITY_DSYNC,     /* Active datafile opened with O_DSYNC, every append is durable once written */
+} ccask_durability_e;
+
+/**
+ * How datafiles are read and written.
+ */
+typedef enum ccask_io_backend {
+    CCASK_IO_SYNC = 0,          /* Blocking preadv/pwritev/fdatasync on the calling thread */
+    CCASK_IO_URING,             /* io_uring with registered files and buffers, falls back to CCASK_IO_SYNC where unavailable */
+} ccask_io_backend_e;
+
+/**
+ * How rotated (immutable) datafiles are memory-mapped for reads, the `madvise` advice their mappings get.
+ */
+typedef enum ccask_mmap_advice {
+    CCASK_MMAP_NORMAL = 0,      /* Mapped, with the kernel's default readahead */
+    CCASK_MMAP_RANDOM,          /* MADV_RANDOM: no readahead, for working sets much larger than memory */
+    CCASK_MMAP_SEQUENTIAL,      /* MADV_SEQUENTIAL: aggressive readahead, pages are dropped soon after use */
+    CCASK_MMAP_WILLNEED,        /* MADV_WILLNEED: the whole file is read in when it's mapped */
+    CCASK_MMAP_DISABLED,        /* Not mapped, every get issues a preadv */
+} ccask_mmap_advice_e;
+
 typedef struct ccask_options {
     char* data_dir;                         /* Directory where all datafiles are stored */
-    size_t writer_ringbuf_capacity;         /* Capacity of the Writer Ring-Buffer */
+    size_t writer_ringbuf_capacity;         /* Capacity of the Writer Ring-Buffer, in records */
+
+    /**
+     * Most bytes of serialized records the Writer Ring-Buffer holds at once, so bursts of large values
+     * can't pin unbounded memory. A record larger than this is still taken when the queue is empty.
+     * 0 picks the default (64 MiB).
+     */
+    size_t writer_queue_max_bytes;
 
     /**
      * Size after which datafiles must be rotated.
      * Note: This doesn't have any effect on existing datafiles.
      */
     size_t datafile_rotate_threshold;
+
+    /**
+     * Number of independently locked partitions (shards) of the key-directory.
+     * Keys are spread over shards by hash. 0 picks the default (64).
+     */
+    size_t keydir_shards;
+
+    /**
+     * Seconds between keydir checkpoints, which let restarts replay only the log written after them.
+     * One is also written on shutdown. 0 picks the default (300).
+     */
+    size_t checkpoint_interval;
+
+    /**
+     * When writes are synced to disk, see `ccask_durability_e`. Defaults to CCASK_DURABILITY_NONE.
+     * Syncs cover whole batches of records, so stricter modes cost far less than syncing every put.
+     */
+    ccask_durability_e durability;
+    size_t sync_interval_ms;                /* For CCASK_DURABILITY_INTERVAL. 0 picks the default (100) */
+
+    /**
+     * Write only the latest version of a key among the records the writer drains in one batch (puts and
+     * deletes alike), so hot keys overwritten in quick succession cost one append instead of many.
+     * Skipped puts are reported to async callers with the outcome of the record that replaced them.
+     */
+    bool coalesce_writes;
+
+    /**
+     * Number of writer threads, each appending to its own active datafile from its own queue (the queue
+     * limits above are split between them). Keys are spread over writers by hash, so puts to one key stay
+     * in order. More than one lets appends, syncs and rotations of different keys run side by side.
+     * 0 picks 1, at most 64 are used.
+     */
+    size_t writer_shards;
+
+    /**
+     * Backend datafile reads and writes go through, see `ccask_io_backend_e`. Defaults to CCASK_IO_SYNC.
+     */
+    ccask_io_backend_e io_backend;
+    bool io_uring_sqpoll;                   /* With CCASK_IO_URING, a kernel thread picks up submissions, saving syscalls for a busy CPU */
+    bool skip_timestamps;                   /* Leave record timestamps at 0, saving a clock read per write */
+
+    /**
+     * Append to active datafiles with O_DIRECT, bypassing the page cache, so write-once data doesn't evict
+     * other pages and isn't flushed by writeback in bursts. Records are packed into aligned buffers and the
+     * last, partly filled block of a file is rewritten with every append. Filesystems without O_DIRECT
+     * fall back to buffered writes.
+     */
+    bool direct_io;
+
+    /**
+     * Rotated datafiles never change, so gets read them from a read-only mapping, made on first access,
+     * with no lock or syscall. Only the active datafiles are read with preadv. See `ccask_mmap_advice_e`.
+     */
+    ccask_mmap_advice_e datafile_mmap;
+
+    /**
+     * Bytes of values kept in memory by gets, keyed by the position of their record. Hot keys are then served
+     * without reading (or checksumming) their record again, while one-off reads and scans mostly pass through
+     * without pushing them out. 0 disables the cache.
+     */
+    size_t value_cache_bytes;
 } ccask_options_t;
 
 /**
@@ -54,8 +153,16 @@ ccask_status_e ccask_init(ccask_options_t opts);
  */
 void ccask_shutdown(void);
 
+/**
+ * Durability barrier, returns once every record put (or deleted) before the call is on disk.
+ * Waits for the writer to append what was queued, then syncs the active datafile unless the durability
+ * mode already did.
+ * @return CCASK_OK if successful, else the error code
+ */
+ccask_status_e ccask_flush(void);
+
 typedef struct ccask_record {
-    uint32_t timestamp;
+    uint64_t timestamp;                     /* When the value was written, in nanoseconds since the Unix epoch (0 with `skip_timestamps`) */
     uint32_t key_size;
     uint32_t value_size;
     void *value;
@@ -77,32 +184,151 @@ void ccask_free_record(ccask_record_t record);
  */
 ccask_status_e ccask_get(void *key, uint32_t key_size, ccask_record_t *record);
 
+/**
+ * Fetch the value of `key` straight into caller memory, with no allocation.
+ *
+ * @param buf Where the value is read to
+ * @param cap Size of `buf`
+ * @param value_size Set to the value's size, 0 if the key doesn't exist
+ * @return CCASK_OK if successful (also if the key doesn't exist), CCASK_FAIL with CCASK_ERR_BUFFER_TOO_SMALL
+ *         if the value is larger than `cap` (`buf` is left unspecified), else the error code
+ */
+ccask_status_e ccask_get_into(void *key, uint32_t key_size, void *buf, uint32_t cap, uint32_t *value_size);
+
+/**
+ * Fetch the values of many keys at once. The keys are looked up in one pass over the key-directory, and
+ * their records read in datafile and offset order: records close together in a file are read with one
+ * `preadv`, and all reads go to the I/O backend together.
+ *
+ * @param keys The `num_keys` keys, duplicates are fine
+ * @param key_sizes Their sizes
+ * @param records Filled in for every key like `ccask_get` does, free them with `ccask_free_record`. A key
+ *                that doesn't exist gets a NULL value with a value_size of 0, one whose value couldn't be
+ *                read a NULL value with its value_size.
+ * @return CCASK_OK if every value was read (or its key doesn't exist), CCASK_FAIL if any couldn't be (the
+ *         others are still filled in)
+ */
+ccask_status_e ccask_multi_get(void *const *keys, const uint32_t *key_sizes, size_t num_keys, ccask_record_t *records);
+
+/**
+ * A value borrowed from where it is stored, see `ccask_get_view`. The fields starting with `_` are internal.
+ */
+typedef struct ccask_view {
+    const void *value;                      /* NULL if the key doesn't exist */
+    uint32_t value_size;
+    uint64_t timestamp;
+
+    void *_owner;                           /* Keeps `value` valid until the view is released */
+    void (*_release)(void *owner);
+} ccask_view_t;
+
+/**
+ * Fetch the value of `key` without copying it where possible: values in rotated datafiles are borrowed
+ * from their memory mapping, which is kept until the view is released. Values of the active datafiles
+ * (and of queued puts) are copied into a buffer the view owns.
+ *
+ * @param view Filled in, release it with `ccask_view_release` once done with the value (also if the key
+ *             doesn't exist). All views must be released before `ccask_shutdown`.
+ * @return CCASK_OK if successful (also if the key doesn't exist), else the error code
+ */
+ccask_status_e ccask_get_view(void *key, uint32_t key_size, ccask_view_t *view);
+void ccask_view_release(ccask_view_t *view);
+
 /**
  * Store a new record with the provided key and value by pushing it to the Writer-Ringbuffer.
- * Note: This is a non-blocking operation.
+ * Note: This is a non-blocking operation. Once the queue is nearly full, some puts are refused at random
+ * (more the fuller it gets) so that callers back off before it fills up.
  * 
  * 
  * @param key Pointer to key
- * @param key_size Size of key
+ * @param key_size Size of key, keys can't be empty (CCASK_ERR_EMPTY_KEY)
  * @param value Pointer to value
  * @param value_size Size of value
- * @return CCASK_OK if successful, else the error code
+ * @return CCASK_OK if successful, CCASK_RETRY if the queue had no room (CCASK_ERR_RINGBUFFER_FULL), else the error code
  */
 ccask_status_e ccask_put(void* key, uint32_t key_size, void* value, uint32_t value_size);
 
+/**
+ * Like `ccask_put`, but waits for room when the Writer-Ringbuffer is full instead of failing.
+ * 
+ * @param timeout_ms Most milliseconds to wait, 0 behaves like `ccask_put`, negative waits as long as it takes
+ * @return CCASK_OK if successful, CCASK_RETRY if there was still no room when the timeout passed, else the error code
+ */
+ccask_status_e ccask_put_wait(void* key, uint32_t key_size, void* value, uint32_t value_size, int timeout_ms);
+
 /**
  * Store a new record with the provided key and value by immediately writing to the active datafile.
  * Note: This is a blocking operation.
  * 
  * 
  * @param key Pointer to key
- * @param key_size Size of key
+ * @param key_size Size of key, keys can't be empty (CCASK_ERR_EMPTY_KEY)
  * @param value Pointer to value
  * @param value_size Size of value
  * @return CCASK_OK if successful, else the error code
  */
 ccask_status_e ccask_put_blocking(void *key, uint32_t key_size, void *value, uint32_t value_size);
 
+/**
+ * Outcome of an asynchronous put. It is reported once the record is as durable as the durability mode
+ * makes it: appended (NONE), synced by the next periodic sync (INTERVAL), or synced with its batch (BATCH, DSYNC).
+ */
+typedef struct ccask_put_result {
+    ccask_status_e status;
+    ccask_error_e error;    /* Set when status isn't CCASK_OK */
+    uint64_t file_id;       /* Datafile the record was appended to */
+    uint64_t offset;        /* Position of the record in that datafile */
+    void *ctx;              /* As passed to the put */
+} ccask_put_result_t;
+
+/**
+ * Called on the writer thread (or the syncer thread, for CCASK_DURABILITY_INTERVAL), so it should only hand
+ * the result off (a slow callback stalls all writes).
+ */
+typedef void (*ccask_put_callback_t)(const ccask_put_result_t *result);
+
+/**
+ * Non-blocking put like `ccask_put`, that calls `callback` with the outcome once the record is written.
+ * A `value_size` of 0 stores a tombstone (delete).
+ * @param ctx Passed back in the result
+ * @return CCASK_OK if queued (the callback will be called exactly once), else the error code (it won't be)
+ */
+ccask_status_e ccask_put_async(void *key, uint32_t key_size, void *value, uint32_t value_size, ccask_put_callback_t callback, void *ctx);
+
+// Opaque Forward-declaration
+typedef struct ccask_completion_queue ccask_completion_queue_t;
+
+/**
+ * Create a queue that collects the outcomes of asynchronous puts, for event loops.
+ * @return Queue instance, or NULL on failure
+ */
+ccask_completion_queue_t* ccask_completion_queue_create(void);
+
+/**
+ * An eventfd that is readable (for poll/epoll) while completions are waiting in the queue.
+ * Don't read from it, `ccask_completion_queue_poll` resets it.
+ */
+int ccask_completion_queue_fd(ccask_completion_queue_t *queue);
+
+/**
+ * Take up to `max_results` completions from the queue, without blocking.
+ * @return Number of results filled in
+ */
+size_t ccask_completion_queue_poll(ccask_completion_queue_t *queue, ccask_put_result_t *results, size_t max_results);
+
+/**
+ * Destroy the queue. No put that reports to it may still be pending.
+ */
+void ccask_completion_queue_destroy(ccask_completion_queue_t *queue);
+
+/**
+ * Non-blocking put like `ccask_put`, whose outcome is added to `queue` once the record is written.
+ * A `value_size` of 0 stores a tombstone (delete).
+ * @param ctx Passed back in the result
+ * @return CCASK_OK if queued (exactly one result will be added), else the error code (none will be)
+ */
+ccask_status_e ccask_put_async_to_queue(void *key, uint32_t key_size, void *value, uint32_t value_size, ccask_completion_queue_t *queue, void *ctx);
+
 /**
  * Delete a stored Key-Value pair
  * This is done by adding a tombstone record for the key.
@@ -125,13 +351,65 @@ ccask_status_e ccask_delete(void *key, uint32_t key_size);
  */
 ccask_status_e ccask_delete_blocking(void *key, uint32_t key_size);
 
+// Opaque Forward-declaration
+typedef struct ccask_write_batch ccask_write_batch_t;
+
+// Most operations a write batch can hold, the batch and its header are written with one `pwritev`
+#define CCASK_WRITE_BATCH_MAX_OPS 1023
+
+/**
+ * Create an empty write batch, which collects puts and deletes to be written together by
+ * `ccask_write_batch_commit`: either all of them survive a crash or none do.
+ * @return Batch instance, or NULL on failure
+ */
+ccask_write_batch_t* ccask_write_batch_create(void);
+
+/**
+ * Add a put to the batch, the key and value are copied. Later operations on a key in the batch win.
+ * Keys must not be empty (CCASK_ERR_EMPTY_KEY). A `value_size` of 0 stores a tombstone (delete).
+ * @return CCASK_OK if added, else the error code. Fails with CCASK_ERR_BATCH_TOO_LARGE if the batch
+ *         already holds CCASK_WRITE_BATCH_MAX_OPS operations
+ */
+ccask_status_e ccask_write_batch_put(ccask_write_batch_t *batch, void *key, uint32_t key_size, void *value, uint32_t value_size);
+
+/**
+ * Add a delete to the batch.
+ * @return CCASK_OK if added, else the error code (like `ccask_write_batch_put`)
+ */
+ccask_status_e ccask_write_batch_delete(ccask_write_batch_t *batch, void *key, uint32_t key_size);
+
+/**
+ * Number of operations in the batch.
+ */
+size_t ccask_write_batch_count(ccask_write_batch_t *batch);
+
+/**
+ * Write the batch as one unit: its records are appended together with one write, behind a header with a
+ * checksum over them, and applied to the key-directory at once. Recovery drops a batch that didn't fully
+ * make it to disk. Blocks like `ccask_put_blocking` (and isn't ordered with puts still queued, see
+ * `ccask_flush`). The batch is left as it was, to be cleared or destroyed.
+ * @return CCASK_OK if written, else the error code
+ */
+ccask_status_e ccask_write_batch_commit(ccask_write_batch_t *batch);
+
+/**
+ * Remove every operation from the batch, so it can be reused.
+ */
+void ccask_write_batch_clear(ccask_write_batch_t *batch);
+
+/**
+ * Destroy the batch.
+ */
+void ccask_write_batch_destroy(ccask_write_batch_t *batch);
+
 // Opaque Forward-declaration
 typedef struct ccask_keys_iter ccask_keys_iter_t;
 
 /**
  * Get a iterator for currently stored keys.
- * This acquires a read-lock over the key-directory. Thus there can be no write operations run while the iter is alive.
- * @return Iterator instance for currently stored keys, acquires a read-lock on key-directory.
+ * The iterator works on a snapshot of the keys as of this call (see `ccask_snapshot_open`), so it doesn't
+ * block writers and isn't affected by them. It may be used and closed from any thread.
+ * @return Iterator instance for currently stored keys
  */
 ccask_keys_iter_t* ccask_list_keys(void);
 
@@ -142,10 +420,166 @@ ccask_keys_iter_t* ccask_list_keys(void);
 ccask_status_e ccask_keys_iter_next(ccask_keys_iter_t *iter, void **key, uint32_t *key_size);
 
 /**
- * Close the keys iterator and release the read-lock.
+ * Close the keys iterator, keys returned by it must not be used afterwards.
  */
 void ccask_keys_iter_close(ccask_keys_iter_t *iter);
 
+// Opaque Forward-declaration
+typedef struct ccask_snapshot ccask_snapshot_t;
+
+/**
+ * Position in a snapshot, for listing its keys in chunks.
+ * Zero-initialize it to start at the beginning. It's a plain value, so it can be stored (eg. as a page
+ * token) and passed back later to continue where the previous chunk ended.
+ */
+typedef struct ccask_snapshot_cursor {
+    uint64_t shard;
+    uint64_t pos;
+} ccask_snapshot_cursor_t;
+
+/**
+ * Take a point-in-time snapshot of the stored keys.
+ * Opening it only briefly pauses writers. Afterwards, the first insert or delete in each key-directory
+ * shard copies that shard's keys into the snapshot; overwriting existing keys costs nothing.
+ * @return Snapshot instance, or NULL on failure
+ */
+ccask_snapshot_t* ccask_snapshot_open(void);
+
+/**
+ * Get the key at the cursor and advance the cursor.
+ * Snapshots may be read from any thread, concurrently with different cursors.
+ * Returned keys stay valid until the snapshot is closed.
+ * @return CCASK_OK if next exists, CCASK_ERR_ITER_END if at end
+ */
+ccask_status_e ccask_snapshot_next(ccask_snapshot_t *snap, ccask_snapshot_cursor_t *cursor, void **key, uint32_t *key_size);
+
+/**
+ * Close the snapshot, keys returned from it must not be used afterwards.
+ */
+void ccask_snapshot_close(ccask_snapshot_t *snap);
+
+// Opaque Forward-declaration
+typedef struct ccask_scan_iter ccask_scan_iter_t;
+
+/**
+ * Get an iterator over the keys in [start, end), in lexicographic (memcmp) order.
+ * The iterator doesn't block writers, keys written meanwhile may or may not be returned.
+ * @param start First key of the range, NULL to start at the smallest key
+ * @param end Key just past the range, NULL to run to the largest key
+ * @return Iterator instance, or NULL on failure
+ */
+ccask_scan_iter_t* ccask_scan_range(void *start, uint32_t start_size, void *end, uint32_t end_size);
+
+/**
+ * Get an iterator over the keys starting with the given prefix, in lexicographic (memcmp) order.
+ * The iterator doesn't block writers, keys written meanwhile may or may not be returned.
+ * @return Iterator instance, or NULL on failure
+ */
+ccask_scan_iter_t* ccask_scan_prefix(void *prefix, uint32_t prefix_size);
+
+/**
+ * Get the next key from the provided scan iterator, and optionally its value.
+ * The key stays valid until the next call on the iterator. Keys deleted before their value could be
+ * read are skipped.
+ * @param record NULL to only return keys, else filled in with the value, which must be freed with `ccask_free_record`
+ * @return CCASK_OK if next exists, CCASK_ERR_ITER_END if at end
+ */
+ccask_status_e ccask_scan_iter_next(ccask_scan_iter_t *iter, void **key, uint32_t *key_size, ccask_record_t *record);
+
+/**
+ * Close the scan iterator.
+ */
+void ccask_scan_iter_close(ccask_scan_iter_t *iter);
+
+/**
+ * Memory used by the key-directory, for sizing hosts.
+ */
+typedef struct ccask_keydir_stats {
+    uint64_t num_keys;
+    uint64_t table_bytes;           /* Hash-table slot arrays */
+    uint64_t entry_bytes;           /* Slabs of packed entries, including free ones */
+    uint64_t key_arena_bytes;       /* Arena chunks holding keys longer than 16 bytes */
+    uint64_t key_arena_dead_bytes;  /* Arena bytes of deleted keys, only given back on restart */
+    uint64_t index_bytes;           /* Ordered key index used by scans */
+    uint64_t total_bytes;
+    double bytes_per_key;
+} ccask_keydir_stats_t;
+
+/**
+ * Get the memory currently used by the key-directory
+ * @param stats Filled in with the current usage
+ * @return CCASK_OK if successful, else the error code
+ */
+ccask_status_e ccask_get_keydir_stats(ccask_keydir_stats_t *stats);
+
+/**
+ * Load on the Writer-Ringbuffer, for alerting on a writer that can't keep up.
+ */
+typedef struct ccask_writer_queue_stats {
+    uint64_t depth;             /* Records waiting to be written */
+    uint64_t capacity;          /* Most records it holds */
+    uint64_t bytes_pending;     /* Serialized bytes waiting to be written */
+    uint64_t max_bytes;         /* Most bytes it holds */
+    uint64_t shed;              /* Non-waiting puts refused early while the queue was nearly full */
+    uint64_t rejected;          /* Non-waiting puts refused because the queue was full */
+    uint64_t waits;             /* Times a waiting put had to wait for room */
+    uint64_t timeouts;          /* Waiting puts that gave up */
+    uint64_t coalesced;         /* Records not written because a newer put of the key was in the same batch */
+} ccask_writer_queue_stats_t;
+
+/**
+ * Get the current load of the Writer-Ringbuffer, and how many puts it turned away since startup
+ * @param stats Filled in with the current values
+ * @return CCASK_OK if successful, else the error code
+ */
+ccask_status_e ccask_get_writer_queue_stats(ccask_writer_queue_stats_t *stats);
+
+/**
+ * Effectiveness of the value cache, all zero while it's disabled.
+ */
+typedef struct ccask_value_cache_stats {
+    uint64_t hits;              /* Gets served from the cache */
+    uint64_t misses;            /* Gets that had to read the datafile */
+    uint64_t evictions;         /* Values dropped to make room for others */
+    uint64_t entries;           /* Values currently cached */
+    uint64_t bytes;             /* Bytes currently charged against the budget, including per-entry overhead */
+    uint64_t capacity;          /* The budget, `value_cache_bytes` */
+} ccask_value_cache_stats_t;
+
+/**
+ * Get the hit, miss and eviction counts of the value cache since startup
+ * @param stats Filled in with the current values
+ * @return CCASK_OK if successful, else the error code
+ */
+ccask_status_e ccask_get_value_cache_stats(ccask_value_cache_stats_t *stats);
+
+/**
+ * Space usage of a datafile. Records the key-directory no longer points to (overwritten or deleted
+ * values and tombstones) are garbage, which compaction can reclaim.
+ */
+typedef struct ccask_file_stats {
+    uint64_t file_id;
+    bool is_active;
+    uint64_t total_bytes;
+    uint64_t live_bytes;
+    uint64_t dead_bytes;
+    uint64_t live_keys;
+    double dead_ratio;      /* dead_bytes / total_bytes, 0 for empty files */
+} ccask_file_stats_t;
+
+/**
+ * Get the space usage of every datafile, newest first
+ * @param stats Set to an array of `num_files` entries, which must be freed with `ccask_free_file_stats`
+ * @param num_files Set to the number of datafiles
+ * @return CCASK_OK if successful, else the error code
+ */
+ccask_status_e ccask_file_stats(ccask_file_stats_t **stats, size_t *num_files);
+
+/**
+ * Free the array returned by `ccask_file_stats`
+ */
+void ccask_free_file_stats(ccask_file_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -39,6 +39,11 @@ typedef enum ccask_error {
     CCASK_ERR_COULDNT_START_THREAD        = 10,
     CCASK_ERR_UNEXPECTED_EOF              = 11,
     CCASK_ERR_RINGBUFFER_FULL             = 12,
+    CCASK_ERR_SYNC_FAILED                 = 13,
+    CCASK_ERR_BATCH_TOO_LARGE             = 14,
+    CCASK_ERR_UNSUPPORTED_FORMAT          = 15,
+    CCASK_ERR_BUFFER_TOO_SMALL            = 16,
+    CCASK_ERR_EMPTY_KEY                   = 17,
 } ccask_error_e;
 
 typedef enum ccask_status {
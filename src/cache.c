@@ -0,0 +1,317 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+#include "ccask/cache.h"
+
+#include "stdlib.h"
+#include "string.h"
+#include "pthread.h"
+#include "ccask/hash.h"
+
+#define CACHE_MIN_BUCKETS 64
+#define CACHE_MAX_FREQ 3
+
+typedef struct cache_fifo {
+    ccask_cache_entry_t *oldest;
+    ccask_cache_entry_t *newest;
+    size_t bytes;
+    size_t count;
+} cache_fifo_t;
+
+/**
+ * Ghosts are only hashes, one per slot of a direct-mapped table, so a collision just forgets the older ghost.
+ * A ghost counts for as long as the shard could still have held its value, ie. until as many values as the
+ * shard holds have been evicted after it.
+ */
+typedef struct cache_ghost {
+    uint64_t hashv;
+    uint64_t evicted_at; // 0 for an empty slot
+} cache_ghost_t;
+
+/**
+ * Chained hash table growing with the number of entries, the ghost table has as many slots as it has buckets.
+ */
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    ccask_cache_entry_t **buckets;
+    cache_ghost_t *ghosts;
+    size_t mask;
+    cache_fifo_t small;
+    cache_fifo_t main;
+    uint64_t ghost_clock; // values evicted from the small FIFO so far
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} __attribute__((aligned(64))) cache_shard_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+
+// 0 while the cache is disabled
+static size_t shard_budget = 0;
+static size_t small_budget = 0;
+
+static inline uint64_t position_hash(uint64_t file_id, uint64_t record_pos) {
+    return hash_mix(file_id ^ UINT64_C(0xa0761d6478bd642f), record_pos ^ UINT64_C(0xe7037ed1a0b428db));
+}
+
+// buckets use the low bits of the hash, so shards are picked from the high ones
+static inline cache_shard_t* shard_for(uint64_t hashv) {
+    return &shards[(hashv >> 60) % CACHE_SHARDS];
+}
+
+static inline size_t entry_charge(uint32_t value_size) {
+    return sizeof(ccask_cache_entry_t) + value_size;
+}
+
+static void fifo_push(cache_fifo_t *fifo, ccask_cache_entry_t *entry) {
+    entry->newer = NULL;
+    if (fifo->newest) fifo->newest->newer = entry;
+    else fifo->oldest = entry;
+    fifo->newest = entry;
+    fifo->bytes += entry_charge(entry->value_size);
+    fifo->count++;
+}
+
+static ccask_cache_entry_t* fifo_pop(cache_fifo_t *fifo) {
+    ccask_cache_entry_t *entry = fifo->oldest;
+    fifo->oldest = entry->newer;
+    if (!fifo->oldest) fifo->newest = NULL;
+    fifo->bytes -= entry_charge(entry->value_size);
+    fifo->count--;
+    return entry;
+}
+
+// returns the link pointing at the position's entry, which is NULL if it has none
+static ccask_cache_entry_t** find_link(cache_shard_t *shard, uint64_t hashv, uint64_t file_id, uint64_t record_pos) {
+    ccask_cache_entry_t **link = &shard->buckets[hashv & shard->mask];
+    while (*link && ((*link)->file_id != file_id || (*link)->record_pos != record_pos)) link = &(*link)->next;
+    return link;
+}
+
+static void ghost_add(cache_shard_t *shard, uint64_t hashv) {
+    cache_ghost_t *ghost = &shard->ghosts[hashv & shard->mask];
+    ghost->hashv = hashv;
+    ghost->evicted_at = ++shard->ghost_clock;
+}
+
+// forgets the position's ghost, returning whether it was recent enough to count
+static bool ghost_take(cache_shard_t *shard, uint64_t hashv) {
+    cache_ghost_t *ghost = &shard->ghosts[hashv & shard->mask];
+    if (ghost->evicted_at == 0 || ghost->hashv != hashv) return false;
+
+    uint64_t evicted_at = ghost->evicted_at;
+    ghost->evicted_at = 0;
+    return shard->ghost_clock - evicted_at < shard->small.count + shard->main.count;
+}
+
+// takes an entry popped from its FIFO out of the table, it's freed once the last reader is done with it
+static void evict(cache_shard_t *shard, ccask_cache_entry_t *entry) {
+    ccask_cache_entry_t **link = find_link(shard, position_hash(entry->file_id, entry->record_pos), entry->file_id, entry->record_pos);
+    *link = entry->next;
+    shard->evictions++;
+    ccask_cache_release(entry);
+}
+
+/**
+ * Evicts until `charge` more bytes fit. Values leaving the small FIFO move to the main one if they were hit
+ * while in it, and values leaving the main one get another round for every hit they had.
+ */
+static void make_room(cache_shard_t *shard, size_t charge) {
+    while (shard->small.bytes + shard->main.bytes + charge > shard_budget) {
+        ccask_cache_entry_t *entry;
+        if (shard->small.oldest && (shard->small.bytes > small_budget || !shard->main.oldest)) {
+            entry = fifo_pop(&shard->small);
+            if (entry->freq > 0) {
+                entry->freq = 0;
+                fifo_push(&shard->main, entry);
+            } else {
+                ghost_add(shard, position_hash(entry->file_id, entry->record_pos));
+                evict(shard, entry);
+            }
+        } else if (shard->main.oldest) {
+            entry = fifo_pop(&shard->main);
+            if (entry->freq > 0) {
+                entry->freq--;
+                fifo_push(&shard->main, entry);
+            } else {
+                evict(shard, entry);
+            }
+        } else {
+            break;
+        }
+    }
+}
+
+// doubles the tables once there are more entries than buckets, a failed allocation just keeps chains longer
+static void maybe_grow(cache_shard_t *shard) {
+    size_t num_buckets = shard->mask + 1;
+    if (shard->small.count + shard->main.count <= num_buckets) return;
+
+    size_t new_mask = (num_buckets << 1) - 1;
+    ccask_cache_entry_t **buckets = calloc(new_mask + 1, sizeof(ccask_cache_entry_t*));
+    cache_ghost_t *ghosts = calloc(new_mask + 1, sizeof(cache_ghost_t));
+    if (!buckets || !ghosts) {
+        free(buckets);
+        free(ghosts);
+        return;
+    }
+
+    for (size_t b = 0; b < num_buckets; b++) {
+        ccask_cache_entry_t *entry = shard->buckets[b];
+        while (entry) {
+            ccask_cache_entry_t *next = entry->next;
+            ccask_cache_entry_t **head = &buckets[position_hash(entry->file_id, entry->record_pos) & new_mask];
+            entry->next = *head;
+            *head = entry;
+            entry = next;
+        }
+
+        if (shard->ghosts[b].evicted_at != 0) ghosts[shard->ghosts[b].hashv & new_mask] = shard->ghosts[b];
+    }
+
+    free(shard->buckets);
+    free(shard->ghosts);
+    shard->buckets = buckets;
+    shard->ghosts = ghosts;
+    shard->mask = new_mask;
+}
+
+ccask_status_e ccask_cache_init(size_t max_bytes) {
+    shard_budget = 0;
+    if (max_bytes / CACHE_SHARDS == 0) return CCASK_OK;
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(cache_shard_t));
+        shards[i].buckets = calloc(CACHE_MIN_BUCKETS, sizeof(ccask_cache_entry_t*));
+        shards[i].ghosts = calloc(CACHE_MIN_BUCKETS, sizeof(cache_ghost_t));
+        if (!shards[i].buckets || !shards[i].ghosts) {
+            do {
+                free(shards[i].buckets);
+                free(shards[i].ghosts);
+            } while (i-- > 0);
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return CCASK_FAIL;
+        }
+
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].mask = CACHE_MIN_BUCKETS - 1;
+    }
+
+    shard_budget = max_bytes / CACHE_SHARDS;
+    small_budget = shard_budget / 10;
+    return CCASK_OK;
+}
+
+static void release_fifo(cache_fifo_t *fifo) {
+    while (fifo->oldest) ccask_cache_release(fifo_pop(fifo));
+}
+
+void ccask_cache_shutdown(void) {
+    if (shard_budget == 0) return;
+
+    // entries still referenced by views are freed when those are released
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        release_fifo(&shards[i].small);
+        release_fifo(&shards[i].main);
+        free(shards[i].buckets);
+        free(shards[i].ghosts);
+        shards[i].buckets = NULL;
+        shards[i].ghosts = NULL;
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+    shard_budget = 0;
+}
+
+ccask_cache_entry_t* ccask_cache_get(uint64_t file_id, uint64_t record_pos) {
+    if (shard_budget == 0) return NULL;
+
+    uint64_t hashv = position_hash(file_id, record_pos);
+    cache_shard_t *shard = shard_for(hashv);
+
+    pthread_mutex_lock(&shard->lock);
+    ccask_cache_entry_t *entry = *find_link(shard, hashv, file_id, record_pos);
+    if (entry) {
+        if (entry->freq < CACHE_MAX_FREQ) entry->freq++;
+        atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+ccask_cache_entry_t* ccask_cache_insert(uint64_t file_id, uint64_t record_pos, const void *value, uint32_t value_size, uint64_t timestamp) {
+    // a value that doesn't fit the small FIFO would flush it on its own
+    size_t charge = entry_charge(value_size);
+    if (shard_budget == 0 || charge > small_budget) return NULL;
+
+    ccask_cache_entry_t *entry = malloc(charge);
+    if (!entry) return NULL;
+    memcpy(entry->value, value, value_size);
+    entry->file_id = file_id;
+    entry->record_pos = record_pos;
+    entry->timestamp = timestamp;
+    entry->value_size = value_size;
+    entry->freq = 0;
+    atomic_init(&entry->refs, 2);
+
+    uint64_t hashv = position_hash(file_id, record_pos);
+    cache_shard_t *shard = shard_for(hashv);
+
+    pthread_mutex_lock(&shard->lock);
+    ccask_cache_entry_t *existing = *find_link(shard, hashv, file_id, record_pos);
+    if (existing) {
+        // another get of the record filled it first
+        atomic_fetch_add_explicit(&existing->refs, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return existing;
+    }
+
+    bool was_ghost = ghost_take(shard, hashv);
+    make_room(shard, charge);
+
+    ccask_cache_entry_t **head = &shard->buckets[hashv & shard->mask];
+    entry->next = *head;
+    *head = entry;
+    fifo_push(was_ghost ? &shard->main : &shard->small, entry);
+    maybe_grow(shard);
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+void ccask_cache_release(ccask_cache_entry_t *entry) {
+    if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) == 1) free(entry);
+}
+
+void ccask_cache_get_stats(ccask_value_cache_stats_t *stats) {
+    *stats = (ccask_value_cache_stats_t){ 0 };
+    if (shard_budget == 0) return;
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        stats->hits += shards[i].hits;
+        stats->misses += shards[i].misses;
+        stats->evictions += shards[i].evictions;
+        stats->entries += shards[i].small.count + shards[i].main.count;
+        stats->bytes += shards[i].small.bytes + shards[i].main.bytes;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    stats->capacity = shard_budget * CACHE_SHARDS;
+}
@@ -0,0 +1,482 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "ccask/checkpoint.h"
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdbool.h"
+#include "time.h"
+#include "errno.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "pthread.h"
+#include "inttypes.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "zlib.h"
+#include "ccask/files.h"
+#include "ccask/keydir.h"
+#include "ccask/index.h"
+#include "ccask/writer.h"
+#include "ccask/utils.h"
+#include "ccask/log.h"
+
+#define CHECKPOINT_FILENAME "keydir.ckpt"
+#define CHECKPOINT_TEMP_FILENAME "keydir.ckpt.tmp"
+
+#define CHECKPOINT_MAGIC 0x43434B50 // "CCKP"
+// older versions point into datafiles of the record format before sequence numbers, which isn't read anymore
+#define CHECKPOINT_VERSION 3
+
+// magic, version, number of entries, CRC32 of everything after the header, number of log positions, next sequence number
+#define CHECKPOINT_HEADER_SIZE 32
+// file ID, offset (one per active datafile and per datafile created ahead of a rotation, right after the header)
+#define CHECKPOINT_POSITION_SIZE 16
+// file ID, record position, sequence number, value size, key size (followed by the key)
+#define CHECKPOINT_ENTRY_HEADER_SIZE 32
+
+#define CHECKPOINT_BUFFER_SIZE (1 << 20)
+
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+// positions of the last checkpoint, skips writing unchanged ones
+static ccask_checkpoint_position_t last_positions[CHECKPOINT_MAX_POSITIONS];
+static size_t last_num_positions = 0;
+
+static pthread_t checkpointer_thread;
+static pthread_mutex_t checkpointer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpointer_cond = PTHREAD_COND_INITIALIZER;
+static bool checkpointer_running = false;
+static size_t checkpointer_interval;
+
+static char* checkpoint_path(const char *filename) {
+    const char *dir = ccask_files_get_data_dir();
+    size_t dir_len = strlen(dir);
+    bool has_trailing_slash = (dir[dir_len - 1] == '/');
+
+    char *path = malloc(dir_len + 1 + strlen(filename) + 1);
+    if (!path) return NULL;
+
+    sprintf(path, has_trailing_slash ? "%s%s" : "%s/%s", dir, filename);
+    return path;
+}
+
+/**
+ * Returns the current end of every active datafile. An active file's lock is held while a record is
+ * written and applied to the keydir, so with all of them taken here, every record before the ends (and
+ * in every file rotated out before) is in the keydir. Files created (or still being created) for the next
+ * rotations are listed too, at offset 0, as their IDs can be lower than another shard's active file.
+ */
+static void capture_log_end(ccask_checkpoint_position_t *positions, size_t *num_positions, uint64_t *next_seq) {
+    size_t count = ccask_files_num_active();
+    ccask_file_t *files[count];
+
+    // whoever holds several of these locks (write batches) takes them in order too, so this can't deadlock
+    for (size_t i = 0; i < count; i++) {
+        while (true) {
+            files[i] = ccask_files_get_active_file(i);
+
+            pthread_rwlock_wrlock(&files[i]->rwlock);
+            if (files[i]->is_active) break;
+
+            // rotated while we were waiting for the lock
+            pthread_rwlock_unlock(&files[i]->rwlock);
+        }
+    }
+
+    // no rotation can take a spare while the locks are held
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        positions[n].file_id = files[i]->file_id;
+        positions[n++].offset = atomic_load_explicit(&files[i]->size, memory_order_relaxed);
+
+        uint64_t spare_id;
+        if (ccask_files_get_spare_file_id(i, &spare_id)) positions[n++] = (ccask_checkpoint_position_t){ spare_id, 0 };
+    }
+    *next_seq = ccask_writer_next_seq();
+
+    for (size_t i = 0; i < count; i++) pthread_rwlock_unlock(&files[i]->rwlock);
+
+    *num_positions = n;
+}
+
+typedef struct checkpoint_writer {
+    int fd;
+    uint8_t *buf;
+    size_t used;
+    uint32_t crc;
+} checkpoint_writer_t;
+
+static ccask_status_e writer_flush(checkpoint_writer_t *w) {
+    struct iovec iov = { w->buf, w->used };
+    if (w->used > 0 && safe_writev(w->fd, &iov, 1) != CCASK_OK) return CCASK_FAIL;
+
+    w->crc = (uint32_t)crc32(w->crc, w->buf, w->used);
+    w->used = 0;
+    return CCASK_OK;
+}
+
+static ccask_status_e writer_append(checkpoint_writer_t *w, const void *data, size_t size) {
+    while (size > 0) {
+        if (w->used == CHECKPOINT_BUFFER_SIZE && writer_flush(w) != CCASK_OK) return CCASK_FAIL;
+
+        size_t n = CHECKPOINT_BUFFER_SIZE - w->used;
+        if (n > size) n = size;
+
+        memcpy(w->buf + w->used, data, n);
+        w->used += n;
+        data = (const uint8_t*)data + n;
+        size -= n;
+    }
+    return CCASK_OK;
+}
+
+static ccask_status_e fsync_data_dir(void) {
+    int fd = open(ccask_files_get_data_dir(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return CCASK_FAIL;
+
+    int res = fsync(fd);
+    close(fd);
+    return res == 0 ? CCASK_OK : CCASK_FAIL;
+}
+
+static ccask_status_e write_checkpoint(const ccask_checkpoint_position_t *positions, size_t num_positions, uint64_t next_seq, const char *temp_path, const char *path) {
+    checkpoint_writer_t w = { -1, NULL, 0, (uint32_t)crc32(0, NULL, 0) };
+
+    w.buf = malloc(CHECKPOINT_BUFFER_SIZE);
+    if (!w.buf) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_FAIL;
+    }
+
+    w.fd = open(temp_path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (w.fd < 0) {
+        log_error("Couldn't create checkpoint file\n\t%s", strerror(errno));
+        free(w.buf);
+        return CCASK_FAIL;
+    }
+
+    // the header is written last, once the entry count and CRC are known
+    uint8_t header[CHECKPOINT_HEADER_SIZE] = {0};
+    if (lseek(w.fd, CHECKPOINT_HEADER_SIZE, SEEK_SET) < 0) goto write_failed;
+
+    for (size_t i = 0; i < num_positions; i++) {
+        uint8_t position[CHECKPOINT_POSITION_SIZE];
+        write_be64(position, positions[i].file_id);
+        write_be64(position + 8, positions[i].offset);
+        if (writer_append(&w, position, sizeof(position)) != CCASK_OK) goto write_failed;
+    }
+
+    // entries are written in key order (walking the ordered index), which makes loading them sequential
+    uint64_t num_entries = 0;
+    ccask_index_cursor_t cursor;
+    if (ccask_index_cursor_open(&cursor, NULL, 0) != CCASK_OK) goto write_failed;
+
+    void *key;
+    uint32_t key_size;
+    while (ccask_index_cursor_next(&cursor, &key, &key_size) == CCASK_OK) {
+        ccask_keydir_record_t record;
+        if (ccask_keydir_find(key, key_size, &record) != CCASK_OK) continue; // deleted meanwhile
+
+        uint8_t entry[CHECKPOINT_ENTRY_HEADER_SIZE];
+        write_be64(entry, record.file_id);
+        write_be64(entry + 8, record.record_pos);
+        write_be64(entry + 16, record.seq);
+        write_be32(entry + 24, record.value_size);
+        write_be32(entry + 28, key_size);
+
+        if (writer_append(&w, entry, sizeof(entry)) != CCASK_OK || writer_append(&w, key, key_size) != CCASK_OK) {
+            ccask_index_cursor_close(&cursor);
+            goto write_failed;
+        }
+        num_entries++;
+    }
+
+    // a failed refill also ends the loop, only a drained cursor means every key was written
+    bool complete = cursor.exhausted && cursor.batch_pos == cursor.batch_size;
+    ccask_index_cursor_close(&cursor);
+    if (!complete) goto write_failed;
+
+    if (writer_flush(&w) != CCASK_OK) goto write_failed;
+
+    write_be32(header, CHECKPOINT_MAGIC);
+    write_be32(header + 4, CHECKPOINT_VERSION);
+    write_be64(header + 8, num_entries);
+    write_be32(header + 16, w.crc);
+    write_be32(header + 20, (uint32_t)num_positions);
+    write_be64(header + 24, next_seq);
+
+    struct iovec iov = { header, sizeof(header) };
+    if (safe_pwritev(w.fd, &iov, 1, 0) != CCASK_OK) goto write_failed;
+
+    // the rename only replaces the previous checkpoint once the new one is complete on disk
+    if (fsync(w.fd) != 0) goto write_failed;
+    close(w.fd);
+    free(w.buf);
+
+    if (rename(temp_path, path) != 0) {
+        log_error("Couldn't replace checkpoint file\n\t%s", strerror(errno));
+        unlink(temp_path);
+        return CCASK_FAIL;
+    }
+
+    if (fsync_data_dir() != CCASK_OK) log_error("Couldn't sync data-directory after writing checkpoint");
+
+    log_info("Wrote keydir checkpoint with %" PRIu64 " keys (valid up to Datafile ID = %" PRIu64 ", offset = %" PRIu64 "%s)",
+        num_entries, positions[0].file_id, positions[0].offset, num_positions > 1 ? " and other active datafiles" : "");
+    return CCASK_OK;
+
+write_failed:
+    log_error("Failed to write keydir checkpoint");
+    close(w.fd);
+    free(w.buf);
+    unlink(temp_path);
+    return CCASK_FAIL;
+}
+
+ccask_status_e ccask_checkpoint_write(void) {
+    pthread_mutex_lock(&checkpoint_lock);
+
+    ccask_checkpoint_position_t positions[CHECKPOINT_MAX_POSITIONS];
+    size_t num_positions;
+    uint64_t next_seq;
+    capture_log_end(positions, &num_positions, &next_seq);
+
+    if (num_positions == last_num_positions && memcmp(positions, last_positions, num_positions * sizeof(ccask_checkpoint_position_t)) == 0) {
+        // nothing was written since the last checkpoint
+        pthread_mutex_unlock(&checkpoint_lock);
+        return CCASK_OK;
+    }
+
+    char *path = checkpoint_path(CHECKPOINT_FILENAME);
+    char *temp_path = checkpoint_path(CHECKPOINT_TEMP_FILENAME);
+    if (!path || !temp_path) {
+        free(path);
+        free(temp_path);
+        pthread_mutex_unlock(&checkpoint_lock);
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_FAIL;
+    }
+
+    ccask_status_e res = write_checkpoint(positions, num_positions, next_seq, temp_path, path);
+    if (res == CCASK_OK) {
+        memcpy(last_positions, positions, num_positions * sizeof(ccask_checkpoint_position_t));
+        last_num_positions = num_positions;
+    }
+
+    free(path);
+    free(temp_path);
+    pthread_mutex_unlock(&checkpoint_lock);
+    return res;
+}
+
+// the checkpoint is only usable if the log still reaches the positions it is valid up to
+static bool log_covers_position(uint64_t file_id, uint64_t offset) {
+    // a file that was still empty may have been removed since, unused
+    if (!ccask_files_get_file(file_id)) return offset == 0;
+
+    int fd;
+    CCASK_ATTEMPT(5, fd, ccask_files_get_datafile_fd(file_id));
+    if (fd < 0) return false;
+
+    off_t size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    return size >= 0 && (uint64_t)size >= offset;
+}
+
+static bool log_covers(const ccask_checkpoint_position_t *positions, size_t num_positions) {
+    for (size_t i = 0; i < num_positions; i++) {
+        if (!log_covers_position(positions[i].file_id, positions[i].offset)) return false;
+    }
+    return true;
+}
+
+ccask_status_e ccask_checkpoint_load(ccask_checkpoint_position_t *positions, size_t *num_positions, uint64_t *next_seq) {
+    char *path = checkpoint_path(CHECKPOINT_FILENAME);
+    if (!path) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_FAIL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        if (errno != ENOENT) log_error("Couldn't open keydir checkpoint\n\t%s", strerror(errno));
+        return CCASK_FAIL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < CHECKPOINT_HEADER_SIZE) {
+        log_error("Ignoring truncated keydir checkpoint");
+        close(fd);
+        return CCASK_FAIL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_error("Couldn't map keydir checkpoint\n\t%s", strerror(errno));
+        return CCASK_FAIL;
+    }
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+
+    ccask_status_e res = CCASK_FAIL;
+    uint32_t version = read_be32(data + 4);
+    if (read_be32(data) != CHECKPOINT_MAGIC || version != CHECKPOINT_VERSION) {
+        log_error("Ignoring keydir checkpoint with unknown format");
+        goto done;
+    }
+
+    ccask_checkpoint_position_t ckpt_positions[CHECKPOINT_MAX_POSITIONS];
+    uint64_t num_entries = read_be64(data + 8);
+    uint32_t expected_crc = read_be32(data + 16);
+    size_t count = read_be32(data + 20);
+    uint64_t ckpt_next_seq = read_be64(data + 24);
+    size_t header_size = CHECKPOINT_HEADER_SIZE + count * CHECKPOINT_POSITION_SIZE;
+    if (count == 0 || count > CHECKPOINT_MAX_POSITIONS || size < header_size) goto malformed;
+
+    // the positions are covered by the CRC as well
+    uint32_t crc = (uint32_t)crc32(crc32(0, NULL, 0), data + CHECKPOINT_HEADER_SIZE, size - CHECKPOINT_HEADER_SIZE);
+    if (crc != expected_crc) {
+        log_error("Ignoring corrupted keydir checkpoint (CRC mismatch)");
+        goto done;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *position = data + CHECKPOINT_HEADER_SIZE + i * CHECKPOINT_POSITION_SIZE;
+        ckpt_positions[i].file_id = read_be64(position);
+        ckpt_positions[i].offset = read_be64(position + 8);
+    }
+
+    if (!log_covers(ckpt_positions, count)) {
+        log_error("Ignoring keydir checkpoint, its datafiles were changed since");
+        goto done;
+    }
+
+    ccask_keydir_presize(num_entries);
+
+    const uint8_t *pos = data + header_size;
+    const uint8_t *end = data + size;
+    for (uint64_t i = 0; i < num_entries; i++) {
+        if ((size_t)(end - pos) < CHECKPOINT_ENTRY_HEADER_SIZE) goto malformed;
+
+        uint64_t entry_file_id = read_be64(pos);
+        uint64_t record_pos = read_be64(pos + 8);
+        uint64_t seq = read_be64(pos + 16);
+        uint32_t value_size = read_be32(pos + 24);
+        uint32_t key_size = read_be32(pos + 28);
+        pos += CHECKPOINT_ENTRY_HEADER_SIZE;
+
+        if ((size_t)(end - pos) < key_size) goto malformed;
+
+        int upsert_res;
+        CCASK_ATTEMPT(5, upsert_res, ccask_keydir_upsert((void*)pos, key_size, entry_file_id, record_pos, value_size, seq));
+        if (upsert_res != CCASK_OK) {
+            log_error("Couldn't load keydir checkpoint entry %" PRIu64, i);
+            goto done;
+        }
+        pos += key_size;
+    }
+
+    memcpy(positions, ckpt_positions, count * sizeof(ccask_checkpoint_position_t));
+    *num_positions = count;
+    *next_seq = ckpt_next_seq;
+    res = CCASK_OK;
+
+    // the next checkpoint is only needed once something new is written
+    pthread_mutex_lock(&checkpoint_lock);
+    memcpy(last_positions, ckpt_positions, count * sizeof(ccask_checkpoint_position_t));
+    last_num_positions = count;
+    pthread_mutex_unlock(&checkpoint_lock);
+
+    log_info("Loaded keydir checkpoint with %" PRIu64 " keys (valid up to Datafile ID = %" PRIu64 ", offset = %" PRIu64 "%s)",
+        num_entries, ckpt_positions[0].file_id, ckpt_positions[0].offset, count > 1 ? " and other active datafiles" : "");
+    goto done;
+
+malformed:
+    log_error("Ignoring malformed keydir checkpoint");
+done:
+    munmap((void*)data, size);
+    return res;
+}
+
+void ccask_checkpoint_discard(void) {
+    pthread_mutex_lock(&checkpoint_lock);
+
+    char *path = checkpoint_path(CHECKPOINT_FILENAME);
+    if (path && unlink(path) != 0 && errno != ENOENT) {
+        log_error("Couldn't delete keydir checkpoint\n\t%s", strerror(errno));
+    }
+    free(path);
+
+    last_num_positions = 0;
+    pthread_mutex_unlock(&checkpoint_lock);
+}
+
+static void* checkpointer_thread_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&checkpointer_lock);
+    while (checkpointer_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += checkpointer_interval;
+
+        int res = 0;
+        while (checkpointer_running && res != ETIMEDOUT) {
+            res = pthread_cond_timedwait(&checkpointer_cond, &checkpointer_lock, &deadline);
+        }
+        if (!checkpointer_running) break;
+
+        pthread_mutex_unlock(&checkpointer_lock);
+        ccask_checkpoint_write();
+        pthread_mutex_lock(&checkpointer_lock);
+    }
+    pthread_mutex_unlock(&checkpointer_lock);
+
+    return NULL;
+}
+
+ccask_status_e ccask_checkpointer_start(size_t interval) {
+    checkpointer_interval = interval ? interval : CHECKPOINT_DEFAULT_INTERVAL;
+    checkpointer_running = true;
+
+    int res;
+    CCASK_ATTEMPT(5, res, pthread_create(&checkpointer_thread, NULL, checkpointer_thread_main, NULL));
+    if (res != 0) {
+        checkpointer_running = false;
+        ccask_errno = CCASK_ERR_COULDNT_START_THREAD;
+        log_error("Couldn't start checkpointer");
+        return CCASK_FAIL;
+    }
+
+    return CCASK_OK;
+}
+
+void ccask_checkpointer_stop(void) {
+    pthread_mutex_lock(&checkpointer_lock);
+    bool was_running = checkpointer_running;
+    checkpointer_running = false;
+    pthread_cond_signal(&checkpointer_cond);
+    pthread_mutex_unlock(&checkpointer_lock);
+
+    if (was_running) pthread_join(checkpointer_thread, NULL);
+}
@@ -22,7 +22,9 @@
 #include "inttypes.h"
 #include "ccask/reader.h"
 #include "ccask/keydir.h"
+#include "ccask/checkpoint.h"
 #include "ccask/files.h"
+#include "ccask/io.h"
 #include "ccask/records.h"
 #include "ccask/utils.h"
 #include "ccask/log.h"
@@ -40,8 +42,10 @@ ccask_status_e ccask_compactor_dump_keydir() {
     ccask_keydir_record_t *kd_record;
     while ((kd_record = ccask_keydir_record_iter_next(&iter)) != NULL) {
         ccask_datafile_record_t df_record;
-        if (ccask_allocate_datafile_record(df_record, kd_record->key_size, kd_record->value_size) != CCASK_OK)
-            return CCASK_FAIL;
+        if (ccask_allocate_datafile_record(df_record, kd_record->key_size, kd_record->value_size) != CCASK_OK) {
+            close(temp_file_fd);
+            goto cancel_compaction;
+        }
         
         int res;
         CCASK_ATTEMPT(5, res, ccask_read_datafile_record(kd_record->file_id, df_record, kd_record->record_pos));
@@ -67,9 +71,10 @@ ccask_status_e ccask_compactor_dump_keydir() {
                 log_error("Couldn't get FD for %" PRIu64 ".data.tmp, cancelling compaction", curr_temp_id);
                 goto cancel_compaction;
             }
+            pos = lseek(temp_file_fd, 0, SEEK_END);
         }
 
-        if (safe_writev(temp_file_fd, df_record, 3) != CCASK_OK) {
+        if (ccask_io_pwritev(temp_file_fd, df_record, 3, pos, NULL) != CCASK_OK) {
             log_error("Failed to write datafile record, cancelling compaction");
             close(temp_file_fd);
             goto cancel_compaction;
@@ -81,6 +86,9 @@ ccask_status_e ccask_compactor_dump_keydir() {
     close(temp_file_fd);
     ccask_keydir_record_iter_close(&iter);
 
+    // the checkpoint points into the datafiles that are about to be replaced
+    ccask_checkpoint_discard();
+
     ccask_status_e delete_res = CCASK_OK;
     ccask_file_t *curr_file = ccask_files_get_oldest_file();
     while (curr_file != NULL) {
@@ -117,6 +125,7 @@ ccask_status_e ccask_compactor_dump_keydir() {
     return CCASK_OK;
 
 cancel_compaction:
+    ccask_keydir_record_iter_close(&iter);
     for (int i = curr_temp_id; i >= 0; i--) {
         int res;
         CCASK_ATTEMPT(5, res, ccask_files_delete(i, FILE_TEMP_DATA));
@@ -0,0 +1,149 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "ccask/completion.h"
+
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "sys/eventfd.h"
+#include "ccask/log.h"
+
+#define COMPLETION_QUEUE_INITIAL_CAPACITY 64
+
+struct ccask_completion_queue {
+    pthread_mutex_t lock; // guards the ring below
+    ccask_put_result_t *results; // ring, grows when full
+    size_t capacity;
+    size_t head;
+    size_t count;
+    int event_fd;
+};
+
+ccask_completion_queue_t* ccask_completion_queue_create(void) {
+    ccask_completion_queue_t *queue = malloc(sizeof(ccask_completion_queue_t));
+    if (!queue) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return NULL;
+    }
+
+    queue->results = malloc(COMPLETION_QUEUE_INITIAL_CAPACITY * sizeof(ccask_put_result_t));
+    if (!queue->results) {
+        free(queue);
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return NULL;
+    }
+
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->event_fd < 0) {
+        log_error("Couldn't create eventfd for completion queue\n\t%s", strerror(errno));
+        free(queue->results);
+        free(queue);
+        ccask_errno = CCASK_ERR_GET_FD_FAILED;
+        return NULL;
+    }
+
+    queue->capacity = COMPLETION_QUEUE_INITIAL_CAPACITY;
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    return queue;
+}
+
+int ccask_completion_queue_fd(ccask_completion_queue_t *queue) {
+    return queue->event_fd;
+}
+
+static inline void signal_queue(ccask_completion_queue_t *queue) {
+    uint64_t one = 1;
+    // only fails if the counter would overflow, it's readable either way
+    if (write(queue->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_error("Couldn't signal completion queue\n\t%s", strerror(errno));
+    }
+}
+
+// must be called with the queue's lock held
+static bool grow_queue(ccask_completion_queue_t *queue) {
+    size_t capacity = queue->capacity * 2;
+    ccask_put_result_t *results = malloc(capacity * sizeof(ccask_put_result_t));
+    if (!results) return false;
+
+    // unwrap the ring into the new buffer
+    for (size_t i = 0; i < queue->count; i++) {
+        results[i] = queue->results[(queue->head + i) % queue->capacity];
+    }
+
+    free(queue->results);
+    queue->results = results;
+    queue->capacity = capacity;
+    queue->head = 0;
+    return true;
+}
+
+static void completion_queue_push(ccask_completion_queue_t *queue, const ccask_put_result_t *result) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity && !grow_queue(queue)) {
+        pthread_mutex_unlock(&queue->lock);
+        log_error("Dropped a put completion (No memory to grow the completion queue)");
+        return;
+    }
+
+    queue->results[(queue->head + queue->count) % queue->capacity] = *result;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+
+    signal_queue(queue);
+}
+
+size_t ccask_completion_queue_poll(ccask_completion_queue_t *queue, ccask_put_result_t *results, size_t max_results) {
+    // reset the eventfd first, results pushed from here on signal it again
+    uint64_t signals;
+    if (read(queue->event_fd, &signals, sizeof(signals)) < 0 && errno != EAGAIN) {
+        log_error("Couldn't reset completion queue's eventfd\n\t%s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    size_t n = queue->count < max_results ? queue->count : max_results;
+    for (size_t i = 0; i < n; i++) {
+        results[i] = queue->results[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+    }
+    queue->count -= n;
+    bool left_over = queue->count > 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    // keep it readable for the results that didn't fit
+    if (left_over) signal_queue(queue);
+    return n;
+}
+
+void ccask_completion_queue_destroy(ccask_completion_queue_t *queue) {
+    close(queue->event_fd);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->results);
+    free(queue);
+}
+
+void ccask_write_completion_deliver(const ccask_write_completion_t *completion, ccask_put_result_t *result) {
+    result->ctx = completion->ctx;
+    if (completion->callback) completion->callback(result);
+    if (completion->queue) completion_queue_push(completion->queue, result);
+}
@@ -23,143 +23,470 @@
 #include "inttypes.h"
 #include "ccask/files.h"
 #include "ccask/keydir.h"
+#include "ccask/index.h"
+#include "ccask/checkpoint.h"
 #include "ccask/writer.h"
-#include "ccask/writer_ringbuf.h"
+#include "ccask/completion.h"
+#include "ccask/pending.h"
 #include "ccask/reader.h"
+#include "ccask/cache.h"
 #include "ccask/hint.h"
+#include "ccask/io.h"
 #include "ccask/log.h"
 #include "ccask/utils.h"
 
 static volatile _Atomic bool is_shutting_down = false;
+#define GET_KEY_STACK_SIZE 256
+
+static bool skip_timestamps = false;
+
+// nanoseconds since the Unix epoch, for a new record
+static inline uint64_t record_timestamp(void) {
+    if (skip_timestamps) return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
 
 ccask_status_e ccask_init(ccask_options_t opts) {
     atomic_store(&is_shutting_down, false);
+    skip_timestamps = opts.skip_timestamps;
     int res;
 
-    CCASK_ATTEMPT(5, res, ccask_files_init(opts.data_dir, opts.datafile_rotate_threshold));
+    // active datafiles get registered with the backend as they're opened
+    ccask_io_init(opts.io_backend, opts.io_uring_sqpoll);
+
+    if (ccask_cache_init(opts.value_cache_bytes) != CCASK_OK) {
+        log_fatal("Couldn't initialize value cache");
+        goto cache_fail;
+    }
+
+    ccask_files_use_dsync(opts.durability == CCASK_DURABILITY_DSYNC);
+    ccask_files_use_direct_io(opts.direct_io);
+    ccask_files_use_mmap(opts.datafile_mmap);
+    CCASK_ATTEMPT(5, res, ccask_files_init(opts.data_dir, opts.datafile_rotate_threshold, opts.writer_shards));
     if (res != CCASK_OK) {
         log_fatal("Couldn't initialize ccask-files");
         goto files_fail;
     }
 
-    CCASK_ATTEMPT(5, res, ccask_keydir_init());
+    CCASK_ATTEMPT(5, res, ccask_keydir_init(opts.keydir_shards));
     if (res != CCASK_OK) {
         log_fatal("Couldn't initialize keydir");
         goto keydir_fail;
     }
-    
-    CCASK_ATTEMPT(5, res, ccask_writer_start(opts.writer_ringbuf_capacity));
+
+    if (ccask_pending_init(opts.writer_ringbuf_capacity) != CCASK_OK) {
+        log_fatal("Couldn't initialize pending-records index");
+        goto pending_fail;
+    }
+
+    CCASK_ATTEMPT(5, res, ccask_writer_start(opts.writer_ringbuf_capacity, opts.writer_queue_max_bytes, opts.durability, opts.sync_interval_ms, opts.coalesce_writes));
     if (res != CCASK_OK) {
         log_fatal("Couldn't initialize writer");
         goto writer_fail;
     }
 
     ccask_hintfile_generator_init();
+
+    if (ccask_checkpointer_start(opts.checkpoint_interval) != CCASK_OK) {
+        // restarts just get slower without periodic checkpoints
+        log_error("Couldn't start periodic keydir checkpoints");
+    }
     return CCASK_OK;
 
 writer_fail:
+    ccask_pending_shutdown();
+pending_fail:
     ccask_keydir_shutdown();
 keydir_fail:
     ccask_files_shutdown();
 files_fail:
+    ccask_cache_shutdown();
+cache_fail:
+    ccask_io_shutdown();
     return CCASK_FAIL;
 }
 
 void ccask_shutdown(void) {
     atomic_store(&is_shutting_down, true);
+    ccask_checkpointer_stop();
     ccask_hintfile_generator_shutdown();
     ccask_writer_stop();
+    ccask_pending_shutdown();
+
+    // all writes are applied by now, so the next start doesn't have to replay anything
+    if (ccask_checkpoint_write() != CCASK_OK) log_error("Couldn't write keydir checkpoint on shutdown");
     ccask_keydir_shutdown();
     ccask_files_shutdown();
+    ccask_cache_shutdown();
+    ccask_io_shutdown();
+}
+
+ccask_status_e ccask_flush(void) {
+    if (atomic_load(&is_shutting_down)) {
+        log_error("Cannot flush after shutdown has been initiated");
+        return CCASK_FAIL;
+    }
+
+    return ccask_writer_flush();
 }
 
 void ccask_free_record(ccask_record_t record) {
     free(record.value);
 }
 
-ccask_status_e ccask_get(void *key, uint32_t key_size, ccask_record_t *record) {
-    ccask_keydir_record_t *kd_record = ccask_keydir_find(key, key_size);
-    if (kd_record == NULL) {
-        record->value = NULL;
-        return CCASK_OK;
-    }
+// checks a record read (or borrowed) from a datafile against its CRC
+static ccask_status_e check_record_crc(ccask_datafile_record_t df_record) {
+    ccask_datafile_record_header_t header = ccask_get_datafile_record_header(df_record);
+    uint32_t crc = ccask_compute_datafile_record_crc(df_record);
+    if (crc == header.crc) return CCASK_OK;
 
-    ccask_datafile_record_t df_record;
-    if (ccask_allocate_datafile_record(df_record, kd_record->key_size, kd_record->value_size) != CCASK_OK)
+    log_error(
+        "Stored CRC for key doesn't match its actual CRC, returning NULL (%" PRIu32" != %" PRIu32 ")",
+        header.crc, crc
+    );
+    ccask_errno = CCASK_ERR_CRC_INVALID;
+    return CCASK_FAIL;
+}
+
+/**
+ * Reads the record the keydir points to with its value going straight to `value`, and checks its CRC.
+ * Header and key are only needed for the CRC, so they're read to the stack where they fit.
+ */
+static ccask_status_e read_value_into(const ccask_keydir_record_t *kd_record, void *value, uint64_t *timestamp) {
+    uint8_t header[DATAFILE_RECORD_HEADER_SIZE];
+    uint8_t key_buf[GET_KEY_STACK_SIZE];
+    void *key = kd_record->key_size <= sizeof(key_buf) ? key_buf : malloc(kd_record->key_size);
+    if (!key) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
         return CCASK_FAIL;
-    
+    }
+
+    ccask_datafile_record_t df_record = {
+        { .iov_base = header, .iov_len = sizeof(header) },
+        { .iov_base = key, .iov_len = kd_record->key_size },
+        { .iov_base = value, .iov_len = kd_record->value_size },
+    };
+
     int res;
     CCASK_ATTEMPT(5, res, ccask_read_datafile_record(kd_record->file_id, df_record, kd_record->record_pos));
     if (res != CCASK_OK) {
         log_error("Failed to read datafile record");
-        return CCASK_FAIL;
+    } else {
+        res = check_record_crc(df_record);
     }
+    if (res == CCASK_OK && timestamp) *timestamp = ccask_get_datafile_record_timestamp(df_record);
 
-    ccask_datafile_record_header_t header = ccask_get_datafile_record_header(df_record);
-    void *read_key = ccask_get_datafile_record_key(df_record);
-    void *read_value = ccask_get_datafile_record_value(df_record);
-
-    uint32_t crc = calculate_crc32(
-        header.timestamp,
-        header.key_size,
-        header.value_size,
-        read_key,
-        read_value
-    );
+    if (key != key_buf) free(key);
+    return res;
+}
 
-    if (crc != header.crc) {
-        log_error(
-            "Stored CRC for key doesn't match its actual CRC, returning NULL (%" PRIu32" != %" PRIu32 ")",
-            header.crc, crc
-        );
-        free_datafile_record(df_record);
-        ccask_errno = CCASK_ERR_CRC_INVALID;
-        return CCASK_FAIL;
+// like `read_value_into`, but served from the value cache if it has the record, and filling it if not
+static ccask_status_e read_value_cached(const ccask_keydir_record_t *kd_record, void *value, uint64_t *timestamp) {
+    ccask_cache_entry_t *entry = ccask_cache_get(kd_record->file_id, kd_record->record_pos);
+    if (entry) {
+        memcpy(value, entry->value, kd_record->value_size);
+        if (timestamp) *timestamp = entry->timestamp;
+        ccask_cache_release(entry);
+        return CCASK_OK;
+    }
+
+    uint64_t value_timestamp;
+    if (read_value_into(kd_record, value, &value_timestamp) != CCASK_OK) return CCASK_FAIL;
+    if (timestamp) *timestamp = value_timestamp;
+
+    entry = ccask_cache_insert(kd_record->file_id, kd_record->record_pos, value, kd_record->value_size, value_timestamp);
+    if (entry) ccask_cache_release(entry);
+    return CCASK_OK;
+}
+
+ccask_status_e ccask_get(void *key, uint32_t key_size, ccask_record_t *record) {
+    // puts still queued for the writer are newer than anything in the keydir
+    if (ccask_pending_find(key, key_size, record)) {
+        return record->value || record->value_size == 0 ? CCASK_OK : CCASK_FAIL;
+    }
+
+    ccask_keydir_record_t kd_record;
+    if (ccask_keydir_find(key, key_size, &kd_record) != CCASK_OK) {
+        record->value = NULL;
+        return CCASK_OK;
     }
 
-    record->value = malloc(kd_record->value_size);
+    // the value is read right into the buffer handed to the caller
+    record->value = malloc(kd_record.value_size);
     if (!record->value) {
         ccask_errno = CCASK_ERR_NO_MEMORY;
         return CCASK_FAIL;
     }
-    memcpy(record->value, read_value, kd_record->value_size);
 
-    record->timestamp = header.timestamp;
-    record->key_size = header.key_size;
-    record->value_size = kd_record->value_size;
+    if (read_value_cached(&kd_record, record->value, &record->timestamp) != CCASK_OK) {
+        free(record->value);
+        record->value = NULL;
+        return CCASK_FAIL;
+    }
 
-    free_datafile_record(df_record);
+    record->key_size = kd_record.key_size;
+    record->value_size = kd_record.value_size;
     return CCASK_OK;
 }
 
-ccask_status_e ccask_put(void* key, uint32_t key_size, void* value, uint32_t value_size) {
-    if (atomic_load(&is_shutting_down)) {
-        log_error("Cannot put values after shutdown has been initiated");
+ccask_status_e ccask_get_into(void *key, uint32_t key_size, void *buf, uint32_t cap, uint32_t *value_size) {
+    if (ccask_pending_find_into(key, key_size, buf, cap, value_size)) {
+        if (*value_size <= cap) return CCASK_OK;
+        ccask_errno = CCASK_ERR_BUFFER_TOO_SMALL;
         return CCASK_FAIL;
     }
 
-    int res;
-    CCASK_ATTEMPT(5, res, ccask_writer_ringbuf_push(time(NULL), key, key_size, value, value_size));
-    if (res != CCASK_OK) {
-        log_error("Couldn't put record into writer ringbuf");
+    ccask_keydir_record_t kd_record;
+    if (ccask_keydir_find(key, key_size, &kd_record) != CCASK_OK) {
+        *value_size = 0;
+        return CCASK_OK;
+    }
+
+    *value_size = kd_record.value_size;
+    if (kd_record.value_size > cap) {
+        ccask_errno = CCASK_ERR_BUFFER_TOO_SMALL;
         return CCASK_FAIL;
     }
+    return read_value_cached(&kd_record, buf, NULL);
+}
+
+ccask_status_e ccask_multi_get(void *const *keys, const uint32_t *key_sizes, size_t num_keys, ccask_record_t *records) {
+    if (num_keys == 0) return CCASK_OK;
+
+    // one allocation for the batch's bookkeeping and for the headers and keys, which are only read for the CRC
+    size_t key_bytes = 0;
+    for (size_t i = 0; i < num_keys; i++) key_bytes += key_sizes[i];
+    uint8_t *scratch = malloc(num_keys * (sizeof(ccask_keydir_record_t) + sizeof(ccask_read_request_t) + sizeof(size_t) +
+                                          DATAFILE_RECORD_HEADER_SIZE + 2 * sizeof(bool)) + key_bytes);
+    if (!scratch) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_FAIL;
+    }
+
+    ccask_keydir_record_t *kd_records = (ccask_keydir_record_t*)scratch;
+    ccask_read_request_t *requests = (ccask_read_request_t*)(kd_records + num_keys);
+    size_t *owners = (size_t*)(requests + num_keys);
+    uint8_t *headers = (uint8_t*)(owners + num_keys);
+    uint8_t *key_buf = headers + num_keys * DATAFILE_RECORD_HEADER_SIZE;
+    bool *queued = (bool*)(key_buf + key_bytes);
+    bool *found = queued + num_keys;
+
+    ccask_status_e status = CCASK_OK;
+
+    // puts still queued for the writer are newer than anything in the keydir
+    for (size_t i = 0; i < num_keys; i++) {
+        records[i] = (ccask_record_t){ 0 };
+        queued[i] = ccask_pending_find(keys[i], key_sizes[i], &records[i]);
+        if (queued[i] && !records[i].value && records[i].value_size != 0) status = CCASK_FAIL;
+    }
+
+    ccask_keydir_find_batch(keys, key_sizes, num_keys, kd_records, found);
+
+    size_t num_requests = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        if (queued[i] || !found[i]) continue;
+
+        ccask_keydir_record_t *kd_record = &kd_records[i];
+        records[i].key_size = kd_record->key_size;
+        records[i].value_size = kd_record->value_size;
+        records[i].value = malloc(kd_record->value_size);
+        if (!records[i].value) {
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            status = CCASK_FAIL;
+            continue;
+        }
+
+        ccask_cache_entry_t *entry = ccask_cache_get(kd_record->file_id, kd_record->record_pos);
+        if (entry) {
+            memcpy(records[i].value, entry->value, kd_record->value_size);
+            records[i].timestamp = entry->timestamp;
+            ccask_cache_release(entry);
+            continue;
+        }
+
+        ccask_read_request_t *request = &requests[num_requests];
+        request->file_id = kd_record->file_id;
+        request->record_pos = kd_record->record_pos;
+        request->record[0] = (struct iovec){ .iov_base = headers + num_requests * DATAFILE_RECORD_HEADER_SIZE, .iov_len = DATAFILE_RECORD_HEADER_SIZE };
+        request->record[1] = (struct iovec){ .iov_base = key_buf, .iov_len = kd_record->key_size };
+        request->record[2] = (struct iovec){ .iov_base = records[i].value, .iov_len = kd_record->value_size };
+        key_buf += kd_record->key_size;
+        owners[num_requests++] = i;
+    }
+
+    ccask_read_datafile_records(requests, num_requests);
+
+    // CRCs are checked once all reads are back, failed reads get retried one by one first
+    for (size_t j = 0; j < num_requests; j++) {
+        ccask_read_request_t *request = &requests[j];
+        ccask_record_t *record = &records[owners[j]];
+
+        int res = request->status;
+        if (res != CCASK_OK) CCASK_ATTEMPT(5, res, ccask_read_datafile_record(request->file_id, request->record, request->record_pos));
+        if (res == CCASK_OK) res = check_record_crc(request->record);
+        if (res != CCASK_OK) {
+            free(record->value);
+            record->value = NULL;
+            status = CCASK_FAIL;
+            continue;
+        }
+
+        record->timestamp = ccask_get_datafile_record_timestamp(request->record);
+        ccask_cache_entry_t *entry = ccask_cache_insert(request->file_id, request->record_pos, record->value, record->value_size, record->timestamp);
+        if (entry) ccask_cache_release(entry);
+    }
 
+    free(scratch);
+    return status;
+}
+
+static void return_borrowed(void *file) {
+    ccask_return_datafile_record(file);
+}
+
+static void release_cached(void *entry) {
+    ccask_cache_release(entry);
+}
+
+// makes the view borrow the value from a cache entry, taking over the reference held on it
+static void view_cached(ccask_view_t *view, ccask_cache_entry_t *entry) {
+    view->value = entry->value;
+    view->value_size = entry->value_size;
+    view->timestamp = entry->timestamp;
+    view->_owner = entry;
+    view->_release = release_cached;
+}
+
+ccask_status_e ccask_get_view(void *key, uint32_t key_size, ccask_view_t *view) {
+    *view = (ccask_view_t){ 0 };
+
+    ccask_record_t record;
+    if (ccask_pending_find(key, key_size, &record)) {
+        if (!record.value) return record.value_size == 0 ? CCASK_OK : CCASK_FAIL;
+    } else {
+        ccask_keydir_record_t kd_record;
+        if (ccask_keydir_find(key, key_size, &kd_record) != CCASK_OK) return CCASK_OK;
+
+        ccask_cache_entry_t *entry = ccask_cache_get(kd_record.file_id, kd_record.record_pos);
+        if (entry) {
+            view_cached(view, entry);
+            return CCASK_OK;
+        }
+
+        // values of rotated datafiles are borrowed from their mapping, and checked right there
+        ccask_file_t *file;
+        ccask_datafile_record_t df_record = {
+            { .iov_base = NULL, .iov_len = DATAFILE_RECORD_HEADER_SIZE },
+            { .iov_base = NULL, .iov_len = kd_record.key_size },
+            { .iov_base = NULL, .iov_len = kd_record.value_size },
+        };
+        if (ccask_borrow_datafile_record(kd_record.file_id, df_record, kd_record.record_pos, &file)) {
+            if (check_record_crc(df_record) != CCASK_OK) {
+                ccask_return_datafile_record(file);
+                return CCASK_FAIL;
+            }
+
+            // once cached, later views don't have to check the CRC again
+            uint64_t timestamp = ccask_get_datafile_record_timestamp(df_record);
+            entry = ccask_cache_insert(kd_record.file_id, kd_record.record_pos, df_record[2].iov_base, kd_record.value_size, timestamp);
+            if (entry) {
+                ccask_return_datafile_record(file);
+                view_cached(view, entry);
+                return CCASK_OK;
+            }
+
+            view->value = df_record[2].iov_base;
+            view->value_size = kd_record.value_size;
+            view->timestamp = timestamp;
+            view->_owner = file;
+            view->_release = return_borrowed;
+            return CCASK_OK;
+        }
+
+        record.value = malloc(kd_record.value_size);
+        if (!record.value) {
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return CCASK_FAIL;
+        }
+        if (read_value_into(&kd_record, record.value, &record.timestamp) != CCASK_OK) {
+            free(record.value);
+            return CCASK_FAIL;
+        }
+
+        entry = ccask_cache_insert(kd_record.file_id, kd_record.record_pos, record.value, kd_record.value_size, record.timestamp);
+        if (entry) {
+            free(record.value);
+            view_cached(view, entry);
+            return CCASK_OK;
+        }
+        record.value_size = kd_record.value_size;
+    }
+
+    // values of queued puts and active datafiles are copied into a buffer the view owns
+    view->value = record.value;
+    view->value_size = record.value_size;
+    view->timestamp = record.timestamp;
+    view->_owner = record.value;
+    view->_release = free;
     return CCASK_OK;
 }
 
+void ccask_view_release(ccask_view_t *view) {
+    if (view->_release) view->_release(view->_owner);
+    *view = (ccask_view_t){ 0 };
+}
+
+// an empty key is how a write batch's header record is told apart from the records, so none may be written
+static inline ccask_status_e check_key(uint32_t key_size) {
+    if (key_size > 0) return CCASK_OK;
+    ccask_errno = CCASK_ERR_EMPTY_KEY;
+    return CCASK_FAIL;
+}
+
+static ccask_status_e put_queued(void* key, uint32_t key_size, void* value, uint32_t value_size, int timeout_ms, const ccask_write_completion_t *completion) {
+    if (atomic_load(&is_shutting_down)) {
+        log_error("Cannot put values after shutdown has been initiated");
+        return CCASK_FAIL;
+    }
+    if (check_key(key_size) != CCASK_OK) return CCASK_FAIL;
+
+    // a full queue is reported to the caller (and counted in the queue stats) rather than logged
+    return ccask_writer_enqueue(record_timestamp(), key, key_size, value, value_size, timeout_ms, completion);
+}
+
+ccask_status_e ccask_put(void* key, uint32_t key_size, void* value, uint32_t value_size) {
+    return put_queued(key, key_size, value, value_size, 0, NULL);
+}
+
+ccask_status_e ccask_put_wait(void* key, uint32_t key_size, void* value, uint32_t value_size, int timeout_ms) {
+    return put_queued(key, key_size, value, value_size, timeout_ms, NULL);
+}
+
+ccask_status_e ccask_put_async(void *key, uint32_t key_size, void *value, uint32_t value_size, ccask_put_callback_t callback, void *ctx) {
+    ccask_write_completion_t completion = { .callback = callback, .queue = NULL, .ctx = ctx };
+    return put_queued(key, key_size, value, value_size, 0, &completion);
+}
+
+ccask_status_e ccask_put_async_to_queue(void *key, uint32_t key_size, void *value, uint32_t value_size, ccask_completion_queue_t *queue, void *ctx) {
+    ccask_write_completion_t completion = { .callback = NULL, .queue = queue, .ctx = ctx };
+    return put_queued(key, key_size, value, value_size, 0, &completion);
+}
+
 ccask_status_e ccask_put_blocking(void *key, uint32_t key_size, void *value, uint32_t value_size) {
     if (atomic_load(&is_shutting_down)) {
         log_error("Cannot put values after shutdown has been initiated");
         return CCASK_FAIL;
     }
+    if (check_key(key_size) != CCASK_OK) return CCASK_FAIL;
 
-    uint32_t timestamp = time(NULL);
     ccask_datafile_record_t record;
 
     int res = ccask_create_datafile_record(
         record,
-        timestamp,
+        record_timestamp(),
         key, key_size,
         value, value_size
     );
@@ -187,8 +514,81 @@ ccask_status_e ccask_delete_blocking(void* key, uint32_t key_size) {
     return ccask_put_blocking(key, key_size, NULL, 0);
 }
 
+struct ccask_write_batch {
+    ccask_datafile_record_t *records;   // serialized as they're added, so commit only writes
+    size_t count;
+    size_t capacity;
+};
+
+ccask_write_batch_t* ccask_write_batch_create(void) {
+    ccask_write_batch_t *batch = calloc(1, sizeof(ccask_write_batch_t));
+    if (!batch) ccask_errno = CCASK_ERR_NO_MEMORY;
+    return batch;
+}
+
+_Static_assert(CCASK_WRITE_BATCH_MAX_OPS == WRITER_BATCH_MAX_FRAMED_RECORDS, "a committed batch must fit one writer batch");
+
+ccask_status_e ccask_write_batch_put(ccask_write_batch_t *batch, void *key, uint32_t key_size, void *value, uint32_t value_size) {
+    if (check_key(key_size) != CCASK_OK) return CCASK_FAIL;
+
+    // refused here rather than at commit, the batch stays committable
+    if (batch->count == CCASK_WRITE_BATCH_MAX_OPS) {
+        ccask_errno = CCASK_ERR_BATCH_TOO_LARGE;
+        return CCASK_FAIL;
+    }
+
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 16;
+        ccask_datafile_record_t *grown = realloc(batch->records, capacity * sizeof(ccask_datafile_record_t));
+        if (!grown) {
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return CCASK_FAIL;
+        }
+        batch->records = grown;
+        batch->capacity = capacity;
+    }
+
+    if (ccask_create_datafile_record(batch->records[batch->count], record_timestamp(), key, key_size, value, value_size) != CCASK_OK) {
+        return CCASK_FAIL;
+    }
+    batch->count++;
+    return CCASK_OK;
+}
+
+ccask_status_e ccask_write_batch_delete(ccask_write_batch_t *batch, void *key, uint32_t key_size) {
+    return ccask_write_batch_put(batch, key, key_size, NULL, 0);
+}
+
+size_t ccask_write_batch_count(ccask_write_batch_t *batch) {
+    return batch->count;
+}
+
+ccask_status_e ccask_write_batch_commit(ccask_write_batch_t *batch) {
+    if (atomic_load(&is_shutting_down)) {
+        log_error("Cannot commit write batches after shutdown has been initiated");
+        return CCASK_FAIL;
+    }
+    if (batch->count == 0) return CCASK_OK;
+
+    ccask_status_e res = ccask_write_batch_blocking(batch->records, batch->count);
+    if (res != CCASK_OK) log_info("Failed to write batch of %zu records", batch->count);
+    return res;
+}
+
+void ccask_write_batch_clear(ccask_write_batch_t *batch) {
+    for (size_t i = 0; i < batch->count; i++) free_datafile_record(batch->records[i]);
+    batch->count = 0;
+}
+
+void ccask_write_batch_destroy(ccask_write_batch_t *batch) {
+    ccask_write_batch_clear(batch);
+    free(batch->records);
+    free(batch);
+}
+
 struct ccask_keys_iter {
-    ccask_keydir_record_iter_t keydir_iter;
+    ccask_keydir_snapshot_t *snapshot;
+    ccask_snapshot_cursor_t cursor;
 };
 
 ccask_keys_iter_t* ccask_list_keys(void) {
@@ -198,23 +598,154 @@ ccask_keys_iter_t* ccask_list_keys(void) {
         return NULL;
     }
 
-    iter->keydir_iter = ccask_keydir_record_iter();
+    iter->snapshot = ccask_keydir_snapshot_open();
+    if (!iter->snapshot) {
+        free(iter);
+        return NULL;
+    }
+
+    iter->cursor.shard = iter->cursor.pos = 0;
     return iter;
 }
 
 ccask_status_e ccask_keys_iter_next(ccask_keys_iter_t *iter, void **key, uint32_t *key_size) {
-    ccask_keydir_record_t *record = ccask_keydir_record_iter_next(&iter->keydir_iter);
-    if (record == NULL) {
-        ccask_errno = CCASK_ERR_ITER_END;
-        return CCASK_FAIL;
+    return ccask_keydir_snapshot_next(iter->snapshot, &iter->cursor.shard, &iter->cursor.pos, key, key_size);
+}
+
+void ccask_keys_iter_close(ccask_keys_iter_t *iter) {
+    ccask_keydir_snapshot_close(iter->snapshot);
+    free(iter);
+}
+
+struct ccask_snapshot {
+    ccask_keydir_snapshot_t *keydir_snapshot;
+};
+
+ccask_snapshot_t* ccask_snapshot_open(void) {
+    ccask_snapshot_t *snap = malloc(sizeof(ccask_snapshot_t));
+    if (!snap) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return NULL;
     }
 
-    *key = record->key;
-    *key_size = record->key_size;
-    return CCASK_OK;
+    snap->keydir_snapshot = ccask_keydir_snapshot_open();
+    if (!snap->keydir_snapshot) {
+        free(snap);
+        return NULL;
+    }
+    return snap;
 }
 
-void ccask_keys_iter_close(ccask_keys_iter_t *iter) {
-    ccask_keydir_record_iter_close(&iter->keydir_iter);
+ccask_status_e ccask_snapshot_next(ccask_snapshot_t *snap, ccask_snapshot_cursor_t *cursor, void **key, uint32_t *key_size) {
+    return ccask_keydir_snapshot_next(snap->keydir_snapshot, &cursor->shard, &cursor->pos, key, key_size);
+}
+
+void ccask_snapshot_close(ccask_snapshot_t *snap) {
+    ccask_keydir_snapshot_close(snap->keydir_snapshot);
+    free(snap);
+}
+
+struct ccask_scan_iter {
+    ccask_index_cursor_t cursor;
+    void *end;          // exclusive upper bound, NULL if none
+    uint32_t end_size;
+    void *prefix;       // required prefix, NULL if none
+    uint32_t prefix_size;
+};
+
+static ccask_scan_iter_t* scan_open(void *start, uint32_t start_size, void *bound, uint32_t bound_size, bool is_prefix) {
+    ccask_scan_iter_t *iter = calloc(1, sizeof(ccask_scan_iter_t));
+    if (!iter) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return NULL;
+    }
+
+    if (bound) {
+        void *copy = malloc(bound_size ? bound_size : 1);
+        if (!copy) {
+            free(iter);
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return NULL;
+        }
+        memcpy(copy, bound, bound_size);
+
+        if (is_prefix) {
+            iter->prefix = copy;
+            iter->prefix_size = bound_size;
+        } else {
+            iter->end = copy;
+            iter->end_size = bound_size;
+        }
+    }
+
+    if (ccask_index_cursor_open(&iter->cursor, start, start_size) != CCASK_OK) {
+        free(iter->end);
+        free(iter->prefix);
+        free(iter);
+        return NULL;
+    }
+    return iter;
+}
+
+ccask_scan_iter_t* ccask_scan_range(void *start, uint32_t start_size, void *end, uint32_t end_size) {
+    return scan_open(start, start_size, end, end_size, false);
+}
+
+ccask_scan_iter_t* ccask_scan_prefix(void *prefix, uint32_t prefix_size) {
+    return scan_open(prefix, prefix_size, prefix, prefix_size, true);
+}
+
+ccask_status_e ccask_scan_iter_next(ccask_scan_iter_t *iter, void **key, uint32_t *key_size, ccask_record_t *record) {
+    while (true) {
+        if (ccask_index_cursor_next(&iter->cursor, key, key_size) != CCASK_OK) return CCASK_FAIL;
+
+        // keys come in order, so the first one out of bounds ends the scan
+        bool past_end = iter->end && ccask_index_compare(*key, *key_size, iter->end, iter->end_size) >= 0;
+        bool past_prefix = iter->prefix &&
+            (*key_size < iter->prefix_size || memcmp(*key, iter->prefix, iter->prefix_size) != 0);
+
+        if (past_end || past_prefix) {
+            ccask_errno = CCASK_ERR_ITER_END;
+            return CCASK_FAIL;
+        }
+
+        if (!record) return CCASK_OK;
+
+        if (ccask_get(*key, *key_size, record) != CCASK_OK) return CCASK_FAIL;
+        if (record->value) return CCASK_OK;
+    }
+}
+
+void ccask_scan_iter_close(ccask_scan_iter_t *iter) {
+    ccask_index_cursor_close(&iter->cursor);
+    free(iter->end);
+    free(iter->prefix);
     free(iter);
 }
+
+ccask_status_e ccask_get_keydir_stats(ccask_keydir_stats_t *stats) {
+    if (!stats) return CCASK_FAIL;
+    ccask_keydir_get_stats(stats);
+    return CCASK_OK;
+}
+
+ccask_status_e ccask_get_writer_queue_stats(ccask_writer_queue_stats_t *stats) {
+    if (!stats) return CCASK_FAIL;
+    ccask_writer_get_queue_stats(stats);
+    return CCASK_OK;
+}
+
+ccask_status_e ccask_get_value_cache_stats(ccask_value_cache_stats_t *stats) {
+    if (!stats) return CCASK_FAIL;
+    ccask_cache_get_stats(stats);
+    return CCASK_OK;
+}
+
+ccask_status_e ccask_file_stats(ccask_file_stats_t **stats, size_t *num_files) {
+    if (!stats || !num_files) return CCASK_FAIL;
+    return ccask_files_get_stats(stats, num_files);
+}
+
+void ccask_free_file_stats(ccask_file_stats_t *stats) {
+    free(stats);
+}
@@ -0,0 +1,257 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "ccask/epoch.h"
+
+#include "stdlib.h"
+#include "stdbool.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "sched.h"
+#include "unistd.h"
+#include "sys/syscall.h"
+#include "linux/membarrier.h"
+#include "ccask/log.h"
+
+#define EPOCH_RETIRE_BATCH 64 // retired objects to collect before trying to advance the epoch
+
+typedef struct epoch_thread {
+    _Atomic uint64_t local_epoch; // epoch observed on entering the outermost guard, 0 when outside
+    _Atomic bool in_use;
+    unsigned nesting; // only touched by the owning thread
+    struct epoch_thread *next;
+} __attribute__((aligned(64))) epoch_thread_t;
+
+#define EPOCH_BLOCK_SIZE 128 // retired objects per limbo block
+#define EPOCH_SPARE_BLOCKS 8 // empty blocks kept around instead of freeing them
+
+typedef struct retired_block {
+    struct retired_block *next;
+    size_t count;
+    struct {
+        void *ptr;
+        ccask_epoch_free_fn free_fn;
+        void *ctx;
+    } items[EPOCH_BLOCK_SIZE];
+} retired_block_t;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(epoch_thread_t*) threads = NULL;
+static bool use_membarrier = false;
+
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static _Thread_local epoch_thread_t *self = NULL;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER; // guards everything below
+static retired_block_t *limbo[3] = { NULL, NULL, NULL }; // objects retired in epoch e live in limbo[e % 3]
+static retired_block_t *spare_blocks = NULL;
+static size_t num_spare_blocks = 0;
+static size_t pending = 0;
+static size_t next_advance_at = EPOCH_RETIRE_BATCH;
+
+static void release_thread(void *arg) {
+    epoch_thread_t *t = arg;
+    atomic_store_explicit(&t->local_epoch, 0, memory_order_release);
+    atomic_store_explicit(&t->in_use, false, memory_order_release);
+}
+
+static void create_thread_key(void) {
+    pthread_key_create(&thread_key, release_thread);
+}
+
+static epoch_thread_t* register_thread(void) {
+    pthread_once(&thread_key_once, create_thread_key);
+
+    // records are never freed, so reuse one left behind by an exited thread first
+    epoch_thread_t *t = atomic_load_explicit(&threads, memory_order_acquire);
+    for (; t; t = t->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&t->in_use, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&t->in_use, &expected, true)) break;
+    }
+
+    if (!t) {
+        t = aligned_alloc(64, sizeof(epoch_thread_t));
+        if (!t) {
+            log_fatal("Couldn't register thread for epoch-based reclamation (No memory)");
+            abort();
+        }
+
+        atomic_init(&t->local_epoch, 0);
+        atomic_init(&t->in_use, true);
+        t->nesting = 0;
+        t->next = atomic_load_explicit(&threads, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&threads, &t->next, t, memory_order_release, memory_order_relaxed));
+    }
+
+    pthread_setspecific(thread_key, t);
+    self = t;
+    return t;
+}
+
+static inline void reader_fence(void) {
+    // with membarrier, the reclaimer issues the fence on the readers' behalf
+    if (use_membarrier) atomic_signal_fence(memory_order_seq_cst);
+    else atomic_thread_fence(memory_order_seq_cst);
+}
+
+static inline void reclaimer_fence(void) {
+    if (use_membarrier) syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    else atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void free_retired_blocks(retired_block_t *block) {
+    while (block) {
+        retired_block_t *next = block->next;
+        for (size_t i = 0; i < block->count; i++) {
+            block->items[i].free_fn(block->items[i].ptr, block->items[i].ctx);
+        }
+        pending -= block->count;
+
+        if (num_spare_blocks < EPOCH_SPARE_BLOCKS) {
+            block->next = spare_blocks;
+            spare_blocks = block;
+            num_spare_blocks++;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+}
+
+// must be called with retire_lock held
+static bool try_advance(void) {
+    reclaimer_fence();
+
+    uint64_t curr = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    for (epoch_thread_t *t = atomic_load_explicit(&threads, memory_order_acquire); t; t = t->next) {
+        uint64_t e = atomic_load_explicit(&t->local_epoch, memory_order_acquire);
+        if (e != 0 && e != curr) return false;
+    }
+
+    atomic_store_explicit(&global_epoch, curr + 1, memory_order_release);
+
+    // everything retired two epochs ago is now unreachable
+    retired_block_t *reclaimable = limbo[(curr + 2) % 3];
+    limbo[(curr + 2) % 3] = NULL;
+    free_retired_blocks(reclaimable);
+    return true;
+}
+
+void ccask_epoch_init(void) {
+    use_membarrier = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+    if (!use_membarrier) log_info("membarrier(2) is unavailable, epoch guards will use memory fences");
+}
+
+void ccask_epoch_shutdown(void) {
+    // callers guarantee that no readers are left, so everything can go
+    pthread_mutex_lock(&retire_lock);
+    for (int i = 0; i < 3; i++) {
+        free_retired_blocks(limbo[i]);
+        limbo[i] = NULL;
+    }
+    while (spare_blocks) {
+        retired_block_t *next = spare_blocks->next;
+        free(spare_blocks);
+        spare_blocks = next;
+    }
+    num_spare_blocks = 0;
+    next_advance_at = EPOCH_RETIRE_BATCH;
+    pthread_mutex_unlock(&retire_lock);
+}
+
+void ccask_epoch_enter(void) {
+    epoch_thread_t *t = self;
+    if (!t) t = register_thread();
+
+    if (t->nesting++ == 0) {
+        uint64_t e = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+        atomic_store_explicit(&t->local_epoch, e, memory_order_relaxed);
+        reader_fence();
+    }
+}
+
+void ccask_epoch_exit(void) {
+    epoch_thread_t *t = self;
+    if (--t->nesting == 0) {
+        atomic_store_explicit(&t->local_epoch, 0, memory_order_release);
+    }
+}
+
+// waits out a full grace period, must be called with retire_lock held
+static void synchronize(void) {
+    for (int advanced = 0; advanced < 2;) {
+        if (try_advance()) {
+            advanced++;
+            continue;
+        }
+        pthread_mutex_unlock(&retire_lock);
+        sched_yield();
+        pthread_mutex_lock(&retire_lock);
+    }
+}
+
+void ccask_epoch_retire(void *ptr, ccask_epoch_free_fn free_fn, void *ctx) {
+    pthread_mutex_lock(&retire_lock);
+
+    uint64_t e = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    retired_block_t *block = limbo[e % 3];
+
+    if (!block || block->count == EPOCH_BLOCK_SIZE) {
+        if (spare_blocks) {
+            block = spare_blocks;
+            spare_blocks = block->next;
+            num_spare_blocks--;
+        } else {
+            block = malloc(sizeof(retired_block_t));
+        }
+
+        if (!block) {
+            if (self && self->nesting > 0) {
+                pthread_mutex_unlock(&retire_lock);
+                log_error("Leaking retired object (No memory, and waiting for a grace period inside a guard would deadlock)");
+                return;
+            }
+
+            // no way to defer it, so wait out a full grace period instead
+            synchronize();
+            pthread_mutex_unlock(&retire_lock);
+            free_fn(ptr, ctx);
+            return;
+        }
+
+        block->count = 0;
+        block->next = limbo[e % 3];
+        limbo[e % 3] = block;
+    }
+
+    block->items[block->count].ptr = ptr;
+    block->items[block->count].free_fn = free_fn;
+    block->items[block->count].ctx = ctx;
+    block->count++;
+    pending++;
+
+    if (pending >= next_advance_at) {
+        try_advance();
+        // back off while readers hold the epoch, every attempt costs a process-wide barrier
+        next_advance_at = pending + EPOCH_RETIRE_BATCH;
+    }
+    pthread_mutex_unlock(&retire_lock);
+}
@@ -16,36 +16,79 @@
  * 
  */
 
+#define _GNU_SOURCE // fallocate
 #include "ccask/files.h"
 
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
 #include "time.h"
 #include "unistd.h"
 #include "fcntl.h"
 #include "dirent.h"
 #include "sys/stat.h"
+#include "sys/mman.h"
 #include "errno.h"
 #include "inttypes.h"
 #include "pthread.h"
 #include "uthash.h"
 #include "ccask/hint.h"
+#include "ccask/io.h"
+#include "ccask/records.h"
 #include "ccask/utils.h"
 #include "ccask/log.h"
 
 size_t MAX_ACTIVE_FILE_SIZE = 50; // TODO: set this to a value that makes sense
 
+#define FILES_PREALLOC_CHUNK (8 << 20)
+#define FILES_SPARE_RETRY_SECONDS 1
+#define FILES_DIRECT_ALIGN 4096 // O_DIRECT offsets, lengths and buffers are multiples of the logical block size
+#define FILES_STAGE_SIZE (1 << 20) // a writer batch at most, larger appends are written in several pieces
+#define FILES_FORMAT_FILENAME "ccask.format" // holds the DATAFILE_FORMAT_VERSION the datafiles are written in
+
 static const int DATAFILE_OPEN_MODE = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
 static const int DATAFILE_OPEN_FLAGS = O_RDONLY;
 static const int HINTFILE_OPEN_FLAGS = O_CREAT | O_RDWR | O_APPEND;
-static const int ACTIVE_DATAFILE_OPEN_FLAGS = O_CREAT | O_RDWR | O_APPEND;
+static const int ACTIVE_DATAFILE_OPEN_FLAGS = O_CREAT | O_RDWR; // appended with pwritev at the tracked size, which O_APPEND would ignore
 static const int TEMP_DATAFILE_OPEN_FLAGS = O_CREAT | O_RDWR | O_APPEND;
+static const int TEMP_HINTFILE_OPEN_FLAGS = O_CREAT | O_TRUNC | O_WRONLY | O_APPEND;
+
+static bool use_dsync = false;
+static atomic_bool use_preallocation = true; // turned off if the filesystem can't do it
+static atomic_bool use_direct_io = false; // turned off if the filesystem can't do it
+static ccask_mmap_advice_e mmap_advice = CCASK_MMAP_NORMAL;
+
+static const int MADVISE_ADVICE[] = {
+    [CCASK_MMAP_NORMAL] = MADV_NORMAL,
+    [CCASK_MMAP_RANDOM] = MADV_RANDOM,
+    [CCASK_MMAP_SEQUENTIAL] = MADV_SEQUENTIAL,
+    [CCASK_MMAP_WILLNEED] = MADV_WILLNEED,
+};
 
 static struct files_state {
     char* data_dir;
     ccask_file_t *hash_table;
-    ccask_file_t *head;
+    ccask_file_t *_Atomic head; // read without locks (syncer), so a rotated-in file is published atomically
     ccask_file_t *tail;
-} files_state;
+
+    ccask_file_t *_Atomic active[FILES_MAX_ACTIVE]; // one per writer shard
+    size_t num_active;
+    _Atomic uint64_t next_file_id; // new files always get the highest ID, so file order stays log order
+    pthread_rwlock_t table_lock; // guards the list and hash table, writer shards add files while others look them up
+} files_state = { .table_lock = PTHREAD_RWLOCK_INITIALIZER };
+
+// the next active datafile of every shard, created ahead of time so rotations don't wait on open()
+static struct spare_files {
+    ccask_file_t *files[FILES_MAX_ACTIVE];
+    // the ID of the spare being created, it is taken under the lock so checkpoints can list the file already
+    bool creating;
+    uint64_t creating_id;
+    size_t creating_shard;
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} spares = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
 
 static void add_file_to_linked_list(ccask_file_t* file) {
     ccask_file_t *curr = files_state.head;
@@ -87,11 +130,25 @@ static void add_file_to_linked_list(ccask_file_t* file) {
 }
 
 static void add_file(ccask_file_t* file) {
+    pthread_rwlock_wrlock(&files_state.table_lock);
     add_file_to_linked_list(file);
     HASH_ADD(hh, files_state.hash_table, file_id, sizeof(uint64_t), file);
+    pthread_rwlock_unlock(&files_state.table_lock);
 }
 
-inline ccask_file_t* ccask_files_get_active_file(void) {
+inline const char* ccask_files_get_data_dir(void) {
+    return files_state.data_dir;
+}
+
+inline ccask_file_t* ccask_files_get_active_file(size_t shard) {
+    return atomic_load(&files_state.active[shard]);
+}
+
+inline size_t ccask_files_num_active(void) {
+    return files_state.num_active;
+}
+
+inline ccask_file_t* ccask_files_get_newest_file(void) {
     return files_state.head;
 }
 
@@ -101,13 +158,60 @@ inline ccask_file_t* ccask_files_get_oldest_file(void) {
 
 inline ccask_file_t* ccask_files_get_file(uint64_t file_id) {
     ccask_file_t* file = NULL;
+    pthread_rwlock_rdlock(&files_state.table_lock);
     HASH_FIND(hh, files_state.hash_table, &file_id, sizeof(uint64_t), file);
+    pthread_rwlock_unlock(&files_state.table_lock);
     return file;
 }
 
+ccask_status_e ccask_files_get_stats(ccask_file_stats_t **stats, size_t *num_files) {
+    // spares are linked in mid-list once rotated in, so the list is only walked with the lock held
+    pthread_rwlock_rdlock(&files_state.table_lock);
+    size_t count = 0;
+    for (ccask_file_t *file = files_state.head; file; file = file->next) count++;
+
+    *stats = malloc((count ? count : 1) * sizeof(ccask_file_stats_t));
+    if (!*stats) {
+        pthread_rwlock_unlock(&files_state.table_lock);
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_FAIL;
+    }
+
+    size_t i = 0;
+    for (ccask_file_t *file = files_state.head; file; file = file->next, i++) {
+        ccask_file_stats_t *fs = &(*stats)[i];
+        fs->file_id = file->file_id;
+        fs->is_active = atomic_load_explicit(&file->is_active, memory_order_relaxed);
+        fs->total_bytes = atomic_load_explicit(&file->size, memory_order_relaxed);
+        fs->live_bytes = atomic_load_explicit(&file->live_bytes, memory_order_relaxed);
+        fs->live_keys = atomic_load_explicit(&file->live_keys, memory_order_relaxed);
+
+        // the counters are read without the file's lock, a record written in between can make them disagree
+        if (fs->live_bytes > fs->total_bytes) fs->live_bytes = fs->total_bytes;
+        fs->dead_bytes = fs->total_bytes - fs->live_bytes;
+        fs->dead_ratio = fs->total_bytes ? (double)fs->dead_bytes / fs->total_bytes : 0;
+    }
+    pthread_rwlock_unlock(&files_state.table_lock);
+
+    *num_files = count;
+    return CCASK_OK;
+}
+
+void ccask_files_use_dsync(bool enabled) {
+    use_dsync = enabled;
+}
+
+void ccask_files_use_direct_io(bool enabled) {
+    atomic_store(&use_direct_io, enabled);
+}
+
+void ccask_files_use_mmap(ccask_mmap_advice_e advice) {
+    mmap_advice = advice;
+}
+
 inline int ccask_files_get_active_datafile_fd(uint64_t id) {
     char* fpath = build_filepath(files_state.data_dir, id, FILE_DATA);
-    int fd = open(fpath, ACTIVE_DATAFILE_OPEN_FLAGS, DATAFILE_OPEN_MODE);
+    int fd = open(fpath, ACTIVE_DATAFILE_OPEN_FLAGS | (use_dsync ? O_DSYNC : 0), DATAFILE_OPEN_MODE);
     if (fd >= 0) return fd;
 
     switch (errno) {
@@ -176,6 +280,62 @@ inline int ccask_files_get_temp_datafile_fd(uint64_t file_id) {
     }
 }
 
+inline int ccask_files_get_temp_hintfile_fd(uint64_t file_id) {
+    char* fpath = build_filepath(files_state.data_dir, file_id, FILE_TEMP_HINT);
+    int fd = open(fpath, TEMP_HINTFILE_OPEN_FLAGS, DATAFILE_OPEN_MODE);
+    if (fd >= 0) return fd;
+
+    switch (errno) {
+        case EACCES:
+        case EPERM:
+        case EISDIR:
+        case ENAMETOOLONG:
+        case ENOENT:
+            ccask_errno = CCASK_ERR_GET_FD_FAILED;
+            return CCASK_FAIL;
+        default:
+            return CCASK_RETRY;
+    }
+}
+
+// opens the descriptor appends go through with direct I/O, the file's own one stays buffered for reads
+static void open_direct_fd(ccask_file_t *file) {
+    file->direct_fd = -1;
+    file->stage = NULL;
+    file->stage_base = 0;
+    if (!atomic_load_explicit(&use_direct_io, memory_order_relaxed)) return;
+
+    char *fpath = build_filepath(files_state.data_dir, file->file_id, FILE_DATA);
+    if (!fpath) return;
+    int fd = open(fpath, O_WRONLY | O_DIRECT | (use_dsync ? O_DSYNC : 0));
+    free(fpath);
+
+    if (fd < 0) {
+        if (errno == EINVAL) {
+            atomic_store_explicit(&use_direct_io, false, memory_order_relaxed);
+            log_info("Filesystem doesn't support direct I/O, appending to datafiles through the page cache");
+        } else {
+            log_error("Couldn't open Datafile ID = %" PRIu64 " for direct I/O\n\t%s", file->file_id, strerror(errno));
+        }
+        return;
+    }
+    file->direct_fd = fd;
+}
+
+// the descriptor appends go through, registered with the I/O backend while the file is active
+static inline int append_fd(ccask_file_t *file) {
+    return file->direct_fd >= 0 ? file->direct_fd : file->fd;
+}
+
+// lets go of what only active datafiles have, the file's own descriptor is left to the caller
+static void release_active_datafile(ccask_file_t *file) {
+    ccask_io_unregister_file(append_fd(file));
+    if (file->direct_fd >= 0) close(file->direct_fd);
+    free(file->stage);
+    file->direct_fd = -1;
+    file->stage = NULL;
+}
+
 static ccask_status_e create_new_active_datafile(uint64_t id, ccask_file_t *file) {
     int fd;
     CCASK_ATTEMPT(5, fd, ccask_files_get_active_datafile_fd(id));
@@ -191,17 +351,27 @@ static ccask_status_e create_new_active_datafile(uint64_t id, ccask_file_t *file
     file->is_active = true;
     file->is_fd_invalidator_running = false;
     file->last_accessed = time(NULL);
+    file->size = 0;
+    file->allocated = 0;
+    file->live_bytes = 0;
+    file->live_keys = 0;
+    file->map = NULL;
+    file->map_failed = false;
+    file->map_borrows = 0;
 
     file->next = NULL;
     file->previous = NULL;
 
     pthread_rwlock_init(&file->rwlock, NULL);
 
+    open_direct_fd(file);
+    ccask_io_register_file(append_fd(file));
+
     log_info("Created new Active DataFile ID = %" PRIu64, id);
     return CCASK_OK;
 }
 
-static inline ccask_file_t* allocate_datafile_node(uint64_t id, bool has_hint) {
+static inline ccask_file_t* allocate_datafile_node(uint64_t id, bool has_hint, uint64_t size) {
     ccask_file_t* file = malloc(sizeof(ccask_file_t));
     if (!file) {
         ccask_errno = CCASK_ERR_NO_MEMORY;
@@ -214,6 +384,16 @@ static inline ccask_file_t* allocate_datafile_node(uint64_t id, bool has_hint) {
     file->is_active = false;
     file->is_fd_invalidator_running = false;
     file->last_accessed = time(NULL);
+    file->size = size;
+    file->allocated = size;
+    file->live_bytes = 0;
+    file->live_keys = 0;
+    file->direct_fd = -1;
+    file->stage = NULL;
+    file->stage_base = 0;
+    file->map = NULL;
+    file->map_failed = false;
+    file->map_borrows = 0;
     file->next = NULL;
     file->previous = NULL;
 
@@ -222,8 +402,427 @@ static inline ccask_file_t* allocate_datafile_node(uint64_t id, bool has_hint) {
     return file;
 }
 
-ccask_status_e ccask_files_init(const char *data_dir, size_t active_file_max_size) {
+static ccask_status_e open_active_datafile(ccask_file_t *file) {
+    int fd;
+    CCASK_ATTEMPT(5, fd, ccask_files_get_active_datafile_fd(file->file_id));
+    if (fd < 0) {
+        log_error("Could not load FD for Active Datafile ID = %" PRIu64, file->file_id);
+        return CCASK_FAIL;
+    }
+
+    file->is_active = true;
+    file->fd = fd;
+    open_direct_fd(file);
+    ccask_io_register_file(append_fd(file));
+    return CCASK_OK;
+}
+
+// loads the file's last partly written block, appends are packed into the stage behind it
+static ccask_status_e load_stage(ccask_file_t *file, uint64_t pos) {
+    if (posix_memalign((void**)&file->stage, FILES_DIRECT_ALIGN, FILES_STAGE_SIZE) != 0) {
+        file->stage = NULL;
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_FAIL;
+    }
+
+    file->stage_base = pos & ~(uint64_t)(FILES_DIRECT_ALIGN - 1);
+    if (pos > file->stage_base && ccask_io_pread(file->fd, file->stage, pos - file->stage_base, file->stage_base) != CCASK_OK) {
+        free(file->stage);
+        file->stage = NULL;
+        return CCASK_FAIL;
+    }
+    return CCASK_OK;
+}
+
+// writes the stage's first `len` bytes, zero-padded to whole blocks, over the file's last partly written block
+static ccask_status_e write_stage(ccask_file_t *file, size_t len, bool *synced) {
+    size_t padded = (len + FILES_DIRECT_ALIGN - 1) & ~(size_t)(FILES_DIRECT_ALIGN - 1);
+    memset(file->stage + len, 0, padded - len);
+
+    struct iovec iov = { .iov_base = file->stage, .iov_len = padded };
+    if (ccask_io_pwritev(file->direct_fd, &iov, 1, file->stage_base, synced) != CCASK_OK) return CCASK_FAIL;
+
+    // the padding is trimmed along with preallocated space when the file is closed, and until then
+    // recovery stops at it like at a torn write
+    if (file->allocated < file->stage_base + padded) file->allocated = file->stage_base + padded;
+    return CCASK_OK;
+}
+
+ccask_status_e ccask_files_append(ccask_file_t *file, const struct iovec *iov, int iovcnt, uint64_t pos, bool *synced) {
+    if (file->direct_fd < 0) return ccask_io_pwritev(file->fd, iov, iovcnt, pos, synced);
+    if (!file->stage && load_stage(file, pos) != CCASK_OK) return CCASK_FAIL;
+
+    size_t len = pos - file->stage_base;
+    for (int i = 0; i < iovcnt; i++) {
+        const uint8_t *src = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+
+        while (left > 0) {
+            // a full stage is only written once more follows, so the last write is the one that syncs
+            if (len == FILES_STAGE_SIZE) {
+                if (write_stage(file, len, NULL) != CCASK_OK) goto fail;
+                file->stage_base += len;
+                len = 0;
+            }
+
+            size_t n = FILES_STAGE_SIZE - len < left ? FILES_STAGE_SIZE - len : left;
+            memcpy(file->stage + len, src, n);
+            len += n;
+            src += n;
+            left -= n;
+        }
+    }
+
+    if (write_stage(file, len, synced) != CCASK_OK) goto fail;
+
+    // only the partly written block is kept, the next append rewrites it
+    size_t full = len & ~(size_t)(FILES_DIRECT_ALIGN - 1);
+    memmove(file->stage, file->stage + full, len - full);
+    file->stage_base += full;
+    return CCASK_OK;
+
+fail:
+    // what made it to disk is unknown, the next append loads the block again
+    free(file->stage);
+    file->stage = NULL;
+    return CCASK_FAIL;
+}
+
+bool ccask_files_read_staged(ccask_file_t *file, struct iovec *iov, int iovcnt, uint64_t pos) {
+    if (!file->stage || pos < file->stage_base) return false;
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    if (pos + len > atomic_load_explicit(&file->size, memory_order_relaxed)) return false;
+
+    const uint8_t *src = file->stage + (pos - file->stage_base);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(iov[i].iov_base, src, iov[i].iov_len);
+        src += iov[i].iov_len;
+    }
+    return true;
+}
+
+ccask_status_e ccask_files_read(ccask_file_t *file, struct iovec *iov, int iovcnt, uint64_t pos) {
+    // the newest records are copied from the stage, direct I/O left them out of the page cache
+    if (ccask_files_read_staged(file, iov, iovcnt, pos)) return CCASK_OK;
+    return ccask_io_preadv(file->fd, iov, iovcnt, pos);
+}
+
+void ccask_files_preallocate(ccask_file_t *file, uint64_t end) {
+    if (end <= file->allocated || !atomic_load_explicit(&use_preallocation, memory_order_relaxed)) return;
+
+    uint64_t target = file->allocated + FILES_PREALLOC_CHUNK;
+    if (target > MAX_ACTIVE_FILE_SIZE) target = MAX_ACTIVE_FILE_SIZE;
+    if (target < end) target = end;
+
+    // the size is kept, so it still marks the end of the log and a crash leaves no zeroes for recovery to read
+    if (fallocate(file->fd, FALLOC_FL_KEEP_SIZE, file->allocated, target - file->allocated) != 0) {
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            atomic_store_explicit(&use_preallocation, false, memory_order_relaxed);
+            log_info("Filesystem doesn't support preallocation, growing datafiles as they are written");
+            return;
+        }
+        // not retried before the next chunk, the writes themselves report a full disk
+        log_error("Couldn't preallocate Datafile ID = %" PRIu64 "\n\t%s", file->file_id, strerror(errno));
+    }
+    file->allocated = target;
+}
+
+ccask_status_e ccask_files_truncate(ccask_file_t *file, uint64_t size) {
+    // immutable datafiles only have a read-only descriptor, so they are cut by path
+    char *fpath = build_filepath(files_state.data_dir, file->file_id, FILE_DATA);
+    if (!fpath) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_FAIL;
+    }
+
+    pthread_rwlock_wrlock(&file->rwlock);
+    int res = truncate(fpath, size);
+    free(fpath);
+    if (res != 0) {
+        log_error("Couldn't truncate Datafile ID = %" PRIu64 "\n\t%s", file->file_id, strerror(errno));
+        pthread_rwlock_unlock(&file->rwlock);
+        ccask_errno = CCASK_ERR_WRITE_FAILED;
+        return CCASK_FAIL;
+    }
+    atomic_store_explicit(&file->size, size, memory_order_relaxed);
+    if (file->is_active) file->allocated = size;
+    free(file->stage); // loaded again by the next append
+    file->stage = NULL;
+    pthread_rwlock_unlock(&file->rwlock);
+    return CCASK_OK;
+}
+
+// gives back the space preallocated past the end of the log
+static void trim_preallocation(ccask_file_t *file) {
+    uint64_t size = atomic_load_explicit(&file->size, memory_order_relaxed);
+    if (file->allocated <= size) return;
+
+    if (ftruncate(file->fd, size) != 0) {
+        log_error("Couldn't trim preallocated space of Datafile ID = %" PRIu64 "\n\t%s", file->file_id, strerror(errno));
+        return;
+    }
+    file->allocated = size;
+}
+
+static ccask_file_t* new_active_datafile_with_id(uint64_t file_id) {
+    ccask_file_t *file = malloc(sizeof(ccask_file_t));
+    if (!file) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return NULL;
+    }
+
+    if (create_new_active_datafile(file_id, file) != CCASK_OK) {
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+static ccask_file_t* new_active_datafile(void) {
+    return new_active_datafile_with_id(atomic_fetch_add(&files_state.next_file_id, 1));
+}
+
+// for files that were never added to the list, like unused spares
+static void discard_datafile(ccask_file_t *file) {
+    release_active_datafile(file);
+    close(file->fd);
+    pthread_rwlock_destroy(&file->rwlock);
+
+    int res;
+    CCASK_ATTEMPT(5, res, ccask_files_delete(file->file_id, FILE_DATA));
+    if (res != CCASK_OK) log_error("Couldn't delete unused Datafile ID = %" PRIu64, file->file_id);
+    free(file);
+}
+
+static void* spare_thread_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&spares.lock);
+    while (spares.running) {
+        size_t shard = 0;
+        while (shard < files_state.num_active && spares.files[shard]) shard++;
+
+        if (shard == files_state.num_active) {
+            pthread_cond_wait(&spares.cond, &spares.lock);
+            continue;
+        }
+
+        // created after the shard's active file, so its ID is higher, the space is reserved up front too
+        uint64_t file_id = atomic_fetch_add(&files_state.next_file_id, 1);
+        spares.creating = true;
+        spares.creating_id = file_id;
+        spares.creating_shard = shard;
+        pthread_mutex_unlock(&spares.lock);
+        ccask_file_t *file = new_active_datafile_with_id(file_id);
+        if (file) ccask_files_preallocate(file, 1);
+        pthread_mutex_lock(&spares.lock);
+        spares.creating = false;
+
+        if (file) {
+            spares.files[shard] = file;
+            continue;
+        }
+
+        // rotations create their files themselves meanwhile
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FILES_SPARE_RETRY_SECONDS;
+
+        int res = 0;
+        while (spares.running && res != ETIMEDOUT) {
+            res = pthread_cond_timedwait(&spares.cond, &spares.lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&spares.lock);
+
+    return NULL;
+}
+
+static void start_spare_thread(void) {
+    spares.running = true;
+
+    int res;
+    CCASK_ATTEMPT(5, res, pthread_create(&spares.thread, NULL, spare_thread_main, NULL));
+    if (res != 0) {
+        // rotations just open their next file themselves
+        spares.running = false;
+        log_error("Couldn't start creating datafiles ahead of rotations");
+    }
+}
+
+static void stop_spare_thread(void) {
+    pthread_mutex_lock(&spares.lock);
+    bool was_running = spares.running;
+    spares.running = false;
+    pthread_cond_signal(&spares.cond);
+    pthread_mutex_unlock(&spares.lock);
+
+    if (was_running) pthread_join(spares.thread, NULL);
+
+    for (size_t i = 0; i < FILES_MAX_ACTIVE; i++) {
+        if (!spares.files[i]) continue;
+        discard_datafile(spares.files[i]);
+        spares.files[i] = NULL;
+    }
+}
+
+bool ccask_files_get_spare_file_id(size_t shard, uint64_t *file_id) {
+    pthread_mutex_lock(&spares.lock);
+    ccask_file_t *file = spares.files[shard];
+    bool found = file || (spares.creating && spares.creating_shard == shard);
+    if (found) *file_id = file ? file->file_id : spares.creating_id;
+    pthread_mutex_unlock(&spares.lock);
+    return found;
+}
+
+// unlinks a file found at startup from the list and hash table, and deletes it
+static void remove_empty_file(ccask_file_t *file) {
+    if (file->previous) file->previous->next = file->next;
+    else files_state.head = file->next;
+
+    if (file->next) file->next->previous = file->previous;
+    else files_state.tail = file->previous;
+
+    HASH_DEL(files_state.hash_table, file);
+    pthread_rwlock_destroy(&file->rwlock);
+
+    int res;
+    CCASK_ATTEMPT(5, res, ccask_files_delete(file->file_id, FILE_DATA));
+    if (res != CCASK_OK) log_error("Couldn't delete empty Datafile ID = %" PRIu64, file->file_id);
+    free(file);
+}
+
+// maps a rotated datafile read-only
+static uint8_t* map_datafile(ccask_file_t *file) {
+    // rotated files are trimmed, so their size is their length for good
+    size_t size = atomic_load_explicit(&file->size, memory_order_relaxed);
+    if (size == 0) {
+        atomic_store_explicit(&file->map_failed, true, memory_order_relaxed);
+        return NULL;
+    }
+
+    int fd;
+    CCASK_ATTEMPT(5, fd, ccask_files_get_datafile_fd(file->file_id));
+    if (fd < 0) return NULL;
+
+    // the mapping keeps the file open by itself
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_error("Couldn't map Datafile ID = %" PRIu64 ", reading it with preadv\n\t%s", file->file_id, strerror(errno));
+        atomic_store_explicit(&file->map_failed, true, memory_order_relaxed);
+        return NULL;
+    }
+
+    if (mmap_advice != CCASK_MMAP_NORMAL && madvise(map, size, MADVISE_ADVICE[mmap_advice]) != 0) {
+        log_warn("Couldn't advise the kernel on the mapping of Datafile ID = %" PRIu64 "\n\t%s", file->file_id, strerror(errno));
+    }
+
+    return map;
+}
+
+/**
+ * The datafile's mapping, made if it is a rotated one that isn't mapped yet. Takes no lock: the first
+ * reads of a file may each map it, the one that publishes its mapping first wins and the others unmap
+ * theirs.
+ */
+static uint8_t* get_map(ccask_file_t *file) {
+    if (mmap_advice == CCASK_MMAP_DISABLED) return NULL;
+
+    uint8_t *map = atomic_load_explicit(&file->map, memory_order_acquire);
+    if (map) return map;
+
+    // the active file is still appended to, it's read with preadv. Once it's rotated its size is final.
+    if (atomic_load_explicit(&file->is_active, memory_order_acquire)) return NULL;
+    if (atomic_load_explicit(&file->map_failed, memory_order_relaxed)) return NULL;
+
+    uint8_t *mapped = map_datafile(file);
+    if (!mapped) return NULL;
+
+    if (atomic_compare_exchange_strong_explicit(&file->map, &map, mapped, memory_order_acq_rel, memory_order_acquire)) {
+        return mapped;
+    }
+    munmap(mapped, atomic_load_explicit(&file->size, memory_order_relaxed));
+    return map;
+}
+
+// whether the bytes the iovecs ask for from `pos` on are all in the mapping (the fd path reports short reads)
+static inline bool in_map(ccask_file_t *file, const struct iovec *iov, int iovcnt, uint64_t pos) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    return pos + len <= atomic_load_explicit(&file->size, memory_order_relaxed);
+}
+
+bool ccask_files_read_mapped(ccask_file_t *file, struct iovec *iov, int iovcnt, uint64_t pos) {
+    uint8_t *map = get_map(file);
+    if (!map || !in_map(file, iov, iovcnt, pos)) return false;
+
+    const uint8_t *src = map + pos;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(iov[i].iov_base, src, iov[i].iov_len);
+        src += iov[i].iov_len;
+    }
+    return true;
+}
+
+bool ccask_files_borrow_mapped(ccask_file_t *file, struct iovec *iov, int iovcnt, uint64_t pos) {
+    uint8_t *map = get_map(file);
+    if (!map || !in_map(file, iov, iovcnt, pos)) return false;
+
+    atomic_fetch_add_explicit(&file->map_borrows, 1, memory_order_relaxed);
+    uint8_t *src = map + pos;
+    for (int i = 0; i < iovcnt; i++) {
+        iov[i].iov_base = src;
+        src += iov[i].iov_len;
+    }
+    return true;
+}
+
+void ccask_files_return_mapped(ccask_file_t *file) {
+    atomic_fetch_sub_explicit(&file->map_borrows, 1, memory_order_release);
+}
+
+/**
+ * Checks that the datafiles are in the format this build reads, by the version recorded next to them.
+ * Recovery would take records of another format for torn writes and cut them off.
+ */
+static ccask_status_e check_format(const char *path, bool has_records) {
+    FILE *f = fopen(path, "r");
+    if (f) {
+        int version = 0;
+        bool parsed = fscanf(f, "%d", &version) == 1;
+        fclose(f);
+        if (parsed && version == DATAFILE_FORMAT_VERSION) return CCASK_OK;
+
+        log_fatal("Datafiles are in format version %d, only version %d can be read", version, DATAFILE_FORMAT_VERSION);
+        ccask_errno = CCASK_ERR_UNSUPPORTED_FORMAT;
+        return CCASK_FAIL;
+    }
+
+    // without a version, records can only be from before it was recorded
+    if (has_records) {
+        log_fatal("Datafiles are in format version 1, only version %d can be read", DATAFILE_FORMAT_VERSION);
+        ccask_errno = CCASK_ERR_UNSUPPORTED_FORMAT;
+        return CCASK_FAIL;
+    }
+
+    f = fopen(path, "w");
+    if (!f || fprintf(f, "%d\n", DATAFILE_FORMAT_VERSION) < 0 || fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        log_fatal("Couldn't record the datafile format\n\t%s", strerror(errno));
+        if (f) fclose(f);
+        ccask_errno = CCASK_ERR_WRITE_FAILED;
+        return CCASK_FAIL;
+    }
+    fclose(f);
+    return CCASK_OK;
+}
+
+ccask_status_e ccask_files_init(const char *data_dir, size_t active_file_max_size, size_t num_active) {
     MAX_ACTIVE_FILE_SIZE = active_file_max_size;
+    if (num_active == 0) num_active = 1;
+    if (num_active > FILES_MAX_ACTIVE) num_active = FILES_MAX_ACTIVE;
     DIR* dir = opendir(data_dir);
     if (!dir) {
         log_fatal("Error while opening data-directory\n\t%s", strerror(errno));
@@ -281,59 +880,75 @@ ccask_status_e ccask_files_init(const char *data_dir, size_t active_file_max_siz
             if (ext == FILE_DATA) {
                 bool has_hint = access(build_filepath(files_state.data_dir, file_id, FILE_HINT), F_OK) == 0;
                 log_info("Found Data File (ID=%d) %s", file_id, has_hint ? ":: Has Hints" : "");
-                ccask_file_t* file = allocate_datafile_node(file_id, has_hint);
+                ccask_file_t* file = allocate_datafile_node(file_id, has_hint, entry_stat.st_size);
                 add_file(file);
             }
         }
     }
 
-    free(entry_path);
     closedir(dir);
 
-    if (!files_state.head) {
-        ccask_file_t *active_file = malloc(sizeof(ccask_file_t));
-        if (!active_file) {
-            ccask_errno = CCASK_ERR_NO_MEMORY;
-            return CCASK_FAIL;
-        }
-        if (create_new_active_datafile(0, active_file) != CCASK_OK) {
-            log_error("Failed to initialize ccask-files (Unable to create active datafile)");
-            return CCASK_FAIL;
-        }
-        add_file(active_file);
-    } else if (files_state.head->has_hint) {
-        ccask_file_t *active_file = malloc(sizeof(ccask_file_t));
-        if (!active_file) {
-            ccask_errno = CCASK_ERR_NO_MEMORY;
-            return CCASK_FAIL;
-        }
-        if (create_new_active_datafile(files_state.head->file_id + 1, active_file) != CCASK_OK) {
+    bool has_records = false;
+    for (ccask_file_t *file = files_state.head; file; file = file->next) has_records |= file->size > 0;
+
+    strcpy(&entry_path[dir_len], FILES_FORMAT_FILENAME);
+    ccask_status_e format_res = check_format(entry_path, has_records);
+    free(entry_path);
+    if (format_res != CCASK_OK) return CCASK_FAIL;
+
+    files_state.next_file_id = files_state.head ? files_state.head->file_id + 1 : 0;
+    files_state.num_active = 0;
+
+    // Files without hints at the top of the log are appended to again. A shard may be handed another
+    // shard's file from the last run, so only files no older record lies beyond qualify: empty ones, and
+    // the newest one holding records. Anything appended to them still comes last in file order.
+    for (ccask_file_t *file = files_state.head; file && !file->has_hint && files_state.num_active < num_active; file = file->next) {
+        if (open_active_datafile(file) != CCASK_OK) return CCASK_FAIL;
+        files_state.active[files_state.num_active++] = file;
+        if (file->size > 0) break;
+    }
+
+    // other empty files (eg. ones created ahead of a rotation before a crash) would stay empty for good
+    for (ccask_file_t *file = files_state.head, *next; file; file = next) {
+        next = file->next;
+        if (!file->is_active && !file->has_hint && file->size == 0) remove_empty_file(file);
+    }
+
+    while (files_state.num_active < num_active) {
+        ccask_file_t *file = new_active_datafile();
+        if (!file) {
             log_error("Failed to initialize ccask-files (Unable to create active datafile)");
             return CCASK_FAIL;
         }
-        add_file(active_file);
-    } else {
-        int fd;
-        CCASK_ATTEMPT(5, fd, ccask_files_get_active_datafile_fd(files_state.head->file_id));
-        if (fd < 0) {
-            log_error("Could not load FD for Active Datafile ID = %" PRIu64, files_state.head->file_id);
-            return CCASK_FAIL;
-        }
+        add_file(file);
+        files_state.active[files_state.num_active++] = file;
+    }
 
-        files_state.head->is_active = true;
-        files_state.head->fd = fd;
+    for (size_t i = 0; i < files_state.num_active; i++) {
+        log_info("Using Data-File ID=%" PRIu64 " as Active Data-File", files_state.active[i]->file_id);
     }
 
-    log_info("Using Data-File ID=%" PRIu64 " as Active Data-File", files_state.head->file_id);
+    start_spare_thread();
     return CCASK_OK;
 }
 
 void ccask_files_shutdown(void) {
+    stop_spare_thread();
     free(files_state.data_dir);
 
     ccask_file_t *curr, *tmp;
     HASH_ITER(hh, files_state.hash_table, curr, tmp) {
         pthread_rwlock_wrlock(&curr->rwlock);
+        if (curr->is_active) {
+            trim_preallocation(curr);
+            release_active_datafile(curr);
+        }
+        if (curr->map && atomic_load_explicit(&curr->map_borrows, memory_order_acquire) > 0) {
+            // better leaked than pulled from under whoever still holds a view into it
+            log_warn("Datafile ID = %" PRIu64 " has values borrowed from it at shutdown, leaving it mapped", curr->file_id);
+        } else if (curr->map) {
+            munmap(curr->map, curr->size);
+        }
         if (curr->fd >= 0) {
             close(curr->fd);
             curr->fd = -1;
@@ -397,26 +1012,80 @@ ccask_status_e ccask_files_change_ext(uint64_t file_id, file_ext_e from, file_ex
     }
 }
 
-ccask_status_e ccask_files_rotate(void) {
+ccask_status_e ccask_files_rotate(size_t shard) {
     int res;
-    ccask_file_t *file = malloc(sizeof(ccask_file_t));
-    if (!file) {
-        ccask_errno = CCASK_ERR_NO_MEMORY;
-        return CCASK_FAIL;
+    ccask_file_t *old = ccask_files_get_active_file(shard);
+
+    pthread_mutex_lock(&spares.lock);
+    ccask_file_t *file = spares.files[shard];
+    spares.files[shard] = NULL;
+    pthread_cond_signal(&spares.cond);
+    pthread_mutex_unlock(&spares.lock);
+
+    // a spare created while the shard had to rotate without one would go back in file order
+    if (file && file->file_id < old->file_id) {
+        discard_datafile(file);
+        file = NULL;
     }
 
-    res = create_new_active_datafile(files_state.head->file_id + 1, file);
-    if (res != CCASK_OK) {
+    if (!file) file = new_active_datafile();
+    if (!file) {
         log_error("Failed to perform rotation of Active Datafile");
         return CCASK_FAIL;
     }
+    add_file(file);
 
-    close(files_state.head->fd);
-    files_state.head->fd = -1;
-    files_state.head->is_active = false;
+    trim_preallocation(old);
 
-    add_file(file);
-    CCASK_ATTEMPT(5, res, ccask_hintfile_generate(files_state.head->next));
+    // a closed file is never synced again, so ccask_files_sync_active covers everything written before
+    if (fdatasync(old->fd) != 0) {
+        log_error("Couldn't sync Datafile ID = %" PRIu64 " before rotating it\n\t%s", old->file_id, strerror(errno));
+    }
+
+    release_active_datafile(old);
+    close(old->fd);
+    old->fd = -1;
+    old->is_active = false;
+    atomic_store(&files_state.active[shard], file);
+
+    CCASK_ATTEMPT(5, res, ccask_hintfile_generate(old));
     
     return CCASK_OK;
 }
+
+static ccask_status_e sync_active_file(size_t shard) {
+    while (true) {
+        ccask_file_t *file = ccask_files_get_active_file(shard);
+
+        // sync a duplicate, so rotation can close the file (and writers can append) meanwhile
+        pthread_rwlock_rdlock(&file->rwlock);
+        if (!file->is_active) {
+            pthread_rwlock_unlock(&file->rwlock);
+            continue;
+        }
+        int fd = dup(file->fd);
+        pthread_rwlock_unlock(&file->rwlock);
+
+        if (fd < 0) {
+            ccask_errno = CCASK_ERR_GET_FD_FAILED;
+            return CCASK_FAIL;
+        }
+
+        int res = fdatasync(fd);
+        close(fd);
+        if (res != 0) {
+            log_error("Couldn't sync active Datafile ID = %" PRIu64 "\n\t%s", file->file_id, strerror(errno));
+            ccask_errno = CCASK_ERR_SYNC_FAILED;
+            return CCASK_FAIL;
+        }
+        return CCASK_OK;
+    }
+}
+
+ccask_status_e ccask_files_sync_active(void) {
+    ccask_status_e res = CCASK_OK;
+    for (size_t i = 0; i < files_state.num_active; i++) {
+        if (sync_active_file(i) != CCASK_OK) res = CCASK_FAIL;
+    }
+    return res;
+}
@@ -34,13 +34,18 @@ typedef struct thread_handle_t {
 } thread_handle_t;
 
 static thread_handle_t *threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER; // writer shards rotate concurrently
 
 void ccask_hintfile_generator_init(void) {
     threads = NULL;
 }
 
 void ccask_hintfile_generator_shutdown(void) {
+    pthread_mutex_lock(&threads_lock);
     thread_handle_t* curr = threads;
+    threads = NULL;
+    pthread_mutex_unlock(&threads_lock);
+
     while (curr) {
         pthread_join(curr->thread, NULL);
 
@@ -54,9 +59,9 @@ void* hintfile_generator_thread(void* arg) {
     ccask_file_t *file = (ccask_file_t*)arg;
     uint64_t file_id = file->file_id;
 
-    // get file-descriptor for new hintfile
+    // written under a temp name, startup takes any hintfile for a complete one, even after a crash cut it short
     int hintfile_fd;
-    CCASK_ATTEMPT(5, hintfile_fd, ccask_files_get_hintfile_fd(file_id));
+    CCASK_ATTEMPT(5, hintfile_fd, ccask_files_get_temp_hintfile_fd(file_id));
     if (hintfile_fd < 0) {
         log_error("Hintfile generation failed (File ID = %" PRIu64 ")", file_id);
         return NULL;
@@ -75,10 +80,17 @@ void* hintfile_generator_thread(void* arg) {
     ccask_datafile_record_t record;
     ccask_hintfile_record_t hint_record;
     while (ccask_datafile_iter_next(&iter, record, &record_pos) == CCASK_OK) {
+        // batch headers locate nothing, the records of a (rotated, so complete) batch get hints as usual
+        if (ccask_is_datafile_batch_header(record)) {
+            free_datafile_record(record);
+            continue;
+        }
+
         ccask_datafile_record_header_t header = ccask_get_datafile_record_header(record);
         void *key = ccask_get_datafile_record_key(record);
         int res = ccask_create_hintfile_record(
             hint_record,
+            header.seq,
             header.timestamp,
             header.key_size,
             header.value_size,
@@ -103,14 +115,25 @@ generation_failed:
         ccask_datafile_iter_close(&iter);
 
         close(hintfile_fd);
-        CCASK_ATTEMPT(5, res, ccask_files_delete(file_id, FILE_HINT));
+        CCASK_ATTEMPT(5, res, ccask_files_delete(file_id, FILE_TEMP_HINT));
         if (res != CCASK_OK) log_error("Couldn't delete partially written hintfile ID = %" PRIu64, file_id);
         
         return NULL;
     }
 
     ccask_datafile_iter_close(&iter);
+
+    // synced before it is renamed, so the rename can't become durable ahead of the contents
+    bool synced = fdatasync(hintfile_fd) == 0;
     close(hintfile_fd);
+    if (synced) CCASK_ATTEMPT(5, res, ccask_files_change_ext(file_id, FILE_TEMP_HINT, FILE_HINT));
+    if (!synced || res != CCASK_OK) {
+        log_error("Hintfile generation failed (File ID = %" PRIu64 ")", file_id);
+        CCASK_ATTEMPT(5, res, ccask_files_delete(file_id, FILE_TEMP_HINT));
+        if (res != CCASK_OK) log_error("Couldn't delete partially written hintfile ID = %" PRIu64, file_id);
+        return NULL;
+    }
+
     file->has_hint = true;
     log_info("Hintfile generation completed (File ID = %" PRIu64 ")", file_id);
     return NULL;
@@ -133,7 +156,9 @@ ccask_status_e ccask_hintfile_generate(ccask_file_t* file) {
         return CCASK_FAIL;
     }
 
+    pthread_mutex_lock(&threads_lock);
     handle->next = threads;
     threads = handle;
+    pthread_mutex_unlock(&threads_lock);
     return CCASK_OK;
 }
@@ -0,0 +1,79 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#ifndef CCASK_CACHE_H
+#define CCASK_CACHE_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdatomic.h"
+
+#include "ccask/core.h"
+#include "ccask/status.h"
+
+/**
+ * Values of datafile records, keyed by (file_id, record_pos). A record never changes once written, and a key
+ * that's overwritten or deleted moves to a new position in the keydir, so entries never go stale; entries of
+ * old positions just stop being hit and age out.
+ * Eviction is S3-FIFO: new values go to a small FIFO and only move to the main one if hit again before they
+ * leave it, so a scan can't flush the hot set. Values evicted from the small FIFO are remembered in a ghost
+ * FIFO, and go straight to the main one if they come back soon.
+ */
+
+#define CACHE_SHARDS 16
+
+typedef struct ccask_cache_entry {
+    struct ccask_cache_entry *next;     // hash-chain
+    struct ccask_cache_entry *newer;    // next entry to leave the FIFO it's in
+    uint64_t file_id;
+    uint64_t record_pos;
+    uint64_t timestamp;
+    uint32_t value_size;
+    uint8_t freq;                       // hits since it last moved, capped
+    _Atomic uint32_t refs;              // one for the cache while it's in there, one per reader
+    uint8_t value[];
+} ccask_cache_entry_t;
+
+/**
+ * @param max_bytes Budget for entries including their overhead, 0 disables the cache
+ */
+ccask_status_e ccask_cache_init(size_t max_bytes);
+void ccask_cache_shutdown(void);
+
+/**
+ * Looks up the value of the record at `record_pos` of datafile `file_id`, counting a hit or miss.
+ * @return The entry with a reference taken on it, or NULL if it isn't cached
+ */
+ccask_cache_entry_t* ccask_cache_get(uint64_t file_id, uint64_t record_pos);
+
+/**
+ * Caches a copy of a value that was read (and checked) from its datafile.
+ * @return The entry with a reference taken on it, or NULL if the value isn't cached (disabled, too large or
+ * out of memory)
+ */
+ccask_cache_entry_t* ccask_cache_insert(uint64_t file_id, uint64_t record_pos, const void *value, uint32_t value_size, uint64_t timestamp);
+
+/**
+ * Drops a reference taken by `ccask_cache_get` or `ccask_cache_insert`, the entry must not be used after.
+ */
+void ccask_cache_release(ccask_cache_entry_t *entry);
+
+void ccask_cache_get_stats(ccask_value_cache_stats_t *stats);
+
+#endif
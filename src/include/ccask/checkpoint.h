@@ -0,0 +1,68 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#ifndef CCASK_CHECKPOINT_H
+#define CCASK_CHECKPOINT_H
+
+#include "stddef.h"
+#include "stdint.h"
+
+#include "ccask/files.h"
+#include "ccask/status.h"
+
+#define CHECKPOINT_DEFAULT_INTERVAL 300 // seconds
+#define CHECKPOINT_MAX_POSITIONS (2 * FILES_MAX_ACTIVE) // active datafiles, and the ones created to replace them
+
+/**
+ * Keydir checkpoints.
+ *
+ * A checkpoint is a dump of the whole keydir plus the positions in the log (ID and offset of every active
+ * datafile) it is valid up to. Every record before those positions, and in every older datafile, is
+ * reflected in it, records after them may or may not be, so recovery loads it and replays the log from
+ * there on. Replaying a record the checkpoint already has is harmless, as the keydir never replaces a
+ * record with an older one (by sequence number).
+ */
+
+typedef struct ccask_checkpoint_position {
+    uint64_t file_id;
+    uint64_t offset;
+} ccask_checkpoint_position_t;
+
+ccask_status_e ccask_checkpoint_write(void);
+
+/**
+ * Loads the checkpoint into the keydir if there is a usable one.
+ * @param positions Filled in with where the log must be replayed from, one per datafile that was active
+ *        (room for CHECKPOINT_MAX_POSITIONS). Datafiles newer than all of them are replayed whole, older ones not at all.
+ * @param num_positions Filled in with the number of positions
+ * @param next_seq Filled in with the sequence number the first record after the positions got (at least)
+ * @return CCASK_OK if loaded, CCASK_FAIL if there is no usable checkpoint. The keydir may then hold part
+ *         of it, which replaying the whole log corrects.
+ */
+ccask_status_e ccask_checkpoint_load(ccask_checkpoint_position_t *positions, size_t *num_positions, uint64_t *next_seq);
+
+/**
+ * Removes the checkpoint, for when datafiles are rewritten (eg. by compaction).
+ */
+void ccask_checkpoint_discard(void);
+
+ccask_status_e ccask_checkpointer_start(size_t interval);
+void ccask_checkpointer_stop(void);
+
+#endif
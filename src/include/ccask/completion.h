@@ -0,0 +1,47 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#ifndef CCASK_COMPLETION_H
+#define CCASK_COMPLETION_H
+
+#include "stdbool.h"
+
+#include "ccask/core.h"
+#include "ccask/status.h"
+
+/**
+ * Where the outcome of a queued write is reported, a callback and/or a completion queue (neither for
+ * plain `ccask_put`).
+ */
+typedef struct ccask_write_completion {
+    ccask_put_callback_t callback;
+    ccask_completion_queue_t *queue;
+    void *ctx;
+} ccask_write_completion_t;
+
+static inline bool ccask_write_completion_wanted(const ccask_write_completion_t *completion) {
+    return completion->callback || completion->queue;
+}
+
+/**
+ * Reports the result to the completion's callback and/or queue, `result->ctx` is filled in.
+ */
+void ccask_write_completion_deliver(const ccask_write_completion_t *completion, ccask_put_result_t *result);
+
+#endif
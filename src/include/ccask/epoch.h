@@ -0,0 +1,46 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#ifndef CCASK_EPOCH_H
+#define CCASK_EPOCH_H
+
+#include "stdint.h"
+
+/**
+ * Epoch-based memory reclamation.
+ *
+ * Readers wrap lock-free traversals in `ccask_epoch_enter`/`ccask_epoch_exit`. Writers unlink shared
+ * objects first and then hand them to `ccask_epoch_retire`, which frees them only once every reader
+ * that could still see them has left its guard (two epoch advances later).
+ *
+ * Guards nest, and the enter/exit fast-path has no atomic read-modify-write. On kernels with
+ * `membarrier(2)` it has no memory fence either, the reclaimer pays for that with a process-wide barrier.
+ */
+
+void ccask_epoch_init(void);
+void ccask_epoch_shutdown(void);
+
+void ccask_epoch_enter(void);
+void ccask_epoch_exit(void);
+
+typedef void (*ccask_epoch_free_fn)(void *ptr, void *ctx);
+
+void ccask_epoch_retire(void *ptr, ccask_epoch_free_fn free_fn, void *ctx);
+
+#endif
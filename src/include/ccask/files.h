@@ -21,12 +21,17 @@
 
 #include "stdint.h"
 #include "stdbool.h"
+#include "stdatomic.h"
 #include "pthread.h"
+#include "sys/uio.h"
 #include "uthash.h"
 
+#include "ccask/core.h"
 #include "ccask/utils.h"
 #include "ccask/status.h"
 
+#define FILES_MAX_ACTIVE 64
+
 extern size_t MAX_ACTIVE_FILE_SIZE;
 
 typedef struct ccask_file {
@@ -34,28 +39,133 @@ typedef struct ccask_file {
     int fd;
     time_t last_accessed;
     bool has_hint;
-    bool is_active;
+    _Atomic bool is_active;         // set once before the file is published, cleared once when it is rotated
     bool is_fd_invalidator_running;
     pthread_rwlock_t rwlock;
 
+    _Atomic uint64_t size;          // bytes written to the datafile, where the next append goes
+    uint64_t allocated;             // bytes of disk space reserved for appends, guarded by rwlock
+    _Atomic uint64_t live_bytes;    // bytes of records the keydir still points to, kept by the keydir
+    _Atomic uint64_t live_keys;
+
+    // with direct I/O, active datafiles are appended to through an O_DIRECT descriptor from an aligned
+    // buffer, which starts with the file's last partly written block (at stage_base), guarded by rwlock
+    int direct_fd;
+    uint8_t *stage;
+    uint64_t stage_base;
+
+    // rotated datafiles are read from a mapping of their whole (final) size, made on first read and kept
+    // until shutdown
+    uint8_t *_Atomic map;
+    _Atomic bool map_failed;        // not tried again
+    _Atomic size_t map_borrows;     // records borrowed from the mapping, which is kept at shutdown while any are
+
     struct ccask_file* next;
     struct ccask_file* previous;
     UT_hash_handle hh;
 } ccask_file_t;
 
-ccask_status_e ccask_files_init(const char *data_dir, size_t active_file_max_size);
+/**
+ * Opens active datafiles with O_DSYNC from now on, call before `ccask_files_init`.
+ */
+void ccask_files_use_dsync(bool enabled);
+
+/**
+ * Appends to active datafiles with O_DIRECT from now on, call before `ccask_files_init`.
+ */
+void ccask_files_use_direct_io(bool enabled);
+
+/**
+ * Maps rotated datafiles with the given advice from now on, call before `ccask_files_init`.
+ */
+void ccask_files_use_mmap(ccask_mmap_advice_e advice);
+
+/**
+ * @param num_active Number of active datafiles appended to side by side, one per writer shard (1 to FILES_MAX_ACTIVE)
+ */
+ccask_status_e ccask_files_init(const char *data_dir, size_t active_file_max_size, size_t num_active);
 void ccask_files_shutdown(void);
 
-ccask_file_t* ccask_files_get_active_file(void);
+const char* ccask_files_get_data_dir(void);
+ccask_file_t* ccask_files_get_active_file(size_t shard);
+size_t ccask_files_num_active(void);
+ccask_file_t* ccask_files_get_newest_file(void);
 ccask_file_t* ccask_files_get_oldest_file(void);
 ccask_file_t* ccask_files_get_file(uint64_t file_id);
 
+/**
+ * Copies the space usage of every datafile, newest first, see `ccask_file_stats`.
+ */
+ccask_status_e ccask_files_get_stats(ccask_file_stats_t **stats, size_t *num_files);
+
 int ccask_files_get_active_datafile_fd(uint64_t file_id);
 int ccask_files_get_datafile_fd(uint64_t file_id);
 int ccask_files_get_hintfile_fd(uint64_t file_id);
 int ccask_files_get_temp_datafile_fd(uint64_t file_id);
+int ccask_files_get_temp_hintfile_fd(uint64_t file_id);
+
+/**
+ * Rotates the shard's active datafile, the closed one is synced first. Must be called with its wrlock held.
+ */
+ccask_status_e ccask_files_rotate(size_t shard);
+
+/**
+ * Writes at `pos`, the end of the active datafile, which the caller holds the wrlock of. The file's size is
+ * left to the caller.
+ * @param synced See `ccask_io_pwritev`
+ */
+ccask_status_e ccask_files_append(ccask_file_t *file, const struct iovec *iov, int iovcnt, uint64_t pos, bool *synced);
 
-ccask_status_e ccask_files_rotate(void);
+/**
+ * Reads from a datafile opened for reading, the caller holds its rdlock. Bytes still staged for direct
+ * I/O are copied from memory instead of being read back from disk.
+ */
+ccask_status_e ccask_files_read(ccask_file_t *file, struct iovec *iov, int iovcnt, uint64_t pos);
+
+/**
+ * The part of `ccask_files_read` that copies from the direct I/O stage, for callers issuing the disk reads
+ * themselves. The caller holds the file's rdlock.
+ * @return false if the bytes aren't all staged, they have to be read from the file's fd then
+ */
+bool ccask_files_read_staged(ccask_file_t *file, struct iovec *iov, int iovcnt, uint64_t pos);
+
+/**
+ * Reads from the datafile's mapping, mapping it first if it is a rotated one that isn't yet. Needs no lock.
+ * @return false if the file can't be read that way (active, empty, mapping disabled or failed), then the
+ *         caller reads it with `ccask_files_read`
+ */
+bool ccask_files_read_mapped(ccask_file_t *file, struct iovec *iov, int iovcnt, uint64_t pos);
+
+/**
+ * Like `ccask_files_read_mapped`, but points the iovecs into the mapping instead of copying, and keeps
+ * it mapped until `ccask_files_return_mapped`.
+ */
+bool ccask_files_borrow_mapped(ccask_file_t *file, struct iovec *iov, int iovcnt, uint64_t pos);
+void ccask_files_return_mapped(ccask_file_t *file);
+
+/**
+ * Reserves disk space for the active datafile up to at least `end`, a chunk at a time, so appends don't
+ * grow it block by block. The file's size is left alone. Must be called with its wrlock held.
+ */
+void ccask_files_preallocate(ccask_file_t *file, uint64_t end);
+
+/**
+ * Cuts a datafile back to `size`, dropping a torn tail left by a crash. Only for recovery, before any
+ * writer, hint generator or compaction runs.
+ */
+ccask_status_e ccask_files_truncate(ccask_file_t *file, uint64_t size);
+
+/**
+ * ID of the datafile the shard will rotate to, if it has been created ahead of time already or is being
+ * created right now (the file may not exist yet, or at all if creating it fails).
+ */
+bool ccask_files_get_spare_file_id(size_t shard, uint64_t *file_id);
+
+/**
+ * fdatasync()s the active datafiles. Files are synced when they're rotated, so with this everything
+ * appended so far is durable. Doesn't block writers while the syncs run.
+ */
+ccask_status_e ccask_files_sync_active(void);
 
 ccask_status_e ccask_files_delete(uint64_t file_id, file_ext_e ext);
 ccask_status_e ccask_files_change_ext(uint64_t file_id, file_ext_e from, file_ext_e to);
@@ -0,0 +1,80 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#ifndef CCASK_HASH_H
+#define CCASK_HASH_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "string.h"
+
+__extension__ typedef unsigned __int128 hash_u128_t;
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    hash_u128_t r = (hash_u128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t hash_load_u64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_load_u32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// wyhash-style, one 64x64->128 multiply per 16 bytes of key
+static inline uint64_t ccask_hash_key(const void *key, uint32_t key_size) {
+    static const uint64_t s0 = UINT64_C(0xa0761d6478bd642f);
+    static const uint64_t s1 = UINT64_C(0xe7037ed1a0b428db);
+
+    const uint8_t *p = key;
+    uint64_t seed = s0 ^ key_size;
+    uint64_t a, b;
+
+    if (key_size <= 16) {
+        if (key_size >= 4) {
+            size_t mid = (key_size >> 3) << 2;
+            a = (hash_load_u32(p) << 32) | hash_load_u32(p + mid);
+            b = (hash_load_u32(p + key_size - 4) << 32) | hash_load_u32(p + key_size - 4 - mid);
+        } else if (key_size > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[key_size >> 1] << 8) | p[key_size - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t left = key_size;
+        while (left > 16) {
+            seed = hash_mix(hash_load_u64(p) ^ s1, hash_load_u64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        a = hash_load_u64(p + left - 16);
+        b = hash_load_u64(p + left - 8);
+    }
+
+    return hash_mix(s1 ^ key_size, hash_mix(a ^ s1, b ^ seed));
+}
+
+#endif
@@ -0,0 +1,80 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#ifndef CCASK_INDEX_H
+#define CCASK_INDEX_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdbool.h"
+
+#include "ccask/status.h"
+
+/**
+ * Ordered key index.
+ *
+ * A B+tree of all keys in lexicographic (memcmp) order, kept next to the keydir: the keydir adds a key
+ * when it is first inserted and removes it on delete, both under the key's shard lock. The tree is
+ * guarded by a single rwlock, only new keys and deletes take it for writing.
+ */
+
+ccask_status_e ccask_index_init(void);
+void ccask_index_shutdown(void);
+
+/**
+ * Adds the key, does nothing if it's already present.
+ */
+ccask_status_e ccask_index_insert(const void *key, uint32_t key_size);
+void ccask_index_remove(const void *key, uint32_t key_size);
+
+int ccask_index_compare(const void *a, uint32_t a_size, const void *b, uint32_t b_size);
+
+size_t ccask_index_bytes(void);
+
+/**
+ * Walks the index in key order without holding its lock between calls.
+ * Keys are copied out in batches, and each refill resumes after the last returned key, so concurrent
+ * inserts and deletes never invalidate the cursor (keys changed meanwhile may or may not be returned).
+ */
+typedef struct ccask_index_cursor {
+    uint8_t *batch;         // packed [key size][key] pairs
+    size_t batch_size;
+    size_t batch_capacity;
+    size_t batch_pos;
+
+    uint8_t *last_key;      // resume position, keys after it are returned next
+    uint32_t last_key_size;
+    size_t last_key_capacity;
+    bool inclusive;         // whether `last_key` itself is still to be returned
+    bool exhausted;
+} ccask_index_cursor_t;
+
+/**
+ * Positions the cursor at the first key >= start (the first key overall when start is NULL).
+ */
+ccask_status_e ccask_index_cursor_open(ccask_index_cursor_t *cursor, const void *start, uint32_t start_size);
+
+/**
+ * Returns the next key, which stays valid until the following call on the cursor.
+ * @return CCASK_OK if next exists, else CCASK_FAIL with CCASK_ERR_ITER_END at the end
+ */
+ccask_status_e ccask_index_cursor_next(ccask_index_cursor_t *cursor, void **key, uint32_t *key_size);
+void ccask_index_cursor_close(ccask_index_cursor_t *cursor);
+
+#endif
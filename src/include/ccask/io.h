@@ -0,0 +1,96 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#ifndef CCASK_IO_H
+#define CCASK_IO_H
+
+#include "stddef.h"
+#include "stdbool.h"
+#include "sys/types.h"
+#include "sys/uio.h"
+#include "ccask/core.h"
+#include "ccask/status.h"
+
+/**
+ * Datafile I/O goes through a backend (picked with `ccask_options_t.io_backend`), so the reader, writer,
+ * iterators and compactor don't care how it's issued. Calls block until done with every backend and
+ * transfer everything asked for: a read fails with CCASK_ERR_UNEXPECTED_EOF when the file ends first.
+ */
+
+/**
+ * One read of a batch, `status` is filled in.
+ */
+typedef struct ccask_io_read {
+    int fd;
+    struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+    ccask_status_e status;
+} ccask_io_read_t;
+
+typedef struct ccask_io_backend_ops {
+    const char *name;
+
+    ccask_status_e (*init)(bool sqpoll);
+    void (*shutdown)(void);
+
+    ccask_status_e (*preadv)(int fd, struct iovec *iov, int iovcnt, off_t offset);
+    void (*preadv_batch)(ccask_io_read_t *reads, size_t count);
+    ccask_status_e (*pwritev)(int fd, const struct iovec *iov, int iovcnt, off_t offset, bool *synced);
+
+    // lets the backend pre-register fds it will write to often (active datafiles)
+    void (*register_file)(int fd);
+    void (*unregister_file)(int fd);
+} ccask_io_backend_ops_t;
+
+extern const ccask_io_backend_ops_t ccask_io_sync_backend;
+#ifdef CCASK_ENABLE_IO_URING
+extern const ccask_io_backend_ops_t ccask_io_uring_backend;
+#endif
+
+/**
+ * Switches to the backend, the sync one is used until then (and whenever the chosen one isn't available).
+ * Must not race with any I/O.
+ */
+ccask_status_e ccask_io_init(ccask_io_backend_e backend, bool sqpoll);
+void ccask_io_shutdown(void);
+const char* ccask_io_backend_name(void);
+
+ccask_status_e ccask_io_preadv(int fd, struct iovec *iov, int iovcnt, off_t offset);
+ccask_status_e ccask_io_pread(int fd, void *buf, size_t len, off_t offset);
+
+/**
+ * Issues the reads together, backends that can submit them at once do.
+ */
+void ccask_io_preadv_batch(ccask_io_read_t *reads, size_t count);
+
+/**
+ * @param synced NULL, or points to true to also fdatasync the file once written (in the same submission
+ *               where the backend can), and is set to whether that sync succeeded
+ * @return CCASK_OK if everything was written, whether or not the sync succeeded
+ */
+ccask_status_e ccask_io_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset, bool *synced);
+
+/**
+ * Register an fd before writing to it repeatedly, and unregister it before closing it.
+ */
+void ccask_io_register_file(int fd);
+void ccask_io_unregister_file(int fd);
+
+#endif
@@ -19,11 +19,19 @@
 #ifndef CCASK_KEYDIR_H
 #define CCASK_KEYDIR_H
 
+#include "stddef.h"
 #include "stdint.h"
-#include "uthash.h"
 
+#include "ccask/core.h"
 #include "ccask/status.h"
 
+/**
+ * Location of the latest record stored for a key.
+ * This is an unpacked copy, the keydir itself stores records as packed 48-byte entries
+ * (32-bit file IDs, 40-bit positions, sequence numbers, keys of up to 20 bytes inline).
+ * `key` is only valid inside an epoch guard (see `ccask/epoch.h`), or, for a record returned by an iterator, until
+ * the iterator moves past its shard.
+ */
 typedef struct ccask_keydir_record {
     void *key;
     uint32_t key_size;
@@ -31,28 +39,114 @@ typedef struct ccask_keydir_record {
     uint64_t file_id;
     uint64_t record_pos;
     uint32_t value_size;
-    uint32_t timestamp;
-
-    UT_hash_handle hh;
+    uint64_t seq;
 } ccask_keydir_record_t;
 
-ccask_status_e ccask_keydir_init(void);
+#define KEYDIR_DEFAULT_SHARDS 64
+
+ccask_status_e ccask_keydir_init(size_t num_shards);
 void ccask_keydir_shutdown(void);
 
-ccask_keydir_record_t* ccask_keydir_find(void *key, uint32_t key_size);
-ccask_status_e ccask_keydir_delete(void *key, uint32_t key_size);
+/**
+ * Lock-free lookup, copies the record for `key` into `out`.
+ * @return CCASK_OK if found, CCASK_FAIL (with CCASK_ERR_NO_KEY) otherwise
+ */
+ccask_status_e ccask_keydir_find(void *key, uint32_t key_size, ccask_keydir_record_t *out);
+/**
+ * Lock-free lookup of many keys, interleaving their probes so their cache misses overlap.
+ * @param found Set to whether each key was found, `out` is only filled in for those
+ */
+void ccask_keydir_find_batch(void *const *keys, const uint32_t *key_sizes, size_t num_keys, ccask_keydir_record_t *out, bool *found);
+/**
+ * Removes `key`, unless its record is newer than the delete's (`seq`).
+ * @return CCASK_OK if found, also when the stored record is newer and is kept (only while recovering),
+ *         CCASK_FAIL (with CCASK_ERR_NO_KEY) otherwise
+ */
+ccask_status_e ccask_keydir_delete(void *key, uint32_t key_size, uint64_t seq);
 
+/**
+ * Points `key` at the record, unless its current record is newer (has a higher `seq`).
+ */
 ccask_status_e ccask_keydir_upsert(
     void *key,
     uint32_t key_size,
     uint64_t file_id,
     uint64_t record_pos,
     uint32_t value_size,
-    uint32_t timestamp
+    uint64_t seq
+);
+
+/**
+ * Highest sequence number of the records found by recovery (see `ccask_keydir_init`), 0 if there were none.
+ */
+uint64_t ccask_keydir_recovered_seq(void);
+
+/**
+ * One record's keydir change, for `ccask_keydir_apply_batch`. A `value_size` of 0 is a tombstone (delete).
+ */
+typedef struct ccask_keydir_update {
+    void *key;
+    uint32_t key_size;
+    uint64_t file_id;
+    uint64_t record_pos;
+    uint32_t value_size;
+    uint64_t seq;
+} ccask_keydir_update_t;
+
+/**
+ * Applies the updates in order, taking each shard's lock once for all of its updates.
+ * Deletes of absent keys are not errors. Every update is attempted even if one fails.
+ * @return CCASK_OK if all were applied, else the status of the first failed one
+ */
+ccask_status_e ccask_keydir_apply_batch(ccask_keydir_update_t *updates, size_t num_updates);
+
+/**
+ * Like `ccask_keydir_apply_batch`, but holds the locks of all shards the updates touch at once, so
+ * snapshots and other writers see the whole batch applied or none of it. Lookups don't take locks and
+ * may still see part of it while it's being applied.
+ */
+ccask_status_e ccask_keydir_apply_batch_atomic(ccask_keydir_update_t *updates, size_t num_updates);
+
+void ccask_keydir_get_stats(ccask_keydir_stats_t *stats);
+
+/**
+ * Grows empty shards up-front to fit the given number of keys, for bulk loads.
+ */
+void ccask_keydir_presize(size_t num_keys);
+
+/**
+ * Point-in-time snapshot of the keydir's keys.
+ * Opening one briefly takes every shard lock. Afterwards writers only pay when they first change a shard's
+ * set of keys, by copying that shard's keys into the snapshot; updates of existing keys cost nothing.
+ * The snapshot can be read from any thread, the position is a plain (shard, index) pair that can be kept
+ * and resumed from later. Keys stay valid until the snapshot is closed.
+ */
+typedef struct ccask_keydir_snapshot ccask_keydir_snapshot_t;
+
+ccask_keydir_snapshot_t* ccask_keydir_snapshot_open(void);
+ccask_status_e ccask_keydir_snapshot_next(
+    ccask_keydir_snapshot_t *snap,
+    uint64_t *shard_idx,
+    uint64_t *pos,
+    void **key,
+    uint32_t *key_size
 );
+void ccask_keydir_snapshot_close(ccask_keydir_snapshot_t *snap);
 
+/**
+ * Iterates all records. Each shard's records and keys are copied under its lock when the iterator reaches
+ * it, which briefly blocks that shard's writers. Copies need no epoch guard, so a long iteration doesn't
+ * hold back reclamation. A returned record (possibly stale) stays valid until the iterator moves past its
+ * shard.
+ */
 typedef struct ccask_keydir_record_iter {
-    ccask_keydir_record_t *next;
+    size_t shard;
+    ccask_keydir_record_t *records;
+    size_t num_records;
+    size_t capacity;
+    uint8_t *keys;
+    size_t keys_capacity;
+    size_t pos;
 } ccask_keydir_record_iter_t;
 
 ccask_keydir_record_iter_t ccask_keydir_record_iter(void);
@@ -0,0 +1,69 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#ifndef CCASK_PENDING_H
+#define CCASK_PENDING_H
+
+#include "stddef.h"
+#include "stdbool.h"
+
+#include "ccask/core.h"
+#include "ccask/records.h"
+#include "ccask/status.h"
+
+/**
+ * Records queued for the writer but not yet in the keydir, by key, so reads see puts that are still queued.
+ * Entries point into the queued records themselves, which stay allocated until their entry is removed.
+ */
+
+#define PENDING_SHARDS 64
+
+/**
+ * @param capacity Most records queued at once, sizes the tables so chains stay short when the queue is full
+ */
+ccask_status_e ccask_pending_init(size_t capacity);
+void ccask_pending_shutdown(void);
+
+/**
+ * Makes `record` the pending value of its key, unless a record queued after it already is.
+ * @param seq The record's position in the writer queue, later puts of a key have larger ones
+ * @return CCASK_OK, or CCASK_FAIL if out of memory (reads of the key then miss the record until it's written)
+ */
+ccask_status_e ccask_pending_add(ccask_datafile_record_t record, size_t seq);
+
+/**
+ * Forgets the records once the keydir has been updated with them (or their write failed), before they are freed.
+ * @param num_records At most WRITER_BATCH_MAX_RECORDS, the bookkeeping lives on the stack
+ */
+void ccask_pending_remove_batch(ccask_datafile_record_t *records, size_t num_records);
+
+/**
+ * Copies the value of the latest queued record of `key` into `out` (NULL value for a tombstone). If the value
+ * couldn't be copied, `out->value` is NULL while `out->value_size` isn't 0 (CCASK_ERR_NO_MEMORY).
+ * @return true if the key has a queued record, false if the keydir has to be consulted
+ */
+bool ccask_pending_find(void *key, uint32_t key_size, ccask_record_t *out);
+
+/**
+ * Like `ccask_pending_find`, but copies the value into `buf` if it fits in `cap` bytes.
+ * @param value_size Set to the value's size (0 for a tombstone), whether it fit or not
+ */
+bool ccask_pending_find_into(void *key, uint32_t key_size, void *buf, uint32_t cap, uint32_t *value_size);
+
+#endif
@@ -25,4 +25,29 @@
 
 ccask_status_e ccask_read_datafile_record(uint64_t file_id, ccask_datafile_record_t record, uint64_t record_pos);
 
+/**
+ * One record of a `ccask_read_datafile_records` batch, `status` is filled in.
+ */
+typedef struct ccask_read_request {
+    uint64_t file_id;
+    uint64_t record_pos;
+    ccask_datafile_record_t record;
+    ccask_status_e status;
+} ccask_read_request_t;
+
+/**
+ * Reads many records at once, in datafile and offset order. Records of mapped datafiles are copied from the
+ * mapping, the others are read with one preadv per run of records lying close together in a file, and all
+ * of those go to the I/O backend as one batch.
+ */
+void ccask_read_datafile_records(ccask_read_request_t *requests, size_t num_requests);
+
+/**
+ * Points the record's iovecs (their lengths set by the caller) at its bytes in the mapping of its datafile,
+ * without copying them. The mapping is kept until `ccask_return_datafile_record(*file)`.
+ * @return false if the datafile isn't mapped, it has to be read with `ccask_read_datafile_record` then
+ */
+bool ccask_borrow_datafile_record(uint64_t file_id, ccask_datafile_record_t record, uint64_t record_pos, ccask_file_t **file);
+void ccask_return_datafile_record(ccask_file_t *file);
+
 #endif
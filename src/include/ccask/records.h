@@ -20,36 +20,64 @@
 #define CCASK_RECORDS_H
 
 #include "stdint.h"
+#include "stdbool.h"
+#include "stddef.h"
 #include "sys/uio.h"
 
 #include "ccask/status.h"
 
-#define DATAFILE_RECORD_HEADER_SIZE 16
-#define HINTFILE_RECORD_HEADER_SIZE 20
+// version 1 had 32-bit second timestamps and no sequence numbers, its datafiles can't be read anymore
+#define DATAFILE_FORMAT_VERSION 2
 
+#define DATAFILE_RECORD_HEADER_SIZE 28
+#define HINTFILE_RECORD_HEADER_SIZE 32
+
+/**
+ * The CRC is the CRC-32 of everything after the sequence number (timestamp, sizes, key and value), XORed with
+ * the CRC-32 of the sequence number. Records are created with a sequence number of 0 and the writer stamps
+ * them with theirs right before appending (see `ccask_stamp_datafile_record`), which only has to swap the
+ * sequence number's part of the CRC.
+ */
 typedef struct ccask_datafile_record_header {
     uint32_t crc; // 32-bit Cyclic Redundancy Check (CRC)
-    uint32_t timestamp;
+    uint64_t seq; // order in which records were appended, across all datafiles
+    uint64_t timestamp; // nanoseconds since the Unix epoch, 0 if not recorded
     uint32_t key_size;
     uint32_t value_size;
 } ccask_datafile_record_header_t;
 
 typedef struct iovec ccask_datafile_record_t[3];
 
+/**
+ * Allocates a record as one buffer holding the header, key and value back to back.
+ */
 ccask_status_e ccask_allocate_datafile_record(ccask_datafile_record_t record, uint32_t key_size, uint32_t value_size);
 
 ccask_status_e ccask_create_datafile_record(
     ccask_datafile_record_t record,
-    uint32_t timestamp,
+    uint64_t timestamp,
     void *key,
     uint32_t key_size,
     void *value,
     uint32_t value_size
 );
 
+/**
+ * Sets the sequence number of a record, updating its CRC to match.
+ */
+void ccask_stamp_datafile_record(ccask_datafile_record_t record, uint64_t seq);
+
+/**
+ * Computes the CRC of a (stamped) record, to compare with the one in its header.
+ */
+uint32_t ccask_compute_datafile_record_crc(ccask_datafile_record_t record);
+
 void free_datafile_record(ccask_datafile_record_t record);
 ccask_datafile_record_header_t ccask_get_datafile_record_header(ccask_datafile_record_t record);
 
+// reads only the timestamp, which unlike the CRC and sequence number doesn't change once the record is created
+uint64_t ccask_get_datafile_record_timestamp(ccask_datafile_record_t record);
+
 static inline void* ccask_get_datafile_record_key(ccask_datafile_record_t record) {
     return record[1].iov_base;
 }
@@ -62,8 +90,38 @@ static inline size_t ccask_get_datafile_record_total_size(ccask_datafile_record_
     return record[0].iov_len + record[1].iov_len + record[2].iov_len;
 }
 
+// the header, key and value share one buffer, so the whole record can be written from a single iovec
+static inline struct iovec ccask_get_datafile_record_iovec(ccask_datafile_record_t record) {
+    struct iovec iov = { record[0].iov_base, ccask_get_datafile_record_total_size(record) };
+    return iov;
+}
+
+/**
+ * A write batch is framed by a header record (an empty key, and the fields below as its value) followed by
+ * the batch's records, written together. Recovery only applies the records if all of them made it to disk.
+ */
+#define DATAFILE_BATCH_MAGIC 0x43434254 // "CCBT"
+#define DATAFILE_BATCH_HEADER_VALUE_SIZE 24
+
+typedef struct ccask_datafile_batch_header {
+    uint32_t count;     // records in the batch
+    uint64_t length;    // bytes of records following the header
+    uint32_t crc;       // CRC-32 of those bytes
+} ccask_datafile_batch_header_t;
+
+ccask_status_e ccask_create_datafile_batch_header(
+    ccask_datafile_record_t record,
+    uint64_t timestamp,
+    ccask_datafile_record_t *records,
+    size_t num_records
+);
+
+bool ccask_is_datafile_batch_header(ccask_datafile_record_t record);
+ccask_datafile_batch_header_t ccask_get_datafile_batch_header(ccask_datafile_record_t record);
+
 typedef struct ccask_hintfile_record_header {
-    uint32_t timestamp;
+    uint64_t seq;
+    uint64_t timestamp;
     uint32_t key_size;
     uint32_t value_size;
     uint64_t record_pos;
@@ -75,7 +133,8 @@ ccask_status_e ccask_allocate_hintfile_record(ccask_hintfile_record_t record, ui
 
 ccask_status_e ccask_create_hintfile_record(
     ccask_hintfile_record_t record,
-    uint32_t timestamp,
+    uint64_t seq,
+    uint64_t timestamp,
     uint32_t key_size,
     uint32_t value_size,
     uint64_t record_pos,
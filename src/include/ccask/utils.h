@@ -26,20 +26,13 @@ typedef enum file_ext {
     FILE_UNKNOWN,
     FILE_DATA,
     FILE_HINT,
-    FILE_TEMP_DATA
+    FILE_TEMP_DATA,
+    FILE_TEMP_HINT
 } file_ext_e;
 
 file_ext_e parse_filename(const char* name, uint64_t *id);
 char* build_filepath(const char* dir, uint64_t file_id, file_ext_e ext);
 
-uint32_t calculate_crc32(
-    uint32_t timestamp,
-    uint32_t key_size,
-    uint32_t value_size,
-    void* key,
-    void* value
-);
-
 void write_be16(uint8_t *buf, uint16_t v);
 void write_be32(uint8_t *buf, uint32_t v);
 void write_be64(uint8_t *buf, uint64_t v);
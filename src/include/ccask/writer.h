@@ -19,11 +19,67 @@
 #ifndef CCASK_WRITER_H
 #define CCASK_WRITER_H
 
+#include "stdbool.h"
+#include "stdint.h"
+
+#include "ccask/core.h"
 #include "ccask/records.h"
+#include "ccask/completion.h"
 #include "ccask/status.h"
 
-ccask_status_e ccask_writer_start(size_t capacity);
+#define WRITER_BATCH_MAX_RECORDS 1024 // IOV_MAX, every record is written as one iovec
+#define WRITER_BATCH_MAX_FRAMED_RECORDS (WRITER_BATCH_MAX_RECORDS - 1) // a write batch's header takes one iovec
+#define WRITER_BATCH_MAX_BYTES (1 << 20)
+#define WRITER_DEFAULT_SYNC_INTERVAL_MS 100
+
+/**
+ * Starts one writer thread per active datafile (see `ccask_files_init`), each with its own queue.
+ * @param capacity Most records queued at once, split evenly over the writers
+ * @param max_bytes Most serialized bytes queued at once, split evenly over the writers (0 picks the default)
+ * @param coalesce Write only the last record of each key in a batch
+ */
+ccask_status_e ccask_writer_start(size_t capacity, size_t max_bytes, ccask_durability_e durability, size_t sync_interval_ms, bool coalesce);
 void ccask_writer_stop(void);
+
+/**
+ * Queues a put for the writer its key belongs to, see `ccask_writer_ringbuf_push`.
+ */
+ccask_status_e ccask_writer_enqueue(uint64_t timestamp, void *key, uint32_t key_size, void *value, uint32_t value_size, int timeout_ms, const ccask_write_completion_t *completion);
+
+/**
+ * Waits until the writers have appended every record queued before the call, then makes them durable.
+ */
+ccask_status_e ccask_writer_flush(void);
 ccask_status_e ccask_write_record_blocking(ccask_datafile_record_t record);
 
+/**
+ * Sums up the queues of all writers. `coalesced` counts records skipped since startup because a later
+ * record of their key was in the same batch.
+ */
+void ccask_writer_get_queue_stats(ccask_writer_queue_stats_t *stats);
+
+/**
+ * Appends the records to the shard's active datafile with as few `pwritev` calls as possible (one, unless
+ * the file has to be rotated in between), then applies their keydir updates as one batch.
+ * @param shard Writer shard the records' keys belong to
+ * @param results NULL, or filled in with each record's status and location (not `ctx`)
+ */
+ccask_status_e ccask_write_records_blocking(size_t shard, ccask_datafile_record_t *records, size_t num_records, ccask_put_result_t *results);
+
+/**
+ * Appends a write batch, a header record (see `ccask_create_datafile_batch_header`) followed by the records,
+ * to one datafile with one `pwritev`, and applies the records to the keydir at once (see
+ * `ccask_keydir_apply_batch_atomic`). The keys may belong to several writer shards: the batch goes to the
+ * first one's active datafile, with the others' locked meanwhile.
+ * @return CCASK_OK if written, else CCASK_FAIL. Fails with CCASK_ERR_BATCH_TOO_LARGE past
+ *         WRITER_BATCH_MAX_FRAMED_RECORDS records
+ */
+ccask_status_e ccask_write_batch_blocking(ccask_datafile_record_t *records, size_t num_records);
+
+/**
+ * Sequence number the next appended record gets. Doesn't change while the locks of all active datafiles
+ * are held, records are stamped under their file's lock.
+ */
+uint64_t ccask_writer_next_seq(void);
+
 #endif
@@ -21,22 +21,68 @@
 
 #include "stddef.h"
 #include "stdbool.h"
+#include "ccask/core.h"
 #include "ccask/records.h"
+#include "ccask/completion.h"
 
-ccask_status_e ccask_writer_ringbuf_init(size_t capacity);
-void ccask_writer_ringbuf_start_shutdown(void);
-void ccask_writer_ringbuf_destroy(void);
+#define RINGBUF_DEFAULT_MAX_BYTES (64 << 20)
 
-size_t ccask_writer_ringbuf_count(void);
+// Opaque Forward-declaration
+typedef struct ccask_writer_ringbuf ccask_writer_ringbuf_t;
 
+/**
+ * @param capacity Most records queued at once
+ * @param max_bytes Most serialized bytes queued at once, 0 picks the default (64 MiB)
+ * @return The queue, or NULL on failure
+ */
+ccask_writer_ringbuf_t* ccask_writer_ringbuf_create(size_t capacity, size_t max_bytes);
+void ccask_writer_ringbuf_start_shutdown(ccask_writer_ringbuf_t *ringbuf);
+void ccask_writer_ringbuf_destroy(ccask_writer_ringbuf_t *ringbuf);
+
+size_t ccask_writer_ringbuf_count(ccask_writer_ringbuf_t *ringbuf);
+
+/**
+ * Number of records pushed so far (including ones still being published), records are popped in this order.
+ */
+size_t ccask_writer_ringbuf_pushed(ccask_writer_ringbuf_t *ringbuf);
+
+/**
+ * Adds the queue's load and counters to `stats`, so the queues of all writers can be summed up.
+ */
+void ccask_writer_ringbuf_add_stats(ccask_writer_ringbuf_t *ringbuf, ccask_writer_queue_stats_t *stats);
+
+/**
+ * Serializes the record and queues it for the writer.
+ * @param timeout_ms How long to wait for room in the queue: 0 fails fast (and may shed the record once the
+ *                   queue is nearly full), negative waits as long as it takes
+ * @param completion Where to report the write's outcome, NULL for nowhere
+ * @return CCASK_OK if queued, CCASK_RETRY if there was no room, else CCASK_FAIL
+ */
 ccask_status_e ccask_writer_ringbuf_push(
-    uint32_t timestamp,
+    ccask_writer_ringbuf_t *ringbuf,
+    uint64_t timestamp,
     void *key,
     uint32_t key_size,
     void *value,
-    uint32_t value_size
+    uint32_t value_size,
+    int timeout_ms,
+    const ccask_write_completion_t *completion
 );
 
-ccask_status_e ccask_writer_ringbuf_pop(ccask_datafile_record_t record);
+ccask_status_e ccask_writer_ringbuf_pop(ccask_writer_ringbuf_t *ringbuf, ccask_datafile_record_t record);
+
+/**
+ * Waits for a record, then also takes the ones published right after it, up to `max_records` records or
+ * `max_bytes` bytes (the first record is always taken).
+ * @param completions NULL, or filled in with each record's completion
+ * @return Number of records taken, 0 once shut down and drained
+ */
+size_t ccask_writer_ringbuf_pop_batch(
+    ccask_writer_ringbuf_t *ringbuf,
+    ccask_datafile_record_t *records,
+    ccask_write_completion_t *completions,
+    size_t max_records,
+    size_t max_bytes
+);
 
 #endif
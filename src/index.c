@@ -0,0 +1,490 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "ccask/index.h"
+
+#include "stdlib.h"
+#include "string.h"
+#include "pthread.h"
+#include "ccask/status.h"
+#include "ccask/log.h"
+
+#define INDEX_NODE_KEYS 64          // max keys per node
+#define INDEX_MAX_DEPTH 16          // 64^16 keys, never reached
+#define INDEX_BATCH_KEYS 256        // keys copied out per cursor refill
+#define INDEX_BATCH_BYTES (64 << 10)
+
+typedef struct index_key {
+    uint32_t size;
+    uint8_t bytes[];
+} index_key_t;
+
+// the key's first 8 bytes are kept next to its pointer, most comparisons are decided without loading the key
+typedef struct index_slot {
+    uint64_t prefix;
+    index_key_t *key;
+} index_slot_t;
+
+/**
+ * Leaves own their keys. Inner nodes own copies of their separators, so deleting a key from a leaf never
+ * leaves a dangling separator behind. Child `i` of an inner node holds keys in [keys[i-1], keys[i]).
+ */
+typedef struct index_node {
+    bool is_leaf;
+    uint32_t num_keys;
+    index_slot_t keys[INDEX_NODE_KEYS];
+    union {
+        struct index_node *children[INDEX_NODE_KEYS + 1];
+        struct {
+            struct index_node *prev;
+            struct index_node *next;
+        } leaf;
+    };
+} index_node_t;
+
+static pthread_rwlock_t index_lock;
+static index_node_t *root = NULL;
+static size_t num_nodes = 0;
+static size_t key_bytes = 0;
+
+int ccask_index_compare(const void *a, uint32_t a_size, const void *b, uint32_t b_size) {
+    int res = memcmp(a, b, a_size < b_size ? a_size : b_size);
+    if (res != 0) return res;
+    return (a_size > b_size) - (a_size < b_size);
+}
+
+// big-endian and zero-padded, so comparing prefixes agrees with comparing the keys whenever they differ
+static inline uint64_t key_prefix(const void *key, uint32_t key_size) {
+    uint8_t buf[8] = {0};
+    memcpy(buf, key, key_size < 8 ? key_size : 8);
+
+    uint64_t prefix = 0;
+    for (int i = 0; i < 8; i++) prefix = (prefix << 8) | buf[i];
+    return prefix;
+}
+
+static inline int compare_slot(const index_slot_t *slot, uint64_t prefix, const void *key, uint32_t key_size) {
+    if (slot->prefix != prefix) return slot->prefix < prefix ? -1 : 1;
+    return ccask_index_compare(slot->key->bytes, slot->key->size, key, key_size);
+}
+
+static inline index_slot_t make_slot(index_key_t *key) {
+    return (index_slot_t){ key_prefix(key->bytes, key->size), key };
+}
+
+static index_key_t* copy_key(const void *key, uint32_t key_size) {
+    index_key_t *copy = malloc(sizeof(index_key_t) + key_size);
+    if (!copy) return NULL;
+
+    copy->size = key_size;
+    memcpy(copy->bytes, key, key_size);
+    key_bytes += sizeof(index_key_t) + key_size;
+    return copy;
+}
+
+static void free_key(index_key_t *key) {
+    key_bytes -= sizeof(index_key_t) + key->size;
+    free(key);
+}
+
+static index_node_t* allocate_node(bool is_leaf) {
+    index_node_t *node = calloc(1, sizeof(index_node_t));
+    if (!node) return NULL;
+
+    node->is_leaf = is_leaf;
+    num_nodes++;
+    return node;
+}
+
+static void free_node(index_node_t *node) {
+    num_nodes--;
+    free(node);
+}
+
+static void free_subtree(index_node_t *node) {
+    for (uint32_t i = 0; i < node->num_keys; i++) {
+        free_key(node->keys[i].key);
+    }
+
+    if (!node->is_leaf) {
+        for (uint32_t i = 0; i <= node->num_keys; i++) {
+            free_subtree(node->children[i]);
+        }
+    }
+    free_node(node);
+}
+
+// index of the first key >= the given one
+static uint32_t lower_bound(const index_node_t *node, uint64_t prefix, const void *key, uint32_t key_size) {
+    uint32_t lo = 0, hi = node->num_keys;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (compare_slot(&node->keys[mid], prefix, key, key_size) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// index of the child whose range covers the key
+static uint32_t child_index(const index_node_t *node, uint64_t prefix, const void *key, uint32_t key_size) {
+    uint32_t lo = 0, hi = node->num_keys;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (compare_slot(&node->keys[mid], prefix, key, key_size) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// inserts the key and child to its right at `pos`, the node must have room
+static void inner_insert_at(index_node_t *node, uint32_t pos, index_key_t *key, index_node_t *right) {
+    memmove(&node->keys[pos + 1], &node->keys[pos], (node->num_keys - pos) * sizeof(index_slot_t));
+    memmove(&node->children[pos + 2], &node->children[pos + 1], (node->num_keys - pos) * sizeof(index_node_t*));
+    node->keys[pos] = make_slot(key);
+    node->children[pos + 1] = right;
+    node->num_keys++;
+}
+
+ccask_status_e ccask_index_insert(const void *key, uint32_t key_size) {
+    pthread_rwlock_wrlock(&index_lock);
+
+    uint64_t prefix = key_prefix(key, key_size);
+    index_node_t *path[INDEX_MAX_DEPTH];
+    uint32_t path_pos[INDEX_MAX_DEPTH];
+    size_t depth = 0;
+
+    index_node_t *node = root;
+    while (!node->is_leaf) {
+        uint32_t i = child_index(node, prefix, key, key_size);
+        path[depth] = node;
+        path_pos[depth] = i;
+        depth++;
+        node = node->children[i];
+    }
+
+    uint32_t pos = lower_bound(node, prefix, key, key_size);
+    if (pos < node->num_keys && compare_slot(&node->keys[pos], prefix, key, key_size) == 0) {
+        pthread_rwlock_unlock(&index_lock);
+        return CCASK_OK;
+    }
+
+    // allocate everything the insert needs first, so running out of memory leaves the tree untouched
+    size_t num_splits = 0;
+    bool grows = false;
+    if (node->num_keys == INDEX_NODE_KEYS) {
+        num_splits = 1;
+        while (num_splits <= depth && path[depth - num_splits]->num_keys == INDEX_NODE_KEYS) num_splits++;
+        grows = num_splits == depth + 1;
+    }
+
+    index_node_t *spare[INDEX_MAX_DEPTH + 1];
+    size_t num_spare = 0;
+    index_key_t *separator = NULL;
+
+    index_key_t *new_key = copy_key(key, key_size);
+    if (!new_key) goto nomem;
+
+    for (; num_spare < num_splits + grows; num_spare++) {
+        spare[num_spare] = allocate_node(num_spare == 0);
+        if (!spare[num_spare]) goto nomem;
+    }
+
+    if (num_splits == 0) {
+        memmove(&node->keys[pos + 1], &node->keys[pos], (node->num_keys - pos) * sizeof(index_slot_t));
+        node->keys[pos] = make_slot(new_key);
+        node->num_keys++;
+        pthread_rwlock_unlock(&index_lock);
+        return CCASK_OK;
+    }
+
+    // the leaf splits, its upper half moves into a new right sibling
+    uint32_t half = INDEX_NODE_KEYS / 2;
+    bool goes_right = pos >= half;
+    index_key_t *first_right = pos == half ? new_key : node->keys[half].key;
+
+    // separators are copies, the keys in the leaves may be deleted independently
+    separator = copy_key(first_right->bytes, first_right->size);
+    if (!separator) goto nomem;
+
+    size_t next_spare = 0;
+    index_node_t *right = spare[next_spare++];
+
+    right->num_keys = INDEX_NODE_KEYS - half;
+    memcpy(right->keys, &node->keys[half], right->num_keys * sizeof(index_slot_t));
+    node->num_keys = half;
+
+    right->leaf.prev = node;
+    right->leaf.next = node->leaf.next;
+    if (node->leaf.next) node->leaf.next->leaf.prev = right;
+    node->leaf.next = right;
+
+    index_node_t *target = goes_right ? right : node;
+    if (goes_right) pos -= half;
+    memmove(&target->keys[pos + 1], &target->keys[pos], (target->num_keys - pos) * sizeof(index_slot_t));
+    target->keys[pos] = make_slot(new_key);
+    target->num_keys++;
+
+    while (true) {
+        if (depth == 0) {
+            index_node_t *new_root = spare[next_spare++];
+            new_root->num_keys = 1;
+            new_root->keys[0] = make_slot(separator);
+            new_root->children[0] = root;
+            new_root->children[1] = right;
+            root = new_root;
+            break;
+        }
+
+        depth--;
+        index_node_t *parent = path[depth];
+        uint32_t at = path_pos[depth];
+
+        if (parent->num_keys < INDEX_NODE_KEYS) {
+            inner_insert_at(parent, at, separator, right);
+            break;
+        }
+
+        // the inner node splits too, its middle key moves up
+        index_node_t *sibling = spare[next_spare++];
+        uint32_t mid = INDEX_NODE_KEYS / 2;
+        index_key_t *up = parent->keys[mid].key;
+
+        sibling->num_keys = INDEX_NODE_KEYS - mid - 1;
+        memcpy(sibling->keys, &parent->keys[mid + 1], sibling->num_keys * sizeof(index_slot_t));
+        memcpy(sibling->children, &parent->children[mid + 1], (sibling->num_keys + 1) * sizeof(index_node_t*));
+        parent->num_keys = mid;
+
+        if (at <= mid) inner_insert_at(parent, at, separator, right);
+        else inner_insert_at(sibling, at - mid - 1, separator, right);
+
+        separator = up;
+        right = sibling;
+    }
+
+    pthread_rwlock_unlock(&index_lock);
+    return CCASK_OK;
+
+nomem:
+    for (size_t i = 0; i < num_spare; i++) free_node(spare[i]);
+    if (new_key) free_key(new_key);
+    pthread_rwlock_unlock(&index_lock);
+    ccask_errno = CCASK_ERR_NO_MEMORY;
+    return CCASK_RETRY;
+}
+
+/**
+ * Removes the key from the subtree. Nodes aren't merged when they become sparse, only empty ones are
+ * unlinked, which keeps deletes cheap and the tree valid at the cost of some slack after mass deletes.
+ * @return true if the node is now empty and must be unlinked by its parent
+ */
+static bool node_remove(index_node_t *node, uint64_t prefix, const void *key, uint32_t key_size) {
+    if (node->is_leaf) {
+        uint32_t pos = lower_bound(node, prefix, key, key_size);
+        if (pos == node->num_keys || compare_slot(&node->keys[pos], prefix, key, key_size) != 0) return false;
+
+        free_key(node->keys[pos].key);
+        memmove(&node->keys[pos], &node->keys[pos + 1], (node->num_keys - pos - 1) * sizeof(index_slot_t));
+        node->num_keys--;
+
+        if (node->num_keys > 0) return false;
+        if (node->leaf.prev) node->leaf.prev->leaf.next = node->leaf.next;
+        if (node->leaf.next) node->leaf.next->leaf.prev = node->leaf.prev;
+        return true;
+    }
+
+    uint32_t i = child_index(node, prefix, key, key_size);
+    if (!node_remove(node->children[i], prefix, key, key_size)) return false;
+    free_node(node->children[i]);
+
+    if (node->num_keys == 0) return true; // that was the only child
+
+    // drop the separator on the emptied child's side
+    uint32_t sep = i > 0 ? i - 1 : 0;
+    free_key(node->keys[sep].key);
+    memmove(&node->keys[sep], &node->keys[sep + 1], (node->num_keys - sep - 1) * sizeof(index_slot_t));
+    memmove(&node->children[i], &node->children[i + 1], (node->num_keys - i) * sizeof(index_node_t*));
+    node->num_keys--;
+    return false;
+}
+
+void ccask_index_remove(const void *key, uint32_t key_size) {
+    pthread_rwlock_wrlock(&index_lock);
+
+    if (node_remove(root, key_prefix(key, key_size), key, key_size)) {
+        if (root->is_leaf) {
+            // the root leaf is kept even when empty
+            root->leaf.prev = root->leaf.next = NULL;
+        } else {
+            free_node(root);
+            root = allocate_node(true);
+            if (!root) log_fatal("Couldn't allocate an empty index root");
+        }
+    }
+
+    // an inner root with a single child is a wasted level
+    while (!root->is_leaf && root->num_keys == 0) {
+        index_node_t *child = root->children[0];
+        free_node(root);
+        root = child;
+    }
+
+    pthread_rwlock_unlock(&index_lock);
+}
+
+size_t ccask_index_bytes(void) {
+    pthread_rwlock_rdlock(&index_lock);
+    size_t bytes = num_nodes * sizeof(index_node_t) + key_bytes;
+    pthread_rwlock_unlock(&index_lock);
+    return bytes;
+}
+
+ccask_status_e ccask_index_init(void) {
+    num_nodes = 0;
+    key_bytes = 0;
+
+    root = allocate_node(true);
+    if (!root) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_RETRY;
+    }
+
+    pthread_rwlock_init(&index_lock, NULL);
+    return CCASK_OK;
+}
+
+void ccask_index_shutdown(void) {
+    pthread_rwlock_wrlock(&index_lock);
+    free_subtree(root);
+    root = NULL;
+    pthread_rwlock_unlock(&index_lock);
+    pthread_rwlock_destroy(&index_lock);
+}
+
+static bool cursor_set_last(ccask_index_cursor_t *cursor, const void *key, uint32_t key_size) {
+    if (key_size > cursor->last_key_capacity) {
+        uint8_t *buf = realloc(cursor->last_key, key_size);
+        if (!buf) return false;
+        cursor->last_key = buf;
+        cursor->last_key_capacity = key_size;
+    }
+
+    memcpy(cursor->last_key, key, key_size);
+    cursor->last_key_size = key_size;
+    return true;
+}
+
+// copies the next batch of keys after the resume position
+static ccask_status_e cursor_fill(ccask_index_cursor_t *cursor) {
+    cursor->batch_size = 0;
+    cursor->batch_pos = 0;
+
+    // no resume position yet starts at the empty key, which sorts first
+    const void *from = cursor->last_key ? (const void*)cursor->last_key : "";
+    uint64_t prefix = key_prefix(from, cursor->last_key_size);
+
+    pthread_rwlock_rdlock(&index_lock);
+
+    index_node_t *node = root;
+    while (!node->is_leaf) {
+        node = node->children[child_index(node, prefix, from, cursor->last_key_size)];
+    }
+
+    uint32_t pos = lower_bound(node, prefix, from, cursor->last_key_size);
+    if (!cursor->inclusive && pos < node->num_keys &&
+        compare_slot(&node->keys[pos], prefix, from, cursor->last_key_size) == 0) {
+        pos++;
+    }
+
+    size_t num_keys = 0;
+    while (node && num_keys < INDEX_BATCH_KEYS && cursor->batch_size < INDEX_BATCH_BYTES) {
+        if (pos == node->num_keys) {
+            node = node->leaf.next;
+            pos = 0;
+            continue;
+        }
+
+        index_key_t *key = node->keys[pos++].key;
+        size_t needed = cursor->batch_size + sizeof(uint32_t) + key->size;
+        if (needed > cursor->batch_capacity) {
+            size_t capacity = cursor->batch_capacity ? cursor->batch_capacity : 4096;
+            while (capacity < needed) capacity *= 2;
+
+            uint8_t *batch = realloc(cursor->batch, capacity);
+            if (!batch) {
+                pthread_rwlock_unlock(&index_lock);
+                ccask_errno = CCASK_ERR_NO_MEMORY;
+                return CCASK_FAIL;
+            }
+            cursor->batch = batch;
+            cursor->batch_capacity = capacity;
+        }
+
+        memcpy(cursor->batch + cursor->batch_size, &key->size, sizeof(uint32_t));
+        memcpy(cursor->batch + cursor->batch_size + sizeof(uint32_t), key->bytes, key->size);
+        cursor->batch_size = needed;
+        num_keys++;
+    }
+
+    pthread_rwlock_unlock(&index_lock);
+
+    if (!node) cursor->exhausted = true;
+    return CCASK_OK;
+}
+
+ccask_status_e ccask_index_cursor_open(ccask_index_cursor_t *cursor, const void *start, uint32_t start_size) {
+    memset(cursor, 0, sizeof(ccask_index_cursor_t));
+    cursor->inclusive = true;
+
+    if (start && !cursor_set_last(cursor, start, start_size)) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_FAIL;
+    }
+    return CCASK_OK;
+}
+
+ccask_status_e ccask_index_cursor_next(ccask_index_cursor_t *cursor, void **key, uint32_t *key_size) {
+    if (cursor->batch_pos == cursor->batch_size) {
+        if (cursor->exhausted || cursor_fill(cursor) != CCASK_OK || cursor->batch_size == 0) {
+            if (cursor->exhausted) ccask_errno = CCASK_ERR_ITER_END;
+            return CCASK_FAIL;
+        }
+    }
+
+    uint32_t size;
+    memcpy(&size, cursor->batch + cursor->batch_pos, sizeof(uint32_t));
+    *key = cursor->batch + cursor->batch_pos + sizeof(uint32_t);
+    *key_size = size;
+    cursor->batch_pos += sizeof(uint32_t) + size;
+
+    // the batch buffer is reused by the next refill, so the resume position needs its own copy
+    if (cursor->batch_pos == cursor->batch_size && !cursor->exhausted) {
+        if (!cursor_set_last(cursor, *key, size)) {
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return CCASK_FAIL;
+        }
+        cursor->inclusive = false;
+    }
+    return CCASK_OK;
+}
+
+void ccask_index_cursor_close(ccask_index_cursor_t *cursor) {
+    free(cursor->batch);
+    free(cursor->last_key);
+    memset(cursor, 0, sizeof(ccask_index_cursor_t));
+}
@@ -0,0 +1,125 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "ccask/io.h"
+
+#include "unistd.h"
+#include "errno.h"
+#include "string.h"
+#include "ccask/utils.h"
+#include "ccask/log.h"
+
+static const ccask_io_backend_ops_t *io = &ccask_io_sync_backend;
+
+ccask_status_e ccask_io_init(ccask_io_backend_e backend, bool sqpoll) {
+    io = &ccask_io_sync_backend;
+    if (backend != CCASK_IO_URING) return CCASK_OK;
+
+#ifdef CCASK_ENABLE_IO_URING
+    if (ccask_io_uring_backend.init(sqpoll) == CCASK_OK) {
+        io = &ccask_io_uring_backend;
+        log_info("Using io_uring I/O backend%s", sqpoll ? " (SQPOLL)" : "");
+        return CCASK_OK;
+    }
+    log_warn("io_uring unavailable, falling back to synchronous I/O");
+#else
+    (void)sqpoll;
+    log_warn("Built without io_uring support, falling back to synchronous I/O");
+#endif
+    return CCASK_OK;
+}
+
+void ccask_io_shutdown(void) {
+    const ccask_io_backend_ops_t *old = io;
+    io = &ccask_io_sync_backend;
+    old->shutdown();
+}
+
+const char* ccask_io_backend_name(void) {
+    return io->name;
+}
+
+ccask_status_e ccask_io_preadv(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+    return io->preadv(fd, iov, iovcnt, offset);
+}
+
+ccask_status_e ccask_io_pread(int fd, void *buf, size_t len, off_t offset) {
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    return io->preadv(fd, &iov, 1, offset);
+}
+
+void ccask_io_preadv_batch(ccask_io_read_t *reads, size_t count) {
+    io->preadv_batch(reads, count);
+}
+
+ccask_status_e ccask_io_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset, bool *synced) {
+    return io->pwritev(fd, iov, iovcnt, offset, synced);
+}
+
+void ccask_io_register_file(int fd) {
+    io->register_file(fd);
+}
+
+void ccask_io_unregister_file(int fd) {
+    io->unregister_file(fd);
+}
+
+// Synchronous backend: plain preadv/pwritev/fdatasync on the calling thread
+
+static ccask_status_e sync_init(bool sqpoll) {
+    (void)sqpoll;
+    return CCASK_OK;
+}
+
+static void sync_shutdown(void) {}
+
+static ccask_status_e sync_preadv(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+    return safe_preadv(fd, iov, iovcnt, offset);
+}
+
+static void sync_preadv_batch(ccask_io_read_t *reads, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        reads[i].status = safe_preadv(reads[i].fd, reads[i].iov, reads[i].iovcnt, reads[i].offset);
+    }
+}
+
+static ccask_status_e sync_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset, bool *synced) {
+    if (safe_pwritev(fd, iov, iovcnt, offset) != CCASK_OK) return CCASK_FAIL;
+
+    if (synced && *synced && fdatasync(fd) != 0) {
+        log_error("fdatasync failed\n\t%s", strerror(errno));
+        *synced = false;
+    }
+    return CCASK_OK;
+}
+
+static void sync_register_file(int fd) {
+    (void)fd;
+}
+
+const ccask_io_backend_ops_t ccask_io_sync_backend = {
+    .name = "sync",
+    .init = sync_init,
+    .shutdown = sync_shutdown,
+    .preadv = sync_preadv,
+    .preadv_batch = sync_preadv_batch,
+    .pwritev = sync_pwritev,
+    .register_file = sync_register_file,
+    .unregister_file = sync_register_file,
+};
@@ -0,0 +1,609 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "ccask/io.h"
+
+#ifdef CCASK_ENABLE_IO_URING
+
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "stdint.h"
+#include "sys/mman.h"
+#include "sys/syscall.h"
+#include "linux/io_uring.h"
+#include "ccask/files.h"
+#include "ccask/utils.h"
+#include "ccask/log.h"
+
+#define URING_MIN_RINGS 4
+#define URING_MAX_RINGS 64
+#define URING_ENTRIES 64                    // per ring, also the most reads of a batch submitted at once
+#define URING_BUFFER_SIZE (64 << 10)        // registered per ring, writes up to this size are copied through it
+#define URING_READ_SLOT_SIZE 4096           // reads up to this size each get a slice of the registered buffer
+#define URING_FIXED_FILES (4 * FILES_MAX_ACTIVE)
+#define URING_SQPOLL_IDLE_MS 50
+#define URING_CQ_SPINS 4096                 // polls of the completion queue before sleeping in the kernel (SQPOLL)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+/**
+ * Calls are synchronous, so instead of a ring per thread there is a small pool of rings, each used by one
+ * thread at a time. A thread sticks to one ring and only moves on when it's busy.
+ */
+typedef struct uring {
+    pthread_mutex_t lock;
+    int fd;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    uint8_t *buffer;                        // registered, NULL if registering failed
+    bool has_fixed_files;
+    uint64_t files_generation;              // of the fixed-file table last copied in
+    int fixed_fds[URING_FIXED_FILES];
+    uint64_t fixed_serials[URING_FIXED_FILES];
+} uring_t;
+
+static uring_t *rings = NULL;
+static size_t num_rings = 0;
+static bool sqpoll = false;
+static int cq_spins = 0;    // only worth it when the polling thread has a CPU of its own
+
+// fds registered through ccask_io_register_file, copied into a ring the next time it's used
+static pthread_mutex_t fixed_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fixed_fds[URING_FIXED_FILES];
+static uint64_t fixed_serials[URING_FIXED_FILES];    // a closed fd's number comes back, so slots are told apart by registration
+static _Atomic uint64_t fixed_generation = 0;
+
+static _Atomic size_t next_home_ring = 0;
+static _Thread_local size_t home_ring = SIZE_MAX;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static size_t iov_total(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    return total;
+}
+
+static void iov_scatter(struct iovec *iov, int iovcnt, const uint8_t *src, size_t len) {
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        size_t n = iov[i].iov_len < len ? iov[i].iov_len : len;
+        memcpy(iov[i].iov_base, src, n);
+        src += n;
+        len -= n;
+    }
+}
+
+static void iov_gather(uint8_t *dst, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+}
+
+// copies what's left of `iov` after `skip` bytes into `rest`, returns the number of iovecs in it
+static int iov_skip(const struct iovec *iov, int iovcnt, size_t skip, struct iovec *rest) {
+    int n = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        rest[n].iov_base = (uint8_t*)iov[i].iov_base + skip;
+        rest[n].iov_len = iov[i].iov_len - skip;
+        skip = 0;
+        n++;
+    }
+    return n;
+}
+
+static void ring_close(uring_t *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_len);
+    // closing the ring drops its registered files and buffer
+    if (r->fd >= 0) close(r->fd);
+    free(r->buffer);
+    pthread_mutex_destroy(&r->lock);
+}
+
+static ccask_status_e ring_open(uring_t *r, int attach_to) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    pthread_mutex_init(&r->lock, NULL);
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = URING_SQPOLL_IDLE_MS;
+        // every ring shares the first one's polling thread
+        if (attach_to >= 0) {
+            params.flags |= IORING_SETUP_ATTACH_WQ;
+            params.wq_fd = attach_to;
+        }
+    }
+
+    r->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (r->fd < 0) {
+        log_error("io_uring_setup failed\n\t%s", strerror(errno));
+        goto fail;
+    }
+
+    // older kernels only poll requests on registered files
+    if (sqpoll && !(params.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+        log_error("Kernel can't poll io_uring submissions on unregistered files");
+        goto fail;
+    }
+
+    r->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto fail;
+    }
+
+    if (single_mmap) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+
+    r->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    uint8_t *sq = r->sq_ptr;
+    uint8_t *cq = r->cq_ptr;
+    r->sq_head = (unsigned*)(sq + params.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    r->sq_flags = (unsigned*)(sq + params.sq_off.flags);
+    r->sq_array = (unsigned*)(sq + params.sq_off.array);
+    r->cq_head = (unsigned*)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // both registrations are optimizations, plain buffers and fds work without them
+    void *buffer;
+    if (posix_memalign(&buffer, 4096, URING_BUFFER_SIZE) == 0) {
+        struct iovec iov = { .iov_base = buffer, .iov_len = URING_BUFFER_SIZE };
+        if (sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+            r->buffer = buffer;
+        } else {
+            log_warn("Couldn't register io_uring buffer\n\t%s", strerror(errno));
+            free(buffer);
+        }
+    }
+
+    for (size_t i = 0; i < URING_FIXED_FILES; i++) r->fixed_fds[i] = -1;
+    r->has_fixed_files = sys_io_uring_register(r->fd, IORING_REGISTER_FILES, r->fixed_fds, URING_FIXED_FILES) == 0;
+    if (!r->has_fixed_files) log_warn("Couldn't register io_uring files\n\t%s", strerror(errno));
+    r->files_generation = 0;
+
+    return CCASK_OK;
+
+fail:
+    ring_close(r);
+    return CCASK_FAIL;
+}
+
+// brings the ring's registered files up to date with the table, the ring's lock must be held
+static void ring_sync_files(uring_t *r) {
+    if (!r->has_fixed_files) return;
+    if (atomic_load_explicit(&fixed_generation, memory_order_acquire) == r->files_generation) return;
+
+    pthread_mutex_lock(&fixed_lock);
+    for (int i = 0; i < URING_FIXED_FILES; i++) {
+        if (r->fixed_serials[i] == fixed_serials[i]) continue;
+
+        struct io_uring_files_update update = {
+            .offset = (uint32_t)i,
+            .fds = (uint64_t)(uintptr_t)&fixed_fds[i],
+        };
+        if (sys_io_uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+            // the ring must not write through stale slots, so it stops using them altogether
+            log_error("Couldn't update io_uring registered files\n\t%s", strerror(errno));
+            sys_io_uring_register(r->fd, IORING_UNREGISTER_FILES, NULL, 0);
+            r->has_fixed_files = false;
+            break;
+        }
+        r->fixed_fds[i] = fixed_fds[i];
+        r->fixed_serials[i] = fixed_serials[i];
+    }
+    r->files_generation = atomic_load_explicit(&fixed_generation, memory_order_relaxed);
+    pthread_mutex_unlock(&fixed_lock);
+}
+
+static int ring_fixed_slot(uring_t *r, int fd) {
+    if (!r->has_fixed_files) return -1;
+    for (int i = 0; i < URING_FIXED_FILES; i++) {
+        if (r->fixed_fds[i] == fd) return i;
+    }
+    return -1;
+}
+
+static uring_t* ring_acquire(void) {
+    if (home_ring == SIZE_MAX) home_ring = atomic_fetch_add_explicit(&next_home_ring, 1, memory_order_relaxed);
+
+    size_t home = home_ring % num_rings;
+    for (size_t i = 0; i < num_rings; i++) {
+        uring_t *r = &rings[(home + i) % num_rings];
+        if (pthread_mutex_trylock(&r->lock) == 0) {
+            home_ring = (home + i) % num_rings;
+            return r;
+        }
+    }
+
+    pthread_mutex_lock(&rings[home].lock);
+    return &rings[home];
+}
+
+static void ring_release(uring_t *r) {
+    pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * Next free submission entry. Every request is waited for before the lock is released, so the queue is
+ * empty when a caller gets the ring and it may take up to URING_ENTRIES of them.
+ */
+static struct io_uring_sqe* ring_prep(uring_t *r, unsigned nth, uint8_t opcode, int fd, off_t offset) {
+    unsigned tail = __atomic_load_n(r->sq_tail, __ATOMIC_RELAXED) + nth;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = nth;
+    r->sq_array[index] = index;
+    return sqe;
+}
+
+/**
+ * Submits the `count` prepared entries and waits for all of them, `results` gets each one's result.
+ * Fails only if nothing was submitted.
+ */
+static ccask_status_e ring_submit_and_wait(uring_t *r, unsigned count, int *results) {
+    unsigned tail = __atomic_load_n(r->sq_tail, __ATOMIC_RELAXED);
+    __atomic_store_n(r->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+    unsigned to_submit = count;
+    unsigned done = 0;
+    while (done < count) {
+        int res = 0;
+        if (sqpoll) {
+            // the polling thread sleeps when idle and has to be woken
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+                res = sys_io_uring_enter(r->fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+            }
+
+            bool ready = false;
+            for (int i = 0; i < cq_spins && !ready; i++) {
+                ready = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) != *r->cq_head;
+                if (!ready) cpu_relax();
+            }
+            if (!ready && res >= 0) res = sys_io_uring_enter(r->fd, 0, count - done, IORING_ENTER_GETEVENTS);
+        } else {
+            res = sys_io_uring_enter(r->fd, to_submit, count - done, IORING_ENTER_GETEVENTS);
+            if (res > 0) to_submit -= (unsigned)res < to_submit ? (unsigned)res : to_submit;
+        }
+
+        if (res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            if (!sqpoll && to_submit == count) {
+                // the kernel hasn't seen the entries, take them back
+                __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+                log_error("io_uring_enter failed\n\t%s", strerror(errno));
+                return CCASK_FAIL;
+            }
+            // requests already in flight still use the caller's buffers, so keep waiting for them
+            log_error("io_uring_enter failed with requests in flight, retrying\n\t%s", strerror(errno));
+        }
+
+        unsigned head = __atomic_load_n(r->cq_head, __ATOMIC_RELAXED);
+        unsigned cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != cq_tail) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return CCASK_OK;
+}
+
+// completes a read from the result of its request: errors are reported, short reads are finished synchronously
+static ccask_status_e finish_preadv(int fd, struct iovec *iov, int iovcnt, off_t offset, int res) {
+    if (res == -EINTR || res == -EAGAIN) return safe_preadv(fd, iov, iovcnt, offset);
+    if (res < 0) {
+        errno = -res;
+        ccask_errno = CCASK_ERR_READ_FAILED;
+        return CCASK_FAIL;
+    }
+
+    if ((size_t)res == iov_total(iov, iovcnt)) return CCASK_OK;
+
+    struct iovec rest[iovcnt];
+    int n = iov_skip(iov, iovcnt, (size_t)res, rest);
+    return safe_preadv(fd, rest, n, offset + res);
+}
+
+static ccask_status_e finish_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset, int res) {
+    if (res == -EINTR || res == -EAGAIN) return safe_pwritev(fd, iov, iovcnt, offset);
+    if (res < 0) {
+        errno = -res;
+        ccask_errno = CCASK_ERR_WRITE_FAILED;
+        return CCASK_FAIL;
+    }
+
+    if ((size_t)res == iov_total(iov, iovcnt)) return CCASK_OK;
+
+    struct iovec rest[iovcnt];
+    int n = iov_skip(iov, iovcnt, (size_t)res, rest);
+    return safe_pwritev(fd, rest, n, offset + res);
+}
+
+static void prep_read(uring_t *r, unsigned nth, ccask_io_read_t *read, size_t size, uint8_t *slot) {
+    if (slot) {
+        struct io_uring_sqe *sqe = ring_prep(r, nth, IORING_OP_READ_FIXED, read->fd, read->offset);
+        sqe->addr = (uint64_t)(uintptr_t)slot;
+        sqe->len = (uint32_t)size;
+        sqe->buf_index = 0;
+    } else {
+        struct io_uring_sqe *sqe = ring_prep(r, nth, IORING_OP_READV, read->fd, read->offset);
+        sqe->addr = (uint64_t)(uintptr_t)read->iov;
+        sqe->len = (uint32_t)read->iovcnt;
+    }
+}
+
+static void uring_preadv_batch(ccask_io_read_t *reads, size_t count) {
+    uring_t *r = ring_acquire();
+
+    while (count > 0) {
+        unsigned n = count < URING_ENTRIES ? (unsigned)count : URING_ENTRIES;
+        uint8_t *slots[URING_ENTRIES];
+        int results[URING_ENTRIES];
+
+        // small reads go through slices of the registered buffer, so their pages needn't be pinned each time
+        size_t next_slot = 0;
+        for (unsigned i = 0; i < n; i++) {
+            size_t size = iov_total(reads[i].iov, reads[i].iovcnt);
+            slots[i] = NULL;
+            if (r->buffer && size <= URING_READ_SLOT_SIZE && (next_slot + 1) * URING_READ_SLOT_SIZE <= URING_BUFFER_SIZE) {
+                slots[i] = r->buffer + next_slot * URING_READ_SLOT_SIZE;
+                next_slot++;
+            }
+            prep_read(r, i, &reads[i], size, slots[i]);
+        }
+
+        if (ring_submit_and_wait(r, n, results) != CCASK_OK) {
+            for (unsigned i = 0; i < n; i++) {
+                reads[i].status = safe_preadv(reads[i].fd, reads[i].iov, reads[i].iovcnt, reads[i].offset);
+            }
+        } else {
+            for (unsigned i = 0; i < n; i++) {
+                if (slots[i] && results[i] > 0) iov_scatter(reads[i].iov, reads[i].iovcnt, slots[i], (size_t)results[i]);
+                reads[i].status = finish_preadv(reads[i].fd, reads[i].iov, reads[i].iovcnt, reads[i].offset, results[i]);
+            }
+        }
+
+        reads += n;
+        count -= n;
+    }
+
+    ring_release(r);
+}
+
+static ccask_status_e uring_preadv(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+    ccask_io_read_t read = { .fd = fd, .iov = iov, .iovcnt = iovcnt, .offset = offset };
+    uring_preadv_batch(&read, 1);
+    return read.status;
+}
+
+static ccask_status_e uring_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset, bool *synced) {
+    bool sync = synced && *synced;
+    size_t size = iov_total(iov, iovcnt);
+    uring_t *r = ring_acquire();
+    ring_sync_files(r);
+
+    // active datafiles are registered, which saves looking up the file on every request
+    int target = fd;
+    uint8_t flags = 0;
+    int slot = ring_fixed_slot(r, fd);
+    if (slot >= 0) {
+        target = slot;
+        flags |= IOSQE_FIXED_FILE;
+    }
+
+    struct io_uring_sqe *sqe;
+    bool use_buffer = r->buffer && size <= URING_BUFFER_SIZE;
+    if (use_buffer) {
+        iov_gather(r->buffer, iov, iovcnt);
+        sqe = ring_prep(r, 0, IORING_OP_WRITE_FIXED, target, offset);
+        sqe->addr = (uint64_t)(uintptr_t)r->buffer;
+        sqe->len = (uint32_t)size;
+        sqe->buf_index = 0;
+    } else {
+        sqe = ring_prep(r, 0, IORING_OP_WRITEV, target, offset);
+        sqe->addr = (uint64_t)(uintptr_t)iov;
+        sqe->len = (uint32_t)iovcnt;
+    }
+    sqe->flags = flags;
+
+    // the sync is linked behind the write, so both go in with one submission (and it's cancelled if the write comes up short)
+    if (sync) {
+        sqe->flags |= IOSQE_IO_LINK;
+        struct io_uring_sqe *fsync_sqe = ring_prep(r, 1, IORING_OP_FSYNC, target, 0);
+        fsync_sqe->flags = flags;
+        fsync_sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+
+    int results[2] = { 0, 0 };
+    ccask_status_e submitted = ring_submit_and_wait(r, sync ? 2 : 1, results);
+    ring_release(r);
+
+    if (submitted != CCASK_OK) return ccask_io_sync_backend.pwritev(fd, iov, iovcnt, offset, synced);
+
+    bool complete = results[0] >= 0 && (size_t)results[0] == size;
+    if (finish_pwritev(fd, iov, iovcnt, offset, results[0]) != CCASK_OK) return CCASK_FAIL;
+    if (!sync) return CCASK_OK;
+
+    int sync_res = results[1];
+    if (!complete || sync_res == -ECANCELED || sync_res == -EINTR || sync_res == -EAGAIN) {
+        sync_res = fdatasync(fd) == 0 ? 0 : -errno;
+    }
+    if (sync_res < 0) {
+        log_error("fdatasync failed\n\t%s", strerror(-sync_res));
+        *synced = false;
+    }
+    return CCASK_OK;
+}
+
+static void uring_register_file(int fd) {
+    pthread_mutex_lock(&fixed_lock);
+    for (size_t i = 0; i < URING_FIXED_FILES; i++) {
+        if (fixed_fds[i] < 0) {
+            fixed_fds[i] = fd;
+            fixed_serials[i] = atomic_fetch_add_explicit(&fixed_generation, 1, memory_order_release) + 1;
+            break;
+        }
+    }
+    // with the table full, the fd is just used unregistered
+    pthread_mutex_unlock(&fixed_lock);
+}
+
+static void uring_unregister_file(int fd) {
+    pthread_mutex_lock(&fixed_lock);
+    for (size_t i = 0; i < URING_FIXED_FILES; i++) {
+        if (fixed_fds[i] == fd) {
+            fixed_fds[i] = -1;
+            fixed_serials[i] = atomic_fetch_add_explicit(&fixed_generation, 1, memory_order_release) + 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fixed_lock);
+}
+
+static void uring_shutdown(void) {
+    for (size_t i = 0; i < num_rings; i++) ring_close(&rings[i]);
+    free(rings);
+    rings = NULL;
+    num_rings = 0;
+}
+
+static ccask_status_e uring_init(bool use_sqpoll) {
+    sqpoll = use_sqpoll;
+
+    pthread_mutex_lock(&fixed_lock);
+    for (size_t i = 0; i < URING_FIXED_FILES; i++) {
+        fixed_fds[i] = -1;
+        fixed_serials[i] = 0;
+    }
+    atomic_store(&fixed_generation, 0);
+    pthread_mutex_unlock(&fixed_lock);
+
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    cq_spins = nprocs > 1 ? URING_CQ_SPINS : 0;
+    size_t count = nprocs > 0 ? 2 * (size_t)nprocs : URING_MIN_RINGS;
+    if (count < URING_MIN_RINGS) count = URING_MIN_RINGS;
+    if (count > URING_MAX_RINGS) count = URING_MAX_RINGS;
+
+    rings = calloc(count, sizeof(uring_t));
+    if (!rings) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_FAIL;
+    }
+
+    for (num_rings = 0; num_rings < count; num_rings++) {
+        int attach_to = num_rings > 0 ? rings[0].fd : -1;
+        if (ring_open(&rings[num_rings], attach_to) != CCASK_OK) break;
+    }
+
+    if (num_rings == 0) {
+        free(rings);
+        rings = NULL;
+        return CCASK_FAIL;
+    }
+    return CCASK_OK;
+}
+
+const ccask_io_backend_ops_t ccask_io_uring_backend = {
+    .name = "io_uring",
+    .init = uring_init,
+    .shutdown = uring_shutdown,
+    .preadv = uring_preadv,
+    .preadv_batch = uring_preadv_batch,
+    .pwritev = uring_pwritev,
+    .register_file = uring_register_file,
+    .unregister_file = uring_unregister_file,
+};
+
+#endif
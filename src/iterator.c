@@ -18,8 +18,10 @@
 
 #include "ccask/iterator.h"
 
+#include "string.h"
 #include "unistd.h"
 #include "ccask/files.h"
+#include "ccask/io.h"
 #include "ccask/status.h"
 #include "ccask/utils.h"
 
@@ -43,39 +45,29 @@ int ccask_datafile_iter_next(ccask_datafile_iter_t *iter, ccask_datafile_record_
 
     *record_pos = iter->offset;
 
-    record[0].iov_base = malloc(DATAFILE_RECORD_HEADER_SIZE);
-    if (!record[0].iov_base) {
-        ccask_errno = CCASK_ERR_NO_MEMORY;
-        return CCASK_FAIL;
-    }
-
-    int res = safe_pread(iter->fd, record[0].iov_base, DATAFILE_RECORD_HEADER_SIZE, iter->offset);
+    uint8_t header_buf[DATAFILE_RECORD_HEADER_SIZE];
+    int res = ccask_io_pread(iter->fd, header_buf, DATAFILE_RECORD_HEADER_SIZE, iter->offset);
     if (res != CCASK_OK) {
         if (ccask_errno == CCASK_ERR_UNEXPECTED_EOF) ccask_errno = CCASK_ERR_ITER_END;
         return CCASK_FAIL;
     }
 
-    ccask_datafile_record_header_t header = ccask_get_datafile_record_header(record);
-    record[1].iov_len = header.key_size;
-    record[2].iov_len = header.value_size;
-    
-    record[1].iov_base = malloc(record[1].iov_len);
-    if (!record[1].iov_base) {
-        free(record[0].iov_base);
-        ccask_errno = CCASK_ERR_NO_MEMORY;
+    // records always get a sequence number, zeroes are the padding direct I/O leaves behind the log until
+    // the file is closed (or a crash kept it from being closed)
+    if (read_be64(header_buf + 4) == 0) {
+        ccask_errno = CCASK_ERR_ITER_END;
         return CCASK_FAIL;
     }
 
-    record[2].iov_base = malloc(record[2].iov_len);
-    if (!record[2].iov_base) {
-        free(record[0].iov_base);
-        free(record[1].iov_base);
-        ccask_errno = CCASK_ERR_NO_MEMORY;
-        return CCASK_FAIL;
-    }
+    uint32_t key_size = read_be32(header_buf + 20);
+    uint32_t value_size = read_be32(header_buf + 24);
+    if (ccask_allocate_datafile_record(record, key_size, value_size) != CCASK_OK) return CCASK_FAIL;
+    memcpy(record[0].iov_base, header_buf, DATAFILE_RECORD_HEADER_SIZE);
 
-    res = safe_preadv(iter->fd, record + 1, 2, iter->offset + DATAFILE_RECORD_HEADER_SIZE);
+    ccask_datafile_record_header_t header = ccask_get_datafile_record_header(record);
+    res = ccask_io_preadv(iter->fd, record + 1, 2, iter->offset + DATAFILE_RECORD_HEADER_SIZE);
     if (res != CCASK_OK) {
+        free_datafile_record(record);
         return CCASK_FAIL;
     }
     
@@ -113,7 +105,7 @@ int ccask_hintfile_iter_next(ccask_hintfile_iter_t *iter, ccask_hintfile_record_
         return CCASK_FAIL;
     }
 
-    int res = safe_pread(iter->fd, record[0].iov_base, HINTFILE_RECORD_HEADER_SIZE, iter->offset);
+    int res = ccask_io_pread(iter->fd, record[0].iov_base, HINTFILE_RECORD_HEADER_SIZE, iter->offset);
     if (res < 0) {
         if (ccask_errno == CCASK_ERR_UNEXPECTED_EOF) ccask_errno = CCASK_ERR_ITER_END;
         return CCASK_FAIL;
@@ -129,7 +121,7 @@ int ccask_hintfile_iter_next(ccask_hintfile_iter_t *iter, ccask_hintfile_record_
         return CCASK_FAIL;
     }
 
-    res = safe_preadv(iter->fd, record + 1, 1, iter->offset + HINTFILE_RECORD_HEADER_SIZE);
+    res = ccask_io_preadv(iter->fd, record + 1, 1, iter->offset + HINTFILE_RECORD_HEADER_SIZE);
     if (res != CCASK_OK) {
         return CCASK_FAIL;
     }
@@ -16,19 +16,557 @@
  * 
  */
 
+
 #include "ccask/keydir.h"
 
 #include "stdlib.h"
+#include "string.h"
+#include "stdbool.h"
+#include "stdatomic.h"
 #include "pthread.h"
 #include "inttypes.h"
-#include "uthash.h"
+#include "zlib.h"
+#include "ccask/epoch.h"
+#include "ccask/hash.h"
+#include "ccask/index.h"
+#include "ccask/checkpoint.h"
 #include "ccask/files.h"
 #include "ccask/iterator.h"
+#include "ccask/io.h"
+#include "ccask/records.h"
 #include "ccask/status.h"
 #include "ccask/log.h"
+#include "uthash.h"
+
+#if defined(__SSE2__)
+#include "emmintrin.h"
+#endif
+
+#define KEYDIR_INITIAL_GROUPS 4
+#define KEYDIR_GROUP_WIDTH 16
+#define KEYDIR_MIGRATE_GROUPS 4 // groups moved out of the old table by every write while resizing
+#define KEYDIR_FIND_BATCH 16    // keys of a batched lookup whose probes are interleaved
+
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+#define CTRL_IS_FULL(c) (((c) & 0x80) == 0) // full slots hold the 7-bit fingerprint (H2) of their key
+
+#define KEYDIR_INLINE_KEY_SIZE 20
+#define KEYDIR_RECORD_POS_BITS 40
+#define KEYDIR_RECORD_POS_MASK ((UINT64_C(1) << KEYDIR_RECORD_POS_BITS) - 1)
+#define KEYDIR_HASH_TAG_BITS (64 - KEYDIR_RECORD_POS_BITS)
+#define KEYDIR_HASH_TAG_MASK ((UINT64_C(1) << KEYDIR_HASH_TAG_BITS) - 1)
+
+#define KEYDIR_SLAB_ENTRIES 1632 // ~64 KiB of entries per slab
+#define KEYDIR_ARENA_MIN_CHUNK_SIZE (4 << 10) // chunks double in size up to the max
+#define KEYDIR_ARENA_MAX_CHUNK_SIZE (1 << 20)
+#define KEYDIR_ARENA_DEDICATED_SIZE (KEYDIR_ARENA_MAX_CHUNK_SIZE / 8) // larger keys get a chunk of their own
+
+/**
+ * Packed keydir entry (48 bytes).
+ * Keys of up to 20 bytes are stored inline, longer ones live in the shard's key arena and `key` holds a
+ * pointer to them instead (unaligned, so only accessed through memcpy).
+ */
+typedef struct keydir_entry {
+    uint64_t location; // record position in the low 40 bits, low 24 bits of the key's hash above them
+    uint64_t seq;
+    uint32_t file_id;
+    uint32_t value_size;
+    uint32_t key_size;
+    uint8_t key[KEYDIR_INLINE_KEY_SIZE];
+} keydir_entry_t;
+
+_Static_assert(sizeof(keydir_entry_t) == 48, "keydir entries are expected to be packed into 48 bytes");
+
+// entries on a free-list reuse their own memory for the link
+typedef struct keydir_free_entry {
+    struct keydir_free_entry *next;
+} keydir_free_entry_t;
+
+typedef struct keydir_slab {
+    struct keydir_slab *next;
+    size_t used;
+    keydir_entry_t entries[KEYDIR_SLAB_ENTRIES];
+} keydir_slab_t;
+
+typedef struct keydir_arena_chunk {
+    struct keydir_arena_chunk *next;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+} keydir_arena_chunk_t;
+
+/**
+ * Swiss-table style open-addressing table.
+ * Slots are probed in groups of 16: one SIMD compare of the group's control bytes against the key's
+ * 7-bit fingerprint finds the candidates, so keys are only compared on likely matches. Probing stops
+ * at the first group with an empty slot.
+ *
+ * Readers probe without locks. Writers (serialized by the shard lock) publish a slot's entry before its
+ * control byte, and a reader always re-checks the entry it loads, so it sees either the old or the new entry.
+ *
+ * Growing is incremental: the new table keeps a link to the old one, and every write moves a few old
+ * groups over. Readers probe the old table before the new one, an entry is only removed from the old
+ * table after it was published in the new one.
+ */
+// control bytes sit next to their slots, so a probe that matches usually finds the entry pointer in the same cache-line
+typedef struct keydir_group {
+    uint8_t ctrl[KEYDIR_GROUP_WIDTH];
+    _Atomic(struct keydir_entry*) slots[KEYDIR_GROUP_WIDTH];
+} __attribute__((aligned(16))) keydir_group_t;
+
+typedef struct keydir_table {
+    size_t num_groups;  // power of two
+    size_t count;       // live entries
+    size_t used;        // live entries + deleted slots
+    size_t migrate_pos; // next group of `old` to move into this table
+    _Atomic(struct keydir_table*) old; // table being drained into this one, NULL unless resizing
+    keydir_group_t groups[];
+} keydir_table_t;
+
+#define TABLE_CTRL(table, i) ((table)->groups[(i) / KEYDIR_GROUP_WIDTH].ctrl[(i) % KEYDIR_GROUP_WIDTH])
+#define TABLE_SLOT(table, i) ((table)->groups[(i) / KEYDIR_GROUP_WIDTH].slots[(i) % KEYDIR_GROUP_WIDTH])
+
+typedef struct keydir_shard {
+    pthread_mutex_t lock; // serializes writers, readers never take it
+    _Atomic(keydir_table_t*) table;
+
+    // allocators, guarded by the lock
+    keydir_slab_t *slabs;
+    keydir_free_entry_t *free_entries;
+    keydir_arena_chunk_t *arena;
+    size_t num_slabs;
+    size_t arena_bytes;
+    size_t arena_dead_bytes;
+
+    // entries whose grace period is over, pushed by whichever thread reclaims them
+    _Atomic(keydir_free_entry_t*) reclaimed_entries;
+
+    uint64_t preserved_gen; // newest snapshot this shard's keys were saved for, guarded by the lock
+} __attribute__((aligned(64))) keydir_shard_t; // one cache-line per shard, so locks don't false-share
+
+static keydir_shard_t *shards = NULL;
+static size_t num_shards = 0;
+
+// keys of one shard as of a snapshot, packed [key size][key] pairs
+typedef struct snapshot_shard {
+    size_t count;
+    size_t *offsets;
+    uint8_t *bytes;
+} snapshot_shard_t;
+
+struct ccask_keydir_snapshot {
+    uint64_t gen;
+    atomic_bool failed; // a shard couldn't be saved, the snapshot is incomplete
+    _Atomic(snapshot_shard_t*) *shards; // each set once, under its shard's lock
+    struct ccask_keydir_snapshot *prev;
+    struct ccask_keydir_snapshot *next;
+};
+
+// open snapshots, guarded by snapshots_lock. Lock order is shard locks (ascending), then snapshots_lock.
+static pthread_mutex_t snapshots_lock = PTHREAD_MUTEX_INITIALIZER;
+static ccask_keydir_snapshot_t *snapshots = NULL;
+static _Atomic uint64_t snapshot_gen = 0;
+
+// tables use the low bits of the hash, so shards are picked from the high bits
+static inline keydir_shard_t* keydir_shard_for(uint64_t hashv) {
+    return &shards[((hashv >> 32) * num_shards) >> 32];
+}
+
+static inline uint8_t hash_h2(uint64_t hashv) {
+    return hashv & 0x7F;
+}
+
+static inline size_t hash_h1(uint64_t hashv) {
+    return (size_t)(hashv >> 7);
+}
+
+#if defined(__SSE2__)
+
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t h2) {
+    __m128i group = _mm_load_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)h2)));
+}
+
+static inline uint32_t group_match_empty(const uint8_t *ctrl) {
+    __m128i group = _mm_load_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)CTRL_EMPTY)));
+}
+
+// empty and deleted are the only control bytes with the high bit set
+static inline uint32_t group_match_empty_or_deleted(const uint8_t *ctrl) {
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)ctrl));
+}
+
+#else
+
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t h2) {
+    uint32_t mask = 0;
+    for (int i = 0; i < KEYDIR_GROUP_WIDTH; i++) mask |= (uint32_t)(ctrl[i] == h2) << i;
+    return mask;
+}
+
+static inline uint32_t group_match_empty(const uint8_t *ctrl) {
+    uint32_t mask = 0;
+    for (int i = 0; i < KEYDIR_GROUP_WIDTH; i++) mask |= (uint32_t)(ctrl[i] == CTRL_EMPTY) << i;
+    return mask;
+}
+
+static inline uint32_t group_match_empty_or_deleted(const uint8_t *ctrl) {
+    uint32_t mask = 0;
+    for (int i = 0; i < KEYDIR_GROUP_WIDTH; i++) mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    return mask;
+}
+
+#endif
+
+static inline void set_ctrl(keydir_table_t *table, size_t i, uint8_t ctrl) {
+    __atomic_store_n(&TABLE_CTRL(table, i), ctrl, __ATOMIC_RELEASE);
+}
+
+static inline size_t table_capacity(const keydir_table_t *table) {
+    return table->num_groups * KEYDIR_GROUP_WIDTH;
+}
+
+static inline uint64_t entry_hash_tag(const keydir_entry_t *entry) {
+    return entry->location >> KEYDIR_RECORD_POS_BITS;
+}
+
+static inline uint64_t entry_record_pos(const keydir_entry_t *entry) {
+    return entry->location & KEYDIR_RECORD_POS_MASK;
+}
+
+static inline const uint8_t* entry_key(const keydir_entry_t *entry) {
+    if (entry->key_size <= KEYDIR_INLINE_KEY_SIZE) return entry->key;
+
+    const uint8_t *ptr;
+    memcpy(&ptr, entry->key, sizeof(ptr));
+    return ptr;
+}
+
+// hash bits for placing the entry, the stored tag covers H2 and H1 for tables of up to 2^17 groups
+static inline uint64_t entry_slot_hash(const keydir_entry_t *entry, size_t num_groups) {
+    if (num_groups <= ((size_t)1 << (KEYDIR_HASH_TAG_BITS - 7))) return entry_hash_tag(entry);
+    return ccask_hash_key(entry_key(entry), entry->key_size);
+}
+
+static inline bool entry_matches(const keydir_entry_t *entry, uint64_t hashv, const void *key, uint32_t key_size) {
+    return entry_hash_tag(entry) == (hashv & KEYDIR_HASH_TAG_MASK) &&
+        entry->key_size == key_size &&
+        memcmp(entry_key(entry), key, key_size) == 0;
+}
+
+static inline void entry_to_record(keydir_entry_t *entry, ccask_keydir_record_t *record) {
+    record->key = (void*)entry_key(entry);
+    record->key_size = entry->key_size;
+    record->file_id = entry->file_id;
+    record->record_pos = entry_record_pos(entry);
+    record->value_size = entry->value_size;
+    record->seq = entry->seq;
+}
+
+// must be called with the shard lock held
+static keydir_entry_t* shard_alloc_entry(keydir_shard_t *shard) {
+    if (!shard->free_entries) {
+        shard->free_entries = atomic_exchange_explicit(&shard->reclaimed_entries, NULL, memory_order_acquire);
+    }
+
+    if (shard->free_entries) {
+        keydir_free_entry_t *free_entry = shard->free_entries;
+        shard->free_entries = free_entry->next;
+        return (keydir_entry_t*)free_entry;
+    }
+
+    if (!shard->slabs || shard->slabs->used == KEYDIR_SLAB_ENTRIES) {
+        keydir_slab_t *slab = malloc(sizeof(keydir_slab_t));
+        if (!slab) {
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return NULL;
+        }
+        slab->used = 0;
+        slab->next = shard->slabs;
+        shard->slabs = slab;
+        shard->num_slabs++;
+    }
+
+    return &shard->slabs->entries[shard->slabs->used++];
+}
+
+// must be called with the shard lock held, for entries that were never published
+static void shard_unalloc_entry(keydir_shard_t *shard, keydir_entry_t *entry) {
+    keydir_free_entry_t *free_entry = (keydir_free_entry_t*)entry;
+    free_entry->next = shard->free_entries;
+    shard->free_entries = free_entry;
+}
+
+// epoch callback, runs on the reclaiming thread without the shard lock
+static void reclaim_entry(void *ptr, void *ctx) {
+    keydir_shard_t *shard = ctx;
+    keydir_free_entry_t *free_entry = ptr;
+    free_entry->next = atomic_load_explicit(&shard->reclaimed_entries, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        &shard->reclaimed_entries, &free_entry->next, free_entry,
+        memory_order_release, memory_order_relaxed
+    ));
+}
+
+// must be called with the shard lock held
+static uint8_t* shard_alloc_key(keydir_shard_t *shard, uint32_t key_size) {
+    keydir_arena_chunk_t *chunk = shard->arena;
+    if (!chunk || chunk->size - chunk->used < key_size) {
+        size_t size = shard->arena_bytes;
+        if (size < KEYDIR_ARENA_MIN_CHUNK_SIZE) size = KEYDIR_ARENA_MIN_CHUNK_SIZE;
+        if (size > KEYDIR_ARENA_MAX_CHUNK_SIZE) size = KEYDIR_ARENA_MAX_CHUNK_SIZE;
+        if (key_size > KEYDIR_ARENA_DEDICATED_SIZE) size = key_size;
+        else if (key_size > size) size = KEYDIR_ARENA_MAX_CHUNK_SIZE;
+        keydir_arena_chunk_t *fresh = malloc(sizeof(keydir_arena_chunk_t) + size);
+        if (!fresh) {
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return NULL;
+        }
+        fresh->size = size;
+        fresh->used = 0;
+        shard->arena_bytes += size;
+
+        if (chunk && key_size > KEYDIR_ARENA_DEDICATED_SIZE) {
+            // keep bump-allocating from the current chunk
+            fresh->next = chunk->next;
+            chunk->next = fresh;
+        } else {
+            fresh->next = chunk;
+            shard->arena = fresh;
+        }
+        chunk = fresh;
+    }
+
+    uint8_t *key = chunk->data + chunk->used;
+    chunk->used += key_size;
+    return key;
+}
+
+static void free_table(void *ptr, void *ctx) {
+    (void)ctx;
+    free(ptr);
+}
+
+static inline size_t table_bytes(const keydir_table_t *table) {
+    return sizeof(keydir_table_t) + table->num_groups * sizeof(keydir_group_t);
+}
+
+static keydir_table_t* allocate_table(size_t num_groups) {
+    size_t size = sizeof(keydir_table_t) + num_groups * sizeof(keydir_group_t);
+
+    keydir_table_t *table = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (!table) return NULL;
+
+    table->num_groups = num_groups;
+    table->count = 0;
+    table->used = 0;
+    table->migrate_pos = 0;
+    atomic_init(&table->old, NULL);
+
+    for (size_t g = 0; g < num_groups; g++) {
+        memset(table->groups[g].ctrl, CTRL_EMPTY, KEYDIR_GROUP_WIDTH);
+        for (size_t i = 0; i < KEYDIR_GROUP_WIDTH; i++) {
+            atomic_init(&table->groups[g].slots[i], NULL);
+        }
+    }
+    return table;
+}
+
+// lock-free, callers must hold an epoch guard
+static keydir_entry_t* table_lookup(keydir_table_t *table, uint64_t hashv, const void *key, uint32_t key_size) {
+    size_t mask = table->num_groups - 1;
+    size_t group = hash_h1(hashv) & mask;
+    uint8_t h2 = hash_h2(hashv);
+
+    for (size_t stride = 1;; group = (group + stride++) & mask) {
+        const uint8_t *ctrl = table->groups[group].ctrl;
+        uint32_t match = group_match(ctrl, h2);
+        uint32_t empty = group_match_empty(ctrl);
+        atomic_thread_fence(memory_order_acquire); // pairs with the release stores of the control bytes
+
+        while (match) {
+            size_t i = group * KEYDIR_GROUP_WIDTH + __builtin_ctz(match);
+            keydir_entry_t *entry = atomic_load_explicit(&TABLE_SLOT(table, i), memory_order_acquire);
+            if (entry && entry_matches(entry, hashv, key, key_size)) return entry;
+            match &= match - 1;
+        }
 
-static pthread_rwlock_t hash_table_lock;
-static ccask_keydir_record_t *hash_table = NULL;
+        if (empty) return NULL;
+    }
+}
+
+// must be called with the shard lock held, returns the slot index of the key or SIZE_MAX
+static size_t table_find_slot(keydir_table_t *table, uint64_t hashv, const void *key, uint32_t key_size) {
+    size_t mask = table->num_groups - 1;
+    size_t group = hash_h1(hashv) & mask;
+    uint8_t h2 = hash_h2(hashv);
+
+    for (size_t stride = 1;; group = (group + stride++) & mask) {
+        const uint8_t *ctrl = table->groups[group].ctrl;
+        uint32_t match = group_match(ctrl, h2);
+
+        while (match) {
+            size_t i = group * KEYDIR_GROUP_WIDTH + __builtin_ctz(match);
+            keydir_entry_t *entry = atomic_load_explicit(&TABLE_SLOT(table, i), memory_order_relaxed);
+            if (entry && entry_matches(entry, hashv, key, key_size)) return i;
+            match &= match - 1;
+        }
+
+        if (group_match_empty(ctrl)) return SIZE_MAX;
+    }
+}
+
+// must be called with the shard lock held, and only for keys that aren't in the table
+static void table_insert(keydir_table_t *table, uint64_t hashv, keydir_entry_t *entry) {
+    size_t mask = table->num_groups - 1;
+    size_t group = hash_h1(hashv) & mask;
+
+    for (size_t stride = 1;; group = (group + stride++) & mask) {
+        uint32_t free_slots = group_match_empty_or_deleted(table->groups[group].ctrl);
+        if (!free_slots) continue;
+
+        size_t i = group * KEYDIR_GROUP_WIDTH + __builtin_ctz(free_slots);
+        if (TABLE_CTRL(table, i) == CTRL_EMPTY) table->used++;
+        table->count++;
+
+        // entry first, a reader matching the control byte must find it
+        atomic_store_explicit(&TABLE_SLOT(table, i), entry, memory_order_release);
+        set_ctrl(table, i, hash_h2(hashv));
+        return;
+    }
+}
+
+// must be called with the shard lock held
+static void table_remove(keydir_table_t *table, size_t i) {
+    atomic_store_explicit(&TABLE_SLOT(table, i), NULL, memory_order_release);
+    set_ctrl(table, i, CTRL_DELETED);
+    table->count--;
+}
+
+// must be called with the shard lock held, moves up to `max_groups` groups out of the old table
+static void table_migrate(keydir_table_t *table, size_t max_groups) {
+    keydir_table_t *old = atomic_load_explicit(&table->old, memory_order_relaxed);
+    if (!old) return;
+
+    size_t end = table->migrate_pos + max_groups;
+    if (end > old->num_groups) end = old->num_groups;
+
+    for (size_t i = table->migrate_pos * KEYDIR_GROUP_WIDTH; i < end * KEYDIR_GROUP_WIDTH; i++) {
+        if (!CTRL_IS_FULL(TABLE_CTRL(old, i))) continue;
+
+        keydir_entry_t *entry = atomic_load_explicit(&TABLE_SLOT(old, i), memory_order_relaxed);
+        table_insert(table, entry_slot_hash(entry, table->num_groups), entry);
+        table_remove(old, i);
+    }
+    table->migrate_pos = end;
+
+    if (end == old->num_groups) {
+        atomic_store_explicit(&table->old, NULL, memory_order_release);
+        ccask_epoch_retire(old, free_table, NULL);
+    }
+}
+
+// must be called with the shard lock held, makes room for one more entry (max load factor of 7/8)
+static ccask_status_e shard_reserve(keydir_shard_t *shard) {
+    keydir_table_t *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    if ((table->used + 1) * 8 <= table_capacity(table) * 7) return CCASK_OK;
+
+    // only one resize at a time, the pending one is usually almost done by now
+    while (atomic_load_explicit(&table->old, memory_order_relaxed)) {
+        table_migrate(table, table->num_groups);
+    }
+
+    // deleted slots aren't carried over, so only grow if live entries need it
+    size_t num_groups = table->num_groups;
+    while ((table->count + 1) * 2 > num_groups * KEYDIR_GROUP_WIDTH) num_groups *= 2;
+
+    keydir_table_t *grown = allocate_table(num_groups);
+    if (!grown) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_RETRY;
+    }
+
+    atomic_store_explicit(&grown->old, table, memory_order_relaxed);
+    atomic_store_explicit(&shard->table, grown, memory_order_release);
+    table_migrate(grown, KEYDIR_MIGRATE_GROUPS);
+    return CCASK_OK;
+}
+
+static void shard_free_all(keydir_shard_t *shard) {
+    keydir_table_t *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    free(atomic_load_explicit(&table->old, memory_order_relaxed));
+    free(table);
+
+    while (shard->slabs) {
+        keydir_slab_t *next = shard->slabs->next;
+        free(shard->slabs);
+        shard->slabs = next;
+    }
+
+    while (shard->arena) {
+        keydir_arena_chunk_t *next = shard->arena->next;
+        free(shard->arena);
+        shard->arena = next;
+    }
+}
+
+/**
+ * A key's delete found while recovering. Files aren't replayed in sequence order, so a put older than the
+ * delete may still come up afterwards, and must not bring the key back.
+ */
+typedef struct recovery_tombstone {
+    uint64_t seq;
+    UT_hash_handle hh;
+    uint32_t key_size;
+    uint8_t key[];
+} recovery_tombstone_t;
+
+static recovery_tombstone_t *tombstones = NULL;
+static uint64_t recovered_seq = 0;
+
+static void free_tombstones(void) {
+    recovery_tombstone_t *tombstone, *tmp;
+    HASH_ITER(hh, tombstones, tombstone, tmp) {
+        HASH_DEL(tombstones, tombstone);
+        free(tombstone);
+    }
+}
+
+// applies a record found in a datafile or hintfile, whichever of a key's records has the highest sequence number wins
+static ccask_status_e recover_record(void *key, uint32_t key_size, uint64_t file_id, uint64_t record_pos, uint32_t value_size, uint64_t seq) {
+    if (seq > recovered_seq) recovered_seq = seq;
+
+    recovery_tombstone_t *tombstone;
+    HASH_FIND(hh, tombstones, key, key_size, tombstone);
+
+    if (value_size > 0) {
+        if (tombstone && tombstone->seq > seq) return CCASK_OK;
+
+        int res;
+        CCASK_ATTEMPT(5, res, ccask_keydir_upsert(key, key_size, file_id, record_pos, value_size, seq));
+        return res;
+    }
+
+    if (!tombstone) {
+        tombstone = malloc(sizeof(recovery_tombstone_t) + key_size);
+        if (!tombstone) {
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return CCASK_FAIL;
+        }
+        tombstone->seq = seq;
+        tombstone->key_size = key_size;
+        memcpy(tombstone->key, key, key_size);
+        HASH_ADD(hh, tombstones, key, key_size, tombstone);
+    } else if (seq > tombstone->seq) {
+        tombstone->seq = seq;
+    }
+
+    // the key may already be absent
+    ccask_keydir_delete(key, key_size, seq);
+    return CCASK_OK;
+}
 
 static ccask_status_e recover_hintfile(ccask_file_t *file) {
     // get iterator for hintfile
@@ -46,16 +584,8 @@ static ccask_status_e recover_hintfile(ccask_file_t *file) {
     while (ccask_hintfile_iter_next(&iter, record, &record_pos) == CCASK_OK) {
         ccask_hintfile_record_header_t header = ccask_get_hintfile_record_header(record);
         void *key = ccask_get_hintfile_record_key(record);
-        
-        int res;
-        CCASK_ATTEMPT(5, res, ccask_keydir_upsert(
-            key, header.key_size,
-            file->file_id,
-            header.record_pos,
-            header.value_size,
-            header.timestamp
-        ));
 
+        int res = recover_record(key, header.key_size, file->file_id, header.record_pos, header.value_size, header.seq);
         if (res != CCASK_OK) {
             log_error("Couldn't recover Hintfile ID = %" PRIu64 " record at position = %" PRIu64, file->file_id, record_pos);
             free_hintfile_record(record);
@@ -71,7 +601,23 @@ static ccask_status_e recover_hintfile(ccask_file_t *file) {
     return CCASK_OK;
 }
 
-static ccask_status_e recover_datafile(ccask_file_t *file) {
+// checks that a write batch's records (following its header) all made it to disk
+static bool batch_is_complete(ccask_datafile_iter_t *iter, ccask_datafile_batch_header_t batch) {
+    if (iter->offset + batch.length > iter->total_size) return false;
+
+    uint8_t buf[64 << 10];
+    uint32_t crc = (uint32_t)crc32(0, NULL, 0);
+    for (uint64_t done = 0; done < batch.length;) {
+        size_t len = batch.length - done < sizeof(buf) ? batch.length - done : sizeof(buf);
+        if (ccask_io_pread(iter->fd, buf, len, iter->offset + done) != CCASK_OK) return false;
+        crc = (uint32_t)crc32(crc, buf, len);
+        done += len;
+    }
+    return crc == batch.crc;
+}
+
+// replays the datafile's records from the given offset on
+static ccask_status_e recover_datafile(ccask_file_t *file, uint64_t offset) {
     // get iterator for datafile
     int res;
     ccask_datafile_iter_t iter;
@@ -81,22 +627,32 @@ static ccask_status_e recover_datafile(ccask_file_t *file) {
         log_error("Datafile recovery failed (File ID = %" PRIu64 ")", file->file_id);
         return CCASK_FAIL;
     }
+    iter.offset = offset;
 
+    bool torn = false;
     uint64_t record_pos;
     ccask_datafile_record_t record;
     while (ccask_datafile_iter_next(&iter, record, &record_pos) == CCASK_OK) {
+        if (ccask_is_datafile_batch_header(record)) {
+            ccask_datafile_batch_header_t batch = ccask_get_datafile_batch_header(record);
+            ccask_datafile_record_header_t header = ccask_get_datafile_record_header(record);
+            free_datafile_record(record);
+
+            // a batch cut short by a crash can only be the end of the log, so replay stops before it
+            if (!batch_is_complete(&iter, batch)) {
+                log_warn("Discarding torn write batch of %" PRIu32 " records in Datafile ID = %" PRIu64, batch.count, file->file_id);
+                iter.offset = record_pos;
+                torn = true;
+                break;
+            }
+            if (header.seq > recovered_seq) recovered_seq = header.seq;
+            continue;
+        }
+
         ccask_datafile_record_header_t header = ccask_get_datafile_record_header(record);
         void *key = ccask_get_datafile_record_key(record);
 
-        int res;
-        CCASK_ATTEMPT(5, res, ccask_keydir_upsert(
-            key, header.key_size,
-            file->file_id,
-            record_pos,
-            header.value_size,
-            header.timestamp
-        ));
-
+        int res = recover_record(key, header.key_size, file->file_id, record_pos, header.value_size, header.seq);
         if (res != CCASK_OK) {
             log_error("Couldn't recover Datafile ID = %" PRIu64 " record at position = %" PRIu64, file->file_id, record_pos);
             free_datafile_record(record);
@@ -106,138 +662,864 @@ static ccask_status_e recover_datafile(ccask_file_t *file) {
 
         free_datafile_record(record); // free memory used by current record's buffers
     }
-
+    if (!torn) torn = ccask_errno == CCASK_ERR_UNEXPECTED_EOF || ccask_errno == CCASK_ERR_ITER_END;
     ccask_datafile_iter_close(&iter);
+
+    // a torn write is cut off, so neither appends nor hints and compaction of the file ever see it
+    if (torn && iter.offset < iter.total_size) {
+        log_warn("Datafile ID = %" PRIu64 " ends in %" PRIu64 " bytes of a torn write", file->file_id, iter.total_size - iter.offset);
+        if (ccask_files_truncate(file, iter.offset) != CCASK_OK) return CCASK_FAIL;
+    }
+
     log_info("Recovered Datafile ID = %" PRIu64, file->file_id);
     return CCASK_OK;
 }
 
 static ccask_status_e keydir_recover(void) {
+    recovered_seq = 0;
+
+    // with a checkpoint, only the log written after it has to be replayed
+    ccask_checkpoint_position_t positions[CHECKPOINT_MAX_POSITIONS];
+    size_t num_positions = 0;
+    uint64_t next_seq = 0;
+    if (ccask_checkpoint_load(positions, &num_positions, &next_seq) != CCASK_OK) num_positions = 0;
+    else if (next_seq > 0) recovered_seq = next_seq - 1;
+
+    uint64_t newest_listed = 0;
+    for (size_t i = 0; i < num_positions; i++) {
+        if (positions[i].file_id > newest_listed) newest_listed = positions[i].file_id;
+    }
+
     ccask_file_t *file = ccask_files_get_oldest_file();
     while (file) {
+        const ccask_checkpoint_position_t *position = NULL;
+        for (size_t i = 0; i < num_positions; i++) {
+            if (positions[i].file_id == file->file_id) position = &positions[i];
+        }
+
+        if (num_positions > 0 && !position && file->file_id < newest_listed) {
+            // closed before the checkpoint was taken, so fully covered by it
+            file = file->previous;
+            continue;
+        }
+
         ccask_status_e status;
-        if (file->has_hint) status = recover_hintfile(file);
-        else status = recover_datafile(file);
+        if (position) status = recover_datafile(file, position->offset);
+        else if (file->has_hint) status = recover_hintfile(file);
+        else status = recover_datafile(file, 0);
 
         if (status != CCASK_OK) {
             log_fatal("Couldn't recover from saved datafiles and hintfiles. Aborting init");
+            free_tombstones();
             return CCASK_FAIL;
         }
 
         file = file->previous;
     }
+
+    free_tombstones();
     return CCASK_OK;
 }
 
-ccask_status_e ccask_keydir_init(void) {
-    hash_table = NULL;
-    pthread_rwlock_init(&hash_table_lock, NULL);
+uint64_t ccask_keydir_recovered_seq(void) {
+    return recovered_seq;
+}
+
+void ccask_keydir_presize(size_t num_keys) {
+    size_t per_shard = num_keys / num_shards + 1;
+
+    for (size_t i = 0; i < num_shards; i++) {
+        keydir_shard_t *shard = &shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        keydir_table_t *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+
+        // sized so the shard fits its share (plus some skew) below the max load factor
+        size_t num_groups = table->num_groups;
+        while (num_groups * KEYDIR_GROUP_WIDTH * 7 < per_shard * 9) num_groups *= 2;
+
+        if (table->count == 0 && !atomic_load_explicit(&table->old, memory_order_relaxed) && num_groups > table->num_groups) {
+            keydir_table_t *sized = allocate_table(num_groups);
+            if (sized) {
+                atomic_store_explicit(&shard->table, sized, memory_order_release);
+                ccask_epoch_retire(table, free_table, NULL);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+ccask_status_e ccask_keydir_init(size_t shard_count) {
+    if (shard_count == 0) shard_count = KEYDIR_DEFAULT_SHARDS;
+
+    shards = aligned_alloc(64, shard_count * sizeof(keydir_shard_t));
+    if (!shards) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return CCASK_RETRY;
+    }
+
+    for (size_t i = 0; i < shard_count; i++) {
+        keydir_shard_t *shard = &shards[i];
+        keydir_table_t *table = allocate_table(KEYDIR_INITIAL_GROUPS);
+        if (!table) {
+            for (size_t j = 0; j < i; j++) {
+                free(atomic_load(&shards[j].table));
+                pthread_mutex_destroy(&shards[j].lock);
+            }
+            free(shards);
+            shards = NULL;
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return CCASK_RETRY;
+        }
+
+        pthread_mutex_init(&shard->lock, NULL);
+        atomic_init(&shard->table, table);
+        shard->slabs = NULL;
+        shard->free_entries = NULL;
+        shard->arena = NULL;
+        shard->num_slabs = 0;
+        shard->arena_bytes = 0;
+        shard->arena_dead_bytes = 0;
+        atomic_init(&shard->reclaimed_entries, NULL);
+        shard->preserved_gen = atomic_load(&snapshot_gen);
+    }
+
+    if (ccask_index_init() != CCASK_OK) {
+        for (size_t i = 0; i < shard_count; i++) {
+            free(atomic_load(&shards[i].table));
+            pthread_mutex_destroy(&shards[i].lock);
+        }
+        free(shards);
+        shards = NULL;
+        return CCASK_RETRY;
+    }
+
+    num_shards = shard_count;
+    ccask_epoch_init();
+    log_info("Initialized keydir with %zu shards", num_shards);
     return keydir_recover();
 }
 
 void ccask_keydir_shutdown(void) {
-    pthread_rwlock_wrlock(&hash_table_lock);
-    ccask_keydir_record_t *entry, *tmp;
-    HASH_ITER(hh, hash_table, entry, tmp) {
-        HASH_DEL(hash_table, entry);
-        free(entry->key);
-        free(entry);
+    // no readers are left at this point, reclaim retired entries before their slabs go away
+    ccask_epoch_shutdown();
+
+    for (size_t i = 0; i < num_shards; i++) {
+        keydir_shard_t *shard = &shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        shard_free_all(shard);
+        pthread_mutex_unlock(&shard->lock);
+
+        pthread_mutex_destroy(&shard->lock);
     }
-    pthread_rwlock_unlock(&hash_table_lock);
-    
-    hash_table = NULL;
-    pthread_rwlock_destroy(&hash_table_lock);
+
+    free(shards);
+    shards = NULL;
+    num_shards = 0;
+
+    ccask_index_shutdown();
 }
 
-ccask_keydir_record_t* ccask_keydir_find(void *key, uint32_t key_size) {
-    ccask_keydir_record_t *entry = NULL;
-    pthread_rwlock_rdlock(&hash_table_lock);
-    HASH_FIND(hh, hash_table, key, key_size, entry);
-    pthread_rwlock_unlock(&hash_table_lock);
-    return entry;
+// must be called inside an epoch guard
+static keydir_entry_t* shard_lookup(keydir_shard_t *shard, uint64_t hashv, const void *key, uint32_t key_size) {
+    keydir_table_t *table = atomic_load_explicit(&shard->table, memory_order_acquire);
+    while (true) {
+        // entries only ever move from the old table into the new one, so check the old one first
+        keydir_table_t *old = atomic_load_explicit(&table->old, memory_order_acquire);
+        keydir_entry_t *entry = NULL;
+        if (old) entry = table_lookup(old, hashv, key, key_size);
+        if (!entry) entry = table_lookup(table, hashv, key, key_size);
+        if (entry) return entry;
+
+        // a resize that started meanwhile may have moved the key out of `table`
+        keydir_table_t *curr = atomic_load_explicit(&shard->table, memory_order_acquire);
+        if (curr == table) return NULL;
+        table = curr;
+    }
 }
 
-ccask_status_e ccask_keydir_delete(void *key, uint32_t key_size) {
-    ccask_keydir_record_t *entry = ccask_keydir_find(key, key_size);
+ccask_status_e ccask_keydir_find(void *key, uint32_t key_size, ccask_keydir_record_t *out) {
+    uint64_t hashv = ccask_hash_key(key, key_size);
+    keydir_shard_t *shard = keydir_shard_for(hashv);
+
+    ccask_epoch_enter();
+    keydir_entry_t *entry = shard_lookup(shard, hashv, key, key_size);
+    if (entry) entry_to_record(entry, out);
+    ccask_epoch_exit();
+
     if (!entry) {
+        ccask_errno = CCASK_ERR_NO_KEY;
         return CCASK_FAIL;
     }
+    return CCASK_OK;
+}
+
+void ccask_keydir_find_batch(void *const *keys, const uint32_t *key_sizes, size_t num_keys, ccask_keydir_record_t *out, bool *found) {
+    for (size_t base = 0; base < num_keys; base += KEYDIR_FIND_BATCH) {
+        size_t count = num_keys - base < KEYDIR_FIND_BATCH ? num_keys - base : KEYDIR_FIND_BATCH;
+        uint64_t hashes[KEYDIR_FIND_BATCH];
+        keydir_entry_t *entries[KEYDIR_FIND_BATCH];
 
-    pthread_rwlock_wrlock(&hash_table_lock);
-    HASH_DEL(hash_table, entry);
-    free(entry->key);
-    free(entry);
-    pthread_rwlock_unlock(&hash_table_lock);
+        ccask_epoch_enter();
+
+        // every key's first group is fetched before any of them is probed, so the cache misses overlap
+        for (size_t i = 0; i < count; i++) {
+            hashes[i] = ccask_hash_key(keys[base + i], key_sizes[base + i]);
+            keydir_table_t *table = atomic_load_explicit(&keydir_shard_for(hashes[i])->table, memory_order_acquire);
+            __builtin_prefetch(&table->groups[hash_h1(hashes[i]) & (table->num_groups - 1)]);
+        }
+
+        // and likewise the entries they point to, before those are copied
+        for (size_t i = 0; i < count; i++) {
+            entries[i] = shard_lookup(keydir_shard_for(hashes[i]), hashes[i], keys[base + i], key_sizes[base + i]);
+            if (entries[i]) __builtin_prefetch(entries[i]);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            found[base + i] = entries[i] != NULL;
+            if (entries[i]) entry_to_record(entries[i], &out[base + i]);
+        }
+
+        ccask_epoch_exit();
+    }
+}
+
+// must be called with the shard lock held, copies the shard's current keys
+static snapshot_shard_t* shard_materialize(keydir_shard_t *shard) {
+    keydir_table_t *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    keydir_table_t *old = atomic_load_explicit(&table->old, memory_order_relaxed);
+
+    size_t count = 0, num_bytes = 0;
+    for (keydir_table_t *t = table; t; t = (t == table ? old : NULL)) {
+        for (size_t i = 0; i < table_capacity(t); i++) {
+            if (!CTRL_IS_FULL(TABLE_CTRL(t, i))) continue;
+            keydir_entry_t *entry = atomic_load_explicit(&TABLE_SLOT(t, i), memory_order_relaxed);
+            num_bytes += sizeof(uint32_t) + entry->key_size;
+            count++;
+        }
+    }
+
+    snapshot_shard_t *saved = malloc(sizeof(snapshot_shard_t));
+    if (!saved) return NULL;
+
+    saved->count = count;
+    saved->offsets = malloc((count ? count : 1) * sizeof(size_t));
+    saved->bytes = malloc(num_bytes ? num_bytes : 1);
+    if (!saved->offsets || !saved->bytes) {
+        free(saved->offsets);
+        free(saved->bytes);
+        free(saved);
+        return NULL;
+    }
+
+    size_t n = 0, pos = 0;
+    for (keydir_table_t *t = table; t; t = (t == table ? old : NULL)) {
+        for (size_t i = 0; i < table_capacity(t); i++) {
+            if (!CTRL_IS_FULL(TABLE_CTRL(t, i))) continue;
+            keydir_entry_t *entry = atomic_load_explicit(&TABLE_SLOT(t, i), memory_order_relaxed);
+
+            saved->offsets[n++] = pos;
+            memcpy(saved->bytes + pos, &entry->key_size, sizeof(uint32_t));
+            memcpy(saved->bytes + pos + sizeof(uint32_t), entry_key(entry), entry->key_size);
+            pos += sizeof(uint32_t) + entry->key_size;
+        }
+    }
+    return saved;
+}
+
+static void free_snapshot_shard(snapshot_shard_t *saved) {
+    if (!saved) return;
+    free(saved->offsets);
+    free(saved->bytes);
+    free(saved);
+}
+
+/**
+ * Must be called with the shard lock held, before a change to the shard's set of keys.
+ * Saves the shard's keys for open snapshots that don't have them yet, so they keep seeing the keys as of
+ * their creation. Only the first change to a shard after a snapshot is opened pays for this.
+ */
+static inline void shard_preserve_for_snapshots(keydir_shard_t *shard) {
+    if (shard->preserved_gen == atomic_load_explicit(&snapshot_gen, memory_order_acquire)) return;
+
+    size_t idx = (size_t)(shard - shards);
+    pthread_mutex_lock(&snapshots_lock);
+
+    for (ccask_keydir_snapshot_t *snap = snapshots; snap; snap = snap->next) {
+        if (snap->gen <= shard->preserved_gen) continue;
+        if (atomic_load_explicit(&snap->shards[idx], memory_order_relaxed)) continue;
+
+        snapshot_shard_t *saved = shard_materialize(shard);
+        if (!saved) {
+            log_error("Couldn't save keydir shard for snapshot, it will be incomplete");
+            atomic_store(&snap->failed, true);
+            continue;
+        }
+        atomic_store_explicit(&snap->shards[idx], saved, memory_order_release);
+    }
 
+    shard->preserved_gen = atomic_load_explicit(&snapshot_gen, memory_order_relaxed);
+    pthread_mutex_unlock(&snapshots_lock);
+}
+
+// moves a record's bytes into or out of its datafile's live counters, whatever isn't live is garbage.
+// Looking the file up takes the files-table lock, so this is called once the shard lock is released:
+// updates of one file from different shards may land out of order, and the stats clamp a short dip.
+static inline void file_account(uint64_t file_id, uint32_t key_size, uint32_t value_size, bool live) {
+    ccask_file_t *file = ccask_files_get_file(file_id);
+    if (!file) return;
+
+    uint64_t bytes = DATAFILE_RECORD_HEADER_SIZE + (uint64_t)key_size + value_size;
+    if (live) {
+        atomic_fetch_add_explicit(&file->live_bytes, bytes, memory_order_relaxed);
+        atomic_fetch_add_explicit(&file->live_keys, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_sub_explicit(&file->live_bytes, bytes, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&file->live_keys, 1, memory_order_relaxed);
+    }
+}
+
+// must be called with the shard lock held, finds the key in the table or the one being drained into it
+static keydir_table_t* shard_find_slot(keydir_table_t *table, uint64_t hashv, const void *key, uint32_t key_size, size_t *slot) {
+    *slot = table_find_slot(table, hashv, key, key_size);
+    if (*slot != SIZE_MAX) return table;
+
+    keydir_table_t *old = atomic_load_explicit(&table->old, memory_order_relaxed);
+    if (!old) return NULL;
+
+    *slot = table_find_slot(old, hashv, key, key_size);
+    return *slot != SIZE_MAX ? old : NULL;
+}
+
+// must be called with the shard lock held, the removed entry is handed back for accounting and retiring
+// after unlocking
+static ccask_status_e shard_delete_locked(
+    keydir_shard_t *shard,
+    uint64_t hashv,
+    void *key,
+    uint32_t key_size,
+    uint64_t seq,
+    keydir_entry_t **retired
+) {
+    *retired = NULL;
+    keydir_table_t *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    table_migrate(table, KEYDIR_MIGRATE_GROUPS);
+
+    size_t slot;
+    keydir_table_t *holder = shard_find_slot(table, hashv, key, key_size, &slot);
+    if (!holder) {
+        ccask_errno = CCASK_ERR_NO_KEY;
+        return CCASK_FAIL;
+    }
+
+    // a newer record of the key, only possible while recovering
+    keydir_entry_t *entry = atomic_load_explicit(&TABLE_SLOT(holder, slot), memory_order_relaxed);
+    if (entry->seq > seq) return CCASK_OK;
+
+    shard_preserve_for_snapshots(shard);
+    table_remove(holder, slot);
+    ccask_index_remove(key, key_size);
+
+    // the arena only bump-allocates, a long key's bytes stay allocated until shutdown
+    if (key_size > KEYDIR_INLINE_KEY_SIZE) shard->arena_dead_bytes += key_size;
+
+    *retired = entry;
     return CCASK_OK;
 }
 
-ccask_status_e ccask_keydir_upsert(
+// must be called with the shard lock held, a superseded entry is handed back for accounting and retiring
+// after unlocking. `applied` tells whether the record went in, to account it after unlocking too.
+static ccask_status_e shard_upsert_locked(
+    keydir_shard_t *shard,
+    uint64_t hashv,
     void *key,
     uint32_t key_size,
     uint64_t file_id,
     uint64_t record_pos,
     uint32_t value_size,
-    uint32_t timestamp
+    uint64_t seq,
+    keydir_entry_t **retired,
+    bool *applied
 ) {
-    ccask_keydir_record_t *entry = ccask_keydir_find(key, key_size);
-    pthread_rwlock_wrlock(&hash_table_lock);
-
-    if (entry) {
-        entry->file_id = file_id;
-        entry->record_pos = record_pos;
-        entry->value_size = value_size;
-        entry->timestamp = timestamp;
-        pthread_rwlock_unlock(&hash_table_lock);
+    *retired = NULL;
+    *applied = false;
+    keydir_table_t *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    table_migrate(table, KEYDIR_MIGRATE_GROUPS);
+
+    size_t slot;
+    keydir_table_t *holder = shard_find_slot(table, hashv, key, key_size, &slot);
+
+    // records of a key are applied in sequence order while running, recovery may come across an older one
+    // after a newer one though, which then stays dead
+    keydir_entry_t *old = holder ? atomic_load_explicit(&TABLE_SLOT(holder, slot), memory_order_relaxed) : NULL;
+    if (old && old->seq > seq) return CCASK_OK;
+
+    keydir_entry_t *entry = shard_alloc_entry(shard);
+    if (!entry) return CCASK_RETRY;
+
+    entry->location = ((hashv & KEYDIR_HASH_TAG_MASK) << KEYDIR_RECORD_POS_BITS) | record_pos;
+    entry->seq = seq;
+    entry->file_id = (uint32_t)file_id;
+    entry->value_size = value_size;
+    entry->key_size = key_size;
+
+    if (holder) {
+        // publish a new version, a long key's arena bytes move over to it
+        memcpy(entry->key, old->key, KEYDIR_INLINE_KEY_SIZE);
+
+        if (holder == table) {
+            atomic_store_explicit(&TABLE_SLOT(table, slot), entry, memory_order_release);
+        } else {
+            // still in the table being drained, move it over with the update. The migration math leaves
+            // the new table at most half full, so there's always room.
+            table_insert(table, hashv, entry);
+            table_remove(holder, slot);
+        }
+
+        *retired = old;
+        *applied = true;
         return CCASK_OK;
     }
 
-    entry = malloc(sizeof(ccask_keydir_record_t));
-    if (!entry) {
-        pthread_rwlock_unlock(&hash_table_lock);
+    if (key_size <= KEYDIR_INLINE_KEY_SIZE) {
+        memcpy(entry->key, key, key_size);
+    } else {
+        uint8_t *ptr = shard_alloc_key(shard, key_size);
+        if (!ptr) {
+            shard_unalloc_entry(shard, entry);
+            return CCASK_RETRY;
+        }
+        memcpy(ptr, key, key_size);
+        memcpy(entry->key, &ptr, sizeof(ptr));
+    }
+
+    shard_preserve_for_snapshots(shard);
+
+    // new keys enter the ordered index under the shard lock, so it agrees with the table for every key
+    if (shard_reserve(shard) != CCASK_OK || ccask_index_insert(key, key_size) != CCASK_OK) {
+        // the arena bytes are lost, they're accounted as dead
+        if (key_size > KEYDIR_INLINE_KEY_SIZE) shard->arena_dead_bytes += key_size;
+        shard_unalloc_entry(shard, entry);
+        return CCASK_RETRY;
+    }
+
+    table_insert(atomic_load_explicit(&shard->table, memory_order_relaxed), hashv, entry);
+    *applied = true;
+    return CCASK_OK;
+}
+
+// called after the shard lock is released: accounts an applied update and retires the entry it replaced
+static inline void finish_update(
+    keydir_shard_t *shard,
+    keydir_entry_t *retired,
+    bool applied,
+    uint64_t file_id,
+    uint32_t key_size,
+    uint32_t value_size
+) {
+    if (applied) file_account(file_id, key_size, value_size, true);
+    if (retired) {
+        file_account(retired->file_id, retired->key_size, retired->value_size, false);
+        ccask_epoch_retire(retired, reclaim_entry, shard);
+    }
+}
+
+ccask_status_e ccask_keydir_delete(void *key, uint32_t key_size, uint64_t seq) {
+    uint64_t hashv = ccask_hash_key(key, key_size);
+    keydir_shard_t *shard = keydir_shard_for(hashv);
+
+    keydir_entry_t *retired;
+    pthread_mutex_lock(&shard->lock);
+    ccask_status_e res = shard_delete_locked(shard, hashv, key, key_size, seq, &retired);
+    pthread_mutex_unlock(&shard->lock);
+
+    finish_update(shard, retired, false, 0, 0, 0);
+    return res;
+}
+
+static inline bool location_in_range(uint64_t file_id, uint64_t record_pos) {
+    if (file_id <= UINT32_MAX && record_pos <= KEYDIR_RECORD_POS_MASK) return true;
+
+    log_error("Record location (File ID = %" PRIu64 ", position = %" PRIu64 ") is out of the keydir's range", file_id, record_pos);
+    return false;
+}
+
+ccask_status_e ccask_keydir_upsert(
+    void *key,
+    uint32_t key_size,
+    uint64_t file_id,
+    uint64_t record_pos,
+    uint32_t value_size,
+    uint64_t seq
+) {
+    if (!location_in_range(file_id, record_pos)) return CCASK_FAIL;
+
+    uint64_t hashv = ccask_hash_key(key, key_size);
+    keydir_shard_t *shard = keydir_shard_for(hashv);
+
+    keydir_entry_t *retired;
+    bool applied;
+    pthread_mutex_lock(&shard->lock);
+    ccask_status_e res = shard_upsert_locked(shard, hashv, key, key_size, file_id, record_pos, value_size, seq, &retired, &applied);
+    pthread_mutex_unlock(&shard->lock);
+
+    finish_update(shard, retired, applied, file_id, key_size, value_size);
+    return res;
+}
+
+ccask_status_e ccask_keydir_apply_batch(ccask_keydir_update_t *updates, size_t num_updates) {
+    if (num_updates == 0) return CCASK_OK;
+
+    // per update: its hash while pending, then the entry it retired (if any) and whether it went in
+    uint64_t *hashes = malloc(num_updates * sizeof(uint64_t));
+    keydir_entry_t **retired = malloc(num_updates * sizeof(keydir_entry_t*));
+    bool *done = calloc(num_updates, sizeof(bool));
+    bool *applied = calloc(num_updates, sizeof(bool));
+    if (!hashes || !retired || !done || !applied) {
+        free(hashes);
+        free(retired);
+        free(done);
+        free(applied);
         ccask_errno = CCASK_ERR_NO_MEMORY;
         return CCASK_RETRY;
     }
 
-    entry->key_size = key_size;
-    entry->key = malloc(key_size);
+    for (size_t i = 0; i < num_updates; i++) {
+        hashes[i] = ccask_hash_key(updates[i].key, updates[i].key_size);
+        retired[i] = NULL;
+    }
+
+    ccask_status_e status = CCASK_OK;
+
+    // each shard is locked once, for all of its updates in batch order. Updates of one key share a shard,
+    // so they still apply in order.
+    for (size_t i = 0; i < num_updates; i++) {
+        if (done[i]) continue;
+        keydir_shard_t *shard = keydir_shard_for(hashes[i]);
+
+        pthread_mutex_lock(&shard->lock);
+        for (size_t j = i; j < num_updates; j++) {
+            if (done[j] || keydir_shard_for(hashes[j]) != shard) continue;
+            done[j] = true;
+
+            ccask_keydir_update_t *u = &updates[j];
+            ccask_status_e res;
+            if (u->value_size == 0) {
+                // tombstone, the key may already be absent
+                shard_delete_locked(shard, hashes[j], u->key, u->key_size, u->seq, &retired[j]);
+                res = CCASK_OK;
+            } else if (!location_in_range(u->file_id, u->record_pos)) {
+                res = CCASK_FAIL;
+            } else {
+                CCASK_ATTEMPT(5, res, shard_upsert_locked(
+                    shard, hashes[j], u->key, u->key_size,
+                    u->file_id, u->record_pos, u->value_size, u->seq,
+                    &retired[j], &applied[j]
+                ));
+            }
+
+            if (res != CCASK_OK && status == CCASK_OK) status = res;
+        }
+        pthread_mutex_unlock(&shard->lock);
 
-    if (!entry->key) {
-        pthread_rwlock_unlock(&hash_table_lock);
-        free(entry);
+        for (size_t j = i; j < num_updates; j++) {
+            if (!retired[j] && !applied[j]) continue;
+
+            ccask_keydir_update_t *u = &updates[j];
+            finish_update(keydir_shard_for(hashes[j]), retired[j], applied[j], u->file_id, u->key_size, u->value_size);
+            retired[j] = NULL;
+            applied[j] = false;
+        }
+    }
+
+    free(hashes);
+    free(retired);
+    free(done);
+    free(applied);
+    return status;
+}
+
+ccask_status_e ccask_keydir_apply_batch_atomic(ccask_keydir_update_t *updates, size_t num_updates) {
+    if (num_updates == 0) return CCASK_OK;
+
+    uint64_t *hashes = malloc(num_updates * sizeof(uint64_t));
+    keydir_entry_t **retired = malloc(num_updates * sizeof(keydir_entry_t*));
+    bool *applied = calloc(num_updates, sizeof(bool));
+    bool *locked = calloc(num_shards, sizeof(bool));
+    if (!hashes || !retired || !applied || !locked) {
+        free(hashes);
+        free(retired);
+        free(applied);
+        free(locked);
         ccask_errno = CCASK_ERR_NO_MEMORY;
         return CCASK_RETRY;
     }
 
-    memcpy(entry->key, key, key_size);
+    for (size_t i = 0; i < num_updates; i++) {
+        hashes[i] = ccask_hash_key(updates[i].key, updates[i].key_size);
+        retired[i] = NULL;
+        locked[keydir_shard_for(hashes[i]) - shards] = true;
+    }
 
-    entry->file_id = file_id;
-    entry->record_pos = record_pos;
-    entry->value_size = value_size;
-    entry->timestamp = timestamp;
+    // every shard involved is held for the whole batch (taken in shard order, like snapshots do), so
+    // anything else that locks shards sees all of the batch or none of it
+    for (size_t i = 0; i < num_shards; i++) {
+        if (locked[i]) pthread_mutex_lock(&shards[i].lock);
+    }
 
-    HASH_ADD_KEYPTR(hh, hash_table, entry->key, key_size, entry);
+    ccask_status_e status = CCASK_OK;
+    for (size_t i = 0; i < num_updates; i++) {
+        keydir_shard_t *shard = keydir_shard_for(hashes[i]);
+        ccask_keydir_update_t *u = &updates[i];
+        ccask_status_e res;
+        if (u->value_size == 0) {
+            shard_delete_locked(shard, hashes[i], u->key, u->key_size, u->seq, &retired[i]);
+            res = CCASK_OK;
+        } else if (!location_in_range(u->file_id, u->record_pos)) {
+            res = CCASK_FAIL;
+        } else {
+            CCASK_ATTEMPT(5, res, shard_upsert_locked(
+                shard, hashes[i], u->key, u->key_size,
+                u->file_id, u->record_pos, u->value_size, u->seq,
+                &retired[i], &applied[i]
+            ));
+        }
 
-    pthread_rwlock_unlock(&hash_table_lock);
-    return CCASK_OK;
+        if (res != CCASK_OK && status == CCASK_OK) status = res;
+    }
+
+    for (size_t i = num_shards; i-- > 0;) {
+        if (locked[i]) pthread_mutex_unlock(&shards[i].lock);
+    }
+
+    for (size_t i = 0; i < num_updates; i++) {
+        ccask_keydir_update_t *u = &updates[i];
+        finish_update(keydir_shard_for(hashes[i]), retired[i], applied[i], u->file_id, u->key_size, u->value_size);
+    }
+
+    free(hashes);
+    free(retired);
+    free(applied);
+    free(locked);
+    return status;
+}
+
+void ccask_keydir_get_stats(ccask_keydir_stats_t *stats) {
+    memset(stats, 0, sizeof(ccask_keydir_stats_t));
+
+    for (size_t i = 0; i < num_shards; i++) {
+        keydir_shard_t *shard = &shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        keydir_table_t *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+        keydir_table_t *old = atomic_load_explicit(&table->old, memory_order_relaxed);
+
+        stats->num_keys += table->count + (old ? old->count : 0);
+        stats->table_bytes += table_bytes(table) + (old ? table_bytes(old) : 0);
+        stats->entry_bytes += shard->num_slabs * sizeof(keydir_slab_t);
+        stats->key_arena_bytes += shard->arena_bytes;
+        stats->key_arena_dead_bytes += shard->arena_dead_bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    stats->index_bytes = ccask_index_bytes();
+    stats->total_bytes = num_shards * sizeof(keydir_shard_t) + stats->table_bytes + stats->entry_bytes +
+        stats->key_arena_bytes + stats->index_bytes;
+    stats->bytes_per_key = stats->num_keys ? (double)stats->total_bytes / stats->num_keys : 0;
+}
+
+// copies the shard's records and keys under its lock, so entries moved by a resize are neither missed nor
+// repeated, and nothing the iterator holds can be reclaimed
+static bool iter_load_shard(ccask_keydir_record_iter_t *iter) {
+    keydir_shard_t *shard = &shards[iter->shard];
+    iter->num_records = 0;
+    iter->pos = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    keydir_table_t *table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    keydir_table_t *old = atomic_load_explicit(&table->old, memory_order_relaxed);
+    size_t count = table->count + (old ? old->count : 0);
+
+    size_t key_bytes = 0;
+    for (keydir_table_t *t = table; t; t = (t == table ? old : NULL)) {
+        for (size_t i = 0; i < table_capacity(t); i++) {
+            if (CTRL_IS_FULL(TABLE_CTRL(t, i))) {
+                key_bytes += atomic_load_explicit(&TABLE_SLOT(t, i), memory_order_relaxed)->key_size;
+            }
+        }
+    }
+
+    if (count > iter->capacity) {
+        ccask_keydir_record_t *records = realloc(iter->records, count * sizeof(ccask_keydir_record_t));
+        if (!records) goto no_memory;
+        iter->records = records;
+        iter->capacity = count;
+    }
+
+    if (key_bytes > iter->keys_capacity) {
+        uint8_t *keys = realloc(iter->keys, key_bytes);
+        if (!keys) goto no_memory;
+        iter->keys = keys;
+        iter->keys_capacity = key_bytes;
+    }
+
+    uint8_t *key = iter->keys;
+    for (keydir_table_t *t = table; t; t = (t == table ? old : NULL)) {
+        for (size_t i = 0; i < table_capacity(t); i++) {
+            if (!CTRL_IS_FULL(TABLE_CTRL(t, i))) continue;
+
+            keydir_entry_t *entry = atomic_load_explicit(&TABLE_SLOT(t, i), memory_order_relaxed);
+            ccask_keydir_record_t *record = &iter->records[iter->num_records++];
+            entry_to_record(entry, record);
+            memcpy(key, record->key, record->key_size);
+            record->key = key;
+            key += record->key_size;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+
+no_memory:
+    pthread_mutex_unlock(&shard->lock);
+    ccask_errno = CCASK_ERR_NO_MEMORY;
+    return false;
 }
 
 ccask_keydir_record_iter_t ccask_keydir_record_iter(void) {
-    pthread_rwlock_rdlock(&hash_table_lock);
     ccask_keydir_record_iter_t iter;
-    iter.next = hash_table;
+    iter.shard = 0;
+    iter.records = NULL;
+    iter.num_records = 0;
+    iter.capacity = 0;
+    iter.keys = NULL;
+    iter.keys_capacity = 0;
+    iter.pos = 0;
+    if (num_shards > 0 && !iter_load_shard(&iter)) iter.shard = num_shards;
     return iter;
 }
 
 ccask_keydir_record_t* ccask_keydir_record_iter_next(ccask_keydir_record_iter_t *iter) {
-    if (iter->next == NULL) return NULL;
+    while (iter->shard < num_shards) {
+        if (iter->pos < iter->num_records) return &iter->records[iter->pos++];
+
+        iter->shard++;
+        if (iter->shard < num_shards && !iter_load_shard(iter)) {
+            log_error("Couldn't load keydir shard for iteration, ending it early");
+            iter->shard = num_shards;
+        }
+    }
 
-    ccask_keydir_record_t *record = iter->next;
-    iter->next = iter->next->hh.next;
-    return record;
+    return NULL;
 }
 
 void ccask_keydir_record_iter_close(ccask_keydir_record_iter_t *iter) {
-    iter->next = NULL;
-    pthread_rwlock_unlock(&hash_table_lock);
+    free(iter->records);
+    free(iter->keys);
+    iter->records = NULL;
+    iter->keys = NULL;
+    iter->num_records = 0;
+    iter->shard = num_shards;
+}
+
+ccask_keydir_snapshot_t* ccask_keydir_snapshot_open(void) {
+    ccask_keydir_snapshot_t *snap = malloc(sizeof(ccask_keydir_snapshot_t));
+    if (!snap) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return NULL;
+    }
+
+    snap->shards = malloc(num_shards * sizeof(_Atomic(snapshot_shard_t*)));
+    if (!snap->shards) {
+        free(snap);
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        return NULL;
+    }
+    for (size_t i = 0; i < num_shards; i++) {
+        atomic_init(&snap->shards[i], NULL);
+    }
+    atomic_init(&snap->failed, false);
+
+    // with every shard lock held, no change is half-applied, so this is one point in time for all shards
+    for (size_t i = 0; i < num_shards; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+    }
+    pthread_mutex_lock(&snapshots_lock);
+
+    snap->gen = atomic_fetch_add(&snapshot_gen, 1) + 1;
+    snap->prev = NULL;
+    snap->next = snapshots;
+    if (snapshots) snapshots->prev = snap;
+    snapshots = snap;
+
+    pthread_mutex_unlock(&snapshots_lock);
+    for (size_t i = num_shards; i > 0; i--) {
+        pthread_mutex_unlock(&shards[i - 1].lock);
+    }
+
+    return snap;
+}
+
+ccask_status_e ccask_keydir_snapshot_next(
+    ccask_keydir_snapshot_t *snap,
+    uint64_t *shard_idx,
+    uint64_t *pos,
+    void **key,
+    uint32_t *key_size
+) {
+    while (*shard_idx < num_shards) {
+        _Atomic(snapshot_shard_t*) *slot = &snap->shards[*shard_idx];
+        snapshot_shard_t *saved = atomic_load_explicit(slot, memory_order_acquire);
+
+        if (!saved) {
+            // no writer changed the shard yet, so its current keys are the snapshot's
+            keydir_shard_t *shard = &shards[*shard_idx];
+            pthread_mutex_lock(&shard->lock);
+            saved = atomic_load_explicit(slot, memory_order_relaxed);
+            if (!saved) {
+                saved = shard_materialize(shard);
+                if (saved) atomic_store_explicit(slot, saved, memory_order_release);
+            }
+            pthread_mutex_unlock(&shard->lock);
+
+            if (!saved) {
+                ccask_errno = CCASK_ERR_NO_MEMORY;
+                return CCASK_FAIL;
+            }
+        }
+
+        if (atomic_load(&snap->failed)) {
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return CCASK_FAIL;
+        }
+
+        if (*pos < saved->count) {
+            uint8_t *entry = saved->bytes + saved->offsets[*pos];
+            memcpy(key_size, entry, sizeof(uint32_t));
+            *key = entry + sizeof(uint32_t);
+            (*pos)++;
+            return CCASK_OK;
+        }
+
+        (*shard_idx)++;
+        *pos = 0;
+    }
+
+    ccask_errno = CCASK_ERR_ITER_END;
+    return CCASK_FAIL;
+}
+
+void ccask_keydir_snapshot_close(ccask_keydir_snapshot_t *snap) {
+    pthread_mutex_lock(&snapshots_lock);
+    if (snap->prev) snap->prev->next = snap->next;
+    else snapshots = snap->next;
+    if (snap->next) snap->next->prev = snap->prev;
+    pthread_mutex_unlock(&snapshots_lock);
+
+    // no writer can reach the snapshot anymore
+    for (size_t i = 0; i < num_shards; i++) {
+        free_snapshot_shard(atomic_load(&snap->shards[i]));
+    }
+    free(snap->shards);
+    free(snap);
 }
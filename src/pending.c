@@ -0,0 +1,245 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "ccask/pending.h"
+
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "ccask/hash.h"
+
+#define PENDING_MIN_BUCKETS 16
+
+typedef struct pending_entry {
+    struct pending_entry *next;
+    uint64_t hashv;
+    size_t seq;
+    ccask_datafile_record_t record; // shallow copy, the key and value are read from it
+} pending_entry_t;
+
+/**
+ * Chained hash table with a fixed number of buckets, entries are recycled through a free-list so the
+ * put path doesn't allocate once the queue has been full before.
+ */
+typedef struct pending_shard {
+    pthread_mutex_t lock;
+    pending_entry_t **buckets;
+    size_t mask;
+    pending_entry_t *free_entries;
+    _Atomic size_t count; // read without the lock, so reads skip shards with nothing queued
+} __attribute__((aligned(64))) pending_shard_t;
+
+static pending_shard_t shards[PENDING_SHARDS];
+
+// buckets use the low bits of the hash, so shards are picked from the high ones
+static inline pending_shard_t* shard_for(uint64_t hashv) {
+    return &shards[(hashv >> 58) % PENDING_SHARDS];
+}
+
+static inline uint32_t record_key_size(ccask_datafile_record_t record) {
+    return record[1].iov_len;
+}
+
+// returns the link pointing at the key's entry, which is NULL if it has none
+static pending_entry_t** find_link(pending_shard_t *shard, uint64_t hashv, const void *key, uint32_t key_size) {
+    pending_entry_t **link = &shard->buckets[hashv & shard->mask];
+    while (*link) {
+        pending_entry_t *entry = *link;
+        if (entry->hashv == hashv && record_key_size(entry->record) == key_size &&
+            memcmp(ccask_get_datafile_record_key(entry->record), key, key_size) == 0) break;
+        link = &entry->next;
+    }
+    return link;
+}
+
+ccask_status_e ccask_pending_init(size_t capacity) {
+    size_t buckets = PENDING_MIN_BUCKETS;
+    while (buckets * PENDING_SHARDS < capacity) buckets <<= 1;
+
+    for (size_t i = 0; i < PENDING_SHARDS; i++) {
+        shards[i].buckets = calloc(buckets, sizeof(pending_entry_t*));
+        if (!shards[i].buckets) {
+            while (i-- > 0) free(shards[i].buckets);
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return CCASK_FAIL;
+        }
+
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].mask = buckets - 1;
+        shards[i].free_entries = NULL;
+        atomic_init(&shards[i].count, 0);
+    }
+
+    return CCASK_OK;
+}
+
+static void free_chain(pending_entry_t *entry) {
+    while (entry) {
+        pending_entry_t *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+}
+
+void ccask_pending_shutdown(void) {
+    // the writer has drained the queue by now, anything left belongs to records that are already freed
+    for (size_t i = 0; i < PENDING_SHARDS; i++) {
+        for (size_t b = 0; b <= shards[i].mask; b++) free_chain(shards[i].buckets[b]);
+        free_chain(shards[i].free_entries);
+        free(shards[i].buckets);
+        shards[i].buckets = NULL;
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+}
+
+ccask_status_e ccask_pending_add(ccask_datafile_record_t record, size_t seq) {
+    void *key = ccask_get_datafile_record_key(record);
+    uint32_t key_size = record_key_size(record);
+    uint64_t hashv = ccask_hash_key(key, key_size);
+    pending_shard_t *shard = shard_for(hashv);
+
+    pthread_mutex_lock(&shard->lock);
+    pending_entry_t **link = find_link(shard, hashv, key, key_size);
+    pending_entry_t *entry = *link;
+    if (entry) {
+        // concurrent puts of a key can get here out of queue order, the writer applies them in it
+        if (entry->seq < seq) {
+            memcpy(entry->record, record, sizeof(ccask_datafile_record_t));
+            entry->seq = seq;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        return CCASK_OK;
+    }
+
+    entry = shard->free_entries;
+    if (entry) {
+        shard->free_entries = entry->next;
+    } else {
+        entry = malloc(sizeof(pending_entry_t));
+        if (!entry) {
+            pthread_mutex_unlock(&shard->lock);
+            ccask_errno = CCASK_ERR_NO_MEMORY;
+            return CCASK_FAIL;
+        }
+    }
+
+    memcpy(entry->record, record, sizeof(ccask_datafile_record_t));
+    entry->hashv = hashv;
+    entry->seq = seq;
+    entry->next = NULL;
+    *link = entry;
+    atomic_fetch_add_explicit(&shard->count, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&shard->lock);
+    return CCASK_OK;
+}
+
+// must be called with the shard's lock held
+static void remove_locked(pending_shard_t *shard, uint64_t hashv, ccask_datafile_record_t record) {
+    pending_entry_t **link = find_link(shard, hashv, ccask_get_datafile_record_key(record), record_key_size(record));
+    pending_entry_t *entry = *link;
+
+    // a later put of the key may have replaced this record, its own write removes the entry
+    if (entry && entry->record[0].iov_base == record[0].iov_base) {
+        *link = entry->next;
+        entry->next = shard->free_entries;
+        shard->free_entries = entry;
+        atomic_fetch_sub_explicit(&shard->count, 1, memory_order_relaxed);
+    }
+}
+
+void ccask_pending_remove_batch(ccask_datafile_record_t *records, size_t num_records) {
+    uint64_t hashes[num_records];
+    uint8_t shard_of[num_records];
+    size_t order[num_records];
+    size_t starts[PENDING_SHARDS + 1] = { 0 };
+
+    // grouped by shard (counting sort), so each shard is locked once for the whole batch
+    for (size_t i = 0; i < num_records; i++) {
+        hashes[i] = ccask_hash_key(ccask_get_datafile_record_key(records[i]), record_key_size(records[i]));
+        shard_of[i] = shard_for(hashes[i]) - shards;
+        starts[shard_of[i] + 1]++;
+    }
+    for (size_t s = 0; s < PENDING_SHARDS; s++) starts[s + 1] += starts[s];
+
+    size_t next[PENDING_SHARDS];
+    memcpy(next, starts, sizeof(next));
+    for (size_t i = 0; i < num_records; i++) order[next[shard_of[i]]++] = i;
+
+    for (size_t s = 0; s < PENDING_SHARDS; s++) {
+        if (starts[s] == starts[s + 1]) continue;
+        pending_shard_t *shard = &shards[s];
+        if (atomic_load_explicit(&shard->count, memory_order_relaxed) == 0) continue;
+
+        pthread_mutex_lock(&shard->lock);
+        for (size_t k = starts[s]; k < starts[s + 1]; k++) remove_locked(shard, hashes[order[k]], records[order[k]]);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// the key's entry with its shard's lock held, or NULL (and nothing locked)
+static pending_entry_t* lock_entry(void *key, uint32_t key_size, pending_shard_t **shard_out) {
+    uint64_t hashv = ccask_hash_key(key, key_size);
+    pending_shard_t *shard = shard_for(hashv);
+    if (atomic_load_explicit(&shard->count, memory_order_relaxed) == 0) return NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    pending_entry_t *entry = *find_link(shard, hashv, key, key_size);
+    if (!entry) {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    *shard_out = shard;
+    return entry;
+}
+
+bool ccask_pending_find(void *key, uint32_t key_size, ccask_record_t *out) {
+    pending_shard_t *shard;
+    pending_entry_t *entry = lock_entry(key, key_size, &shard);
+    if (!entry) return false;
+
+    // copied under the lock, the writer frees the record only after removing its entry. It may be stamping
+    // the record's sequence number meanwhile, so the header is only read where that doesn't write.
+    uint32_t value_size = entry->record[2].iov_len;
+    out->timestamp = ccask_get_datafile_record_timestamp(entry->record);
+    out->key_size = entry->record[1].iov_len;
+    out->value_size = value_size;
+    out->value = NULL;
+    if (value_size > 0) {
+        out->value = malloc(value_size);
+        if (out->value) memcpy(out->value, ccask_get_datafile_record_value(entry->record), value_size);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (value_size > 0 && !out->value) ccask_errno = CCASK_ERR_NO_MEMORY;
+    return true;
+}
+
+bool ccask_pending_find_into(void *key, uint32_t key_size, void *buf, uint32_t cap, uint32_t *value_size) {
+    pending_shard_t *shard;
+    pending_entry_t *entry = lock_entry(key, key_size, &shard);
+    if (!entry) return false;
+
+    // see ccask_pending_find
+    *value_size = entry->record[2].iov_len;
+    if (*value_size <= cap) memcpy(buf, ccask_get_datafile_record_value(entry->record), *value_size);
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+}
@@ -22,12 +22,19 @@
 #include "unistd.h"
 #include "pthread.h"
 #include "inttypes.h"
+#include "stdlib.h"
+#include "string.h"
 #include "ccask/files.h"
+#include "ccask/io.h"
 #include "ccask/utils.h"
 #include "ccask/log.h"
 
 #define FD_INVALIDATE_DURATION 5 // seconds
 
+#define READ_MERGE_GAP 4096                 // most bytes between two records of a batch still read together
+#define READ_MERGE_MAX_BYTES (1024 * 1024)  // most bytes of one merged read
+#define READ_MERGE_MAX_IOVS 64              // most iovecs of one merged read
+
 static void* datafile_fd_invalidator_thread(void* arg) {
     ccask_file_t* file = (ccask_file_t*)arg;
     while (true) {
@@ -45,15 +52,10 @@ static void* datafile_fd_invalidator_thread(void* arg) {
     }
 }
 
-ccask_status_e ccask_read_datafile_record(uint64_t file_id, ccask_datafile_record_t record, uint64_t record_pos) {
+// opens the file's fd for reading if the FD invalidator closed it (or it was never opened)
+static ccask_status_e open_datafile_fd(ccask_file_t *file) {
     int ret = CCASK_OK;
 
-    ccask_file_t *file = ccask_files_get_file(file_id);
-    if (!file) {
-        ccask_errno = CCASK_ERR_NO_SUCH_DATAFILE;
-        return CCASK_FAIL;
-    }
-
     pthread_rwlock_rdlock(&file->rwlock);
     bool needs_open = (file->fd < 0);
     pthread_rwlock_unlock(&file->rwlock);
@@ -89,12 +91,28 @@ ccask_status_e ccask_read_datafile_record(uint64_t file_id, ccask_datafile_recor
             }
         }
         pthread_rwlock_unlock(&file->rwlock);
-        if (ret != CCASK_OK) return ret;
     }
 
+    return ret;
+}
+
+ccask_status_e ccask_read_datafile_record(uint64_t file_id, ccask_datafile_record_t record, uint64_t record_pos) {
+    int ret = CCASK_OK;
+
+    ccask_file_t *file = ccask_files_get_file(file_id);
+    if (!file) {
+        ccask_errno = CCASK_ERR_NO_SUCH_DATAFILE;
+        return CCASK_FAIL;
+    }
+
+    // rotated datafiles are read from their mapping, without taking the file's lock
+    if (ccask_files_read_mapped(file, record, 3, record_pos)) return CCASK_OK;
+
+    if (open_datafile_fd(file) != CCASK_OK) return CCASK_FAIL;
+
     pthread_rwlock_rdlock(&file->rwlock);
-    ssize_t n = safe_preadv(file->fd, record, 3, record_pos);
-    if (n < 0) {
+    ccask_status_e n = ccask_files_read(file, record, 3, record_pos);
+    if (n != CCASK_OK) {
         log_error("Read failed on Datafile ID=%" PRIu64, file->file_id);
         ccask_errno = CCASK_ERR_READ_FAILED;
         ret = CCASK_FAIL;
@@ -105,3 +123,140 @@ ccask_status_e ccask_read_datafile_record(uint64_t file_id, ccask_datafile_recor
 
     return ret;
 }
+
+static int compare_requests(const void *a, const void *b) {
+    const ccask_read_request_t *x = *(ccask_read_request_t *const *)a;
+    const ccask_read_request_t *y = *(ccask_read_request_t *const *)b;
+    if (x->file_id != y->file_id) return x->file_id < y->file_id ? -1 : 1;
+    if (x->record_pos != y->record_pos) return x->record_pos < y->record_pos ? -1 : 1;
+    return 0;
+}
+
+static inline uint64_t request_size(const ccask_read_request_t *request) {
+    return request->record[0].iov_len + request->record[1].iov_len + request->record[2].iov_len;
+}
+
+void ccask_read_datafile_records(ccask_read_request_t *requests, size_t num_requests) {
+    if (num_requests == 0) return;
+
+    // the requests in read order, for each one the merged read it's part of, the merged reads with their iovecs
+    // (3 per record and 1 per gap), and the files whose rdlock is held until they're done
+    size_t scratch_size = num_requests * (sizeof(ccask_read_request_t*) + sizeof(size_t) + sizeof(ccask_io_read_t) +
+                                          4 * sizeof(struct iovec) + sizeof(ccask_file_t*));
+    uint8_t *scratch = malloc(scratch_size);
+    if (!scratch) {
+        for (size_t i = 0; i < num_requests; i++) {
+            requests[i].status = ccask_read_datafile_record(requests[i].file_id, requests[i].record, requests[i].record_pos);
+        }
+        return;
+    }
+
+    ccask_io_read_t *reads = (ccask_io_read_t*)scratch;
+    struct iovec *iovs = (struct iovec*)(reads + num_requests);
+    ccask_read_request_t **sorted = (ccask_read_request_t**)(iovs + 4 * num_requests);
+    size_t *read_of = (size_t*)(sorted + num_requests);
+    ccask_file_t **locked = (ccask_file_t**)(read_of + num_requests);
+    size_t num_reads = 0, num_iovs = 0, num_locked = 0;
+
+    for (size_t i = 0; i < num_requests; i++) sorted[i] = &requests[i];
+    qsort(sorted, num_requests, sizeof(ccask_read_request_t*), compare_requests);
+
+    // bytes between records read together land here and are dropped
+    uint8_t gap[READ_MERGE_GAP];
+
+    for (size_t i = 0, end; i < num_requests; i = end) {
+        uint64_t file_id = sorted[i]->file_id;
+        for (end = i; end < num_requests && sorted[end]->file_id == file_id; end++);
+
+        ccask_file_t *file = ccask_files_get_file(file_id);
+        if (!file) {
+            for (size_t k = i; k < end; k++) sorted[k]->status = CCASK_FAIL;
+            ccask_errno = CCASK_ERR_NO_SUCH_DATAFILE;
+            continue;
+        }
+
+        // rotated datafiles are read from their mapping, what's left (CCASK_RETRY) goes through the fd
+        bool needs_fd = false;
+        for (size_t k = i; k < end; k++) {
+            ccask_read_request_t *request = sorted[k];
+            request->status = ccask_files_read_mapped(file, request->record, 3, request->record_pos) ? CCASK_OK : CCASK_RETRY;
+            needs_fd |= request->status == CCASK_RETRY;
+        }
+        if (!needs_fd) continue;
+
+        bool readable = false;
+        if (open_datafile_fd(file) == CCASK_OK) {
+            // the FD invalidator may have closed it again already
+            pthread_rwlock_rdlock(&file->rwlock);
+            readable = file->fd >= 0;
+            if (readable) locked[num_locked++] = file;
+            else pthread_rwlock_unlock(&file->rwlock);
+        }
+        if (!readable) {
+            for (size_t k = i; k < end; k++) {
+                if (sorted[k]->status == CCASK_RETRY) sorted[k]->status = CCASK_FAIL;
+            }
+            continue;
+        }
+
+        // records separated by at most READ_MERGE_GAP bytes are read with one preadv
+        ccask_io_read_t *run = NULL;
+        uint64_t run_end = 0;
+        for (size_t k = i; k < end; k++) {
+            ccask_read_request_t *request = sorted[k];
+            if (request->status != CCASK_RETRY) continue;
+            if (ccask_files_read_staged(file, request->record, 3, request->record_pos)) {
+                request->status = CCASK_OK;
+                continue;
+            }
+
+            uint64_t pos = request->record_pos;
+            uint64_t size = request_size(request);
+            bool merge = run && pos >= run_end && pos - run_end <= READ_MERGE_GAP &&
+                         pos + size - (uint64_t)run->offset <= READ_MERGE_MAX_BYTES && run->iovcnt + 4 <= READ_MERGE_MAX_IOVS;
+            if (!merge) {
+                run = &reads[num_reads++];
+                run->fd = file->fd;
+                run->iov = &iovs[num_iovs];
+                run->iovcnt = 0;
+                run->offset = (off_t)pos;
+            } else if (pos > run_end) {
+                iovs[num_iovs++] = (struct iovec){ .iov_base = gap, .iov_len = pos - run_end };
+                run->iovcnt++;
+            }
+
+            memcpy(&iovs[num_iovs], request->record, sizeof(ccask_datafile_record_t));
+            num_iovs += 3;
+            run->iovcnt += 3;
+            run_end = pos + size;
+            read_of[k] = num_reads - 1;
+        }
+    }
+
+    ccask_io_preadv_batch(reads, num_reads);
+
+    for (size_t k = 0; k < num_requests; k++) {
+        if (sorted[k]->status != CCASK_RETRY) continue;
+        sorted[k]->status = reads[read_of[k]].status;
+        if (sorted[k]->status != CCASK_OK) {
+            log_error("Read failed on Datafile ID=%" PRIu64, sorted[k]->file_id);
+            ccask_errno = CCASK_ERR_READ_FAILED;
+        }
+    }
+
+    time_t now = time(NULL);
+    for (size_t i = 0; i < num_locked; i++) {
+        locked[i]->last_accessed = now;
+        pthread_rwlock_unlock(&locked[i]->rwlock);
+    }
+    free(scratch);
+}
+
+bool ccask_borrow_datafile_record(uint64_t file_id, ccask_datafile_record_t record, uint64_t record_pos, ccask_file_t **file) {
+    *file = ccask_files_get_file(file_id);
+    return *file && ccask_files_borrow_mapped(*file, record, 3, record_pos);
+}
+
+void ccask_return_datafile_record(ccask_file_t *file) {
+    ccask_files_return_mapped(file);
+}
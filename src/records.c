@@ -21,72 +21,131 @@
 #include "stdlib.h"
 #include "stdbool.h"
 #include "string.h"
+#include "zlib.h"
 #include "ccask/utils.h"
 #include "ccask/status.h"
 
 ccask_status_e ccask_allocate_datafile_record(ccask_datafile_record_t record, uint32_t key_size, uint32_t value_size) {
-    record[0].iov_len = DATAFILE_RECORD_HEADER_SIZE;
-    record[1].iov_len = key_size;
-    record[2].iov_len = value_size;
-
-    bool done = true;
-    int i = 0;
-    for (; i < 3; i++) {
-        record[i].iov_base = malloc(record[i].iov_len);
-        if (!record[i].iov_base) {
-            done = false;
-            break;
-        }
-    }
-
-    if (!done) {
-        for (; i > 0; i--) {
-            free(record[i].iov_base);
-        }
+    // one buffer holding the header, key and value back to back
+    uint8_t *buf = malloc(DATAFILE_RECORD_HEADER_SIZE + (size_t)key_size + value_size);
+    if (!buf) {
         ccask_errno = CCASK_ERR_NO_MEMORY;
         return CCASK_FAIL;
     }
 
+    record[0].iov_base = buf;
+    record[0].iov_len = DATAFILE_RECORD_HEADER_SIZE;
+    record[1].iov_base = buf + DATAFILE_RECORD_HEADER_SIZE;
+    record[1].iov_len = key_size;
+    record[2].iov_base = buf + DATAFILE_RECORD_HEADER_SIZE + key_size;
+    record[2].iov_len = value_size;
     return CCASK_OK;
 }
 
+// CRC of everything after the sequence number, the parts needn't be back to back (reads fill separate buffers)
+static inline uint32_t body_crc(ccask_datafile_record_t record) {
+    uLong crc = crc32(crc32(0, NULL, 0), (const uint8_t*)record[0].iov_base + 12, record[0].iov_len - 12);
+    crc = crc32(crc, record[1].iov_base, record[1].iov_len);
+    return (uint32_t)crc32(crc, record[2].iov_base, record[2].iov_len);
+}
+
+static inline uint32_t seq_crc(const uint8_t *seq_buf) {
+    return (uint32_t)crc32(crc32(0, NULL, 0), seq_buf, 8);
+}
+
 ccask_status_e ccask_create_datafile_record(
     ccask_datafile_record_t record,
-    uint32_t timestamp,
+    uint64_t timestamp,
     void *key,
     uint32_t key_size,
     void *value,
     uint32_t value_size
 ) {
-    uint32_t crc = calculate_crc32(timestamp, key_size, value_size, key, value);
-
     ccask_status_e res = ccask_allocate_datafile_record(record, key_size, value_size);
     if (res != CCASK_OK) return res;
 
-    write_be32((uint8_t*)record[0].iov_base, crc);
-    write_be32((uint8_t*)record[0].iov_base + 4, timestamp);
-    write_be32((uint8_t*)record[0].iov_base + 8, key_size);
-    write_be32((uint8_t*)record[0].iov_base + 12, value_size);
+    uint8_t *header_buf = record[0].iov_base;
+    write_be64(header_buf + 4, 0);
+    write_be64(header_buf + 12, timestamp);
+    write_be32(header_buf + 20, key_size);
+    write_be32(header_buf + 24, value_size);
 
     memcpy(record[1].iov_base, key, key_size);
-    memcpy(record[2].iov_base, value, value_size);
+    if (value_size > 0) memcpy(record[2].iov_base, value, value_size);
+
+    write_be32(header_buf, body_crc(record) ^ seq_crc(header_buf + 4));
     return CCASK_OK;
 }
 
+void ccask_stamp_datafile_record(ccask_datafile_record_t record, uint64_t seq) {
+    uint8_t *header_buf = record[0].iov_base;
+    uint32_t crc = read_be32(header_buf) ^ seq_crc(header_buf + 4);
+    write_be64(header_buf + 4, seq);
+    write_be32(header_buf, crc ^ seq_crc(header_buf + 4));
+}
+
+uint32_t ccask_compute_datafile_record_crc(ccask_datafile_record_t record) {
+    return body_crc(record) ^ seq_crc((uint8_t*)record[0].iov_base + 4);
+}
+
 ccask_datafile_record_header_t ccask_get_datafile_record_header(ccask_datafile_record_t record) {
     uint8_t *header_buf = record[0].iov_base;
     ccask_datafile_record_header_t header;
     header.crc = read_be32(header_buf);
-    header.timestamp = read_be32(header_buf + 4);
-    header.key_size = read_be32(header_buf + 8);
-    header.value_size = read_be32(header_buf + 12);
+    header.seq = read_be64(header_buf + 4);
+    header.timestamp = read_be64(header_buf + 12);
+    header.key_size = read_be32(header_buf + 20);
+    header.value_size = read_be32(header_buf + 24);
+    return header;
+}
+
+uint64_t ccask_get_datafile_record_timestamp(ccask_datafile_record_t record) {
+    return read_be64((uint8_t*)record[0].iov_base + 12);
+}
+
+ccask_status_e ccask_create_datafile_batch_header(
+    ccask_datafile_record_t record,
+    uint64_t timestamp,
+    ccask_datafile_record_t *records,
+    size_t num_records
+) {
+    uint64_t length = 0;
+    uint32_t batch_crc = (uint32_t)crc32(0, NULL, 0);
+    for (size_t i = 0; i < num_records; i++) {
+        struct iovec iov = ccask_get_datafile_record_iovec(records[i]);
+        batch_crc = (uint32_t)crc32(batch_crc, iov.iov_base, iov.iov_len);
+        length += iov.iov_len;
+    }
+
+    uint8_t value[DATAFILE_BATCH_HEADER_VALUE_SIZE];
+    write_be32(value, DATAFILE_BATCH_MAGIC);
+    write_be32(value + 4, (uint32_t)num_records);
+    write_be64(value + 8, length);
+    write_be32(value + 16, batch_crc);
+    write_be32(value + 20, 0);
+
+    return ccask_create_datafile_record(record, timestamp, value, 0, value, DATAFILE_BATCH_HEADER_VALUE_SIZE);
+}
+
+bool ccask_is_datafile_batch_header(ccask_datafile_record_t record) {
+    // every write path refuses empty keys (CCASK_ERR_EMPTY_KEY), so no other record can look like this
+    return record[1].iov_len == 0 &&
+        record[2].iov_len == DATAFILE_BATCH_HEADER_VALUE_SIZE &&
+        read_be32(record[2].iov_base) == DATAFILE_BATCH_MAGIC;
+}
+
+ccask_datafile_batch_header_t ccask_get_datafile_batch_header(ccask_datafile_record_t record) {
+    const uint8_t *value = record[2].iov_base;
+    ccask_datafile_batch_header_t header;
+    header.count = read_be32(value + 4);
+    header.length = read_be64(value + 8);
+    header.crc = read_be32(value + 16);
     return header;
 }
 
 void free_datafile_record(ccask_datafile_record_t record) {
+    // the key and value live in the header's buffer
     if (record[0].iov_base) free(record[0].iov_base);
-    if (record[1].iov_base) free(record[1].iov_base);
-    if (record[2].iov_base) free(record[2].iov_base);
 }
 
 ccask_status_e ccask_allocate_hintfile_record(ccask_hintfile_record_t record, uint32_t key_size) {
@@ -116,7 +175,8 @@ ccask_status_e ccask_allocate_hintfile_record(ccask_hintfile_record_t record, ui
 
 ccask_status_e ccask_create_hintfile_record(
     ccask_hintfile_record_t record,
-    uint32_t timestamp,
+    uint64_t seq,
+    uint64_t timestamp,
     uint32_t key_size,
     uint32_t value_size,
     uint64_t record_pos,
@@ -125,10 +185,11 @@ ccask_status_e ccask_create_hintfile_record(
     ccask_status_e res = ccask_allocate_hintfile_record(record, key_size);
     if (res != CCASK_OK) return res;
 
-    write_be32((uint8_t*)record[0].iov_base, timestamp);
-    write_be32((uint8_t*)record[0].iov_base + 4, key_size);
-    write_be32((uint8_t*)record[0].iov_base + 8, value_size);
-    write_be64((uint8_t*)record[0].iov_base + 12, record_pos);
+    write_be64((uint8_t*)record[0].iov_base, seq);
+    write_be64((uint8_t*)record[0].iov_base + 8, timestamp);
+    write_be32((uint8_t*)record[0].iov_base + 16, key_size);
+    write_be32((uint8_t*)record[0].iov_base + 20, value_size);
+    write_be64((uint8_t*)record[0].iov_base + 24, record_pos);
 
     memcpy(record[1].iov_base, key, key_size);
     return CCASK_OK;
@@ -142,9 +203,10 @@ void free_hintfile_record(ccask_hintfile_record_t record) {
 ccask_hintfile_record_header_t ccask_get_hintfile_record_header(ccask_hintfile_record_t record) {
     uint8_t *header_buf = record[0].iov_base;
     ccask_hintfile_record_header_t header;
-    header.timestamp = read_be32(header_buf);
-    header.key_size = read_be32(header_buf + 4);
-    header.value_size = read_be32(header_buf + 8);
-    header.record_pos = read_be64(header_buf + 12);
+    header.seq = read_be64(header_buf);
+    header.timestamp = read_be64(header_buf + 8);
+    header.key_size = read_be32(header_buf + 16);
+    header.value_size = read_be32(header_buf + 20);
+    header.record_pos = read_be64(header_buf + 24);
     return header;
 }
@@ -25,7 +25,7 @@
 #include "inttypes.h"
 #include "endian.h"
 #include "errno.h"
-#include "zlib.h"
+#include "unistd.h"
 #include "ccask/status.h"
 
 file_ext_e parse_filename(const char* name, uint64_t *id) {
@@ -61,6 +61,9 @@ char* build_filepath(const char* dir, uint64_t file_id, file_ext_e ext) {
         case FILE_TEMP_DATA:
             ext_char = ".data.tmp";
             break;
+        case FILE_TEMP_HINT:
+            ext_char = ".hint.tmp";
+            break;
         default:
             return NULL;
     }
@@ -83,21 +86,6 @@ char* build_filepath(const char* dir, uint64_t file_id, file_ext_e ext) {
     return path;
 }
 
-inline uint32_t calculate_crc32(
-    uint32_t timestamp,
-    uint32_t key_size,
-    uint32_t value_size,
-    void* key,
-    void* value
-) {
-    uint32_t crc = (uint32_t)crc32(0, (unsigned char*)&timestamp, 4);
-    crc = (uint32_t)crc32(crc, (unsigned char*)&key_size, 4);
-    crc = (uint32_t)crc32(crc, (unsigned char*)&value_size, 4);
-    crc = (uint32_t)crc32(crc, (unsigned char*)key, key_size);
-    crc = (uint32_t)crc32(crc, (unsigned char*)value, value_size);
-    return crc;
-}
-
 inline void write_be16(uint8_t *buf, uint16_t v) {
     uint16_t be = htobe16(v);
     memcpy(buf, &be, sizeof(be));
@@ -159,15 +147,15 @@ int safe_writev(int fd, const struct iovec *iov, int iovcnt) {
 
         total_written += nwritten;
 
-        while (current_iov_idx < iovcnt && nwritten > 0) {
-            if ((size_t)nwritten < local_iov[current_iov_idx].iov_len) {
-                local_iov[current_iov_idx].iov_base = (char *)local_iov[current_iov_idx].iov_base + nwritten;
-                local_iov[current_iov_idx].iov_len -= nwritten;
-                nwritten = 0;
-            } else {
-                nwritten -= local_iov[current_iov_idx].iov_len;
-                current_iov_idx++;
-            }
+        // also steps over zero-length iovecs (eg. empty tombstone values), which would otherwise never complete
+        while (current_iov_idx < iovcnt && (size_t)nwritten >= local_iov[current_iov_idx].iov_len) {
+            nwritten -= local_iov[current_iov_idx].iov_len;
+            current_iov_idx++;
+        }
+
+        if (current_iov_idx < iovcnt) {
+            local_iov[current_iov_idx].iov_base = (char *)local_iov[current_iov_idx].iov_base + nwritten;
+            local_iov[current_iov_idx].iov_len -= nwritten;
         }
     }
 
@@ -201,15 +189,15 @@ int safe_readv(int fd, struct iovec *iov, int iovcnt) {
 
         total_read += nread;
 
-        while (current_iov_idx < iovcnt && nread > 0) {
-            if ((size_t)nread < local_iov[current_iov_idx].iov_len) {
-                local_iov[current_iov_idx].iov_base = (char *)local_iov[current_iov_idx].iov_base + nread;
-                local_iov[current_iov_idx].iov_len -= nread;
-                nread = 0;
-            } else {
-                nread -= local_iov[current_iov_idx].iov_len;
-                current_iov_idx++;
-            }
+        // also steps over zero-length iovecs (eg. empty tombstone values), which would otherwise never complete
+        while (current_iov_idx < iovcnt && (size_t)nread >= local_iov[current_iov_idx].iov_len) {
+            nread -= local_iov[current_iov_idx].iov_len;
+            current_iov_idx++;
+        }
+
+        if (current_iov_idx < iovcnt) {
+            local_iov[current_iov_idx].iov_base = (char *)local_iov[current_iov_idx].iov_base + nread;
+            local_iov[current_iov_idx].iov_len -= nread;
         }
     }
 
@@ -238,15 +226,15 @@ int safe_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
 
         total_written += nwritten;
 
-        while (current_iov_idx < iovcnt && nwritten > 0) {
-            if ((size_t)nwritten < local_iov[current_iov_idx].iov_len) {
-                local_iov[current_iov_idx].iov_base = (char *)local_iov[current_iov_idx].iov_base + nwritten;
-                local_iov[current_iov_idx].iov_len -= nwritten;
-                nwritten = 0;
-            } else {
-                nwritten -= local_iov[current_iov_idx].iov_len;
-                current_iov_idx++;
-            }
+        // also steps over zero-length iovecs (eg. empty tombstone values), which would otherwise never complete
+        while (current_iov_idx < iovcnt && (size_t)nwritten >= local_iov[current_iov_idx].iov_len) {
+            nwritten -= local_iov[current_iov_idx].iov_len;
+            current_iov_idx++;
+        }
+
+        if (current_iov_idx < iovcnt) {
+            local_iov[current_iov_idx].iov_base = (char *)local_iov[current_iov_idx].iov_base + nwritten;
+            local_iov[current_iov_idx].iov_len -= nwritten;
         }
     }
 
@@ -280,15 +268,15 @@ int safe_preadv(int fd, struct iovec *iov, int iovcnt, off_t offset) {
 
         total_read += nread;
 
-        while (current_iov_idx < iovcnt && nread > 0) {
-            if ((size_t)nread < local_iov[current_iov_idx].iov_len) {
-                local_iov[current_iov_idx].iov_base = (char *)local_iov[current_iov_idx].iov_base + nread;
-                local_iov[current_iov_idx].iov_len -= nread;
-                nread = 0;
-            } else {
-                nread -= local_iov[current_iov_idx].iov_len;
-                current_iov_idx++;
-            }
+        // also steps over zero-length iovecs (eg. empty tombstone values), which would otherwise never complete
+        while (current_iov_idx < iovcnt && (size_t)nread >= local_iov[current_iov_idx].iov_len) {
+            nread -= local_iov[current_iov_idx].iov_len;
+            current_iov_idx++;
+        }
+
+        if (current_iov_idx < iovcnt) {
+            local_iov[current_iov_idx].iov_base = (char *)local_iov[current_iov_idx].iov_base + nread;
+            local_iov[current_iov_idx].iov_len -= nread;
         }
     }
 
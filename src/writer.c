@@ -19,89 +19,625 @@
 #include "ccask/writer.h"
 
 #include "stdbool.h"
+#include "stdatomic.h"
+#include "time.h"
+#include "errno.h"
+#include "string.h"
 #include "pthread.h"
 #include "unistd.h"
 #include "ccask/keydir.h"
 #include "ccask/files.h"
 #include "ccask/writer_ringbuf.h"
+#include "ccask/pending.h"
+#include "ccask/hash.h"
 #include "ccask/utils.h"
 #include "ccask/log.h"
 
-static pthread_t writer_thread;
+/**
+ * A writer thread with its own queue and active datafile. Keys are spread over shards by hash, so all
+ * records of a key go through one shard, in order, and shards never wait on each other.
+ */
+typedef struct writer_shard {
+    size_t index;
+    ccask_writer_ringbuf_t *queue;
+    pthread_t thread;
+
+    // progress of the writer thread, in queue positions (see ccask_writer_ringbuf_pushed), for flushes
+    _Atomic size_t written_pos;
+
+    // group commit: everything queued up meanwhile is appended with one writev
+    ccask_datafile_record_t records[WRITER_BATCH_MAX_RECORDS];
+    ccask_write_completion_t completions[WRITER_BATCH_MAX_RECORDS];
+    ccask_put_result_t results[WRITER_BATCH_MAX_RECORDS];
+
+    // with coalescing, the records actually written
+    ccask_datafile_record_t kept[WRITER_BATCH_MAX_RECORDS];
+    ccask_put_result_t kept_results[WRITER_BATCH_MAX_RECORDS];
+    size_t kept_index[WRITER_BATCH_MAX_RECORDS];
+
+    // scratch space of coalesce_batch
+    uint32_t slots[WRITER_BATCH_MAX_RECORDS * 2]; // record index + 1, 0 is free
+    uint64_t hashes[WRITER_BATCH_MAX_RECORDS];
+    size_t last_of[WRITER_BATCH_MAX_RECORDS];
+} writer_shard_t;
+
+static writer_shard_t *shards = NULL;
+static size_t num_shards = 0;
+
+static ccask_durability_e durability = CCASK_DURABILITY_NONE;
+
+// taken by records as they are appended, under their file's lock (0 is never used, unstamped records have it)
+static _Atomic uint64_t next_seq = 1;
+static bool coalesce_writes = false;
+static _Atomic uint64_t coalesced_records = 0;
+
+static _Atomic size_t flush_waiters = 0;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+
+// periodic syncs, for CCASK_DURABILITY_INTERVAL. Appends are counted once they're written, a finished sync
+// moves synced_appends up to the count it saw before starting.
+static _Atomic uint64_t appends = 0;
+static _Atomic uint64_t synced_appends = 0;
+static pthread_t syncer_thread;
+static bool syncer_running = false;
+static size_t syncer_interval_ms;
+static pthread_mutex_t syncer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t syncer_cond = PTHREAD_COND_INITIALIZER;
+
+static inline size_t shard_of(const void *key, uint32_t key_size) {
+    return num_shards > 1 ? ccask_hash_key(key, key_size) % num_shards : 0;
+}
+
+ccask_status_e ccask_writer_enqueue(uint64_t timestamp, void *key, uint32_t key_size, void *value, uint32_t value_size, int timeout_ms, const ccask_write_completion_t *completion) {
+    // recovery would take a record with an empty key for a batch header (see ccask_is_datafile_batch_header)
+    if (key_size == 0) {
+        ccask_errno = CCASK_ERR_EMPTY_KEY;
+        return CCASK_FAIL;
+    }
+    writer_shard_t *shard = &shards[shard_of(key, key_size)];
+    return ccask_writer_ringbuf_push(shard->queue, timestamp, key, key_size, value, value_size, timeout_ms, completion);
+}
 
 ccask_status_e ccask_write_record_blocking(ccask_datafile_record_t record) {
-    ccask_file_t *file = ccask_files_get_active_file();
+    if (record[1].iov_len == 0) {
+        ccask_errno = CCASK_ERR_EMPTY_KEY;
+        return CCASK_FAIL;
+    }
+    size_t shard = shard_of(ccask_get_datafile_record_key(record), record[1].iov_len);
+    return ccask_write_records_blocking(shard, (ccask_datafile_record_t*)record, 1, NULL);
+}
 
-    pthread_rwlock_wrlock(&file->rwlock);
+static inline void set_results(ccask_put_result_t *results, size_t from, size_t to, ccask_status_e status, ccask_error_e error) {
+    if (!results) return;
+    for (size_t i = from; i < to; i++) {
+        results[i].status = status;
+        results[i].error = error;
+    }
+}
 
-    off_t pos = lseek(file->fd, 0, SEEK_END);
-    if (pos < 0) {
-        log_error("lseek failed during write record to active-datafile");
-        pthread_rwlock_unlock(&file->rwlock);
+/**
+ * Stamps the records with their sequence numbers, appends them at the end of the shard's active datafile,
+ * which the caller holds the wrlock of, and applies their keydir updates. `framed` writes them as a write
+ * batch: behind a batch header, applied to the keydir all at once.
+ * @param synced Set to false if the write was made but the sync durability asks for failed
+ */
+static ccask_status_e append_locked(
+    ccask_file_t *file,
+    bool framed,
+    ccask_datafile_record_t *records,
+    size_t count,
+    ccask_put_result_t *results,
+    bool *synced
+) {
+    // every write to a key holds the lock of the file its writer shard appends to, so a key's records get
+    // increasing sequence numbers in the order they're applied, whichever file they land in
+    uint64_t seq = atomic_fetch_add_explicit(&next_seq, count + (framed ? 1 : 0), memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) ccask_stamp_datafile_record(records[i], seq + (framed ? 1 : 0) + i);
+
+    // the batch header covers the stamped records
+    ccask_datafile_record_t frame;
+    if (framed) {
+        if (ccask_create_datafile_batch_header(frame, ccask_get_datafile_record_timestamp(records[0]), records, count) != CCASK_OK) {
+            log_error("Couldn't create write batch header");
+            return CCASK_FAIL;
+        }
+        ccask_stamp_datafile_record(frame, seq);
+    }
+
+    uint64_t pos = atomic_load_explicit(&file->size, memory_order_relaxed);
+    size_t num_iov = count + (framed ? 1 : 0);
+    struct iovec iov[num_iov];
+    ccask_keydir_update_t updates[count];
+    uint64_t record_pos = pos;
+
+    if (framed) {
+        iov[0] = ccask_get_datafile_record_iovec(frame);
+        record_pos += iov[0].iov_len;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        ccask_datafile_record_t *record = &records[i];
+        ccask_datafile_record_header_t header = ccask_get_datafile_record_header(*record);
+
+        struct iovec record_iov = ccask_get_datafile_record_iovec(*record);
+        iov[num_iov - count + i] = record_iov;
+        updates[i] = (ccask_keydir_update_t){
+            .key = ccask_get_datafile_record_key(*record),
+            .key_size = header.key_size,
+            .file_id = file->file_id,
+            .record_pos = record_pos,
+            .value_size = header.value_size,
+            .seq = header.seq,
+        };
+        if (results) {
+            results[i].file_id = file->file_id;
+            results[i].offset = record_pos;
+        }
+        record_pos += record_iov.iov_len;
+    }
+
+    ccask_files_preallocate(file, record_pos);
+
+    // one sync for the whole batch, issued along with the write
+    *synced = true;
+    ccask_status_e written = ccask_files_append(file, iov, (int)num_iov, pos, durability == CCASK_DURABILITY_BATCH ? synced : NULL);
+    if (framed) free_datafile_record(frame);
+    if (written != CCASK_OK) {
+        log_error("Failed to write datafile-records to active datafile");
         return CCASK_FAIL;
     }
+    atomic_store_explicit(&file->size, record_pos, memory_order_relaxed);
 
-    size_t record_size = ccask_get_datafile_record_total_size(record);
-    if ((size_t)pos + record_size > MAX_ACTIVE_FILE_SIZE) {
-        ccask_files_rotate();
-        pthread_rwlock_unlock(&file->rwlock);
-        return ccask_write_record_blocking(record);
+    if (!*synced) {
+        log_error("Couldn't sync active datafile after writing records");
+    } else if (durability == CCASK_DURABILITY_INTERVAL) {
+        atomic_fetch_add(&appends, 1);
     }
 
-    int res = safe_writev(file->fd, record, 3);
+    // the keydir is updated before the lock is released, so it applies records in file order and
+    // everything before the file's end is applied whenever the lock is free (see checkpoint)
+    ccask_status_e res = framed ? ccask_keydir_apply_batch_atomic(updates, count) : ccask_keydir_apply_batch(updates, count);
     if (res != CCASK_OK) {
-        log_error("Failed to write datafile-record to active datafile");
-        pthread_rwlock_unlock(&file->rwlock);
+        log_error("Records written to Active datafile but couldn't update Key-Directory");
         return CCASK_FAIL;
     }
+    return CCASK_OK;
+}
 
-    pthread_rwlock_unlock(&file->rwlock);
+ccask_status_e ccask_write_records_blocking(size_t shard, ccask_datafile_record_t *records, size_t num_records, ccask_put_result_t *results) {
+    size_t written = 0;
+    while (written < num_records) {
+        ccask_file_t *file = ccask_files_get_active_file(shard);
 
-    ccask_datafile_record_header_t header = ccask_get_datafile_record_header(record);
-    void *key = ccask_get_datafile_record_key(record);
-    
-    CCASK_ATTEMPT(5, res, ccask_keydir_upsert(key, header.key_size, file->file_id, pos, header.value_size, header.timestamp));
-    if (res != CCASK_OK) {
-        log_error("Record written to Active datafile but couldn't update Key-Directory");
+        pthread_rwlock_wrlock(&file->rwlock);
+        if (!file->is_active) {
+            // another writer rotated the file while we were waiting for the lock
+            pthread_rwlock_unlock(&file->rwlock);
+            continue;
+        }
+
+        // the size only changes under the wrlock
+        uint64_t pos = atomic_load_explicit(&file->size, memory_order_relaxed);
+
+        // take as many records as fit in the file, one too large for any file goes into an empty one alone
+        size_t count = 0;
+        size_t batch_size = 0;
+        while (written + count < num_records && count < WRITER_BATCH_MAX_RECORDS) {
+            size_t record_size = ccask_get_datafile_record_total_size(records[written + count]);
+            if (pos + batch_size + record_size > MAX_ACTIVE_FILE_SIZE && (pos > 0 || count > 0)) break;
+            batch_size += record_size;
+            count++;
+        }
+
+        if (count == 0) {
+            ccask_files_rotate(shard);
+            pthread_rwlock_unlock(&file->rwlock);
+            continue;
+        }
+
+        bool synced;
+        ccask_status_e res = append_locked(file, false, records + written, count, results ? results + written : NULL, &synced);
+        pthread_rwlock_unlock(&file->rwlock);
+
+        if (res != CCASK_OK) {
+            set_results(results, written, num_records, CCASK_FAIL, ccask_errno);
+            return CCASK_FAIL;
+        }
+        if (!synced) {
+            ccask_errno = CCASK_ERR_SYNC_FAILED;
+            set_results(results, written, num_records, CCASK_FAIL, ccask_errno);
+            return CCASK_FAIL;
+        }
+
+        set_results(results, written, written + count, CCASK_OK, CCASK_ERR_UNKNOWN);
+        written += count;
+    }
+
+    return CCASK_OK;
+}
+
+// wrlocks the active datafiles of the given writer shards, in shard order
+static void lock_active_files(const bool *involved, ccask_file_t **files) {
+    for (size_t i = 0; i < num_shards; i++) {
+        if (!involved[i]) continue;
+        while (true) {
+            files[i] = ccask_files_get_active_file(i);
+
+            pthread_rwlock_wrlock(&files[i]->rwlock);
+            if (files[i]->is_active) break;
+
+            // rotated while we were waiting for the lock
+            pthread_rwlock_unlock(&files[i]->rwlock);
+        }
+    }
+}
+
+static void unlock_active_files(const bool *involved, ccask_file_t **files, size_t except) {
+    for (size_t i = num_shards; i-- > 0;) {
+        if (involved[i] && i != except) pthread_rwlock_unlock(&files[i]->rwlock);
+    }
+}
+
+ccask_status_e ccask_write_batch_blocking(ccask_datafile_record_t *records, size_t num_records) {
+    if (num_records == 0) return CCASK_OK;
+    if (num_records > WRITER_BATCH_MAX_FRAMED_RECORDS) {
+        ccask_errno = CCASK_ERR_BATCH_TOO_LARGE;
         return CCASK_FAIL;
     }
 
+    // the batch lands in the first writer shard's file, holding the other shards' locks as well keeps it in
+    // order with their own writes of its keys (see append_locked)
+    bool involved[num_shards];
+    memset(involved, 0, sizeof(involved));
+    size_t shard = num_shards;
+    size_t size = DATAFILE_RECORD_HEADER_SIZE + DATAFILE_BATCH_HEADER_VALUE_SIZE;
+    for (size_t i = 0; i < num_records; i++) {
+        size_t s = shard_of(ccask_get_datafile_record_key(records[i]), records[i][1].iov_len);
+        involved[s] = true;
+        if (s < shard) shard = s;
+        size += ccask_get_datafile_record_total_size(records[i]);
+    }
+
+    ccask_file_t *files[num_shards];
+    while (true) {
+        lock_active_files(involved, files);
+        ccask_file_t *file = files[shard];
+
+        // a batch is never split over two files, one too large for any file goes into an empty one alone
+        uint64_t pos = atomic_load_explicit(&file->size, memory_order_relaxed);
+        if (pos > 0 && pos + size > MAX_ACTIVE_FILE_SIZE) {
+            unlock_active_files(involved, files, shard);
+            ccask_files_rotate(shard);
+            pthread_rwlock_unlock(&file->rwlock);
+            continue;
+        }
+
+        bool synced;
+        ccask_status_e res = append_locked(file, true, records, num_records, NULL, &synced);
+        unlock_active_files(involved, files, num_shards);
+
+        if (res != CCASK_OK) return CCASK_FAIL;
+        if (!synced) {
+            ccask_errno = CCASK_ERR_SYNC_FAILED;
+            return CCASK_FAIL;
+        }
+        return CCASK_OK;
+    }
+}
+
+// completions waiting for the next periodic sync, guarded by syncer_lock
+typedef struct pending_completion {
+    ccask_write_completion_t completion;
+    ccask_put_result_t result;
+} pending_completion_t;
+
+static pending_completion_t *pending = NULL;
+static size_t num_pending = 0;
+static size_t pending_capacity = 0;
+
+/**
+ * Makes sure a finished sync covers every append counted so far. Only returns early if one already does:
+ * a sync another thread is still running doesn't count.
+ */
+static ccask_status_e sync_appended(void) {
+    uint64_t target = atomic_load(&appends);
+    if (atomic_load(&synced_appends) >= target) return CCASK_OK;
+
+    ccask_status_e res = ccask_files_sync_active();
+    if (res != CCASK_OK) return res;
+
+    // syncs can finish out of order, the count only moves forward
+    uint64_t synced = atomic_load(&synced_appends);
+    while (synced < target && !atomic_compare_exchange_weak(&synced_appends, &synced, target));
     return CCASK_OK;
 }
 
+// syncs what was appended so far and reports the completions that were waiting for it
+static ccask_status_e sync_and_complete_pending(void) {
+    pthread_mutex_lock(&syncer_lock);
+    pending_completion_t *batch = pending;
+    size_t batch_size = num_pending;
+    pending = NULL;
+    num_pending = pending_capacity = 0;
+    pthread_mutex_unlock(&syncer_lock);
+
+    // the records were appended (and counted) before their completions were added, so this covers them
+    ccask_status_e res = sync_appended();
+
+    for (size_t i = 0; i < batch_size; i++) {
+        if (res != CCASK_OK) {
+            batch[i].result.status = CCASK_FAIL;
+            batch[i].result.error = CCASK_ERR_SYNC_FAILED;
+        }
+        ccask_write_completion_deliver(&batch[i].completion, &batch[i].result);
+    }
+    free(batch);
+    return res;
+}
+
+static void complete_writes(ccask_write_completion_t *completions, ccask_put_result_t *results, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!ccask_write_completion_wanted(&completions[i])) continue;
+
+        // with periodic syncs, successful writes are reported by the sync that makes them durable
+        if (durability == CCASK_DURABILITY_INTERVAL && results[i].status == CCASK_OK) {
+            pthread_mutex_lock(&syncer_lock);
+            if (syncer_running && num_pending == pending_capacity) {
+                size_t capacity = pending_capacity ? pending_capacity * 2 : 64;
+                pending_completion_t *grown = realloc(pending, capacity * sizeof(pending_completion_t));
+                if (grown) {
+                    pending = grown;
+                    pending_capacity = capacity;
+                }
+            }
+
+            if (syncer_running && num_pending < pending_capacity) {
+                pending[num_pending++] = (pending_completion_t){ completions[i], results[i] };
+                pthread_mutex_unlock(&syncer_lock);
+                continue;
+            }
+            pthread_mutex_unlock(&syncer_lock);
+
+            // nothing will sync it soon enough, sync right away
+            if (sync_and_complete_pending() != CCASK_OK) {
+                results[i].status = CCASK_FAIL;
+                results[i].error = CCASK_ERR_SYNC_FAILED;
+            }
+        }
+
+        ccask_write_completion_deliver(&completions[i], &results[i]);
+    }
+}
+
+/**
+ * Picks the last record of every key in the batch (tombstones included), in batch order.
+ * @param kept Set to shallow copies of the records to write
+ * @param kept_index Set to, for every record, the index in `kept` of its key's last record
+ * @return Number of records kept
+ */
+static size_t coalesce_batch(writer_shard_t *shard, ccask_datafile_record_t *records, size_t count, ccask_datafile_record_t *kept, size_t *kept_index) {
+    uint32_t *slots = shard->slots;
+    uint64_t *hashes = shard->hashes;
+    size_t *last_of = shard->last_of;
+
+    size_t num_slots = 2;
+    while (num_slots < count * 2) num_slots <<= 1;
+    memset(slots, 0, num_slots * sizeof(uint32_t));
+
+    // newest first, so the first record seen of a key is the one that survives
+    for (size_t i = count; i-- > 0;) {
+        void *key = ccask_get_datafile_record_key(records[i]);
+        uint32_t key_size = records[i][1].iov_len;
+        hashes[i] = ccask_hash_key(key, key_size);
+
+        size_t slot = hashes[i] & (num_slots - 1);
+        while (true) {
+            if (slots[slot] == 0) {
+                slots[slot] = i + 1;
+                last_of[i] = i;
+                break;
+            }
+
+            size_t j = slots[slot] - 1;
+            if (hashes[j] == hashes[i] && records[j][1].iov_len == key_size &&
+                memcmp(ccask_get_datafile_record_key(records[j]), key, key_size) == 0) {
+                last_of[i] = j;
+                break;
+            }
+            slot = (slot + 1) & (num_slots - 1);
+        }
+    }
+
+    size_t num_kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (last_of[i] != i) continue;
+        memcpy(kept[num_kept], records[i], sizeof(ccask_datafile_record_t));
+        kept_index[i] = num_kept++;
+    }
+    // superseded records come before their key's last one, whose index is set by now
+    for (size_t i = 0; i < count; i++) kept_index[i] = kept_index[last_of[i]];
+
+    return num_kept;
+}
+
 static void* writer_thread_main(void *arg) {
-    (void)arg;
+    writer_shard_t *shard = (writer_shard_t*)arg;
+    ccask_datafile_record_t *records = shard->records;
+    ccask_put_result_t *results = shard->results;
 
-    ccask_datafile_record_t record;
     while (true) {
-        int res = ccask_writer_ringbuf_pop(record);
-        if (res != CCASK_OK) break;
+        size_t count = ccask_writer_ringbuf_pop_batch(shard->queue, records, shard->completions, WRITER_BATCH_MAX_RECORDS, WRITER_BATCH_MAX_BYTES);
+        if (count == 0) break;
+
+        size_t num_kept = coalesce_writes && count > 1 ? coalesce_batch(shard, records, count, shard->kept, shard->kept_index) : count;
+        if (num_kept < count) {
+            // superseded puts are reported with the outcome and location of the record that replaced them
+            ccask_write_records_blocking(shard->index, shard->kept, num_kept, shard->kept_results);
+            for (size_t i = 0; i < count; i++) results[i] = shard->kept_results[shard->kept_index[i]];
+            atomic_fetch_add_explicit(&coalesced_records, count - num_kept, memory_order_relaxed);
+        } else {
+            ccask_write_records_blocking(shard->index, records, count, results);
+        }
+
+        // once the keydir has the records, reads can stop finding them in the pending index
+        ccask_pending_remove_batch(records, count);
+        for (size_t i = 0; i < count; i++) free_datafile_record(records[i]);
+        complete_writes(shard->completions, results, count);
 
-        ccask_write_record_blocking(record);
-        free_datafile_record(record);
+        atomic_fetch_add(&shard->written_pos, count);
+        if (atomic_load(&flush_waiters) > 0) {
+            pthread_mutex_lock(&progress_lock);
+            pthread_cond_broadcast(&progress_cond);
+            pthread_mutex_unlock(&progress_lock);
+        }
     }
 
     return NULL;
 }
 
-ccask_status_e ccask_writer_start(size_t capacity) {
-    if (ccask_writer_ringbuf_init(capacity) != CCASK_OK)
+static void* syncer_thread_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&syncer_lock);
+    while (syncer_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += syncer_interval_ms / 1000;
+        deadline.tv_nsec += (syncer_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        int res = 0;
+        while (syncer_running && res != ETIMEDOUT) {
+            res = pthread_cond_timedwait(&syncer_cond, &syncer_lock, &deadline);
+        }
+        if (!syncer_running) break;
+
+        pthread_mutex_unlock(&syncer_lock);
+        sync_and_complete_pending();
+        pthread_mutex_lock(&syncer_lock);
+    }
+    pthread_mutex_unlock(&syncer_lock);
+
+    return NULL;
+}
+
+ccask_status_e ccask_writer_flush(void) {
+    // everything pushed before this point is popped and written by the time written_pos gets here
+    size_t targets[num_shards];
+    for (size_t i = 0; i < num_shards; i++) targets[i] = ccask_writer_ringbuf_pushed(shards[i].queue);
+
+    atomic_fetch_add(&flush_waiters, 1);
+    pthread_mutex_lock(&progress_lock);
+    for (size_t i = 0; i < num_shards; i++) {
+        while (atomic_load(&shards[i].written_pos) < targets[i]) {
+            pthread_cond_wait(&progress_cond, &progress_lock);
+        }
+    }
+    pthread_mutex_unlock(&progress_lock);
+    atomic_fetch_sub(&flush_waiters, 1);
+
+    // these already synced every write before the writer moved on
+    if (durability == CCASK_DURABILITY_BATCH || durability == CCASK_DURABILITY_DSYNC) return CCASK_OK;
+    if (durability == CCASK_DURABILITY_INTERVAL) return sync_appended();
+    return ccask_files_sync_active();
+}
+
+void ccask_writer_get_queue_stats(ccask_writer_queue_stats_t *stats) {
+    *stats = (ccask_writer_queue_stats_t){0};
+    for (size_t i = 0; i < num_shards; i++) ccask_writer_ringbuf_add_stats(shards[i].queue, stats);
+    stats->coalesced = atomic_load_explicit(&coalesced_records, memory_order_relaxed);
+}
+
+// stops and frees the first `count` shards
+static void stop_shards(size_t count) {
+    for (size_t i = 0; i < count; i++) ccask_writer_ringbuf_start_shutdown(shards[i].queue);
+    for (size_t i = 0; i < count; i++) {
+        pthread_join(shards[i].thread, NULL);
+        ccask_writer_ringbuf_destroy(shards[i].queue);
+    }
+
+    free(shards);
+    shards = NULL;
+    num_shards = 0;
+}
+
+uint64_t ccask_writer_next_seq(void) {
+    return atomic_load_explicit(&next_seq, memory_order_relaxed);
+}
+
+ccask_status_e ccask_writer_start(size_t capacity, size_t max_bytes, ccask_durability_e mode, size_t sync_interval_ms, bool coalesce) {
+    // the keydir was recovered by now, numbering goes on after the last record found
+    atomic_store(&next_seq, ccask_keydir_recovered_seq() + 1);
+    durability = mode;
+    coalesce_writes = coalesce;
+    atomic_store(&coalesced_records, 0);
+    atomic_store(&appends, 0);
+    atomic_store(&synced_appends, 0);
+
+    // one shard per active datafile, sharing the queue limits evenly
+    size_t count = ccask_files_num_active();
+    if (max_bytes == 0) max_bytes = RINGBUF_DEFAULT_MAX_BYTES;
+    size_t shard_capacity = capacity / count ? capacity / count : 1;
+    size_t shard_max_bytes = max_bytes / count ? max_bytes / count : 1;
+
+    shards = calloc(count, sizeof(writer_shard_t));
+    if (!shards) {
+        ccask_errno = CCASK_ERR_NO_MEMORY;
+        log_error("Couldn't start writer");
         return CCASK_FAIL;
-    
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        writer_shard_t *shard = &shards[i];
+        shard->index = i;
+        shard->queue = ccask_writer_ringbuf_create(shard_capacity, shard_max_bytes);
+        if (!shard->queue) {
+            stop_shards(i);
+            return CCASK_FAIL;
+        }
+
+        int res;
+        CCASK_ATTEMPT(5, res, pthread_create(&shard->thread, NULL, writer_thread_main, shard));
+        if (res != 0) {
+            ccask_writer_ringbuf_destroy(shard->queue);
+            stop_shards(i);
+            ccask_errno = CCASK_ERR_COULDNT_START_THREAD;
+            log_info("Couldn't start writer");
+            return CCASK_FAIL;
+        }
+    }
+    // set once every shard is running, enqueues can only start after this returns anyway
+    num_shards = count;
+
     int res;
-    CCASK_ATTEMPT(5, res, pthread_create(&writer_thread, NULL, writer_thread_main, NULL));
-    if (res != 0) {
-        ccask_writer_ringbuf_destroy();
-        ccask_errno = CCASK_ERR_COULDNT_START_THREAD;
-        log_info("Couldn't start writer");
-        return CCASK_FAIL;
+    if (durability == CCASK_DURABILITY_INTERVAL) {
+        syncer_interval_ms = sync_interval_ms ? sync_interval_ms : WRITER_DEFAULT_SYNC_INTERVAL_MS;
+        syncer_running = true;
+
+        CCASK_ATTEMPT(5, res, pthread_create(&syncer_thread, NULL, syncer_thread_main, NULL));
+        if (res != 0) {
+            // writes still get synced on rotation, flush and shutdown
+            syncer_running = false;
+            log_error("Couldn't start periodic datafile syncs");
+        }
     }
 
     return CCASK_OK;
 }
 
 void ccask_writer_stop(void) {
-    ccask_writer_ringbuf_start_shutdown();
-    pthread_join(writer_thread, NULL);
-    ccask_writer_ringbuf_destroy();
+    stop_shards(num_shards);
+
+    pthread_mutex_lock(&syncer_lock);
+    bool was_running = syncer_running;
+    syncer_running = false;
+    pthread_cond_signal(&syncer_cond);
+    pthread_mutex_unlock(&syncer_lock);
+
+    if (was_running) pthread_join(syncer_thread, NULL);
+    sync_and_complete_pending();
 }
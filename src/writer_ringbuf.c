@@ -21,132 +21,429 @@
 #include "stdlib.h"
 #include "string.h"
 #include "unistd.h"
+#include "time.h"
+#include "errno.h"
+#include "stdatomic.h"
 #include "pthread.h"
 #include "ccask/records.h"
 #include "ccask/status.h"
+#include "ccask/pending.h"
 #include "ccask/log.h"
 
-typedef struct ccask_writer_ringbuf {
-    ccask_datafile_record_t *buf;
-    size_t capacity;
-    size_t head;
-    size_t tail;
+#define RINGBUF_SPIN_ITERATIONS 512 // polls by the writer before it parks on the condvar
+#define RINGBUF_CACHE_LINE 64
+#define RINGBUF_SHED_FRACTION 4 // fail-fast pushes start being shed once the last quarter of the budget is in use
 
-    pthread_mutex_t mutex; // guard for head, tail, buf
-    pthread_cond_t not_empty;  // signaled when new item pushed
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
 
-    bool shutdown;
-} ccask_writer_ringbuf_t;
+/**
+ * Bounded multi-producer/single-consumer queue (Vyukov's sequenced cells).
+ * A cell whose `seq` equals a producer's claimed position is free, one whose `seq` is the position + 1
+ * holds a published record. Producers serialize their record before claiming a cell, so the only shared
+ * write on the push path is the CAS on `head`.
+ */
+typedef struct ringbuf_cell {
+    _Atomic size_t seq;
+    ccask_datafile_record_t record;
+    ccask_write_completion_t completion;
+} ringbuf_cell_t;
+
+struct ccask_writer_ringbuf {
+    ringbuf_cell_t *cells;
+    size_t capacity; // power of two
+    size_t mask;
+
+    _Alignas(RINGBUF_CACHE_LINE) _Atomic size_t head; // next position to claim, shared by producers
+    _Alignas(RINGBUF_CACHE_LINE) _Atomic size_t tail; // next position to pop, only written by the writer
+
+    _Alignas(RINGBUF_CACHE_LINE) _Atomic size_t bytes_pending; // serialized bytes of queued records
+    size_t max_bytes;
+    size_t shed_threshold;
 
-static ccask_writer_ringbuf_t *ringbuf;
+    _Alignas(RINGBUF_CACHE_LINE) _Atomic bool parked; // the writer is (about to be) asleep on not_empty
+    int spin_iterations; // 0 on a single CPU, where spinning only delays the producers
+    atomic_bool shutdown;
+    pthread_mutex_t park_mutex;
+    pthread_cond_t not_empty;
 
-size_t ccask_writer_ringbuf_count(void) {
-    size_t head, tail;
+    // producers waiting for room, only signalled while there are some
+    _Alignas(RINGBUF_CACHE_LINE) _Atomic size_t full_waiters;
+    pthread_mutex_t full_mutex;
+    pthread_cond_t not_full;
 
-    pthread_mutex_lock((pthread_mutex_t*)&ringbuf->mutex);
-    head = ringbuf->head;
-    tail = ringbuf->tail;
-    pthread_mutex_unlock((pthread_mutex_t*)&ringbuf->mutex);
+    _Atomic uint64_t shed;
+    _Atomic uint64_t rejected;
+    _Atomic uint64_t waits;
+    _Atomic uint64_t timeouts;
+};
+
+size_t ccask_writer_ringbuf_count(ccask_writer_ringbuf_t *ringbuf) {
+    size_t tail = atomic_load_explicit(&ringbuf->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ringbuf->head, memory_order_relaxed);
+    return head >= tail ? head - tail : 0;
+}
+
+size_t ccask_writer_ringbuf_pushed(ccask_writer_ringbuf_t *ringbuf) {
+    return atomic_load(&ringbuf->head);
+}
 
-    if (head >= tail) return head - tail;
-    return ringbuf->capacity - (tail - head);
+void ccask_writer_ringbuf_add_stats(ccask_writer_ringbuf_t *ringbuf, ccask_writer_queue_stats_t *stats) {
+    stats->depth += ccask_writer_ringbuf_count(ringbuf);
+    stats->capacity += ringbuf->capacity;
+    stats->bytes_pending += atomic_load_explicit(&ringbuf->bytes_pending, memory_order_relaxed);
+    stats->max_bytes += ringbuf->max_bytes;
+    stats->shed += atomic_load_explicit(&ringbuf->shed, memory_order_relaxed);
+    stats->rejected += atomic_load_explicit(&ringbuf->rejected, memory_order_relaxed);
+    stats->waits += atomic_load_explicit(&ringbuf->waits, memory_order_relaxed);
+    stats->timeouts += atomic_load_explicit(&ringbuf->timeouts, memory_order_relaxed);
 }
 
-ccask_status_e ccask_writer_ringbuf_init(size_t capacity) {
-    ringbuf = malloc(sizeof(ccask_writer_ringbuf_t));
+ccask_writer_ringbuf_t* ccask_writer_ringbuf_create(size_t capacity, size_t max_bytes) {
+    ccask_writer_ringbuf_t *ringbuf = aligned_alloc(RINGBUF_CACHE_LINE, sizeof(ccask_writer_ringbuf_t));
     if (!ringbuf) {
         log_error("Couldn't initialize writer ring-buffer");
         ccask_errno = CCASK_ERR_NO_MEMORY;
-        return CCASK_FAIL;
+        return NULL;
     }
 
-    ringbuf->head = 0;
-    ringbuf->tail = 0;
-    ringbuf->shutdown = false;
-    ringbuf->capacity = capacity;
+    // cells are found by masking the position
+    size_t cells = 2;
+    while (cells < capacity) cells <<= 1;
+
+    ringbuf->capacity = cells;
+    ringbuf->mask = cells - 1;
+    atomic_init(&ringbuf->head, 0);
+    atomic_init(&ringbuf->tail, 0);
+    atomic_init(&ringbuf->parked, false);
+    atomic_init(&ringbuf->shutdown, false);
+    atomic_init(&ringbuf->bytes_pending, 0);
+    atomic_init(&ringbuf->full_waiters, 0);
+    atomic_init(&ringbuf->shed, 0);
+    atomic_init(&ringbuf->rejected, 0);
+    atomic_init(&ringbuf->waits, 0);
+    atomic_init(&ringbuf->timeouts, 0);
+    ringbuf->max_bytes = max_bytes ? max_bytes : RINGBUF_DEFAULT_MAX_BYTES;
+    ringbuf->shed_threshold = ringbuf->max_bytes - ringbuf->max_bytes / RINGBUF_SHED_FRACTION;
+    ringbuf->spin_iterations = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RINGBUF_SPIN_ITERATIONS : 0;
 
-    ringbuf->buf = calloc(capacity, sizeof(ccask_datafile_record_t));
-    if (!ringbuf->buf) {
+    ringbuf->cells = calloc(cells, sizeof(ringbuf_cell_t));
+    if (!ringbuf->cells) {
         free(ringbuf);
-        ringbuf = NULL;
         log_error("Couldn't initialize writer ring-buffer");
         ccask_errno = CCASK_ERR_NO_MEMORY;
-        return CCASK_FAIL;
+        return NULL;
     }
 
-    pthread_mutex_init(&ringbuf->mutex, NULL);
+    for (size_t i = 0; i < cells; i++) atomic_init(&ringbuf->cells[i].seq, i);
+
+    pthread_mutex_init(&ringbuf->park_mutex, NULL);
     pthread_cond_init(&ringbuf->not_empty, NULL);
+    pthread_mutex_init(&ringbuf->full_mutex, NULL);
+    pthread_cond_init(&ringbuf->not_full, NULL);
 
-    return CCASK_OK;
+    return ringbuf;
+}
+
+static void wake_writer(ccask_writer_ringbuf_t *ringbuf) {
+    pthread_mutex_lock(&ringbuf->park_mutex);
+    pthread_cond_signal(&ringbuf->not_empty);
+    pthread_mutex_unlock(&ringbuf->park_mutex);
 }
 
-void ccask_writer_ringbuf_start_shutdown(void) {
-    pthread_mutex_lock(&ringbuf->mutex);
-    ringbuf->shutdown = true;
+void ccask_writer_ringbuf_start_shutdown(ccask_writer_ringbuf_t *ringbuf) {
+    atomic_store(&ringbuf->shutdown, true);
+
+    pthread_mutex_lock(&ringbuf->park_mutex);
     pthread_cond_broadcast(&ringbuf->not_empty);
-    pthread_mutex_unlock(&ringbuf->mutex);
+    pthread_mutex_unlock(&ringbuf->park_mutex);
+
+    pthread_mutex_lock(&ringbuf->full_mutex);
+    pthread_cond_broadcast(&ringbuf->not_full);
+    pthread_mutex_unlock(&ringbuf->full_mutex);
 }
 
-void ccask_writer_ringbuf_destroy(void) {
+void ccask_writer_ringbuf_destroy(ccask_writer_ringbuf_t *ringbuf) {
+    pthread_cond_destroy(&ringbuf->not_full);
+    pthread_mutex_destroy(&ringbuf->full_mutex);
     pthread_cond_destroy(&ringbuf->not_empty);
-    pthread_mutex_destroy(&ringbuf->mutex);
-    free(ringbuf->buf);
+    pthread_mutex_destroy(&ringbuf->park_mutex);
+    free(ringbuf->cells);
     free(ringbuf);
 }
 
+typedef enum admission {
+    ADMITTED,
+    FULL,
+    SHED,
+} admission_e;
+
+// xorshift, only used to spread shedding over producers
+static inline uint32_t shed_random(void) {
+    static _Thread_local uint32_t state = 0;
+    if (state == 0) state = (uint32_t)(uintptr_t)&state ^ (uint32_t)time(NULL) ^ 0x9e3779b9u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/**
+ * Takes `size` bytes of the budget. An empty queue admits any record, however large, so it can't get stuck.
+ * With `shed`, records are refused at random once the budget is mostly used, more often the closer it is
+ * to full, so fail-fast callers back off gradually instead of all at once.
+ */
+static admission_e reserve_bytes(ccask_writer_ringbuf_t *ringbuf, size_t size, bool shed) {
+    size_t pending = atomic_load_explicit(&ringbuf->bytes_pending, memory_order_relaxed);
+    if (shed && pending > ringbuf->shed_threshold) {
+        uint64_t over = pending - ringbuf->shed_threshold;
+        uint64_t range = ringbuf->max_bytes - ringbuf->shed_threshold;
+        if (over >= range || shed_random() % range < over) return SHED;
+    }
+
+    while (true) {
+        if (pending > 0 && pending + size > ringbuf->max_bytes) return FULL;
+        if (atomic_compare_exchange_weak_explicit(&ringbuf->bytes_pending, &pending, pending + size, memory_order_relaxed, memory_order_relaxed))
+            return ADMITTED;
+    }
+}
+
+// claims the cell at the head of the queue, false if the writer hasn't freed it yet
+static bool claim_cell(ccask_writer_ringbuf_t *ringbuf, size_t *claimed) {
+    size_t pos = atomic_load_explicit(&ringbuf->head, memory_order_relaxed);
+    while (true) {
+        ringbuf_cell_t *cell = &ringbuf->cells[pos & ringbuf->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ringbuf->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *claimed = pos;
+                return true;
+            }
+        } else if (diff < 0) {
+            // the writer hasn't popped this cell's previous record yet
+            return false;
+        } else {
+            // another producer claimed it first
+            pos = atomic_load_explicit(&ringbuf->head, memory_order_relaxed);
+        }
+    }
+}
+
+// what a waiting producer is after, room in the byte budget or a free cell
+typedef struct room_request {
+    ccask_writer_ringbuf_t *ringbuf;
+    size_t size;    // bytes to reserve
+    size_t pos;     // set to the claimed cell's position
+} room_request_t;
+
+// sleeps until the writer frees room or the deadline passes, false on timeout or shutdown
+static bool wait_for_room(room_request_t *request, const struct timespec *deadline, bool (*has_room)(room_request_t *request)) {
+    ccask_writer_ringbuf_t *ringbuf = request->ringbuf;
+    bool ok = true;
+    pthread_mutex_lock(&ringbuf->full_mutex);
+    // registered before checking, pairs with the fence in pop so either we see the room or get signalled
+    atomic_fetch_add(&ringbuf->full_waiters, 1);
+    while (!has_room(request)) {
+        if (atomic_load(&ringbuf->shutdown)) {
+            ok = false;
+            break;
+        }
+
+        int res = deadline
+            ? pthread_cond_timedwait(&ringbuf->not_full, &ringbuf->full_mutex, deadline)
+            : pthread_cond_wait(&ringbuf->not_full, &ringbuf->full_mutex);
+        if (res == ETIMEDOUT) {
+            ok = has_room(request);
+            break;
+        }
+    }
+    atomic_fetch_sub(&ringbuf->full_waiters, 1);
+    pthread_mutex_unlock(&ringbuf->full_mutex);
+    return ok;
+}
+
+static bool try_reserve_bytes(room_request_t *request) {
+    return reserve_bytes(request->ringbuf, request->size, false) == ADMITTED;
+}
+
+static bool try_claim_cell(room_request_t *request) {
+    return claim_cell(request->ringbuf, &request->pos);
+}
+
+static inline void release_bytes(ccask_writer_ringbuf_t *ringbuf, size_t size) {
+    atomic_fetch_sub_explicit(&ringbuf->bytes_pending, size, memory_order_relaxed);
+}
+
 ccask_status_e ccask_writer_ringbuf_push(
-    uint32_t timestamp,
+    ccask_writer_ringbuf_t *ringbuf,
+    uint64_t timestamp,
     void *key,
     uint32_t key_size,
     void *value,
-    uint32_t value_size
+    uint32_t value_size,
+    int timeout_ms,
+    const ccask_write_completion_t *completion
 ) {
-    pthread_mutex_lock(&ringbuf->mutex);
-
-    size_t next = (ringbuf->head + 1) % ringbuf->capacity;
-    if (next == ringbuf->tail) {
-        // full
-        pthread_mutex_unlock(&ringbuf->mutex);
-        log_warn("Failed to push record onto writer ring-buffer! (Max capacity reached)");
-        ccask_errno = CCASK_ERR_RINGBUFFER_FULL;
-        return CCASK_RETRY;
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    const struct timespec *wait_until = timeout_ms > 0 ? &deadline : NULL;
+
+    room_request_t request = { ringbuf, DATAFILE_RECORD_HEADER_SIZE + (size_t)key_size + value_size, 0 };
+    admission_e admission = reserve_bytes(ringbuf, request.size, timeout_ms == 0);
+    if (admission != ADMITTED) {
+        if (timeout_ms == 0) {
+            atomic_fetch_add_explicit(admission == SHED ? &ringbuf->shed : &ringbuf->rejected, 1, memory_order_relaxed);
+            ccask_errno = CCASK_ERR_RINGBUFFER_FULL;
+            return CCASK_RETRY;
+        }
+
+        atomic_fetch_add_explicit(&ringbuf->waits, 1, memory_order_relaxed);
+        if (!wait_for_room(&request, wait_until, try_reserve_bytes)) {
+            atomic_fetch_add_explicit(&ringbuf->timeouts, 1, memory_order_relaxed);
+            ccask_errno = CCASK_ERR_RINGBUFFER_FULL;
+            return CCASK_RETRY;
+        }
     }
 
+    // CRC and copies happen before claiming a cell, other producers aren't held up by them
+    ccask_datafile_record_t record;
     int res = ccask_create_datafile_record(
-        ringbuf->buf[ringbuf->head],
+        record,
         timestamp,
         key, key_size,
         value, value_size
     );
     if (res != CCASK_OK) {
+        release_bytes(ringbuf, request.size);
         log_info("Failed to push record onto writer ring-buffer! (Could not create a datafile-record)");
         return CCASK_FAIL;
     }
-    
-    ringbuf->head = next;
 
-    pthread_cond_signal(&ringbuf->not_empty);
+    if (!claim_cell(ringbuf, &request.pos)) {
+        bool claimed = false;
+        if (timeout_ms == 0) {
+            atomic_fetch_add_explicit(&ringbuf->rejected, 1, memory_order_relaxed);
+        } else {
+            atomic_fetch_add_explicit(&ringbuf->waits, 1, memory_order_relaxed);
+            claimed = wait_for_room(&request, wait_until, try_claim_cell);
+            if (!claimed) atomic_fetch_add_explicit(&ringbuf->timeouts, 1, memory_order_relaxed);
+        }
+
+        if (!claimed) {
+            free_datafile_record(record);
+            release_bytes(ringbuf, request.size);
+            ccask_errno = CCASK_ERR_RINGBUFFER_FULL;
+            return CCASK_RETRY;
+        }
+    }
+
+    // visible to reads before the writer can pop it, so it's removed only after being added
+    size_t pos = request.pos;
+    if (ccask_pending_add(record, pos) != CCASK_OK) {
+        log_warn("Couldn't add queued record to pending index, reads will miss it until it is written");
+    }
+
+    ringbuf_cell_t *cell = &ringbuf->cells[pos & ringbuf->mask];
+    memcpy(cell->record, record, sizeof(ccask_datafile_record_t));
+    if (completion) cell->completion = *completion;
+    else cell->completion = (ccask_write_completion_t){ NULL, NULL, NULL };
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    // pairs with the fence in pop, either the writer sees the record or we see it parked. Only the
+    // producer that clears the flag signals, the others don't queue up on the mutex.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ringbuf->parked, memory_order_relaxed) &&
+        atomic_exchange_explicit(&ringbuf->parked, false, memory_order_relaxed)) wake_writer(ringbuf);
 
-    pthread_mutex_unlock(&ringbuf->mutex);
     return CCASK_OK;
 }
 
-ccask_status_e ccask_writer_ringbuf_pop(ccask_datafile_record_t record) {
-    pthread_mutex_lock(&ringbuf->mutex);
+static inline bool cell_ready(ringbuf_cell_t *cell, size_t pos) {
+    return atomic_load_explicit(&cell->seq, memory_order_acquire) == pos + 1;
+}
+
+// waits until the cell at `pos` is published, false once shut down with nothing left to pop
+static bool wait_for_cell(ccask_writer_ringbuf_t *ringbuf, ringbuf_cell_t *cell, size_t pos) {
+    while (!cell_ready(cell, pos)) {
+        // a claimed cell may still be filled in, so the queue is only drained once head catches up
+        if (atomic_load(&ringbuf->shutdown) && atomic_load(&ringbuf->head) == pos) return false;
 
-    while (ringbuf->tail == ringbuf->head && !ringbuf->shutdown) {
-        // empty, wait for a push or shutdown
-        pthread_cond_wait(&ringbuf->not_empty, &ringbuf->mutex);
+        // spin briefly, records often follow each other closely
+        bool ready = false;
+        for (int i = 0; i < ringbuf->spin_iterations && !ready; i++) {
+            cpu_relax();
+            ready = cell_ready(cell, pos);
+        }
+        if (ready) break;
+
+        // then park until a producer sees the flag and signals, the flag is set again before every check
+        pthread_mutex_lock(&ringbuf->park_mutex);
+        while (true) {
+            atomic_store_explicit(&ringbuf->parked, true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (cell_ready(cell, pos) || atomic_load(&ringbuf->shutdown)) break;
+            pthread_cond_wait(&ringbuf->not_empty, &ringbuf->park_mutex);
+        }
+        atomic_store_explicit(&ringbuf->parked, false, memory_order_relaxed);
+        pthread_mutex_unlock(&ringbuf->park_mutex);
     }
 
-    if (ringbuf->shutdown && ringbuf->tail == ringbuf->head) {
-        pthread_mutex_unlock(&ringbuf->mutex);
-        return CCASK_FAIL;
+    return true;
+}
+
+size_t ccask_writer_ringbuf_pop_batch(
+    ccask_writer_ringbuf_t *ringbuf,
+    ccask_datafile_record_t *records,
+    ccask_write_completion_t *completions,
+    size_t max_records,
+    size_t max_bytes
+) {
+    size_t pos = atomic_load_explicit(&ringbuf->tail, memory_order_relaxed);
+    if (max_records == 0 || !wait_for_cell(ringbuf, &ringbuf->cells[pos & ringbuf->mask], pos)) return 0;
+
+    size_t count = 0;
+    size_t bytes = 0;
+    while (count < max_records) {
+        ringbuf_cell_t *cell = &ringbuf->cells[pos & ringbuf->mask];
+        if (!cell_ready(cell, pos)) break;
+
+        size_t record_size = ccask_get_datafile_record_total_size(cell->record);
+        if (count > 0 && bytes + record_size > max_bytes) break;
+
+        memcpy(records[count], cell->record, sizeof(ccask_datafile_record_t)); // shallow-copy
+        if (completions) completions[count] = cell->completion;
+        atomic_store_explicit(&cell->seq, pos + ringbuf->capacity, memory_order_release);
+        bytes += record_size;
+        count++;
+        pos++;
     }
 
-    memcpy(record, ringbuf->buf[ringbuf->tail], sizeof(ccask_datafile_record_t)); // shallow-copy
-    ringbuf->tail = (ringbuf->tail + 1) % ringbuf->capacity;
+    atomic_store_explicit(&ringbuf->tail, pos, memory_order_relaxed);
+    release_bytes(ringbuf, bytes);
 
-    pthread_mutex_unlock(&ringbuf->mutex);
-    return CCASK_OK;
+    // pairs with the registration in wait_for_room, either a waiter sees the room or we see the waiter
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ringbuf->full_waiters, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&ringbuf->full_mutex);
+        pthread_cond_broadcast(&ringbuf->not_full);
+        pthread_mutex_unlock(&ringbuf->full_mutex);
+    }
+    return count;
+}
+
+ccask_status_e ccask_writer_ringbuf_pop(ccask_writer_ringbuf_t *ringbuf, ccask_datafile_record_t record) {
+    return ccask_writer_ringbuf_pop_batch(ringbuf, (ccask_datafile_record_t*)record, NULL, 1, SIZE_MAX) == 1 ? CCASK_OK : CCASK_FAIL;
 }
@@ -0,0 +1,177 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "test_util.h"
+
+#include "ccask/records.h"
+
+static const char *dir;
+
+// a 24-byte value shaped like a batch header's: "CCBT", then a record count, length and checksum
+static void make_header_lookalike(uint8_t value[DATAFILE_BATCH_HEADER_VALUE_SIZE]) {
+    memset(value, 0, DATAFILE_BATCH_HEADER_VALUE_SIZE);
+    write_be32(value, DATAFILE_BATCH_MAGIC);
+    write_be32(value + 4, 2);
+    write_be64(value + 8, 64);
+}
+
+static void write_around_empty_key(void *arg) {
+    (void)arg;
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    test_put("before", "1");
+
+    uint8_t value[DATAFILE_BATCH_HEADER_VALUE_SIZE];
+    make_header_lookalike(value);
+
+    ccask_errno = CCASK_ERR_UNKNOWN;
+    CHECK(ccask_put_blocking("", 0, value, sizeof(value)) == CCASK_FAIL);
+    CHECK(ccask_errno == CCASK_ERR_EMPTY_KEY);
+
+    ccask_errno = CCASK_ERR_UNKNOWN;
+    CHECK(ccask_put("", 0, value, sizeof(value)) == CCASK_FAIL);
+    CHECK(ccask_errno == CCASK_ERR_EMPTY_KEY);
+
+    ccask_errno = CCASK_ERR_UNKNOWN;
+    CHECK(ccask_delete_blocking("", 0) == CCASK_FAIL);
+    CHECK(ccask_errno == CCASK_ERR_EMPTY_KEY);
+
+    ccask_write_batch_t *batch = ccask_write_batch_create();
+    CHECK(batch);
+    ccask_errno = CCASK_ERR_UNKNOWN;
+    CHECK(ccask_write_batch_put(batch, "", 0, value, sizeof(value)) == CCASK_FAIL);
+    CHECK(ccask_errno == CCASK_ERR_EMPTY_KEY);
+    ccask_write_batch_destroy(batch);
+
+    test_put("after-1", "2");
+    test_put("after-2", "3");
+}
+
+/**
+ * A put with an empty key and a value shaped like a batch header would be taken for one on recovery, and
+ * everything after it dropped. Every write path refuses it, so the records around it survive a crash.
+ */
+static void test_empty_key_is_refused(void) {
+    test_run_crashing(write_around_empty_key, NULL);
+
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    test_expect("before", "1");
+    test_expect("after-1", "2");
+    test_expect("after-2", "3");
+    ccask_shutdown();
+}
+
+static void write_torn_batch(void *arg) {
+    (void)arg;
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    test_put("solo", "kept");
+
+    ccask_write_batch_t *batch = ccask_write_batch_create();
+    CHECK(batch);
+    CHECK(ccask_write_batch_put(batch, "batch-1", 8, "value-1", 8) == CCASK_OK);
+    CHECK(ccask_write_batch_put(batch, "batch-2", 8, "value-2", 8) == CCASK_OK);
+    CHECK(ccask_write_batch_delete(batch, "solo", 5) == CCASK_OK);
+    CHECK(ccask_write_batch_put(batch, "batch-3", 8, "torn-tail", 10) == CCASK_OK);
+    CHECK(ccask_write_batch_commit(batch) == CCASK_OK);
+    ccask_write_batch_destroy(batch);
+}
+
+/**
+ * A batch whose tail didn't reach the disk is dropped whole on recovery, including its delete of an older
+ * key, while what was written before it survives.
+ */
+static void test_torn_batch_is_dropped(void) {
+    test_run_crashing(write_torn_batch, NULL);
+
+    // cut off inside the batch's last record, as if that write had only partly reached the disk
+    off_t offset;
+    char *path = test_find_in_datafiles(dir, "torn-tail", &offset);
+    test_truncate_file(path, offset + 1);
+    free(path);
+
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    test_expect("solo", "kept");
+    test_expect("batch-1", NULL);
+    test_expect("batch-2", NULL);
+    test_expect("batch-3", NULL);
+
+    // the torn tail was cut off, so new writes land after the surviving records
+    test_put("batch-1", "rewritten");
+    ccask_shutdown();
+
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    test_expect("solo", "kept");
+    test_expect("batch-1", "rewritten");
+    ccask_shutdown();
+}
+
+/**
+ * A batch holds CCASK_WRITE_BATCH_MAX_OPS operations, the header record takes the last of the IOV_MAX
+ * iovecs. One more is refused when it is added, and the full batch still commits and recovers.
+ */
+static void test_batch_limit(void) {
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+
+    ccask_write_batch_t *batch = ccask_write_batch_create();
+    CHECK(batch);
+
+    char key[32];
+    for (int i = 0; i < CCASK_WRITE_BATCH_MAX_OPS; i++) {
+        snprintf(key, sizeof(key), "op-%d", i);
+        CHECK(ccask_write_batch_put(batch, key, (uint32_t)strlen(key) + 1, key, (uint32_t)strlen(key) + 1) == CCASK_OK);
+    }
+
+    ccask_errno = CCASK_ERR_UNKNOWN;
+    CHECK(ccask_write_batch_put(batch, "one-too-many", 13, "x", 2) == CCASK_FAIL);
+    CHECK(ccask_errno == CCASK_ERR_BATCH_TOO_LARGE);
+    ccask_errno = CCASK_ERR_UNKNOWN;
+    CHECK(ccask_write_batch_delete(batch, "op-0", 5) == CCASK_FAIL);
+    CHECK(ccask_errno == CCASK_ERR_BATCH_TOO_LARGE);
+    CHECK(ccask_write_batch_count(batch) == CCASK_WRITE_BATCH_MAX_OPS);
+
+    CHECK(ccask_write_batch_commit(batch) == CCASK_OK);
+    ccask_write_batch_destroy(batch);
+    ccask_shutdown();
+
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    for (int i = 0; i < CCASK_WRITE_BATCH_MAX_OPS; i++) {
+        snprintf(key, sizeof(key), "op-%d", i);
+        test_expect(key, key);
+    }
+    test_expect("one-too-many", NULL);
+    ccask_shutdown();
+}
+
+int main(void) {
+    char *d = test_make_dir();
+    dir = d;
+    test_empty_key_is_refused();
+    test_remove_dir(d);
+
+    d = test_make_dir();
+    dir = d;
+    test_torn_batch_is_dropped();
+    test_remove_dir(d);
+
+    d = test_make_dir();
+    dir = d;
+    test_batch_limit();
+    test_remove_dir(d);
+
+    return 0;
+}
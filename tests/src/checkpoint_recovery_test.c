@@ -0,0 +1,330 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "test_util.h"
+
+#include "signal.h"
+#include "inttypes.h"
+#include "sys/mman.h"
+
+#include "ccask/checkpoint.h"
+#include "ccask/files.h"
+#include "ccask/hash.h"
+#include "ccask/records.h"
+
+#define NUM_KEYS 100
+#define SHARDED_ROTATE_THRESHOLD 256
+
+static const char *dir;
+
+static void key_of(int i, char *key) {
+    snprintf(key, 32, "key-%d", i);
+}
+
+// values name their generation and key, so every record's bytes can be found in the datafiles
+static void value_of(int gen, int i, char *value) {
+    snprintf(value, 32, "gen%d:key-%d;", gen, i);
+}
+
+static void put_gen(int gen, int from, int to) {
+    char key[32], value[32];
+    for (int i = from; i < to; i++) {
+        key_of(i, key);
+        value_of(gen, i, value);
+        test_put(key, value);
+    }
+}
+
+// writes the first generation and shuts down cleanly, which leaves a checkpoint
+static void write_checkpointed(void) {
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    put_gen(1, 0, NUM_KEYS);
+    ccask_shutdown();
+}
+
+/**
+ * After the checkpoint: overwrites keys 0-9, deletes 10-19 and adds 100-109. Nothing checkpoints again
+ * before the crash, so all of it is only in the log after the checkpoint's positions.
+ */
+static void write_tail(void *arg) {
+    (void)arg;
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    put_gen(2, 0, 10);
+
+    char key[32];
+    for (int i = 10; i < 20; i++) {
+        key_of(i, key);
+        CHECK(ccask_delete_blocking(key, (uint32_t)strlen(key) + 1) == CCASK_OK);
+    }
+
+    put_gen(2, NUM_KEYS, NUM_KEYS + 10);
+}
+
+static void expect_tail_applied(void) {
+    char key[32], value[32];
+    for (int i = 0; i < NUM_KEYS + 10; i++) {
+        key_of(i, key);
+        if (i >= 10 && i < 20) {
+            test_expect(key, NULL);
+            continue;
+        }
+
+        value_of(i < 10 || i >= NUM_KEYS ? 2 : 1, i, value);
+        test_expect(key, value);
+    }
+}
+
+/**
+ * Zeroes the sequence number of the record holding `value`. Replay takes a zero sequence number for the
+ * end of the log (the padding direct I/O leaves), so it would stop there and cut the file off.
+ */
+static void end_log_at(const char *key, const char *value) {
+    off_t offset;
+    char *path = test_find_in_datafiles(dir, value, &offset);
+    off_t record_pos = offset - DATAFILE_RECORD_HEADER_SIZE - (off_t)(strlen(key) + 1);
+
+    int fd = open(path, O_RDWR);
+    CHECK(fd >= 0);
+    uint8_t zeroes[8] = {0};
+    CHECK(pwrite(fd, zeroes, sizeof(zeroes), record_pos + 4) == sizeof(zeroes));
+    close(fd);
+    free(path);
+}
+
+static void corrupt_checkpoint(void) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/keydir.ckpt", dir);
+
+    struct stat st;
+    CHECK(stat(path, &st) == 0);
+    test_corrupt_file(path, st.st_size - 1);
+}
+
+/**
+ * Recovery loads the checkpoint and replays only the log after it. The log is made to end early, at a
+ * record before the checkpoint's positions (a dead one, key 0 was overwritten since): replaying from the
+ * start would stop there and lose the tail.
+ */
+static void test_replays_only_the_tail(void) {
+    write_checkpointed();
+    test_run_crashing(write_tail, NULL);
+    end_log_at("key-0", "gen1:key-0;");
+
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    expect_tail_applied();
+    ccask_shutdown();
+}
+
+static void overwrite_after_restart(void *arg) {
+    (void)arg;
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    put_gen(3, 20, 30);
+}
+
+/**
+ * With no log after the checkpoint, nothing is replayed, so only the checkpoint tells where sequence
+ * numbers go on. Records written after restarting have to win over the checkpointed ones on the next
+ * replay.
+ */
+static void test_numbering_goes_on_after_checkpoint(void) {
+    write_checkpointed();
+    test_run_crashing(overwrite_after_restart, NULL);
+
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    char key[32], value[32];
+    for (int i = 0; i < NUM_KEYS; i++) {
+        key_of(i, key);
+        value_of(i >= 20 && i < 30 ? 3 : 1, i, value);
+        test_expect(key, value);
+    }
+    ccask_shutdown();
+}
+
+// a checkpoint that fails its CRC is ignored, and the whole log is replayed instead
+static void test_corrupted_checkpoint_is_ignored(void) {
+    write_checkpointed();
+    test_run_crashing(write_tail, NULL);
+    corrupt_checkpoint();
+
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    expect_tail_applied();
+    ccask_shutdown();
+}
+
+// a checkpoint pointing past the end of a datafile, which was cut short since, is ignored as well
+static void test_checkpoint_past_the_log_is_ignored(void) {
+    write_checkpointed();
+
+    char key[32], value[32];
+    value_of(1, NUM_KEYS - 1, value);
+    off_t offset;
+    char *path = test_find_in_datafiles(dir, value, &offset);
+    test_truncate_file(path, offset);
+    free(path);
+
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        key_of(i, key);
+        value_of(1, i, value);
+        test_expect(key, i == NUM_KEYS - 1 ? NULL : value);
+    }
+    ccask_shutdown();
+}
+
+// a key the writer puts on `shard` of two, the `n`th one found
+static void shard_key_of(size_t shard, int n, char *key) {
+    for (int i = 0;; i++) {
+        snprintf(key, 32, "s%zu-%d", shard, i);
+        if (ccask_hash_key(key, (uint32_t)strlen(key) + 1) % 2 == shard && n-- == 0) return;
+    }
+}
+
+// counted in the crashing child, so shared with the parent checking them afterwards
+static int *shard_keys_put;
+
+// puts new keys on `shard` until it rotates, the last one is the first record in its new file
+static void rotate_shard(size_t shard) {
+    uint64_t file_id = ccask_files_get_active_file(shard)->file_id;
+    char key[32], value[32];
+    do {
+        shard_key_of(shard, shard_keys_put[shard], key);
+        snprintf(value, sizeof(value), "value-%d", shard_keys_put[shard]++);
+        test_put(key, value);
+    } while (ccask_files_get_active_file(shard)->file_id == file_id);
+}
+
+static bool leases_supported(void) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/lease-probe", dir);
+    close(open(path, O_CREAT | O_WRONLY, 0644));
+
+    int fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+    bool supported = fcntl(fd, F_SETLEASE, F_RDLCK) == 0;
+    close(fd);
+    unlink(path);
+    return supported;
+}
+
+/**
+ * Holds a read lease on the datafile the spare thread creates next, so its open() waits until the lease
+ * is released. Conflicting opens send the holder SIGIO, which would end the process.
+ */
+static int stall_spare(uint64_t file_id) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%" PRIu64 ".data", dir, file_id);
+    close(open(path, O_CREAT | O_WRONLY, 0644));
+
+    signal(SIGIO, SIG_IGN);
+    int fd = open(path, O_RDONLY);
+    CHECK(fd >= 0 && fcntl(fd, F_SETLEASE, F_RDLCK) == 0);
+    return fd;
+}
+
+static ccask_options_t sharded_options(void) {
+    ccask_options_t opts = test_options(dir);
+    opts.writer_shards = 2;
+    opts.datafile_rotate_threshold = SHARDED_ROTATE_THRESHOLD;
+    return opts;
+}
+
+/**
+ * Shard 0 rotates and its next spare gets an ID, but creating the file stalls. Shard 1 meanwhile rotates
+ * twice, the second time without a spare, so its new file is newer than shard 0's spare. Then the
+ * checkpoint is taken, and afterwards shard 0 rotates into the spare and writes to it.
+ */
+static void checkpoint_while_creating_spare(void *arg) {
+    (void)arg;
+    CHECK(ccask_init(sharded_options()) == CCASK_OK);
+
+    // the next ID goes to shard 0's next spare, once both shards have theirs
+    uint64_t spare_ids[2] = { 0, 0 };
+    for (size_t shard = 0; shard < 2; shard++) {
+        char path[256];
+        while (true) {
+            if (ccask_files_get_spare_file_id(shard, &spare_ids[shard])) {
+                snprintf(path, sizeof(path), "%s/%" PRIu64 ".data", dir, spare_ids[shard]);
+                if (access(path, F_OK) == 0) break;
+            }
+            usleep(1000);
+        }
+    }
+    usleep(200 * 1000); // they are handed over after being preallocated
+    uint64_t next_spare_id = (spare_ids[0] > spare_ids[1] ? spare_ids[0] : spare_ids[1]) + 1;
+    int lease_fd = stall_spare(next_spare_id);
+
+    rotate_shard(0);
+    rotate_shard(1);
+    rotate_shard(1);
+    CHECK(ccask_files_get_active_file(1)->file_id > next_spare_id);
+    CHECK(ccask_checkpoint_write() == CCASK_OK);
+
+    // once created, the spare is handed to shard 0 on its next rotation
+    CHECK(fcntl(lease_fd, F_SETLEASE, F_UNLCK) == 0);
+    close(lease_fd);
+    usleep(200 * 1000);
+
+    rotate_shard(0);
+    CHECK(ccask_files_get_active_file(0)->file_id == next_spare_id);
+    rotate_shard(0);
+}
+
+/**
+ * A checkpoint lists the spare that is still being created. Otherwise replay would take it for a file
+ * closed before the checkpoint, as a newer one is listed, and skip what was written to it.
+ */
+static void test_checkpoint_lists_spare_being_created(void) {
+    if (!leases_supported()) {
+        fprintf(stderr, "Skipping, the filesystem doesn't support leases\n");
+        return;
+    }
+    shard_keys_put = mmap(NULL, 2 * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CHECK(shard_keys_put != MAP_FAILED);
+    test_run_crashing(checkpoint_while_creating_spare, NULL);
+
+    CHECK(ccask_init(sharded_options()) == CCASK_OK);
+    char key[32], value[32];
+    for (size_t shard = 0; shard < 2; shard++) {
+        for (int n = 0; n < shard_keys_put[shard]; n++) {
+            shard_key_of(shard, n, key);
+            snprintf(value, sizeof(value), "value-%d", n);
+            test_expect(key, value);
+        }
+    }
+    ccask_shutdown();
+    munmap(shard_keys_put, 2 * sizeof(int));
+}
+
+int main(void) {
+    void (*tests[])(void) = {
+        test_replays_only_the_tail,
+        test_numbering_goes_on_after_checkpoint,
+        test_corrupted_checkpoint_is_ignored,
+        test_checkpoint_past_the_log_is_ignored,
+        test_checkpoint_lists_spare_being_created,
+    };
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        char *d = test_make_dir();
+        dir = d;
+        tests[i]();
+        test_remove_dir(d);
+    }
+    return 0;
+}
@@ -0,0 +1,299 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "test_util.h"
+
+#include "ccask/index.h"
+
+#define NUM_KEYS 40000
+#define NUM_RANDOM_STARTS 50
+#define STEP_BETWEEN_EDITS 300 // more than a cursor refill, so edits land between refills
+
+#define NUM_SCAN_KEYS 6000
+
+/**
+ * Keys are inserted into and deleted from the index directly, in an order that makes nodes split at every
+ * level and whole subtrees empty out, and every walk is checked against a sorted reference. Then the
+ * range and prefix scans are checked the same way through the public API.
+ */
+
+typedef struct {
+    char key[32];
+    uint32_t size;
+    bool present;
+} ref_key_t;
+
+static ref_key_t *refs; // sorted by key
+
+// short keys that are prefixes of each other, and long ones sharing more than the 8 bytes compared first
+static void index_key_of(int i, char *key) {
+    if (i % 5 == 0) snprintf(key, 32, "k%d", i);
+    else snprintf(key, 32, "user/%06d/item", i);
+}
+
+static int compare_refs(const void *a, const void *b) {
+    const ref_key_t *ra = a, *rb = b;
+    return ccask_index_compare(ra->key, ra->size, rb->key, rb->size);
+}
+
+// position of the first reference key >= key
+static size_t ref_lower_bound(const void *key, uint32_t key_size) {
+    size_t lo = 0, hi = NUM_KEYS;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ccask_index_compare(refs[mid].key, refs[mid].size, key, key_size) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void set_present(size_t i, bool present) {
+    if (present) CHECK(ccask_index_insert(refs[i].key, refs[i].size) == CCASK_OK);
+    else ccask_index_remove(refs[i].key, refs[i].size);
+    refs[i].present = present;
+}
+
+// walks from `start` (NULL for the first key) to the end, the keys have to be exactly the present ones
+static void check_walk(const void *start, uint32_t start_size) {
+    ccask_index_cursor_t cursor;
+    CHECK(ccask_index_cursor_open(&cursor, start, start_size) == CCASK_OK);
+
+    size_t i = start ? ref_lower_bound(start, start_size) : 0;
+    void *key;
+    uint32_t key_size;
+    while (ccask_index_cursor_next(&cursor, &key, &key_size) == CCASK_OK) {
+        while (i < NUM_KEYS && !refs[i].present) i++;
+        CHECK(i < NUM_KEYS);
+        CHECK(key_size == refs[i].size && memcmp(key, refs[i].key, key_size) == 0);
+        i++;
+    }
+    CHECK(ccask_errno == CCASK_ERR_ITER_END);
+    while (i < NUM_KEYS && !refs[i].present) i++;
+    CHECK(i == NUM_KEYS);
+
+    ccask_index_cursor_close(&cursor);
+}
+
+static void check_walks(unsigned int *rand_state) {
+    check_walk(NULL, 0);
+
+    // from existing keys, and from keys just before and after them that aren't in the index
+    for (int n = 0; n < NUM_RANDOM_STARTS; n++) {
+        ref_key_t *ref = &refs[rand_r(rand_state) % NUM_KEYS];
+        char start[40];
+        memcpy(start, ref->key, ref->size);
+
+        switch (n % 3) {
+            case 0: check_walk(start, ref->size); break;
+            case 1: check_walk(start, ref->size - 1); break;
+            default:
+                start[ref->size] = '\x01';
+                check_walk(start, ref->size + 1);
+        }
+    }
+}
+
+/**
+ * Walks while the index changes between refills: the key the cursor resumes from is deleted, and keys
+ * are added before and after it. Keys present the whole time must all come back, in order.
+ */
+static void check_walk_with_edits(unsigned int *rand_state) {
+    bool *stable = malloc(NUM_KEYS * sizeof(bool));
+    CHECK(stable);
+    for (size_t i = 0; i < NUM_KEYS; i++) stable[i] = refs[i].present;
+
+    ccask_index_cursor_t cursor;
+    CHECK(ccask_index_cursor_open(&cursor, NULL, 0) == CCASK_OK);
+
+    size_t returned = 0;
+    size_t last = 0;
+    void *key;
+    uint32_t key_size;
+    while (ccask_index_cursor_next(&cursor, &key, &key_size) == CCASK_OK) {
+        size_t i = ref_lower_bound(key, key_size);
+        CHECK(i < NUM_KEYS && key_size == refs[i].size && memcmp(key, refs[i].key, key_size) == 0);
+        CHECK(returned == 0 || i > last);
+
+        // every stable key in between was returned
+        for (size_t j = returned ? last + 1 : 0; j < i; j++) CHECK(!stable[j]);
+        last = i;
+
+        if (++returned % STEP_BETWEEN_EDITS != 0) continue;
+
+        set_present(i, false);
+        stable[i] = false;
+        for (int n = 0; n < 8; n++) {
+            size_t j = rand_r(rand_state) % NUM_KEYS;
+            set_present(j, !refs[j].present);
+            stable[j] = false;
+        }
+    }
+    CHECK(ccask_errno == CCASK_ERR_ITER_END);
+    for (size_t j = last + 1; j < NUM_KEYS; j++) CHECK(!stable[j]);
+
+    ccask_index_cursor_close(&cursor);
+    free(stable);
+}
+
+static void test_index(void) {
+    CHECK(ccask_index_init() == CCASK_OK);
+    size_t empty_bytes = ccask_index_bytes();
+
+    refs = malloc(NUM_KEYS * sizeof(ref_key_t));
+    size_t *order = malloc(NUM_KEYS * sizeof(size_t));
+    CHECK(refs && order);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        index_key_of(i, refs[i].key);
+        refs[i].size = (uint32_t)strlen(refs[i].key);
+        refs[i].present = false;
+    }
+    qsort(refs, NUM_KEYS, sizeof(ref_key_t), compare_refs);
+
+    // inserted in random order, so leaves and inner nodes split anywhere, not just at their ends
+    unsigned int rand_state = 42;
+    for (size_t i = 0; i < NUM_KEYS; i++) order[i] = i;
+    for (size_t i = NUM_KEYS - 1; i > 0; i--) {
+        size_t j = rand_r(&rand_state) % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (size_t i = 0; i < NUM_KEYS; i++) set_present(order[i], true);
+    check_walks(&rand_state);
+
+    // inserting a present key changes nothing
+    size_t full_bytes = ccask_index_bytes();
+    for (size_t i = 0; i < NUM_KEYS; i += 7) set_present(i, true);
+    CHECK(ccask_index_bytes() == full_bytes);
+
+    // a contiguous range empties whole leaves and subtrees, the rest thins out without emptying nodes
+    for (size_t i = NUM_KEYS / 4; i < NUM_KEYS / 2; i++) set_present(i, false);
+    for (size_t i = 0; i < NUM_KEYS; i++) {
+        if (order[i] % 3 == 0) set_present(order[i], false);
+    }
+    ccask_index_remove("not-a-key", 9);
+    check_walks(&rand_state);
+
+    check_walk_with_edits(&rand_state);
+    check_walks(&rand_state);
+
+    // emptied out, the tree is back to its single empty root
+    for (size_t i = 0; i < NUM_KEYS; i++) set_present(order[i], false);
+    check_walk(NULL, 0);
+    CHECK(ccask_index_bytes() == empty_bytes);
+
+    for (size_t i = 0; i < NUM_KEYS; i += 2) set_present(i, true);
+    check_walks(&rand_state);
+
+    ccask_index_shutdown();
+    free(order);
+    free(refs);
+}
+
+static const char *scan_groups[] = { "apple", "apricot", "banana", "band", "cherry" };
+#define NUM_GROUPS (sizeof(scan_groups) / sizeof(scan_groups[0]))
+#define KEYS_PER_GROUP (NUM_SCAN_KEYS / NUM_GROUPS)
+
+// in key order: the groups are sorted, and the numbers are zero-padded
+static void scan_key_of(int i, char *key) {
+    snprintf(key, 32, "%s/%05d", scan_groups[i / KEYS_PER_GROUP], i % KEYS_PER_GROUP);
+}
+
+static bool scan_key_present(int i) {
+    return i % 7 != 3;
+}
+
+// checks that the scan returns exactly the present keys in [from, to), with their values if asked
+static void check_scan(ccask_scan_iter_t *iter, int from, int to, bool with_values) {
+    CHECK(iter);
+    char expected[32], value[40];
+    void *key;
+    uint32_t key_size;
+    ccask_record_t record;
+
+    for (int i = from; i < to; i++) {
+        if (!scan_key_present(i)) continue;
+        scan_key_of(i, expected);
+        CHECK(ccask_scan_iter_next(iter, &key, &key_size, with_values ? &record : NULL) == CCASK_OK);
+        CHECK(key_size == strlen(expected) + 1 && memcmp(key, expected, key_size) == 0);
+
+        if (!with_values) continue;
+        snprintf(value, sizeof(value), "value-of-%s", expected);
+        CHECK(record.value && strcmp(record.value, value) == 0);
+        ccask_free_record(record);
+    }
+    CHECK(ccask_scan_iter_next(iter, &key, &key_size, NULL) != CCASK_OK);
+    CHECK(ccask_errno == CCASK_ERR_ITER_END);
+    ccask_scan_iter_close(iter);
+}
+
+static ccask_scan_iter_t* scan_between(int from, int to) {
+    char start[32], end[32];
+    scan_key_of(from, start);
+    scan_key_of(to, end);
+    return ccask_scan_range(start, (uint32_t)strlen(start) + 1, end, (uint32_t)strlen(end) + 1);
+}
+
+static ccask_scan_iter_t* scan_with_prefix(const char *prefix) {
+    return ccask_scan_prefix((void*)prefix, (uint32_t)strlen(prefix));
+}
+
+static void test_scans(void) {
+    char *dir = test_make_dir();
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+
+    char key[32], value[40];
+    for (int i = 0; i < NUM_SCAN_KEYS; i++) {
+        scan_key_of(i, key);
+        snprintf(value, sizeof(value), "value-of-%s", key);
+        test_put(key, value);
+    }
+    for (int i = 0; i < NUM_SCAN_KEYS; i++) {
+        if (scan_key_present(i)) continue;
+        scan_key_of(i, key);
+        CHECK(ccask_delete_blocking(key, (uint32_t)strlen(key) + 1) == CCASK_OK);
+    }
+
+    check_scan(ccask_scan_range(NULL, 0, NULL, 0), 0, NUM_SCAN_KEYS, true);
+    check_scan(scan_between(100, 4321), 100, 4321, true);
+    check_scan(scan_between(3, 4), 3, 4, false); // only a deleted key
+    check_scan(scan_between(500, 500), 500, 500, false);
+
+    // the bounds don't have to be keys
+    check_scan(ccask_scan_range((void*)"b", 1, (void*)"c", 1), 2 * KEYS_PER_GROUP, 4 * KEYS_PER_GROUP, false);
+    char start[32];
+    scan_key_of(KEYS_PER_GROUP + 10, start);
+    check_scan(ccask_scan_range(start, (uint32_t)strlen(start), NULL, 0), KEYS_PER_GROUP + 10, NUM_SCAN_KEYS, false);
+
+    check_scan(scan_with_prefix("ap"), 0, 2 * KEYS_PER_GROUP, true);
+    check_scan(scan_with_prefix("ban"), 2 * KEYS_PER_GROUP, 4 * KEYS_PER_GROUP, false);
+    check_scan(scan_with_prefix("band/"), 3 * KEYS_PER_GROUP, 4 * KEYS_PER_GROUP, false);
+    check_scan(scan_with_prefix("cherry/00"), 4 * KEYS_PER_GROUP, 4 * KEYS_PER_GROUP + 1000, false);
+    check_scan(scan_with_prefix("apples"), 0, 0, false);
+    check_scan(scan_with_prefix("zzz"), 0, 0, false);
+
+    ccask_shutdown();
+    test_remove_dir(dir);
+}
+
+int main(void) {
+    test_index();
+    test_scans();
+    return 0;
+}
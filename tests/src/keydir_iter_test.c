@@ -0,0 +1,107 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "test_util.h"
+
+#include "stdatomic.h"
+
+#include "ccask/keydir.h"
+#include "ccask/epoch.h"
+
+#define NUM_KEYS 2000
+
+static _Atomic bool marker_freed = false;
+
+static void free_marker(void *ptr, void *ctx) {
+    (void)ctx;
+    free(ptr);
+    atomic_store(&marker_freed, true);
+}
+
+// every fourth key is too long to be stored inline in its keydir entry
+static void key_of(int i, char *key, size_t cap) {
+    if (i % 4 == 0) snprintf(key, cap, "long-key-that-lives-in-the-shard-arena-%d", i);
+    else snprintf(key, cap, "key-%d", i);
+}
+
+static int index_of(const ccask_keydir_record_t *record) {
+    char key[64];
+    CHECK(record->key_size > 0 && record->key_size < sizeof(key));
+    memcpy(key, record->key, record->key_size);
+    key[record->key_size] = '\0';
+
+    int i;
+    if (sscanf(key, "long-key-that-lives-in-the-shard-arena-%d", &i) != 1) CHECK(sscanf(key, "key-%d", &i) == 1);
+    CHECK(i >= 0 && i < NUM_KEYS);
+
+    char expected[64];
+    key_of(i, expected, sizeof(expected));
+    CHECK(strlen(expected) + 1 == record->key_size && strcmp(expected, key) == 0);
+    return i;
+}
+
+/**
+ * The iterator copies each shard's records, so entries retired while it is open are reclaimed, and every
+ * key is still returned exactly once (with its own bytes) while the keys are overwritten meanwhile.
+ */
+int main(void) {
+    char *dir = test_make_dir();
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+
+    char key[64];
+    for (int i = 0; i < NUM_KEYS; i++) {
+        key_of(i, key, sizeof(key));
+        test_put(key, "first");
+    }
+
+    bool *seen = calloc(NUM_KEYS, sizeof(bool));
+    CHECK(seen);
+
+    ccask_keydir_record_iter_t iter = ccask_keydir_record_iter();
+    ccask_keydir_record_t *record = ccask_keydir_record_iter_next(&iter);
+    CHECK(record);
+    seen[index_of(record)] = true;
+
+    // overwriting every key retires every entry, which moves the epoch along unless something holds it
+    void *marker = malloc(1);
+    CHECK(marker);
+    ccask_epoch_retire(marker, free_marker, NULL);
+    for (int round = 0; round < 4 && !atomic_load(&marker_freed); round++) {
+        for (int i = 0; i < NUM_KEYS; i++) {
+            key_of(i, key, sizeof(key));
+            test_put(key, "again");
+        }
+    }
+    CHECK(atomic_load(&marker_freed));
+
+    size_t count = 1;
+    while ((record = ccask_keydir_record_iter_next(&iter)) != NULL) {
+        int i = index_of(record);
+        CHECK(!seen[i]);
+        seen[i] = true;
+        count++;
+    }
+    ccask_keydir_record_iter_close(&iter);
+    CHECK(count == NUM_KEYS);
+
+    free(seen);
+    ccask_shutdown();
+    test_remove_dir(dir);
+    return 0;
+}
@@ -0,0 +1,135 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "test_util.h"
+
+#include "pthread.h"
+#include "stdatomic.h"
+
+#include "ccask/keydir.h"
+
+#define NUM_WRITERS 4
+#define NUM_READERS 4
+#define KEYS_PER_WRITER 4096
+#define ROUNDS 6
+#define READS_PER_READER 400000
+
+/**
+ * Writers own disjoint key ranges and rewrite them in rounds, deleting every seventh key and putting it
+ * back the round after. Every record a writer stores names its writer (file ID) and key (value size), and
+ * its version (position) only grows. Readers look keys up without locks the whole time, while the tables
+ * grow under them, and check that what they find is whole and that a key's version never goes back.
+ */
+
+static _Atomic bool writers_done = false;
+
+static void key_of(int writer, int i, char *key) {
+    // every third key is too long to be stored inline in its entry
+    if (i % 3 == 0) snprintf(key, 64, "stress/writer-%d/a-long-key-kept-in-the-arena/%d", writer, i);
+    else snprintf(key, 64, "w%d/%d", writer, i);
+}
+
+static uint32_t value_size_of(int writer, int i) {
+    return (uint32_t)(writer * KEYS_PER_WRITER + i + 1);
+}
+
+static void* writer_main(void *arg) {
+    int writer = (int)(intptr_t)arg;
+    char key[64];
+    uint64_t seq = 1;
+
+    for (uint64_t round = 1; round <= ROUNDS; round++) {
+        for (int i = 0; i < KEYS_PER_WRITER; i++) {
+            key_of(writer, i, key);
+            uint32_t key_size = (uint32_t)strlen(key) + 1;
+
+            if (i % 7 == (int)(round % 7)) {
+                ccask_keydir_delete(key, key_size, seq++);
+                continue;
+            }
+            CHECK(ccask_keydir_upsert(key, key_size, (uint64_t)writer, round, value_size_of(writer, i), seq++) == CCASK_OK);
+        }
+    }
+    return NULL;
+}
+
+static void* reader_main(void *arg) {
+    unsigned int rand_state = (unsigned int)(intptr_t)arg;
+    uint64_t *last_seen = calloc(NUM_WRITERS * KEYS_PER_WRITER, sizeof(uint64_t));
+    CHECK(last_seen);
+
+    char key[64];
+    for (int n = 0; n < READS_PER_READER || !atomic_load(&writers_done); n++) {
+        int writer = rand_r(&rand_state) % NUM_WRITERS;
+        int i = rand_r(&rand_state) % KEYS_PER_WRITER;
+        key_of(writer, i, key);
+
+        ccask_keydir_record_t record;
+        if (ccask_keydir_find(key, (uint32_t)strlen(key) + 1, &record) != CCASK_OK) continue;
+
+        CHECK(record.key_size == strlen(key) + 1);
+        CHECK(record.file_id == (uint64_t)writer);
+        CHECK(record.value_size == value_size_of(writer, i));
+        CHECK(record.record_pos >= 1 && record.record_pos <= ROUNDS);
+
+        uint64_t *seen = &last_seen[writer * KEYS_PER_WRITER + i];
+        CHECK(record.record_pos >= *seen);
+        *seen = record.record_pos;
+    }
+
+    free(last_seen);
+    return NULL;
+}
+
+int main(void) {
+    char *dir = test_make_dir();
+
+    // few shards with small tables, so they are resized while being read
+    ccask_options_t opts = test_options(dir);
+    opts.keydir_shards = 2;
+    CHECK(ccask_init(opts) == CCASK_OK);
+
+    pthread_t writers[NUM_WRITERS], readers[NUM_READERS];
+    for (int i = 0; i < NUM_READERS; i++) CHECK(pthread_create(&readers[i], NULL, reader_main, (void*)(intptr_t)(i + 1)) == 0);
+    for (int i = 0; i < NUM_WRITERS; i++) CHECK(pthread_create(&writers[i], NULL, writer_main, (void*)(intptr_t)i) == 0);
+
+    for (int i = 0; i < NUM_WRITERS; i++) pthread_join(writers[i], NULL);
+    atomic_store(&writers_done, true);
+    for (int i = 0; i < NUM_READERS; i++) pthread_join(readers[i], NULL);
+
+    // after the last round, exactly the keys it didn't delete are there, at its version
+    char key[64];
+    for (int writer = 0; writer < NUM_WRITERS; writer++) {
+        for (int i = 0; i < KEYS_PER_WRITER; i++) {
+            key_of(writer, i, key);
+            ccask_keydir_record_t record;
+            ccask_status_e found = ccask_keydir_find(key, (uint32_t)strlen(key) + 1, &record);
+
+            if (i % 7 == ROUNDS % 7) {
+                CHECK(found != CCASK_OK);
+                continue;
+            }
+            CHECK(found == CCASK_OK && record.record_pos == ROUNDS);
+        }
+    }
+
+    ccask_shutdown();
+    test_remove_dir(dir);
+    return 0;
+}
@@ -0,0 +1,137 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "test_util.h"
+
+#include "pthread.h"
+#include "sched.h"
+#include "stdatomic.h"
+
+#include "ccask/pending.h"
+#include "ccask/writer_ringbuf.h"
+
+#define NUM_PRODUCERS 6
+#define RECORDS_PER_PRODUCER 50000
+#define RINGBUF_CAPACITY 64
+#define RINGBUF_MAX_BYTES 4096
+#define POP_BATCH 32
+
+/**
+ * Producers push numbered records into a small queue, so it keeps wrapping around and filling up, half of
+ * them waiting for room and half failing fast and pushing again. A single consumer pops batches the way the
+ * writer does and checks that every record arrives exactly once, whole, with its own completion, and in
+ * the order its producer pushed it.
+ */
+
+typedef struct {
+    uint32_t producer;
+    uint32_t seq;
+} stress_value_t;
+
+static ccask_writer_ringbuf_t *ringbuf;
+
+static uintptr_t completion_ctx(uint32_t producer, uint32_t seq) {
+    return ((uintptr_t)producer << 32) | seq;
+}
+
+static void* producer_main(void *arg) {
+    uint32_t producer = (uint32_t)(intptr_t)arg;
+    int timeout_ms = producer % 2 == 0 ? -1 : 0;
+    char key[32];
+
+    for (uint32_t seq = 0; seq < RECORDS_PER_PRODUCER; seq++) {
+        // keys repeat, so the pending index also sees the same key queued more than once
+        snprintf(key, sizeof(key), "p%u/%u", producer, seq % 128);
+        stress_value_t value = { producer, seq };
+        ccask_write_completion_t completion = { NULL, NULL, (void*)completion_ctx(producer, seq) };
+
+        while (true) {
+            ccask_status_e status = ccask_writer_ringbuf_push(
+                ringbuf, seq, key, (uint32_t)strlen(key) + 1, &value, sizeof(value), timeout_ms, &completion
+            );
+            if (status == CCASK_OK) break;
+            CHECK(status == CCASK_RETRY && timeout_ms == 0);
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+int main(void) {
+    char *dir = test_make_dir();
+
+    // only for the pending index pushes add to, the queue under test is a separate one
+    CHECK(ccask_init(test_options(dir)) == CCASK_OK);
+    ringbuf = ccask_writer_ringbuf_create(RINGBUF_CAPACITY, RINGBUF_MAX_BYTES);
+    CHECK(ringbuf);
+
+    pthread_t producers[NUM_PRODUCERS];
+    for (int i = 0; i < NUM_PRODUCERS; i++) CHECK(pthread_create(&producers[i], NULL, producer_main, (void*)(intptr_t)i) == 0);
+
+    uint32_t next_seq[NUM_PRODUCERS] = { 0 };
+    size_t total = 0;
+    ccask_datafile_record_t records[POP_BATCH];
+    ccask_write_completion_t completions[POP_BATCH];
+    char key[32];
+
+    while (total < (size_t)NUM_PRODUCERS * RECORDS_PER_PRODUCER) {
+        size_t count = ccask_writer_ringbuf_pop_batch(ringbuf, records, completions, POP_BATCH, RINGBUF_MAX_BYTES);
+        CHECK(count >= 1 && count <= POP_BATCH);
+
+        for (size_t i = 0; i < count; i++) {
+            CHECK(records[i][2].iov_len == sizeof(stress_value_t));
+            stress_value_t value;
+            memcpy(&value, ccask_get_datafile_record_value(records[i]), sizeof(value));
+            CHECK(value.producer < NUM_PRODUCERS);
+            CHECK(value.seq == next_seq[value.producer]);
+            next_seq[value.producer]++;
+
+            snprintf(key, sizeof(key), "p%u/%u", value.producer, value.seq % 128);
+            CHECK(records[i][1].iov_len == strlen(key) + 1);
+            CHECK(memcmp(ccask_get_datafile_record_key(records[i]), key, strlen(key) + 1) == 0);
+            CHECK(ccask_get_datafile_record_timestamp(records[i]) == value.seq);
+            CHECK((uintptr_t)completions[i].ctx == completion_ctx(value.producer, value.seq));
+        }
+
+        ccask_pending_remove_batch(records, count);
+        for (size_t i = 0; i < count; i++) free_datafile_record(records[i]);
+        total += count;
+    }
+
+    for (int i = 0; i < NUM_PRODUCERS; i++) pthread_join(producers[i], NULL);
+    for (int i = 0; i < NUM_PRODUCERS; i++) CHECK(next_seq[i] == RECORDS_PER_PRODUCER);
+    CHECK(ccask_writer_ringbuf_pushed(ringbuf) == total);
+    CHECK(ccask_writer_ringbuf_count(ringbuf) == 0);
+
+    // every record popped was removed from the pending index again
+    ccask_record_t pending;
+    for (uint32_t producer = 0; producer < NUM_PRODUCERS; producer++) {
+        snprintf(key, sizeof(key), "p%u/%u", producer, 0);
+        CHECK(!ccask_pending_find(key, (uint32_t)strlen(key) + 1, &pending));
+    }
+
+    // nothing is left, so once shut down a pop returns straight away
+    ccask_writer_ringbuf_start_shutdown(ringbuf);
+    CHECK(ccask_writer_ringbuf_pop_batch(ringbuf, records, completions, POP_BATCH, RINGBUF_MAX_BYTES) == 0);
+    ccask_writer_ringbuf_destroy(ringbuf);
+
+    ccask_shutdown();
+    test_remove_dir(dir);
+    return 0;
+}
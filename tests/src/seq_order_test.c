@@ -0,0 +1,114 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "test_util.h"
+
+#define NUM_KEYS 64
+
+static const char *dir;
+
+static ccask_options_t options_with_shards(size_t writer_shards) {
+    ccask_options_t opts = test_options(dir);
+    opts.writer_shards = writer_shards;
+    return opts;
+}
+
+static void key_of(int i, char *key) {
+    snprintf(key, 32, "key-%d", i);
+}
+
+/**
+ * Puts every key, then rewrites it in a write batch together with its neighbour. A batch goes to the
+ * datafile of the first writer shard it involves, so a key's batch record often lands in an older file
+ * than its put did, and replaying the files in order would see them the wrong way round. Every fourth
+ * key is deleted by its batch instead.
+ */
+static void write_across_shards(void *arg) {
+    (void)arg;
+    CHECK(ccask_init(options_with_shards(4)) == CCASK_OK);
+
+    char key[32], next[32];
+    for (int i = 0; i < NUM_KEYS; i++) {
+        key_of(i, key);
+        test_put(key, "put");
+    }
+
+    for (int i = 0; i < NUM_KEYS; i += 2) {
+        key_of(i, key);
+        key_of(i + 1, next);
+
+        ccask_write_batch_t *batch = ccask_write_batch_create();
+        CHECK(batch);
+        if (i % 4 == 0) CHECK(ccask_write_batch_delete(batch, key, (uint32_t)strlen(key) + 1) == CCASK_OK);
+        else CHECK(ccask_write_batch_put(batch, key, (uint32_t)strlen(key) + 1, "batch", 6) == CCASK_OK);
+        CHECK(ccask_write_batch_put(batch, next, (uint32_t)strlen(next) + 1, "batch", 6) == CCASK_OK);
+        CHECK(ccask_write_batch_commit(batch) == CCASK_OK);
+        ccask_write_batch_destroy(batch);
+    }
+}
+
+// a different number of writer shards moves keys to other datafiles, the last record still has to win
+static void overwrite_with_fewer_shards(void *arg) {
+    (void)arg;
+    CHECK(ccask_init(options_with_shards(2)) == CCASK_OK);
+
+    char key[32];
+    for (int i = 0; i < NUM_KEYS; i += 3) {
+        key_of(i, key);
+        test_put(key, "again");
+    }
+}
+
+static const char* expected_after_batches(int i) {
+    return i % 4 == 0 ? NULL : "batch";
+}
+
+static void expect_all(const char* (*expected)(int)) {
+    char key[32];
+    for (int i = 0; i < NUM_KEYS; i++) {
+        key_of(i, key);
+        test_expect(key, expected(i));
+    }
+}
+
+static const char* expected_after_overwrite(int i) {
+    return i % 3 == 0 ? "again" : expected_after_batches(i);
+}
+
+/**
+ * Recovery applies whichever record of a key has the highest sequence number, so it doesn't depend on
+ * which datafile a record is in, or on how many writer shards wrote them.
+ */
+int main(void) {
+    char *d = test_make_dir();
+    dir = d;
+
+    test_run_crashing(write_across_shards, NULL);
+    CHECK(ccask_init(options_with_shards(3)) == CCASK_OK);
+    expect_all(expected_after_batches);
+    ccask_shutdown();
+
+    test_run_crashing(overwrite_with_fewer_shards, NULL);
+    CHECK(ccask_init(options_with_shards(1)) == CCASK_OK);
+    expect_all(expected_after_overwrite);
+    ccask_shutdown();
+
+    test_remove_dir(d);
+    return 0;
+}
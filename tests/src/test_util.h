@@ -0,0 +1,179 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#ifndef CCASK_TEST_UTIL_H
+#define CCASK_TEST_UTIL_H
+
+/**
+ * Helpers shared by the tests. Every test is its own executable that exits with 0 on success, a failed
+ * check prints where it failed and exits with 1.
+ */
+
+#define _GNU_SOURCE
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "unistd.h"
+#include "ftw.h"
+#include "fcntl.h"
+#include "dirent.h"
+#include "sys/stat.h"
+#include "sys/wait.h"
+
+#include "ccask/core.h"
+#include "ccask/status.h"
+#include "ccask/utils.h"
+
+#define CHECK(cond)                                                                             \
+    do {                                                                                        \
+        if (!(cond)) {                                                                          \
+            fprintf(stderr, "%s:%d: check failed: %s (ccask_errno = %d)\n",                     \
+                    __FILE__, __LINE__, #cond, (int)ccask_errno);                               \
+            exit(1);                                                                            \
+        }                                                                                       \
+    } while (0)
+
+// a fresh data directory under /tmp, removed again by `test_remove_dir`
+static inline char* test_make_dir(void) {
+    char *dir = strdup("/tmp/ccask-test-XXXXXX");
+    CHECK(dir && mkdtemp(dir));
+    return dir;
+}
+
+static inline int test_remove_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    (void)sb; (void)type; (void)ftw;
+    return remove(path);
+}
+
+static inline void test_remove_dir(char *dir) {
+    nftw(dir, test_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    free(dir);
+}
+
+static inline ccask_options_t test_options(const char *dir) {
+    ccask_options_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.data_dir = (char*)dir;
+    opts.writer_ringbuf_capacity = 1024;
+    opts.datafile_rotate_threshold = 1 << 20;
+    return opts;
+}
+
+/**
+ * Runs `fn` in a child process that exits without `ccask_shutdown`, like a crash after the writes it made
+ * (they are in the page cache, so they survive it), and waits for it.
+ */
+static inline void test_run_crashing(void (*fn)(void *arg), void *arg) {
+    fflush(NULL);
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        fn(arg);
+        _exit(0);
+    }
+
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// the offset of `needle` in the file at `path`, or -1
+static inline off_t test_find_in_file(const char *path, const char *needle) {
+    int fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+
+    struct stat st;
+    CHECK(fstat(fd, &st) == 0);
+    char *buf = malloc(st.st_size + 1);
+    CHECK(buf && pread(fd, buf, st.st_size, 0) == st.st_size);
+    close(fd);
+
+    char *at = memmem(buf, st.st_size, needle, strlen(needle));
+    off_t offset = at ? at - buf : -1;
+    free(buf);
+    return offset;
+}
+
+// the path of the datafile in `dir` holding `needle` (to be freed) and the needle's offset in it
+static inline char* test_find_in_datafiles(const char *dir, const char *needle, off_t *offset) {
+    DIR *d = opendir(dir);
+    CHECK(d);
+
+    char *found = NULL;
+    struct dirent *entry;
+    while (!found && (entry = readdir(d))) {
+        uint64_t id;
+        if (parse_filename(entry->d_name, &id) != FILE_DATA) continue;
+
+        char *path = build_filepath(dir, id, FILE_DATA);
+        CHECK(path);
+        *offset = test_find_in_file(path, needle);
+        if (*offset >= 0) found = path;
+        else free(path);
+    }
+    closedir(d);
+
+    CHECK(found);
+    return found;
+}
+
+static inline void test_truncate_file(const char *path, off_t size) {
+    CHECK(truncate(path, size) == 0);
+}
+
+// flips the bits of the byte at `offset`, so whatever checksum covers it no longer matches
+static inline void test_corrupt_file(const char *path, off_t offset) {
+    int fd = open(path, O_RDWR);
+    CHECK(fd >= 0);
+
+    uint8_t byte;
+    CHECK(pread(fd, &byte, 1, offset) == 1);
+    byte = ~byte;
+    CHECK(pwrite(fd, &byte, 1, offset) == 1);
+    close(fd);
+}
+
+// the value of `key` as a string, or NULL if it doesn't exist
+static inline char* test_get(const char *key) {
+    ccask_record_t record;
+    CHECK(ccask_get((void*)key, (uint32_t)strlen(key) + 1, &record) == CCASK_OK);
+    return record.value;
+}
+
+static inline void test_put(const char *key, const char *value) {
+    CHECK(ccask_put_blocking((void*)key, (uint32_t)strlen(key) + 1, (void*)value, (uint32_t)strlen(value) + 1) == CCASK_OK);
+}
+
+static inline void test_expect(const char *key, const char *value) {
+    char *got = test_get(key);
+    if (!value) {
+        CHECK(got == NULL);
+        return;
+    }
+    if (!got || strcmp(got, value) != 0) {
+        fprintf(stderr, "key %s: expected %s, got %s\n", key, value, got ? got : "(none)");
+        exit(1);
+    }
+    free(got);
+}
+
+#endif
@@ -0,0 +1,217 @@
+/**
+ * Copyright (C) 2025  Shardul Nalegave
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the Lesser GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * Lesser GNU General Public License for more details.
+ * 
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ */
+
+
+#include "test_util.h"
+
+#include "ccask/cache.h"
+
+#define NUM_KEYS 12000
+#define VALUE_SIZE 200
+#define ENTRIES_PER_SHARD 256
+#define CACHE_BYTES (CACHE_SHARDS * ENTRIES_PER_SHARD * (sizeof(ccask_cache_entry_t) + VALUE_SIZE))
+
+// read once, then come back after the small FIFO has let them go but before their ghosts are forgotten
+#define NUM_RETURNING (CACHE_SHARDS * 16)
+// enough to push the returning keys out of the small FIFO in every shard
+#define NUM_BETWEEN (CACHE_SHARDS * ENTRIES_PER_SHARD * 115 / 100)
+
+#define HOT_KEY "zz/hot" // after all the others, so a full scan reaches it last
+
+/**
+ * The value cache is sized for a few thousand values and read through the public API, so every shard keeps
+ * overflowing: a hot key has to survive a scan of everything else, keys that come back soon after being
+ * evicted have to be let straight into the main FIFO, and the stats have to add up to the reads made.
+ */
+
+static void key_of(int i, char *key) {
+    snprintf(key, 32, "key/%05d", i);
+}
+
+static void value_of(const char *key, char *value) {
+    memset(value, 'a' + (int)(strlen(key) % 26), VALUE_SIZE - 1);
+    memcpy(value, key, strlen(key));
+    value[VALUE_SIZE - 1] = '\0';
+}
+
+static ccask_value_cache_stats_t cache_stats(void) {
+    ccask_value_cache_stats_t stats;
+    CHECK(ccask_get_value_cache_stats(&stats) == CCASK_OK);
+    return stats;
+}
+
+// gets the key and checks its value, returning whether the cache had it
+static bool read_key(const char *key) {
+    uint64_t hits = cache_stats().hits;
+    char expected[VALUE_SIZE];
+    value_of(key, expected);
+    test_expect(key, expected);
+    return cache_stats().hits > hits;
+}
+
+static int read_keys(int from, int to) {
+    char key[32];
+    int hits = 0;
+    for (int i = from; i < to; i++) {
+        key_of(i, key);
+        if (read_key(key)) hits++;
+    }
+    return hits;
+}
+
+// reads the values of all keys in [start, end) once, like a scan of a table would
+static void scan_values(const char *start, const char *end) {
+    ccask_scan_iter_t *iter = ccask_scan_range(
+        (void*)start, start ? (uint32_t)strlen(start) + 1 : 0, (void*)end, end ? (uint32_t)strlen(end) + 1 : 0
+    );
+    CHECK(iter);
+
+    void *key;
+    uint32_t key_size;
+    ccask_record_t record;
+    char expected[VALUE_SIZE];
+    while (ccask_scan_iter_next(iter, &key, &key_size, &record) == CCASK_OK) {
+        value_of(key, expected);
+        CHECK(record.value && strcmp(record.value, expected) == 0);
+        ccask_free_record(record);
+    }
+    CHECK(ccask_errno == CCASK_ERR_ITER_END);
+    ccask_scan_iter_close(iter);
+}
+
+// every value is the same size, so the stats can be checked against the per-shard budget exactly
+static void check_budget(void) {
+    ccask_value_cache_stats_t stats = cache_stats();
+    size_t charge = sizeof(ccask_cache_entry_t) + VALUE_SIZE;
+    CHECK(stats.capacity == CACHE_BYTES);
+    CHECK(stats.bytes == stats.entries * charge);
+    CHECK(stats.entries == stats.misses - stats.evictions);
+
+    // each shard is full, to within the one value that didn't fit anymore
+    CHECK(stats.bytes <= stats.capacity);
+    CHECK(stats.bytes > stats.capacity - CACHE_SHARDS * charge);
+}
+
+static void test_hot_key_survives_scan(void) {
+    ccask_value_cache_stats_t stats = cache_stats();
+    CHECK(stats.hits == 0 && stats.misses == 0 && stats.evictions == 0 && stats.entries == 0);
+    CHECK(stats.capacity == CACHE_BYTES);
+
+    CHECK(!read_key(HOT_KEY));
+    for (int i = 0; i < 3; i++) CHECK(read_key(HOT_KEY));
+
+    stats = cache_stats();
+    CHECK(stats.hits == 3 && stats.misses == 1 && stats.evictions == 0 && stats.entries == 1);
+    CHECK(stats.bytes == sizeof(ccask_cache_entry_t) + VALUE_SIZE);
+
+    // the scan reads every other value once, each is a miss and most push something out
+    scan_values(NULL, NULL);
+    stats = cache_stats();
+    CHECK(stats.hits == 4);
+    CHECK(stats.misses == 1 + NUM_KEYS);
+    CHECK(stats.evictions > 0);
+    check_budget();
+
+    // so do more scans, long after their values were let go
+    scan_values(NULL, HOT_KEY);
+    CHECK(cache_stats().misses == 1 + 2 * NUM_KEYS);
+    CHECK(read_key(HOT_KEY));
+    check_budget();
+}
+
+static void test_returning_keys_skip_small_fifo(void) {
+    CHECK(read_keys(0, NUM_RETURNING) == 0);
+    CHECK(read_keys(NUM_RETURNING, NUM_RETURNING + NUM_BETWEEN) == 0);
+
+    // hits are the few keys not pushed out yet, they move to the main FIFO for the hit
+    int returned_hits = read_keys(0, NUM_RETURNING);
+    CHECK(returned_hits < NUM_RETURNING / 4);
+
+    char start[32];
+    key_of(NUM_RETURNING + NUM_BETWEEN, start);
+    scan_values(start, NULL);
+
+    // they came back to the main FIFO, except those whose ghost a colliding position's overwrote
+    CHECK(read_keys(0, NUM_RETURNING) > NUM_RETURNING / 2);
+
+    // keys read once and not again soon are long gone, and their ghosts too old to count when they come back
+    CHECK(read_keys(NUM_RETURNING, NUM_RETURNING + 1000) == 0);
+    scan_values(start, NULL);
+    CHECK(read_keys(NUM_RETURNING, NUM_RETURNING + 1000) == 0);
+    check_budget();
+}
+
+static void test_new_position_misses(void) {
+    char value[VALUE_SIZE];
+    value_of(HOT_KEY, value);
+    CHECK(read_key(HOT_KEY));
+
+    // the cache is keyed by the record's position, an overwrite doesn't have to touch it
+    value[0] = 'Z';
+    test_put(HOT_KEY, value);
+
+    ccask_value_cache_stats_t stats = cache_stats();
+    test_expect(HOT_KEY, value);
+    CHECK(cache_stats().misses == stats.misses + 1);
+    CHECK(cache_stats().hits == stats.hits);
+    test_expect(HOT_KEY, value);
+    CHECK(cache_stats().hits == stats.hits + 1);
+
+    // a value that doesn't fit the small FIFO isn't cached at all
+    size_t large_size = ENTRIES_PER_SHARD * VALUE_SIZE;
+    char *large = malloc(large_size);
+    CHECK(large);
+    memset(large, 'L', large_size - 1);
+    large[large_size - 1] = '\0';
+    test_put("large", large);
+
+    stats = cache_stats();
+    test_expect("large", large);
+    test_expect("large", large);
+    CHECK(cache_stats().misses == stats.misses + 2);
+    CHECK(cache_stats().entries == stats.entries);
+    free(large);
+}
+
+int main(void) {
+    char *dir = test_make_dir();
+    ccask_options_t opts = test_options(dir);
+    opts.value_cache_bytes = CACHE_BYTES;
+    CHECK(ccask_init(opts) == CCASK_OK);
+
+    char key[32], value[VALUE_SIZE];
+    for (int i = 0; i < NUM_KEYS; i++) {
+        key_of(i, key);
+        value_of(key, value);
+        test_put(key, value);
+    }
+    value_of(HOT_KEY, value);
+    test_put(HOT_KEY, value);
+
+    test_hot_key_survives_scan();
+
+    // the cache starts out empty again
+    ccask_shutdown();
+    CHECK(ccask_init(opts) == CCASK_OK);
+    test_returning_keys_skip_small_fifo();
+    test_new_position_misses();
+
+    ccask_shutdown();
+    test_remove_dir(dir);
+    return 0;
+}